@@ -0,0 +1,612 @@
+/*
+ * BSD 2-Clause License
+ *
+ * Copyright (c) 2019, Pham Phi Long <phamphilong2010@gmail.com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *   * Redistributions of source code must retain the above copyright notice,
+ *     this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *   * Neither the name of Redis nor the names of its contributors may be used
+ *     to endorse or promote products derived from this software without
+ *     specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+/*
+ * Benchmark driver: starts every server model on loopback, drives it with the load generator across a matrix of
+ * connection counts, message sizes and worker counts, and writes one CSV or JSON report.
+ *
+ * Each server runs in its own process group, so the CPU time, context switches and resident memory of the
+ * pre-forked workers and of the per-connection children are accounted to the server that spawned them.
+ */
+
+#include <dirent.h>
+#include <getopt.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <signal.h>
+#include <sys/prctl.h>
+#include <sys/select.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
+#include <cstring>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace {
+    constexpr int SERVER_BACKLOG{4096};
+    constexpr auto SERVER_START_TIMEOUT = std::chrono::seconds(5);
+    constexpr auto SERVER_STOP_TIMEOUT = std::chrono::seconds(2);
+
+    struct server_model {
+        const char *name;
+        std::vector<std::string> binaries;   // CMake target name first, then the Makefile binary name
+        std::vector<std::string> extra_args; // appended after "port backlog [workers]"
+        bool multi_worker;
+        int max_connections;                 // 0 for no limit
+    };
+
+    const std::vector<server_model> &server_models() {
+        static const std::vector<server_model> models{
+                {"single_client_blocking_io_server", {"single_client_blocking_io_server"}, {}, false, 1},
+                {"fork_process_per_connection_server", {"fork_process_per_connection_server"}, {}, false, 0},
+                {"nonblocking_io_multiplexing_select_server", {"nonblocking_io_multiplexing_select_server"}, {}, false, FD_SETSIZE - 16},
+                {"nonblocking_io_multiplexing_edge_trigger_epoll_server", {"nonblocking_io_multiplexing_edge_trigger_epoll_server"}, {}, false, 0},
+                {"multi_worker_reuseport_nonblocking_io_multiplexing_server", {"multi_worker_reuseport_nonblocking_io_multiplexing_server"}, {}, true, 0},
+                {"multi_worker_threaded_epoll_server", {"linux_tcp_servers", "server_main"}, {"--reuse-port=no"}, true, 0},
+                {"multi_worker_threaded_io_uring_server", {"linux_tcp_servers", "server_main"}, {"--engine=io_uring"}, true, 0},
+        };
+        return models;
+    }
+
+    struct benchmark_options {
+        std::string bin_dir{};
+        std::vector<std::string> servers{};
+        std::vector<std::string> connections{"1", "16", "64"};
+        std::vector<std::string> message_sizes{"fixed:64", "fixed:4096"};
+        std::vector<std::string> workers{"1", "2", "4"};
+        std::string duration{"5"};
+        std::string warmup{"1"};
+        std::string rate{"0"};
+        std::string pipeline_depth{"1"};
+        std::string load_threads{"1"};
+        std::string format{"csv"};
+        std::string output{"-"};
+        int base_port{20000};
+    };
+
+    /**
+     * Resources used by every process of a process group, summed from /proc.
+     */
+    struct process_group_stats {
+        double user_seconds{0};
+        double system_seconds{0};
+        uint64_t voluntary_context_switches{0};
+        uint64_t involuntary_context_switches{0};
+        uint64_t rss_kb{0};
+        uint64_t peak_rss_kb{0};
+        int processes{0};
+    };
+
+    struct benchmark_result {
+        std::string server{};
+        int workers{1};
+        int connections{0};
+        std::string message_size{};
+        std::string status{"ok"};
+        double completed{0};
+        double errors{0};
+        double mismatches{0};
+        double throughput_rps{0};
+        double throughput_mb_per_second{0};
+        double latency_p50_us{0};
+        double latency_p99_us{0};
+        double latency_p999_us{0};
+        double latency_max_us{0};
+        double service_time_p99_us{0};
+        double cpu_user_seconds{0};
+        double cpu_system_seconds{0};
+        double cpu_percent{0};
+        uint64_t voluntary_context_switches{0};
+        uint64_t involuntary_context_switches{0};
+        uint64_t rss_kb{0};
+        uint64_t peak_rss_kb{0};
+    };
+
+    std::vector<std::string> split(const std::string &list) {
+        std::vector<std::string> items{};
+        std::istringstream stream{list};
+        std::string item;
+        while (std::getline(stream, item, ',')) {
+            if (not item.empty()) {
+                items.push_back(item);
+            }
+        }
+        return items;
+    }
+
+    bool is_executable(const std::string &path) {
+        return access(path.c_str(), X_OK) == 0;
+    }
+
+    /**
+     * Looks for the binary next to the benchmark driver (CMake build directory), then in the Makefile layout
+     * (build/bin/servers, build/bin/clients).
+     */
+    std::string find_binary(const std::string &bin_dir, const std::vector<std::string> &names) {
+        for (const char *sub_dir : {"", "/../servers", "/../clients"}) {
+            for (const std::string &name : names) {
+                const std::string path = bin_dir + sub_dir + "/" + name;
+                if (is_executable(path)) {
+                    return path;
+                }
+            }
+        }
+        return "";
+    }
+
+    std::string executable_dir() {
+        char path[4096];
+        const ssize_t len = readlink("/proc/self/exe", path, sizeof(path) - 1);
+        if (len <= 0) {
+            return ".";
+        }
+        std::string exe{path, static_cast<size_t>(len)};
+        return exe.substr(0, exe.rfind('/'));
+    }
+
+    uint64_t status_field(const std::string &path, const std::string &field) {
+        std::ifstream status{path};
+        std::string line;
+        while (std::getline(status, line)) {
+            if (line.compare(0, field.size(), field) == 0 and line.size() > field.size() and line[field.size()] == ':') {
+                return std::strtoull(line.c_str() + field.size() + 1, nullptr, 10);
+            }
+        }
+        return 0;
+    }
+
+    process_group_stats collect_stats(pid_t pgid) {
+        static const double ticks_per_second = static_cast<double>(sysconf(_SC_CLK_TCK));
+        process_group_stats stats{};
+
+        DIR *proc = opendir("/proc");
+        if (proc == nullptr) {
+            return stats;
+        }
+
+        while (struct dirent *entry = readdir(proc)) {
+            if (entry->d_name[0] < '0' or entry->d_name[0] > '9') {
+                continue;
+            }
+
+            const std::string pid_dir = std::string{"/proc/"} + entry->d_name;
+            std::ifstream stat_file{pid_dir + "/stat"};
+            std::string stat;
+            if (not std::getline(stat_file, stat)) {
+                continue;
+            }
+
+            // fields after the command name: state ppid pgrp session tty_nr tpgid flags minflt cminflt majflt cmajflt utime stime
+            std::istringstream fields{stat.substr(stat.rfind(')') + 2)};
+            std::string state;
+            long ppid, pgrp;
+            fields >> state >> ppid >> pgrp;
+            if (pgrp != pgid) {
+                continue;
+            }
+
+            std::string skip;
+            for (int i{0}; i < 8; ++i) {
+                fields >> skip;
+            }
+            unsigned long long utime{0}, stime{0};
+            fields >> utime >> stime;
+
+            ++stats.processes;
+            stats.user_seconds += static_cast<double>(utime) / ticks_per_second;
+            stats.system_seconds += static_cast<double>(stime) / ticks_per_second;
+            stats.rss_kb += status_field(pid_dir + "/status", "VmRSS");
+            stats.peak_rss_kb += status_field(pid_dir + "/status", "VmHWM");
+
+            // context switches are only reported per thread
+            if (DIR *tasks = opendir((pid_dir + "/task").c_str())) {
+                while (struct dirent *task = readdir(tasks)) {
+                    if (task->d_name[0] == '.') {
+                        continue;
+                    }
+                    const std::string task_status = pid_dir + "/task/" + task->d_name + "/status";
+                    stats.voluntary_context_switches += status_field(task_status, "voluntary_ctxt_switches");
+                    stats.involuntary_context_switches += status_field(task_status, "nonvoluntary_ctxt_switches");
+                }
+                closedir(tasks);
+            }
+        }
+
+        closedir(proc);
+        return stats;
+    }
+
+    /**
+     * Starts argv[0] in a new process group with stdin and stderr redirected to /dev/null.
+     * If stdout_fd is -1, stdout goes to /dev/null too.
+     */
+    pid_t spawn(const std::vector<std::string> &args, int stdout_fd = -1) {
+        const pid_t pid = fork();
+        if (pid < 0) {
+            throw std::runtime_error(std::string{"fork() failed: "} + strerror(errno));
+        }
+
+        if (pid == 0) {
+            setpgid(0, 0);
+            const int dev_null = open("/dev/null", O_RDWR);
+            dup2(dev_null, STDIN_FILENO);
+            dup2(stdout_fd != -1 ? stdout_fd : dev_null, STDOUT_FILENO);
+            dup2(dev_null, STDERR_FILENO);
+
+            std::vector<char *> argv{};
+            for (const std::string &arg : args) {
+                argv.push_back(const_cast<char *>(arg.c_str()));
+            }
+            argv.push_back(nullptr);
+            execv(argv[0], argv.data());
+            _exit(127);
+        }
+
+        setpgid(pid, pid);
+        return pid;
+    }
+
+    bool is_listening(int port) {
+        const int sfd = socket(AF_INET, SOCK_STREAM, 0);
+        struct sockaddr_in addr{};
+        addr.sin_family = AF_INET;
+        addr.sin_port = htons(static_cast<uint16_t>(port));
+        addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        const bool connected = connect(sfd, reinterpret_cast<struct sockaddr *>(&addr), sizeof(addr)) == 0;
+        close(sfd);
+        return connected;
+    }
+
+    /**
+     * Collects every exited child. The driver is a child subreaper, so it also inherits the workers and
+     * per-connection processes of the servers whose master exited.
+     */
+    void reap_children() {
+        while (waitpid(-1, nullptr, WNOHANG) > 0) {}
+    }
+
+    void stop_process_group(pid_t pgid) {
+        killpg(pgid, SIGTERM);
+        const auto deadline = std::chrono::steady_clock::now() + SERVER_STOP_TIMEOUT;
+        for (;;) {
+            reap_children();
+            if (killpg(pgid, 0) < 0 and errno == ESRCH) {
+                return;
+            }
+            if (std::chrono::steady_clock::now() >= deadline) {
+                killpg(pgid, SIGKILL);
+            }
+            std::this_thread::sleep_for(std::chrono::milliseconds(10));
+        }
+    }
+
+    /**
+     * Runs the load generator and returns its JSON report (empty if it failed).
+     */
+    std::string run_load_generator(const std::vector<std::string> &args) {
+        int pipe_fds[2];
+        if (pipe(pipe_fds) < 0) {
+            throw std::runtime_error(std::string{"pipe() failed: "} + strerror(errno));
+        }
+
+        const pid_t pid = spawn(args, pipe_fds[1]);
+        close(pipe_fds[1]);
+
+        std::string report{};
+        char buffer[4096];
+        ssize_t rlen;
+        while ((rlen = read(pipe_fds[0], buffer, sizeof(buffer))) != 0) {
+            if (rlen < 0) {
+                if (errno == EINTR) {
+                    continue;
+                }
+                break;
+            }
+            report.append(buffer, static_cast<size_t>(rlen));
+        }
+        close(pipe_fds[0]);
+
+        int status{0};
+        waitpid(pid, &status, 0);
+        return (WIFEXITED(status) and WEXITSTATUS(status) == 0) ? report : "";
+    }
+
+    double json_number(const std::string &json, const std::string &key, size_t from = 0) {
+        const size_t pos = json.find("\"" + key + "\": ", from);
+        return pos == std::string::npos ? 0 : std::strtod(json.c_str() + pos + key.size() + 4, nullptr);
+    }
+
+    benchmark_result run_benchmark(const benchmark_options &options, const server_model &model, const std::string &server_binary,
+                                   const std::string &load_generator, int workers, int connections,
+                                   const std::string &message_size, int port) {
+        benchmark_result result{};
+        result.server = model.name;
+        result.workers = workers;
+        result.connections = connections;
+        result.message_size = message_size;
+
+        std::vector<std::string> server_args{server_binary, std::to_string(port), std::to_string(SERVER_BACKLOG)};
+        if (model.multi_worker) {
+            server_args.push_back(std::to_string(workers));
+        }
+        server_args.insert(server_args.end(), model.extra_args.begin(), model.extra_args.end());
+
+        const pid_t pgid = spawn(server_args);
+        const auto start_deadline = std::chrono::steady_clock::now() + SERVER_START_TIMEOUT;
+        while (not is_listening(port)) {
+            if (std::chrono::steady_clock::now() >= start_deadline) {
+                stop_process_group(pgid);
+                result.status = "server did not start";
+                return result;
+            }
+            std::this_thread::sleep_for(std::chrono::milliseconds(20));
+        }
+        // let the remaining workers of a pre-forked server open their listeners
+        std::this_thread::sleep_for(std::chrono::milliseconds(200));
+
+        const process_group_stats before = collect_stats(pgid);
+        const auto started = std::chrono::steady_clock::now();
+        const std::string report = run_load_generator({load_generator, "--host", "127.0.0.1", "--port", std::to_string(port),
+                                                       "--connections", std::to_string(connections),
+                                                       "--threads", options.load_threads,
+                                                       "--pipeline", options.pipeline_depth,
+                                                       "--rate", options.rate,
+                                                       "--size", message_size,
+                                                       "--duration", options.duration,
+                                                       "--warmup", options.warmup,
+                                                       "--json"});
+        const double elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - started).count();
+        const process_group_stats after = collect_stats(pgid);
+        stop_process_group(pgid);
+
+        if (report.empty()) {
+            result.status = "load generator failed";
+            return result;
+        }
+
+        const size_t latency = report.find("\"latency_us\"");
+        const size_t service_time = report.find("\"service_time_us\"");
+        result.completed = json_number(report, "completed");
+        result.errors = json_number(report, "errors");
+        result.mismatches = json_number(report, "mismatches");
+        result.throughput_rps = json_number(report, "throughput_rps");
+        result.throughput_mb_per_second = json_number(report, "throughput_bytes_per_second") / (1024 * 1024);
+        result.latency_p50_us = json_number(report, "p50", latency);
+        result.latency_p99_us = json_number(report, "p99", latency);
+        result.latency_p999_us = json_number(report, "p99.9", latency);
+        result.latency_max_us = json_number(report, "max", latency);
+        result.service_time_p99_us = json_number(report, "p99", service_time);
+
+        // processes spawned during the run (per-connection children) only appear in the second snapshot
+        result.cpu_user_seconds = after.user_seconds - std::min(before.user_seconds, after.user_seconds);
+        result.cpu_system_seconds = after.system_seconds - std::min(before.system_seconds, after.system_seconds);
+        result.cpu_percent = 100.0 * (result.cpu_user_seconds + result.cpu_system_seconds) / elapsed;
+        result.voluntary_context_switches = after.voluntary_context_switches - std::min(before.voluntary_context_switches, after.voluntary_context_switches);
+        result.involuntary_context_switches = after.involuntary_context_switches - std::min(before.involuntary_context_switches, after.involuntary_context_switches);
+        result.rss_kb = after.rss_kb;
+        result.peak_rss_kb = after.peak_rss_kb;
+
+        if (result.errors > 0 or result.mismatches > 0) {
+            result.status = "errors";
+        }
+        return result;
+    }
+
+    void print_csv(std::ostream &out, const std::vector<benchmark_result> &results) {
+        out << "server,workers,connections,message_size,status,completed,errors,mismatches,throughput_rps,throughput_mb_per_second,"
+               "latency_p50_us,latency_p99_us,latency_p99.9_us,latency_max_us,service_time_p99_us,"
+               "cpu_user_seconds,cpu_system_seconds,cpu_percent,voluntary_context_switches,involuntary_context_switches,"
+               "rss_kb,peak_rss_kb\n";
+        out << std::fixed << std::setprecision(3);
+        for (const benchmark_result &r : results) {
+            out << r.server << ',' << r.workers << ',' << r.connections << ',' << r.message_size << ',' << r.status << ','
+                << static_cast<uint64_t>(r.completed) << ',' << static_cast<uint64_t>(r.errors) << ',' << static_cast<uint64_t>(r.mismatches) << ','
+                << r.throughput_rps << ',' << r.throughput_mb_per_second << ','
+                << r.latency_p50_us << ',' << r.latency_p99_us << ',' << r.latency_p999_us << ',' << r.latency_max_us << ','
+                << r.service_time_p99_us << ',' << r.cpu_user_seconds << ',' << r.cpu_system_seconds << ',' << r.cpu_percent << ','
+                << r.voluntary_context_switches << ',' << r.involuntary_context_switches << ',' << r.rss_kb << ',' << r.peak_rss_kb << '\n';
+        }
+    }
+
+    void print_json(std::ostream &out, const benchmark_options &options, const std::vector<benchmark_result> &results) {
+        out << std::fixed << std::setprecision(3)
+            << "{\"duration\": " << options.duration << ", \"warmup\": " << options.warmup << ", \"rate\": " << options.rate
+            << ", \"pipeline_depth\": " << options.pipeline_depth << ", \"results\": [";
+        const char *separator = "\n  ";
+        for (const benchmark_result &r : results) {
+            out << separator
+                << "{\"server\": \"" << r.server << "\", \"workers\": " << r.workers << ", \"connections\": " << r.connections
+                << ", \"message_size\": \"" << r.message_size << "\", \"status\": \"" << r.status << "\""
+                << ", \"completed\": " << static_cast<uint64_t>(r.completed) << ", \"errors\": " << static_cast<uint64_t>(r.errors)
+                << ", \"mismatches\": " << static_cast<uint64_t>(r.mismatches)
+                << ", \"throughput_rps\": " << r.throughput_rps << ", \"throughput_mb_per_second\": " << r.throughput_mb_per_second
+                << ", \"latency_p50_us\": " << r.latency_p50_us << ", \"latency_p99_us\": " << r.latency_p99_us
+                << ", \"latency_p99.9_us\": " << r.latency_p999_us << ", \"latency_max_us\": " << r.latency_max_us
+                << ", \"service_time_p99_us\": " << r.service_time_p99_us
+                << ", \"cpu_user_seconds\": " << r.cpu_user_seconds << ", \"cpu_system_seconds\": " << r.cpu_system_seconds
+                << ", \"cpu_percent\": " << r.cpu_percent
+                << ", \"voluntary_context_switches\": " << r.voluntary_context_switches
+                << ", \"involuntary_context_switches\": " << r.involuntary_context_switches
+                << ", \"rss_kb\": " << r.rss_kb << ", \"peak_rss_kb\": " << r.peak_rss_kb << "}";
+            separator = ",\n  ";
+        }
+        out << "\n]}\n";
+    }
+
+    void print_usage(const char *program) {
+        std::cerr << "Usage: " << program << " [options]\n"
+                  << "  -b, --bin-dir DIR          directory of the server and load generator binaries (next to this binary)\n"
+                  << "  -S, --servers LIST         comma separated server models (all):\n";
+        for (const server_model &model : server_models()) {
+            std::cerr << "                               " << model.name << "\n";
+        }
+        std::cerr << "  -c, --connections LIST     connection counts (1,16,64)\n"
+                  << "  -s, --sizes LIST           message sizes, see the load generator --size (fixed:64,fixed:4096)\n"
+                  << "  -W, --workers LIST         worker counts of the multi worker servers (1,2,4)\n"
+                  << "  -D, --duration SECONDS     measured duration of every run (5)\n"
+                  << "  -w, --warmup SECONDS       warm-up of every run (1)\n"
+                  << "  -r, --rate N               target requests per second, 0 for closed loop (0)\n"
+                  << "  -d, --pipeline N           requests in flight per connection (1)\n"
+                  << "  -t, --load-threads N       load generator threads (1)\n"
+                  << "  -f, --format csv|json      report format (csv)\n"
+                  << "  -o, --output FILE          report file, - for stdout (-)\n"
+                  << "  -p, --port N               first port, every run uses the next one (20000)\n";
+    }
+
+    benchmark_options parse_options(int argc, char *argv[]) {
+        static const struct option long_options[] = {
+                {"bin-dir",      required_argument, nullptr, 'b'},
+                {"servers",      required_argument, nullptr, 'S'},
+                {"connections",  required_argument, nullptr, 'c'},
+                {"sizes",        required_argument, nullptr, 's'},
+                {"workers",      required_argument, nullptr, 'W'},
+                {"duration",     required_argument, nullptr, 'D'},
+                {"warmup",       required_argument, nullptr, 'w'},
+                {"rate",         required_argument, nullptr, 'r'},
+                {"pipeline",     required_argument, nullptr, 'd'},
+                {"load-threads", required_argument, nullptr, 't'},
+                {"format",       required_argument, nullptr, 'f'},
+                {"output",       required_argument, nullptr, 'o'},
+                {"port",         required_argument, nullptr, 'p'},
+                {"help",         no_argument,       nullptr, 'h'},
+                {nullptr,        0,                 nullptr, 0}
+        };
+
+        benchmark_options options{};
+        int opt;
+        while ((opt = getopt_long(argc, argv, "b:S:c:s:W:D:w:r:d:t:f:o:p:h", long_options, nullptr)) != -1) {
+            switch (opt) {
+                case 'b': options.bin_dir = optarg; break;
+                case 'S': options.servers = split(optarg); break;
+                case 'c': options.connections = split(optarg); break;
+                case 's': options.message_sizes = split(optarg); break;
+                case 'W': options.workers = split(optarg); break;
+                case 'D': options.duration = optarg; break;
+                case 'w': options.warmup = optarg; break;
+                case 'r': options.rate = optarg; break;
+                case 'd': options.pipeline_depth = optarg; break;
+                case 't': options.load_threads = optarg; break;
+                case 'f': options.format = optarg; break;
+                case 'o': options.output = optarg; break;
+                case 'p': options.base_port = std::atoi(optarg); break;
+                default:
+                    print_usage(argv[0]);
+                    exit(opt == 'h' ? EXIT_SUCCESS : EXIT_FAILURE);
+            }
+        }
+
+        if (options.format != "csv" and options.format != "json") {
+            print_usage(argv[0]);
+            exit(EXIT_FAILURE);
+        }
+        if (options.bin_dir.empty()) {
+            options.bin_dir = executable_dir();
+        }
+        return options;
+    }
+}
+
+int main(int argc, char *argv[]) {
+    const benchmark_options options = parse_options(argc, argv);
+
+    // adopt the workers of pre-forked servers whose master process exits, so they can be reaped
+    prctl(PR_SET_CHILD_SUBREAPER, 1, 0, 0, 0);
+    signal(SIGPIPE, SIG_IGN);
+
+    const std::string load_generator = find_binary(options.bin_dir, {"linux_tcp_load_generator", "load_generator"});
+    if (load_generator.empty()) {
+        std::cerr << "ERROR, no load generator in " << options.bin_dir << std::endl;
+        exit(EXIT_FAILURE);
+    }
+
+    std::vector<benchmark_result> results{};
+    int port{options.base_port};
+    for (const server_model &model : server_models()) {
+        if (not options.servers.empty() and std::find(options.servers.begin(), options.servers.end(), model.name) == options.servers.end()) {
+            continue;
+        }
+
+        const std::string server_binary = find_binary(options.bin_dir, model.binaries);
+        if (server_binary.empty()) {
+            std::cerr << "skipping " << model.name << ": binary not found in " << options.bin_dir << std::endl;
+            continue;
+        }
+
+        const std::vector<std::string> workers = model.multi_worker ? options.workers : std::vector<std::string>{"1"};
+        for (const std::string &worker_num : workers) {
+            for (const std::string &connection_num : options.connections) {
+                const int connections = std::atoi(connection_num.c_str());
+                if (model.max_connections != 0 and connections > model.max_connections) {
+                    continue;
+                }
+
+                for (const std::string &message_size : options.message_sizes) {
+                    std::cerr << model.name << ": workers=" << worker_num << " connections=" << connections
+                              << " size=" << message_size << " ... " << std::flush;
+                    // every run listens on a new port: the single process servers do not set SO_REUSEADDR
+                    results.push_back(run_benchmark(options, model, server_binary, load_generator,
+                                                    std::atoi(worker_num.c_str()), connections, message_size, port++));
+                    std::cerr << results.back().status << ", " << std::fixed << std::setprecision(0)
+                              << results.back().throughput_rps << " req/s" << std::endl;
+                }
+            }
+        }
+    }
+
+    std::ofstream file{};
+    if (options.output != "-") {
+        file.open(options.output);
+        if (not file) {
+            std::cerr << "ERROR, cannot write " << options.output << std::endl;
+            exit(EXIT_FAILURE);
+        }
+    }
+    std::ostream &out = (options.output == "-") ? std::cout : file;
+    if (options.format == "json") {
+        print_json(out, options, results);
+    } else {
+        print_csv(out, results);
+    }
+
+    return 0;
+}
@@ -0,0 +1,688 @@
+/*
+ * BSD 2-Clause License
+ *
+ * Copyright (c) 2019, Pham Phi Long <phamphilong2010@gmail.com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *   * Redistributions of source code must retain the above copyright notice,
+ *     this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *   * Neither the name of Redis nor the names of its contributors may be used
+ *     to endorse or promote products derived from this software without
+ *     specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+/*
+ * Open loop load generator for the echo servers.
+ *
+ * Every connection sends requests on a fixed schedule derived from the target rate, whether or not the previous
+ * echoes came back (up to the pipelining depth). Latency is measured from the time a request was scheduled to be
+ * sent, not from the time it was actually written, so a stalled server is charged for the requests it delayed
+ * (no coordinated omission). The service time, measured from the actual write, is reported as well.
+ * With a rate of 0 the generator runs closed loop: each connection keeps pipeline_depth requests in flight.
+ */
+
+#include <fcntl.h>
+#include <getopt.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
+#include <cstring>
+#include <deque>
+#include <iomanip>
+#include <iostream>
+#include <memory>
+#include <random>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "constants.h"
+#include "frame_codec.h"
+#include "latency_histogram.h"
+
+namespace {
+    constexpr size_t MAX_MESSAGE_SIZE{64 * 1024};
+    constexpr size_t READ_BUFFER_SIZE{64 * 1024};
+    constexpr int MAX_EVENTS{256};
+    constexpr uint64_t NANOSECONDS_PER_SECOND{1000 * 1000 * 1000};
+    constexpr uint64_t DRAIN_TIMEOUT_NS{2 * NANOSECONDS_PER_SECOND};
+
+    uint64_t now_ns() {
+        return static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::nanoseconds>(
+                std::chrono::steady_clock::now().time_since_epoch()).count());
+    }
+
+    /**
+     * Message sizes: "fixed:N", "uniform:MIN-MAX" or "exponential:MEAN".
+     */
+    class size_distribution {
+    public:
+        explicit size_distribution(const std::string &spec) : _spec{spec} {
+            const auto colon = spec.find(':');
+            const std::string kind = spec.substr(0, colon);
+            const std::string args = (colon == std::string::npos) ? "" : spec.substr(colon + 1);
+
+            try {
+                if (kind == "fixed") {
+                    _kind = FIXED;
+                    _min = _max = std::stoul(args);
+                } else if (kind == "uniform") {
+                    _kind = UNIFORM;
+                    const auto dash = args.find('-');
+                    _min = std::stoul(args.substr(0, dash));
+                    _max = std::stoul(args.substr(dash + 1));
+                } else if (kind == "exponential") {
+                    _kind = EXPONENTIAL;
+                    _mean = std::stod(args);
+                    _min = 1;
+                    _max = MAX_MESSAGE_SIZE;
+                } else {
+                    throw std::invalid_argument{kind};
+                }
+            } catch (const std::exception &) {
+                throw std::runtime_error("invalid message size distribution: " + spec);
+            }
+
+            if (_min == 0 or _min > _max or _max > MAX_MESSAGE_SIZE or (_kind == EXPONENTIAL and _mean <= 0)) {
+                throw std::runtime_error("message sizes must be between 1 and " + std::to_string(MAX_MESSAGE_SIZE) + ": " + spec);
+            }
+        }
+
+        size_t next(std::mt19937_64 &rng) const {
+            switch (_kind) {
+                case UNIFORM:
+                    return std::uniform_int_distribution<size_t>{_min, _max}(rng);
+                case EXPONENTIAL:
+                    return std::clamp(static_cast<size_t>(std::exponential_distribution<double>{1.0 / _mean}(rng)) + 1, _min, _max);
+                default:
+                    return _min;
+            }
+        }
+
+        const std::string &spec() const {
+            return _spec;
+        }
+
+    private:
+        enum distribution {
+            FIXED,
+            UNIFORM,
+            EXPONENTIAL
+        };
+
+        std::string _spec;
+        distribution _kind{FIXED};
+        size_t _min{0};
+        size_t _max{0};
+        double _mean{0};
+    };
+
+    struct load_options {
+        std::string host{"localhost"};
+        std::string port{concurrent_servers::DEFAULT_PORT};
+        int connections{16};
+        int threads{1};
+        size_t pipeline_depth{1};
+        double rate{0};                     // requests per second over all connections, 0 for closed loop
+        double duration{10};                // seconds, warm-up excluded
+        double warmup{1};                   // seconds
+        std::string message_size{"fixed:64"};
+        std::string framing{"none"};        // none, or the length prefix of every request: fixed32 or varint
+        bool json{false};
+    };
+
+    struct load_result {
+        concurrent_servers::latency_histogram latency{};      // from the intended send time
+        concurrent_servers::latency_histogram service_time{}; // from the actual send time
+        uint64_t completed{0};
+        uint64_t bytes{0};
+        uint64_t errors{0};
+        uint64_t mismatches{0};
+        uint64_t unsent{0};  // scheduled during the measurement but never sent because the pipeline stayed full
+
+        void merge(const load_result &other) {
+            latency.merge(other.latency);
+            service_time.merge(other.service_time);
+            completed += other.completed;
+            bytes += other.bytes;
+            errors += other.errors;
+            mismatches += other.mismatches;
+            unsent += other.unsent;
+        }
+    };
+
+    /**
+     * Drives a share of the connections from one thread with its own epoll instance.
+     */
+    class load_thread {
+    public:
+        load_thread(const load_options &options, const struct addrinfo *address, int connection_num, uint64_t start_ns, int id) :
+                _options{options},
+                _address{address},
+                _sizes{options.message_size},
+                _rng{std::random_device{}() + static_cast<uint64_t>(id)},
+                _interval_ns{options.rate > 0 ? static_cast<uint64_t>(options.connections * 1e9 / options.rate) : 0},
+                _start_ns{start_ns},
+                _measure_from_ns{start_ns + static_cast<uint64_t>(options.warmup * 1e9)},
+                _stop_ns{_measure_from_ns + static_cast<uint64_t>(options.duration * 1e9)},
+                _connections(connection_num),
+                _framed{options.framing != "none"},
+                _codec{options.framing == "varint" ? concurrent_servers::frame_prefix::VARINT : concurrent_servers::frame_prefix::FIXED32},
+                _payload(MAX_MESSAGE_SIZE),
+                _read_buffer(READ_BUFFER_SIZE) {
+            for (size_t i{0}; i < _payload.size(); ++i) {
+                _payload[i] = static_cast<char>('a' + i % 26);
+            }
+        }
+
+        void run() {
+            _epoll_fd = epoll_create1(0);
+            if (_epoll_fd < 0) {
+                throw std::runtime_error(std::string{"epoll_create1() failed: "} + strerror(errno));
+            }
+
+            std::uniform_int_distribution<uint64_t> phase{0, std::max<uint64_t>(_interval_ns, 1) - 1};
+            for (size_t i{0}; i < _connections.size(); ++i) {
+                open_connection(i);
+                // spread the first requests over one interval so the connections do not send in bursts
+                _connections[i].next_send_ns = _start_ns + phase(_rng);
+            }
+
+            struct epoll_event events[MAX_EVENTS];
+            for (;;) {
+                uint64_t now = now_ns();
+                const bool sending = now < _stop_ns;
+                if (not sending and (in_flight() == 0 or now >= _stop_ns + DRAIN_TIMEOUT_NS)) {
+                    break;
+                }
+
+                uint64_t next_send_ns = sending ? _stop_ns : _stop_ns + DRAIN_TIMEOUT_NS;
+                if (sending) {
+                    for (size_t i{0}; i < _connections.size(); ++i) {
+                        send_due_requests(i, now);
+                        if (_interval_ns > 0 and _connections[i].fd != -1) {
+                            next_send_ns = std::min(next_send_ns, _connections[i].next_send_ns);
+                        }
+                    }
+                }
+
+                // sleep in epoll_wait() until the next scheduled send, spin when it is less than 1ms away
+                const int timeout_ms = next_send_ns > now ? static_cast<int>((next_send_ns - now) / 1000000) : 0;
+                const int nfds = epoll_wait(_epoll_fd, events, MAX_EVENTS, timeout_ms);
+                if (nfds < 0) {
+                    if (errno == EINTR) {
+                        continue;
+                    }
+                    throw std::runtime_error(std::string{"epoll_wait() failed: "} + strerror(errno));
+                }
+
+                now = now_ns();
+                for (int i{0}; i < nfds; ++i) {
+                    const auto index = static_cast<size_t>(events[i].data.u64);
+                    if (events[i].events & (EPOLLERR | EPOLLHUP)) {
+                        fail_connection(index);
+                        continue;
+                    }
+                    if (events[i].events & EPOLLIN) {
+                        receive(index, now);
+                    }
+                    if ((events[i].events & EPOLLOUT) and _connections[index].fd != -1) {
+                        flush(index);
+                    }
+                }
+            }
+
+            for (size_t i{0}; i < _connections.size(); ++i) {
+                connection &conn = _connections[i];
+                if (_interval_ns > 0 and conn.fd != -1 and conn.next_send_ns < _stop_ns) {
+                    _result.unsent += (_stop_ns - std::max(conn.next_send_ns, _measure_from_ns)) / _interval_ns;
+                }
+                _result.errors += conn.in_flight.size();
+                close_connection(conn);
+            }
+        }
+
+        load_thread(const load_thread &) = delete;
+        load_thread &operator=(const load_thread &) = delete;
+
+        ~load_thread() {
+            for (connection &conn : _connections) {
+                close_connection(conn);
+            }
+            if (_epoll_fd != -1) {
+                close(_epoll_fd);
+            }
+        }
+
+        const load_result &result() const {
+            return _result;
+        }
+
+    private:
+        struct request {
+            uint64_t intended_ns;
+            uint64_t sent_ns;
+            uint32_t size;     // header included
+            uint32_t received;
+            uint32_t header_size;
+            char header[concurrent_servers::frame_codec::MAX_HEADER_SIZE];
+        };
+
+        struct connection {
+            int fd{-1};
+            std::deque<request> in_flight{};
+            std::string output{};
+            size_t output_offset{0};
+            uint64_t next_send_ns{0};
+            bool want_write{false};
+        };
+
+        const load_options &_options;
+        const struct addrinfo *_address;
+        const size_distribution _sizes;
+        std::mt19937_64 _rng;
+        const uint64_t _interval_ns;
+        const uint64_t _start_ns;
+        const uint64_t _measure_from_ns;
+        const uint64_t _stop_ns;
+        int _epoll_fd{-1};
+        std::vector<connection> _connections;
+        const bool _framed;
+        const concurrent_servers::frame_codec _codec;
+        std::vector<char> _payload;
+        std::vector<char> _read_buffer;
+        load_result _result{};
+
+        size_t in_flight() const {
+            size_t total{0};
+            for (const connection &conn : _connections) {
+                total += conn.in_flight.size();
+            }
+            return total;
+        }
+
+        void open_connection(size_t index) {
+            connection &conn = _connections[index];
+            conn.fd = socket(_address->ai_family, _address->ai_socktype, _address->ai_protocol);
+            if (conn.fd < 0) {
+                throw std::runtime_error(std::string{"socket() failed: "} + strerror(errno));
+            }
+            if (connect(conn.fd, _address->ai_addr, _address->ai_addrlen) < 0) {
+                throw std::runtime_error(std::string{"connect() failed: "} + strerror(errno));
+            }
+
+            const int one{1};
+            setsockopt(conn.fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+            fcntl(conn.fd, F_SETFL, fcntl(conn.fd, F_GETFL, 0) | O_NONBLOCK);
+
+            struct epoll_event event{};
+            event.events = EPOLLIN;
+            event.data.u64 = index;
+            if (epoll_ctl(_epoll_fd, EPOLL_CTL_ADD, conn.fd, &event) < 0) {
+                throw std::runtime_error(std::string{"epoll_ctl() failed: "} + strerror(errno));
+            }
+        }
+
+        static void close_connection(connection &conn) {
+            if (conn.fd != -1) {
+                close(conn.fd);
+                conn.fd = -1;
+            }
+        }
+
+        void fail_connection(size_t index) {
+            connection &conn = _connections[index];
+            _result.errors += conn.in_flight.size() + 1;
+            conn.in_flight.clear();
+            close_connection(conn);
+        }
+
+        void send_due_requests(size_t index, uint64_t now) {
+            connection &conn = _connections[index];
+            if (conn.fd == -1) {
+                return;
+            }
+
+            const size_t queued = conn.in_flight.size();
+            if (_interval_ns == 0) {
+                while (conn.in_flight.size() < _options.pipeline_depth) {
+                    queue_request(conn, now, now);
+                }
+            } else {
+                // a request that could not be sent on time keeps its intended send time
+                while (conn.next_send_ns <= now and conn.next_send_ns < _stop_ns and conn.in_flight.size() < _options.pipeline_depth) {
+                    queue_request(conn, conn.next_send_ns, now);
+                    conn.next_send_ns += _interval_ns;
+                }
+            }
+
+            if (conn.in_flight.size() != queued) {
+                flush(index);
+            }
+        }
+
+        void queue_request(connection &conn, uint64_t intended_ns, uint64_t now) {
+            const size_t size = _sizes.next(_rng);
+            request req{intended_ns, now, 0, 0, 0, {}};
+            if (_framed) {
+                req.header_size = static_cast<uint32_t>(_codec.encode_header(req.header, static_cast<uint32_t>(size)));
+                conn.output.append(req.header, req.header_size);
+            }
+            req.size = static_cast<uint32_t>(req.header_size + size);
+            conn.output.append(_payload.data(), size);
+            conn.in_flight.push_back(req);
+        }
+
+        void flush(size_t index) {
+            connection &conn = _connections[index];
+            while (conn.output_offset < conn.output.size()) {
+                const ssize_t wlen = send(conn.fd, conn.output.data() + conn.output_offset,
+                                          conn.output.size() - conn.output_offset, MSG_NOSIGNAL);
+                if (wlen < 0) {
+                    if (errno == EAGAIN or errno == EWOULDBLOCK) {
+                        set_want_write(index, true);
+                        return;
+                    }
+                    if (errno == EINTR) {
+                        continue;
+                    }
+                    fail_connection(index);
+                    return;
+                }
+                conn.output_offset += static_cast<size_t>(wlen);
+            }
+
+            conn.output.clear();
+            conn.output_offset = 0;
+            set_want_write(index, false);
+        }
+
+        void set_want_write(size_t index, bool want_write) {
+            connection &conn = _connections[index];
+            if (conn.want_write == want_write) {
+                return;
+            }
+
+            struct epoll_event event{};
+            event.events = want_write ? (EPOLLIN | EPOLLOUT) : EPOLLIN;
+            event.data.u64 = index;
+            epoll_ctl(_epoll_fd, EPOLL_CTL_MOD, conn.fd, &event);
+            conn.want_write = want_write;
+        }
+
+        void receive(size_t index, uint64_t now) {
+            connection &conn = _connections[index];
+            for (;;) {
+                const ssize_t rlen = recv(conn.fd, _read_buffer.data(), _read_buffer.size(), 0);
+                if (rlen < 0) {
+                    if (errno == EINTR) {
+                        continue;
+                    }
+                    if (errno != EAGAIN and errno != EWOULDBLOCK) {
+                        fail_connection(index);
+                    }
+                    return;
+                }
+                if (rlen == 0) {
+                    fail_connection(index);
+                    return;
+                }
+
+                consume(conn, static_cast<size_t>(rlen), now);
+                if (static_cast<size_t>(rlen) < _read_buffer.size()) {
+                    return;
+                }
+            }
+        }
+
+        /**
+         * The echo comes back in order, so received bytes complete the oldest requests first.
+         */
+        void consume(connection &conn, size_t len, uint64_t now) {
+            const char *data = _read_buffer.data();
+            while (len > 0) {
+                if (conn.in_flight.empty()) {
+                    ++_result.mismatches; // the server sent more than it was sent
+                    return;
+                }
+
+                request &head = conn.in_flight.front();
+                size_t chunk = std::min<size_t>(len, head.size - head.received);
+                if (head.received < head.header_size) {
+                    // a framed echo starts with the request header
+                    chunk = std::min<size_t>(chunk, head.header_size - head.received);
+                    if (memcmp(data, head.header + head.received, chunk) != 0) {
+                        ++_result.mismatches;
+                    }
+                } else if (memcmp(data, _payload.data() + (head.received - head.header_size), chunk) != 0) {
+                    ++_result.mismatches;
+                }
+                head.received += static_cast<uint32_t>(chunk);
+                data += chunk;
+                len -= chunk;
+
+                if (head.received == head.size) {
+                    complete(head, now);
+                    conn.in_flight.pop_front();
+                }
+            }
+        }
+
+        void complete(const request &req, uint64_t now) {
+            if (req.intended_ns < _measure_from_ns or req.intended_ns >= _stop_ns) {
+                return;
+            }
+            _result.latency.record(now - req.intended_ns);
+            _result.service_time.record(now - req.sent_ns);
+            ++_result.completed;
+            _result.bytes += req.size;
+        }
+    };
+
+    void print_usage(const char *program) {
+        std::cerr << "Usage: " << program << " [options]\n"
+                  << "  -H, --host HOST            server host (localhost)\n"
+                  << "  -p, --port PORT            server port (" << concurrent_servers::DEFAULT_PORT << ")\n"
+                  << "  -c, --connections N        number of connections (16)\n"
+                  << "  -t, --threads N            number of client threads (1)\n"
+                  << "  -d, --pipeline N           maximum requests in flight per connection (1)\n"
+                  << "  -r, --rate N               target requests per second over all connections, 0 for closed loop (0)\n"
+                  << "  -s, --size DIST            message size: fixed:N, uniform:MIN-MAX or exponential:MEAN (fixed:64)\n"
+                  << "  -f, --framing PREFIX       length prefix of every message: none, fixed32 or varint (none)\n"
+                  << "  -D, --duration SECONDS     measured duration (10)\n"
+                  << "  -w, --warmup SECONDS       warm-up excluded from the results (1)\n"
+                  << "  -j, --json                 print the report as JSON\n";
+    }
+
+    load_options parse_options(int argc, char *argv[]) {
+        static const struct option long_options[] = {
+                {"host",        required_argument, nullptr, 'H'},
+                {"port",        required_argument, nullptr, 'p'},
+                {"connections", required_argument, nullptr, 'c'},
+                {"threads",     required_argument, nullptr, 't'},
+                {"pipeline",    required_argument, nullptr, 'd'},
+                {"rate",        required_argument, nullptr, 'r'},
+                {"size",        required_argument, nullptr, 's'},
+                {"framing",     required_argument, nullptr, 'f'},
+                {"duration",    required_argument, nullptr, 'D'},
+                {"warmup",      required_argument, nullptr, 'w'},
+                {"json",        no_argument,       nullptr, 'j'},
+                {"help",        no_argument,       nullptr, 'h'},
+                {nullptr,       0,                 nullptr, 0}
+        };
+
+        load_options options{};
+        int opt;
+        while ((opt = getopt_long(argc, argv, "H:p:c:t:d:r:s:f:D:w:jh", long_options, nullptr)) != -1) {
+            switch (opt) {
+                case 'H': options.host = optarg; break;
+                case 'p': options.port = optarg; break;
+                case 'c': options.connections = std::atoi(optarg); break;
+                case 't': options.threads = std::atoi(optarg); break;
+                case 'd': options.pipeline_depth = std::strtoul(optarg, nullptr, 10); break;
+                case 'r': options.rate = std::atof(optarg); break;
+                case 's': options.message_size = optarg; break;
+                case 'f': options.framing = optarg; break;
+                case 'D': options.duration = std::atof(optarg); break;
+                case 'w': options.warmup = std::atof(optarg); break;
+                case 'j': options.json = true; break;
+                default:
+                    print_usage(argv[0]);
+                    exit(opt == 'h' ? EXIT_SUCCESS : EXIT_FAILURE);
+            }
+        }
+
+        if (options.connections < 1 or options.threads < 1 or options.pipeline_depth < 1 or options.rate < 0
+            or options.duration <= 0 or options.warmup < 0
+            or (options.framing != "none" and options.framing != "fixed32" and options.framing != "varint")) {
+            print_usage(argv[0]);
+            exit(EXIT_FAILURE);
+        }
+        options.threads = std::min(options.threads, options.connections);
+        return options;
+    }
+
+    void print_text_report(const load_options &options, const load_result &result) {
+        constexpr double US{1000.0};
+        std::ostringstream rate;
+        if (options.rate > 0) {
+            rate << std::fixed << std::setprecision(0) << options.rate << " req/s (open loop)";
+        } else {
+            rate << "unlimited (closed loop)";
+        }
+
+        std::cout << std::fixed << std::setprecision(2)
+                  << options.connections << " connections, " << options.threads << " threads, pipeline depth "
+                  << options.pipeline_depth << ", rate " << rate.str() << ", message size " << options.message_size
+                  << ", framing " << options.framing << ", " << options.duration << " s (+" << options.warmup << " s warm-up)\n"
+                  << "Requests: " << result.completed << " completed, " << result.errors << " errors, "
+                  << result.mismatches << " mismatched echoes, " << result.unsent << " never sent\n"
+                  << "Throughput: " << static_cast<double>(result.completed) / options.duration << " req/s, "
+                  << static_cast<double>(result.bytes) / options.duration / (1024 * 1024) << " MB/s\n\n";
+
+        const std::pair<const char *, const concurrent_servers::latency_histogram *> histograms[] = {
+                {"Latency from the intended send time (corrected for coordinated omission), in us", &result.latency},
+                {"Service time from the actual send time, in us", &result.service_time}
+        };
+        for (const auto &[title, histogram] : histograms) {
+            std::cout << title << ":\n" << std::setprecision(3)
+                      << "  p50 " << static_cast<double>(histogram->value_at_percentile(50.0)) / US
+                      << "  p99 " << static_cast<double>(histogram->value_at_percentile(99.0)) / US
+                      << "  p99.9 " << static_cast<double>(histogram->value_at_percentile(99.9)) / US
+                      << "  max " << static_cast<double>(histogram->max()) / US << "\n\n";
+            histogram->print_percentiles(std::cout, US);
+            std::cout << "\n";
+        }
+    }
+
+    void print_json_report(const load_options &options, const load_result &result) {
+        constexpr double US{1000.0};
+        std::cout << std::fixed << std::setprecision(3)
+                  << "{\"connections\": " << options.connections
+                  << ", \"threads\": " << options.threads
+                  << ", \"pipeline_depth\": " << options.pipeline_depth
+                  << ", \"target_rate\": " << options.rate
+                  << ", \"message_size\": \"" << options.message_size << "\""
+                  << ", \"framing\": \"" << options.framing << "\""
+                  << ", \"duration\": " << options.duration
+                  << ", \"completed\": " << result.completed
+                  << ", \"errors\": " << result.errors
+                  << ", \"mismatches\": " << result.mismatches
+                  << ", \"unsent\": " << result.unsent
+                  << ", \"throughput_rps\": " << static_cast<double>(result.completed) / options.duration
+                  << ", \"throughput_bytes_per_second\": " << static_cast<double>(result.bytes) / options.duration
+                  << ", \"latency_us\": ";
+        result.latency.print_json(std::cout, US);
+        std::cout << ", \"service_time_us\": ";
+        result.service_time.print_json(std::cout, US);
+        std::cout << "}" << std::endl;
+    }
+}
+
+int main(int argc, char *argv[]) {
+    const load_options options = parse_options(argc, argv);
+
+    struct addrinfo hints{};
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    struct addrinfo *address{nullptr};
+    const int rc = getaddrinfo(options.host.c_str(), options.port.c_str(), &hints, &address);
+    if (rc != 0) {
+        std::cerr << "ERROR, cannot resolve " << options.host << ": " << gai_strerror(rc) << std::endl;
+        exit(EXIT_FAILURE);
+    }
+
+    try {
+        const uint64_t start_ns = now_ns();
+        std::vector<std::unique_ptr<load_thread>> load_threads{};
+        for (int i{0}; i < options.threads; ++i) {
+            const int connection_num = options.connections / options.threads + (i < options.connections % options.threads ? 1 : 0);
+            load_threads.push_back(std::make_unique<load_thread>(options, address, connection_num, start_ns, i));
+        }
+
+        std::vector<std::thread> threads{};
+        std::vector<std::string> errors(load_threads.size());
+        for (size_t i{0}; i < load_threads.size(); ++i) {
+            threads.emplace_back([&load_threads, &errors, i]() {
+                try {
+                    load_threads[i]->run();
+                } catch (const std::exception &e) {
+                    errors[i] = e.what();
+                }
+            });
+        }
+        for (auto &thread : threads) {
+            thread.join();
+        }
+        freeaddrinfo(address);
+
+        for (const std::string &error : errors) {
+            if (not error.empty()) {
+                throw std::runtime_error(error);
+            }
+        }
+
+        load_result result{};
+        for (const auto &thread : load_threads) {
+            result.merge(thread->result());
+        }
+
+        if (options.json) {
+            print_json_report(options, result);
+        } else {
+            print_text_report(options, result);
+        }
+    } catch (const std::exception &e) {
+        std::cerr << "ERROR, " << e.what() << std::endl;
+        exit(EXIT_FAILURE);
+    }
+
+    return 0;
+}
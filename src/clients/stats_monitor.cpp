@@ -0,0 +1,196 @@
+/*
+ * BSD 2-Clause License
+ *
+ * Copyright (c) 2019, Pham Phi Long <phamphilong2010@gmail.com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *   * Redistributions of source code must retain the above copyright notice,
+ *     this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *   * Neither the name of Redis nor the names of its contributors may be used
+ *     to endorse or promote products derived from this software without
+ *     specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+/*
+ * Reads the stats segment of a running prefork server and prints, every interval, what each worker process
+ * did since the previous sample and the total: connections, throughput, wakeups and read handler latency.
+ * The share column is each worker's part of the bytes received, SO_REUSEPORT hashing imbalance shows there.
+ *
+ * Usage: linux_tcp_stats <server pid | segment path> [interval seconds (1)] [samples, 0 for no end (0)]
+ */
+
+#include <stdlib.h>
+#include <unistd.h>
+#include <algorithm>
+#include <array>
+#include <chrono>
+#include <cstdint>
+#include <iomanip>
+#include <iostream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "stats_segment.h"
+
+namespace {
+    using concurrent_servers::worker_counter;
+    using concurrent_servers::worker_metrics;
+
+    /**
+     * What a slot held at one time, copied out of the shared memory.
+     */
+    struct sample {
+        int64_t pid{0};
+        std::array<uint64_t, worker_metrics::COUNTERS> counters{};
+        std::array<uint64_t, worker_metrics::LATENCY_BUCKETS> latency{};
+
+        uint64_t get(worker_counter counter) const {
+            return counters[static_cast<size_t>(counter)];
+        }
+    };
+
+    sample read_slot(const concurrent_servers::worker_stats_slot &slot) {
+        sample s{};
+        s.pid = slot.pid.load(std::memory_order_relaxed);
+        for (size_t i{0}; i < worker_metrics::COUNTERS; ++i) {
+            s.counters[i] = slot.metrics.counters[i].load(std::memory_order_relaxed);
+        }
+        for (size_t i{0}; i < worker_metrics::LATENCY_BUCKETS; ++i) {
+            s.latency[i] = slot.metrics.handler_latency[i].load(std::memory_order_relaxed);
+        }
+        return s;
+    }
+
+    /**
+     * Upper bound of the latency bucket holding the given percentile of the calls between two samples, in µs.
+     */
+    double latency_percentile_us(const sample &now, const sample &before, double percentile) {
+        uint64_t total{0};
+        for (size_t i{0}; i < worker_metrics::LATENCY_BUCKETS; ++i) {
+            total += now.latency[i] - before.latency[i];
+        }
+        if (total == 0) {
+            return 0;
+        }
+        const auto target = std::max<uint64_t>(1, static_cast<uint64_t>(percentile / 100.0 * static_cast<double>(total)));
+        uint64_t seen{0};
+        size_t bucket{0};
+        for (; bucket + 1 < worker_metrics::LATENCY_BUCKETS; ++bucket) {
+            seen += now.latency[bucket] - before.latency[bucket];
+            if (seen >= target) {
+                break;
+            }
+        }
+        return static_cast<double>(worker_metrics::latency_bucket_bound(std::min(bucket, worker_metrics::LATENCY_BUCKETS - 2))) / 1000.0;
+    }
+
+    void print_row(const std::string &name, const std::string &pid, const sample &now, const sample &before,
+                   double seconds, uint64_t all_bytes_in) {
+        const auto delta = [&now, &before](worker_counter counter) {
+            return static_cast<double>(now.get(counter) - before.get(counter));
+        };
+        const double wakeups = delta(worker_counter::WAKEUPS);
+        const double bytes_in = delta(worker_counter::BYTES_IN);
+        const uint64_t accepted = now.get(worker_counter::ACCEPTS);
+        const uint64_t closed = now.get(worker_counter::CLOSES);
+
+        std::cout << std::setw(8) << name << std::setw(9) << pid
+                  << std::setw(10) << delta(worker_counter::ACCEPTS) / seconds
+                  << std::setw(8) << (accepted >= closed ? accepted - closed : 0)
+                  << std::setw(10) << bytes_in / seconds / (1024 * 1024)
+                  << std::setw(10) << delta(worker_counter::BYTES_OUT) / seconds / (1024 * 1024)
+                  << std::setw(11) << wakeups / seconds
+                  << std::setw(10) << (wakeups > 0 ? delta(worker_counter::EVENTS) / wakeups : 0)
+                  << std::setw(10) << latency_percentile_us(now, before, 50.0)
+                  << std::setw(10) << latency_percentile_us(now, before, 99.0)
+                  << std::setw(8) << (all_bytes_in > 0 ? 100.0 * bytes_in / static_cast<double>(all_bytes_in) : 0) << "%\n";
+    }
+}
+
+int main(int argc, char *argv[]) {
+    if (argc < 2) {
+        std::cerr << "Usage: " << argv[0] << " <server pid | segment path> [interval seconds (1)] [samples, 0 for no end (0)]" << std::endl;
+        exit(EXIT_FAILURE);
+    }
+    const std::string target{argv[1]};
+    const double interval = (argc >= 3) ? std::max(atof(argv[2]), 0.1) : 1.0;
+    const long samples = (argc >= 4) ? atol(argv[3]) : 0;
+
+    std::string path{target};
+    if (target.find_first_not_of("0123456789") == std::string::npos) {
+        path = concurrent_servers::stats_segment::find(static_cast<pid_t>(atol(target.c_str())));
+        if (path.empty()) {
+            std::cerr << "ERROR, process " << target << " holds no stats segment" << std::endl;
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    try {
+        const concurrent_servers::stats_segment stats{path};
+        const size_t slot_count = stats.slot_count();
+        std::vector<sample> before(slot_count);
+        for (size_t i{0}; i < slot_count; ++i) {
+            before[i] = read_slot(stats.slot(i));
+        }
+        auto before_time = std::chrono::steady_clock::now();
+
+        for (long n{0}; samples == 0 or n < samples; ++n) {
+            std::this_thread::sleep_for(std::chrono::duration<double>{interval});
+            const auto now_time = std::chrono::steady_clock::now();
+            const double seconds = std::chrono::duration<double>{now_time - before_time}.count();
+
+            std::vector<sample> now(slot_count);
+            sample total_now{};
+            sample total_before{};
+            for (size_t i{0}; i < slot_count; ++i) {
+                now[i] = read_slot(stats.slot(i));
+                for (size_t c{0}; c < worker_metrics::COUNTERS; ++c) {
+                    total_now.counters[c] += now[i].counters[c];
+                    total_before.counters[c] += before[i].counters[c];
+                }
+                for (size_t b{0}; b < worker_metrics::LATENCY_BUCKETS; ++b) {
+                    total_now.latency[b] += now[i].latency[b];
+                    total_before.latency[b] += before[i].latency[b];
+                }
+            }
+            const uint64_t all_bytes_in = total_now.get(worker_counter::BYTES_IN) - total_before.get(worker_counter::BYTES_IN);
+
+            std::cout << std::fixed << std::setprecision(1)
+                      << std::setw(8) << "worker" << std::setw(9) << "pid" << std::setw(10) << "conn/s" << std::setw(8) << "open"
+                      << std::setw(10) << "MB/s in" << std::setw(10) << "MB/s out" << std::setw(11) << "wakeups/s"
+                      << std::setw(10) << "ev/wake" << std::setw(10) << "p50 us" << std::setw(10) << "p99 us"
+                      << std::setw(9) << "share" << "\n";
+            for (size_t i{0}; i < slot_count; ++i) {
+                print_row(std::to_string(i), now[i].pid > 0 ? std::to_string(now[i].pid) : "-", now[i], before[i], seconds, all_bytes_in);
+            }
+            print_row("total", "", total_now, total_before, seconds, all_bytes_in);
+            std::cout << std::endl;
+
+            before = now;
+            before_time = now_time;
+        }
+    } catch (const std::runtime_error &e) {
+        std::cerr << "ERROR, " << e.what() << std::endl;
+        exit(EXIT_FAILURE);
+    }
+}
@@ -6,7 +6,7 @@
 #ifndef LINUX_TCP_SERVERS_CONSTANTS_H
 #define LINUX_TCP_SERVERS_CONSTANTS_H
 
-#define DEFAULT_BACKLOG 50
+#define DEFAULT_BACKLOG 0 // net.core.somaxconn, see concurrent_servers::listen_backlog()
 #define BUFF_SIZE 1000
 
 namespace concurrent_servers {
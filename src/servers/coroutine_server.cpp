@@ -0,0 +1,80 @@
+/*
+ * BSD 2-Clause License
+ *
+ * Copyright (c) 2019, Pham Phi Long <phamphilong2010@gmail.com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *   * Redistributions of source code must retain the above copyright notice,
+ *     this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *   * Neither the name of Redis nor the names of its contributors may be used
+ *     to endorse or promote products derived from this software without
+ *     specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "coroutine_server.h"
+#include "frame_codec.h"
+#include "print_utility.h"
+#include "command_line.h"
+
+/**
+ * Echoes every frame back as a frame, after delay if one is set.
+ */
+struct echo_handler {
+    std::chrono::milliseconds delay;
+
+    concurrent_servers::task<> operator()(concurrent_servers::coroutine_connection &conn) const {
+        while (auto frame = co_await conn.read_frame()) {
+            CS_LOG_INFO("fd=", conn.fd(), "  received frame: ", *frame);
+            if (delay.count() > 0) {
+                const std::string payload{*frame};
+                co_await concurrent_servers::sleep_for(delay);
+                if (not co_await conn.write_frame(payload)) {
+                    co_return;
+                }
+            } else if (not co_await conn.write_frame(*frame)) {
+                co_return;
+            }
+        }
+    }
+};
+
+int main(int argc, char *argv[]) {
+    const concurrent_servers::listener_options listener = concurrent_servers::listener_options::from_args(argc, argv);
+    concurrent_servers::command_line args{argc, argv};
+    try {
+        const std::string port_num = args.positional(0, concurrent_servers::DEFAULT_PORT);
+        const int backlog = args.positional_number(1, DEFAULT_BACKLOG);
+        const int worker_process_num = args.positional_number(2, concurrent_servers::DEFAULT_WORKER_PROCESS_NUMBER);
+        const concurrent_servers::frame_prefix prefix = args.choice<concurrent_servers::frame_prefix>("prefix", {
+                    {"fixed32", concurrent_servers::frame_prefix::FIXED32},
+                    {"varint", concurrent_servers::frame_prefix::VARINT}},
+                    concurrent_servers::frame_prefix::FIXED32);
+        const std::chrono::milliseconds delay{args.number("delay-ms", 0)};
+        args.finish(3);
+
+        concurrent_servers::coroutine_server<echo_handler> server{
+                worker_process_num, port_num, backlog, concurrent_servers::frame_codec{prefix}, delay};
+        server.set_listener_options(listener);
+        server.start();
+    } catch (const concurrent_servers::usage_error &e) {
+        concurrent_servers::exit_with_usage(argv[0], "[port] [backlog] [worker processes] [--prefix=fixed32|varint] [--delay-ms=MS]", e);
+    }
+}
@@ -0,0 +1,572 @@
+/*
+ * BSD 2-Clause License
+ *
+ * Copyright (c) 2019, Pham Phi Long <phamphilong2010@gmail.com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *   * Redistributions of source code must retain the above copyright notice,
+ *     this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *   * Neither the name of Redis nor the names of its contributors may be used
+ *     to endorse or promote products derived from this software without
+ *     specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef LINUX_TCP_SERVERS_COROUTINE_SERVER_H
+#define LINUX_TCP_SERVERS_COROUTINE_SERVER_H
+
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#include <array>
+#include <chrono>
+#include <coroutine>
+#include <cstring>
+#include <exception>
+#include <memory>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <utility>
+#include <vector>
+
+#include "utilities/print_utility.h"
+#include "utilities/file_descriptor.h"
+#include "utilities/server_utility.h"
+#include "utilities/listener_options.h"
+#include "utilities/buffer_pool.h"
+#include "utilities/input_buffer.h"
+#include "utilities/output_queue.h"
+#include "utilities/frame_codec.h"
+#include "utilities/timing_wheel.h"
+#include "utilities/cpu_topology.h"
+#include "utilities/coroutine_task.h"
+#include "include/constants.h"
+
+namespace concurrent_servers {
+    namespace detail {
+        // timers of the worker running on this thread and the connection whose handler it runs, for sleep_for()
+        inline thread_local timing_wheel *coroutine_timers{nullptr};
+        inline thread_local int coroutine_fd{-1};
+
+        struct sleep_awaiter {
+            std::chrono::milliseconds duration;
+            timing_wheel::timer timer{};
+            std::coroutine_handle<> handle{};
+            int fd{-1};
+
+            bool await_ready() const noexcept {
+                return duration.count() <= 0 or coroutine_timers == nullptr;
+            }
+
+            void await_suspend(std::coroutine_handle<> awaiting) {
+                handle = awaiting;
+                fd = coroutine_fd;
+                // tagged with the low bit, connection timers hold a connection pointer
+                timer.data = reinterpret_cast<uint64_t>(this) | 1;
+                coroutine_timers->schedule(timer, timing_wheel::now_ms() + static_cast<uint64_t>(duration.count()));
+            }
+
+            void await_resume() const noexcept {
+            }
+        };
+    }
+
+    /**
+     * Suspends the calling handler for at least duration, rounded up to the timing wheel resolution.
+     */
+    inline detail::sleep_awaiter sleep_for(std::chrono::milliseconds duration) {
+        return detail::sleep_awaiter{duration};
+    }
+
+    /**
+     * Connection given to a coroutine handler. Every operation is awaited and suspends the handler only when the
+     * socket is not ready; the event loop resumes it directly once it is:
+     *     while (auto frame = co_await conn.read_frame()) {
+     *         co_await conn.write_frame(*frame);
+     *     }
+     * A read yields std::nullopt at the end of the input: end of file, an error, a malformed frame, or no data
+     * within the idle timeout. The bytes it returns stay valid until the next read. A write queues the data, sent
+     * as soon as the handler suspends, and only waits while more than the output high watermark is pending; it
+     * yields false once the connection is broken. Pending output is still sent after the handler returns, then the connection is closed.
+     */
+    class coroutine_connection {
+    public:
+        coroutine_connection(int fd, buffer_pool &pool, const frame_codec &codec, timing_wheel &timers,
+                             const connection_timeouts &timeouts) :
+                _fd{fd},
+                _codec{codec},
+                _timers{timers},
+                _timeouts{timeouts},
+                _input{},
+                _output{},
+                _timer{},
+                _reader{},
+                _writer{},
+                _read_kind{read_kind::SOME},
+                _consume_on_next_read{0},
+                _read_closed{false},
+                _broken{false} {
+            _input.set_buffer_pool(&pool);
+            _output.set_buffer_pool(&pool);
+            _timer.data = reinterpret_cast<uint64_t>(this);
+        }
+
+        coroutine_connection(const coroutine_connection &) = delete;
+        coroutine_connection &operator=(const coroutine_connection &) = delete;
+
+        ~coroutine_connection() {
+            _timers.cancel(_timer);
+        }
+
+        /**
+         * The payload of the next length prefixed frame.
+         */
+        auto read_frame() {
+            return read_awaiter{*this, read_kind::FRAME};
+        }
+
+        /**
+         * Whatever the peer sent since the last read, at least one byte.
+         */
+        auto read_some() {
+            return read_awaiter{*this, read_kind::SOME};
+        }
+
+        auto write(std::string_view data) {
+            return write_awaiter{*this, data, false};
+        }
+
+        auto write_frame(std::string_view payload) {
+            return write_awaiter{*this, payload, true};
+        }
+
+        int fd() const {
+            return _fd;
+        }
+
+    private:
+        template <typename Handler>
+        friend class coroutine_server;
+
+        enum class read_kind {
+            FRAME,
+            SOME
+        };
+
+        static constexpr size_t MAX_PENDING_INPUT{2 * 1024 * 1024};
+
+        struct read_awaiter {
+            coroutine_connection &conn;
+            read_kind kind;
+
+            bool await_ready() {
+                conn._read_kind = kind;
+                return conn.try_read();
+            }
+
+            void await_suspend(std::coroutine_handle<> awaiting) {
+                conn._reader = awaiting;
+                conn._timers.schedule(conn._timer, connection_timeouts::deadline(timing_wheel::now_ms(), conn._timeouts.idle));
+            }
+
+            std::optional<std::string_view> await_resume() {
+                conn._reader = {};
+                conn._timers.cancel(conn._timer);
+                return conn.take_input();
+            }
+        };
+
+        struct write_awaiter {
+            coroutine_connection &conn;
+            std::string_view data;
+            bool framed;
+
+            bool await_ready() {
+                if (conn._broken) {
+                    return true;
+                }
+                const bool queued = framed ? conn._codec.append_frame(conn._output, data.data(), data.size())
+                                           : conn._output.append(data.data(), data.size());
+                if (not queued) {
+                    CS_LOG_ERROR("coroutine connection: could not queue the output, fd=", conn._fd);
+                    conn._broken = true;
+                    return true;
+                }
+                // the output is sent when the handler suspends, so the replies to pipelined requests share a write
+                if (conn._output.above_high_watermark()) {
+                    conn.flush();
+                }
+                return conn._broken or not conn._output.above_high_watermark();
+            }
+
+            void await_suspend(std::coroutine_handle<> awaiting) {
+                conn._writer = awaiting;
+                conn._timers.schedule(conn._timer, connection_timeouts::deadline(timing_wheel::now_ms(), conn._timeouts.write));
+            }
+
+            bool await_resume() {
+                conn._writer = {};
+                conn._timers.cancel(conn._timer);
+                return not conn._broken;
+            }
+        };
+
+        const int _fd;
+        const frame_codec &_codec;
+        timing_wheel &_timers;
+        const connection_timeouts &_timeouts;
+        input_buffer _input;
+        output_queue _output;
+        timing_wheel::timer _timer;       // timeout of the suspended read or write, or of the last output
+        std::coroutine_handle<> _reader;  // suspended in a read until the socket is readable
+        std::coroutine_handle<> _writer;  // suspended in a write until the output drains
+        read_kind _read_kind;
+        size_t _consume_on_next_read;     // the bytes returned by the last read, valid until the next one
+        bool _read_closed;
+        bool _broken;
+
+        /**
+         * Reads until the awaited input is complete or the socket would block. Returns true if the read can
+         * complete now, with data or with the end of the input.
+         */
+        bool try_read() {
+            if (_consume_on_next_read > 0) {
+                _input.consume(_consume_on_next_read);
+                _consume_on_next_read = 0;
+            }
+
+            for (;;) {
+                if (has_input() or _read_closed or _broken) {
+                    return true;
+                }
+
+                char *buffer = _input.prepare(MAX_PENDING_INPUT);
+                if (buffer == nullptr) {
+                    CS_LOG_WARNING("coroutine connection: input too long or out of buffers, fd=", _fd);
+                    _read_closed = true;
+                    return true;
+                }
+                const ssize_t rlen = ::read(_fd, buffer, _input.writable());
+                if (rlen > 0) {
+                    _input.commit(static_cast<size_t>(rlen));
+                    continue;
+                }
+                if (rlen < 0 and (errno == EAGAIN or errno == EWOULDBLOCK)) {
+                    return false;
+                }
+                if (rlen < 0 and errno == EINTR) {
+                    continue;
+                }
+                _read_closed = true; // end of file or error
+            }
+        }
+
+        /**
+         * A frame whose header is malformed ends the input.
+         */
+        bool has_input() {
+            if (_input.empty()) {
+                return false;
+            }
+            if (_read_kind == read_kind::SOME) {
+                return true;
+            }
+            size_t header_size{0};
+            uint32_t payload_size{0};
+            const auto status = _codec.decode_header(_input.data(), _input.size(), header_size, payload_size);
+            if (status == frame_codec::decode_status::INVALID) {
+                CS_LOG_WARNING("coroutine connection: malformed frame, fd=", _fd);
+                _read_closed = true;
+                return false;
+            }
+            return status == frame_codec::decode_status::COMPLETE and _input.size() >= header_size + payload_size;
+        }
+
+        std::optional<std::string_view> take_input() {
+            if (not has_input()) {
+                return std::nullopt;
+            }
+            if (_read_kind == read_kind::SOME) {
+                _consume_on_next_read = _input.size();
+                return std::string_view{_input.data(), _input.size()};
+            }
+            size_t header_size{0};
+            uint32_t payload_size{0};
+            _codec.decode_header(_input.data(), _input.size(), header_size, payload_size);
+            _consume_on_next_read = header_size + payload_size;
+            return std::string_view{_input.data() + header_size, payload_size};
+        }
+
+        void flush() {
+            if (not _output.empty() and _output.flush(_fd) == output_queue::flush_result::ERROR) {
+                CS_LOG_ERROR("coroutine connection: error on writing, fd=", _fd, "\t", strerror(errno));
+                _broken = true;
+            }
+        }
+
+        /**
+         * The handler of a connection timed out in a read or a write, or after it returned.
+         */
+        void time_out() {
+            CS_LOG_WARNING("coroutine connection: timed out, fd=", _fd);
+            if (_reader) {
+                _read_closed = true;
+            } else {
+                _broken = true;
+            }
+        }
+    };
+
+    /**
+     * Prefork server whose connections are served by coroutines:
+     * concurrent_servers::task<> operator()(concurrent_servers::coroutine_connection &conn) const
+     * Every worker process owns an SO_REUSEPORT listener and an edge-triggered epoll set. A readiness event
+     * resumes the coroutine suspended on that connection right away, on the stack of the event loop, and the
+     * frames of the coroutines come from coroutine_frame_pool.
+     */
+    template <typename Handler>
+    class coroutine_server {
+    public:
+        /**
+         * handler_args, if any, are given to the Handler constructor.
+         */
+        template <typename... HandlerArgs>
+        explicit coroutine_server(int worker_process_num, std::string port_num, int backlog, frame_codec codec,
+                                  HandlerArgs&&... handler_args) :
+                _worker_process_num{worker_process_num},
+                _port_num{std::move(port_num)},
+                _backlog{backlog},
+                _codec{codec},
+                _handler{std::forward<HandlerArgs>(handler_args)...},
+                _timeouts{},
+                _affinity{worker_affinity::CPU},
+                _listener{} {
+        }
+
+        /**
+         * Replaces the default connection timeouts: idle bounds a read, write a write and the output left when
+         * the handler returns. Call it before start().
+         */
+        void set_timeouts(const connection_timeouts &timeouts) {
+            _timeouts = timeouts;
+        }
+
+        void set_affinity(worker_affinity affinity) {
+            _affinity = affinity;
+        }
+
+        /**
+         * Tunes the listening sockets and the accepted connections, see listener_options. Call it before start().
+         */
+        void set_listener_options(const listener_options &options) {
+            _listener = options;
+        }
+
+        /**
+         * Without a worker process number, i.e. 0, forks one worker per CPU that the affinity allows.
+         */
+        void start() const {
+            const cpu_topology topology = cpu_topology::detect();
+            const int worker_process_num = _worker_process_num > 0 ? _worker_process_num : topology.worker_count(_affinity);
+
+            for (int i{0}; i < worker_process_num; ++i) {
+                const pid_t child_pid = fork();
+                if (child_pid == -1) {
+                    throw std::runtime_error("Failed to fork worker processes");
+                } else if (child_pid > 0) {
+                    std::cout << "\033[32m" << "Forked new worker process with pid=" << child_pid << "\033[0m" << std::endl;
+                    continue;
+                }
+
+                file_descriptor server_sfd{};
+                try {
+                    const int cpu = topology.place_worker(i, _affinity);
+                    CS_LOG_INFO("worker process ", i, " pid=", getpid(), " cpu=", cpu);
+                    server_sfd = setup_server_tcp_socket(_port_num, _backlog, true, true, _listener);
+                    event_loop(server_sfd);
+                } catch (const std::runtime_error &e) {
+                    log_error(e.what(), "\n\t", strerror(errno));
+                    server_sfd.close_fd();
+                    exit(EXIT_FAILURE);
+                }
+            }
+
+            while (wait(nullptr) > 0 or errno == EINTR) {}
+        }
+
+    private:
+        const int _worker_process_num;
+        const std::string _port_num;
+        const int _backlog;
+        const frame_codec _codec;
+        const Handler _handler;
+        connection_timeouts _timeouts;
+        worker_affinity _affinity;
+        listener_options _listener;
+
+        struct connection_slot {
+            std::unique_ptr<coroutine_connection> conn{};
+            task<> handler{}; // destroyed before conn, its frame refers to it
+        };
+
+        static constexpr size_t CONNECTION_BUFFER_SIZE{4096};
+        static constexpr int MAX_EVENTS{1024};
+
+        [[noreturn]] void event_loop(const file_descriptor &server_sfd) const {
+            const std::string prefix_log = "Coroutine worker process " + std::to_string(getpid()) + ": ";
+            buffer_pool pool{CONNECTION_BUFFER_SIZE};
+            timing_wheel timers{};
+            detail::coroutine_timers = &timers;
+            std::vector<connection_slot> slots{}; // indexed by client socket fd
+
+            file_descriptor epoll_fd{};
+            if (not epoll_fd.set_fd(epoll_create1(0))) {
+                throw std::runtime_error("epoll_create1() failed");
+            }
+            struct epoll_event event{};
+            event.data.fd = server_sfd.get_fd();
+            event.events = EPOLLIN | EPOLLET;
+            if (epoll_ctl(epoll_fd.get_fd(), EPOLL_CTL_ADD, server_sfd.get_fd(), &event) == -1) {
+                throw std::runtime_error("epoll_ctl() failed");
+            }
+
+            const auto close_connection = [&slots, &epoll_fd](int fd) {
+                epoll_ctl(epoll_fd.get_fd(), EPOLL_CTL_DEL, fd, nullptr);
+                slots[fd].handler = task<>{};
+                slots[fd].conn.reset();
+                close(fd);
+            };
+
+            // called once a handler suspends or returns: sends its output, a handler that returned is closed once it is sent
+            const auto settle = [&prefix_log, &slots, &timers, &close_connection, this](int fd) {
+                connection_slot &slot = slots[fd];
+                if (slot.conn == nullptr) {
+                    return;
+                }
+                slot.conn->flush();
+                if (not slot.handler.done()) {
+                    return;
+                }
+                if (slot.handler.handle() and slot.handler.handle().promise().exception) {
+                    try {
+                        slot.handler.handle().promise().result();
+                    } catch (const std::exception &e) {
+                        CS_LOG_ERROR(prefix_log, "handler failed, fd=", fd, ": ", e.what());
+                    }
+                    slot.conn->_broken = true;
+                }
+                coroutine_connection &conn = *slot.conn;
+                if (conn._broken or conn._output.empty()) {
+                    close_connection(fd);
+                } else if (not conn._timer.scheduled()) {
+                    timers.schedule(conn._timer, connection_timeouts::deadline(timing_wheel::now_ms(), _timeouts.write));
+                }
+            };
+
+            std::array<struct epoll_event, MAX_EVENTS> events{};
+            for (;;) {
+                const int nfds = epoll_wait(epoll_fd.get_fd(), events.data(), MAX_EVENTS, timers.next_timeout_ms(timing_wheel::now_ms()));
+                if (nfds == -1 and errno != EINTR) {
+                    throw std::runtime_error(prefix_log + "epoll_wait() failed");
+                }
+
+                timers.advance(timing_wheel::now_ms(), [&settle](timing_wheel::timer &timer) {
+                    if (timer.data & 1) {
+                        // the awaiter of sleep_for() lives in the frame of the suspended handler
+                        auto &sleeper = *reinterpret_cast<detail::sleep_awaiter *>(timer.data & ~uint64_t{1});
+                        const int fd = sleeper.fd;
+                        detail::coroutine_fd = fd;
+                        sleeper.handle.resume();
+                        settle(fd);
+                        return;
+                    }
+                    auto &conn = *reinterpret_cast<coroutine_connection *>(timer.data);
+                    const int fd = conn._fd;
+                    detail::coroutine_fd = fd;
+                    conn.time_out();
+                    if (conn._reader) {
+                        conn._reader.resume();
+                    } else if (conn._writer) {
+                        conn._writer.resume();
+                    }
+                    settle(fd);
+                });
+
+                for (int i{0}; i < nfds; ++i) {
+                    const int fd = events[i].data.fd;
+                    if (fd == server_sfd.get_fd()) {
+                        for (;;) {
+                            const int conn_fd = accept4(server_sfd.get_fd(), nullptr, nullptr, SOCK_NONBLOCK);
+                            if (conn_fd < 0) {
+                                if (errno != EWOULDBLOCK and errno != EAGAIN) {
+                                    CS_LOG_ERROR(prefix_log, "could not accept a new connection. ", strerror(errno));
+                                }
+                                break;
+                            }
+                            CS_LOG_INFO(prefix_log, "Add new client socket fd=", conn_fd);
+                            set_accepted_options(conn_fd, _listener);
+                            if (static_cast<size_t>(conn_fd) >= slots.size()) {
+                                slots.resize(conn_fd + 1);
+                            }
+
+                            // registered once for both directions, the awaiters tell what the events resume
+                            struct epoll_event conn_event{};
+                            conn_event.data.fd = conn_fd;
+                            conn_event.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+                            if (epoll_ctl(epoll_fd.get_fd(), EPOLL_CTL_ADD, conn_fd, &conn_event) == -1) {
+                                CS_LOG_ERROR(prefix_log, "epoll_ctl() failed. Could not register event for new client_fd ", conn_fd);
+                                close(conn_fd);
+                                continue;
+                            }
+                            connection_slot &slot = slots[conn_fd];
+                            slot.conn = std::make_unique<coroutine_connection>(conn_fd, pool, _codec, timers, _timeouts);
+                            slot.handler = _handler(*slot.conn);
+                            detail::coroutine_fd = conn_fd;
+                            slot.handler.handle().resume(); // runs until its first suspension
+                            settle(conn_fd);
+                        }
+                        continue;
+                    }
+
+                    if (static_cast<size_t>(fd) >= slots.size() or slots[fd].conn == nullptr) {
+                        continue;
+                    }
+                    coroutine_connection &conn = *slots[fd].conn;
+                    detail::coroutine_fd = fd;
+                    if (events[i].events & (EPOLLOUT | EPOLLERR | EPOLLHUP)) {
+                        conn.flush();
+                        if (conn._writer and (conn._broken or conn._output.below_low_watermark())) {
+                            conn._writer.resume();
+                        }
+                    }
+                    if (slots[fd].conn != nullptr and conn._reader and (events[i].events & (EPOLLIN | EPOLLRDHUP | EPOLLERR | EPOLLHUP))
+                        and conn.try_read()) {
+                        conn._reader.resume();
+                    }
+                    settle(fd);
+                }
+            }
+        }
+    };
+}
+
+#endif /* LINUX_TCP_SERVERS_COROUTINE_SERVER_H */
@@ -0,0 +1,161 @@
+/*
+ * BSD 2-Clause License
+ *
+ * Copyright (c) 2019, Pham Phi Long <phamphilong2010@gmail.com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *   * Redistributions of source code must retain the above copyright notice,
+ *     this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *   * Neither the name of Redis nor the names of its contributors may be used
+ *     to endorse or promote products derived from this software without
+ *     specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * Serves files under a root directory on the prefork/reuseport engine.
+ * Request, one per line, possibly pipelined:   GET <path>\n
+ * Reply:   OK <size>\n followed by the content,   or   ERROR <reason>\n
+ * The content is sent with sendfile() from a cache of open file descriptors, it never goes through user space.
+ */
+
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <cstring>
+#include <string>
+
+#include "multi_worker_reuseport_nonblocking_io_multiplexing_server.h"
+#include "open_file_cache.h"
+#include "output_queue.h"
+#include "print_utility.h"
+
+class file_request_handler {
+public:
+    explicit file_request_handler(const std::string &root_dir) :
+            _root_fd{open(root_dir.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC)},
+            _cache{_root_fd} {
+        if (_root_fd == -1) {
+            throw std::runtime_error("could not open the root directory " + root_dir);
+        }
+    }
+
+    file_request_handler(const file_request_handler &) = delete;
+    file_request_handler &operator=(const file_request_handler &) = delete;
+
+    /**
+     * Answers every complete request line of buff, returns the length of those lines. Closes the connection
+     * when a reply could not be queued whole, the client would take what follows for its missing part.
+     */
+    size_t operator()(const std::string &prefix_log, char *buff, size_t buff_len, concurrent_servers::output_queue &output) const {
+        size_t consumed{0};
+        for (;;) {
+            const auto *line_end = static_cast<const char *>(memchr(buff + consumed, '\n', buff_len - consumed));
+            if (line_end == nullptr) {
+                return consumed;
+            }
+
+            std::string line{buff + consumed, static_cast<size_t>(line_end - (buff + consumed))};
+            consumed = static_cast<size_t>(line_end - buff) + 1;
+            if (not line.empty() and line.back() == '\r') {
+                line.pop_back();
+            }
+            if (not serve(prefix_log, line, output)) {
+                return concurrent_servers::CLOSE_CONNECTION;
+            }
+        }
+    }
+
+private:
+    const int _root_fd;
+    mutable concurrent_servers::open_file_cache _cache;
+
+    /**
+     * Queues the reply to one request line. Returns false if the pool ran out of chunks, a part of the reply may
+     * be queued then.
+     */
+    bool serve(const std::string &prefix_log, const std::string &line, concurrent_servers::output_queue &output) const {
+        if (line.compare(0, 4, "GET ") != 0) {
+            return output.append("ERROR bad request\n", 18);
+        }
+
+        std::string path = line.substr(4);
+        while (not path.empty() and path.front() == '/') {
+            path.erase(0, 1);
+        }
+        if (not valid_path(path)) {
+            return output.append("ERROR bad path\n", 15);
+        }
+
+        concurrent_servers::open_file_cache::entry *file = _cache.acquire(path);
+        if (file == nullptr) {
+            CS_LOG_INFO(prefix_log, "  could not open ", path, ": ", strerror(errno));
+            const std::string reply = std::string{"ERROR "} + strerror(errno) + "\n";
+            return output.append(reply.data(), reply.size());
+        }
+        if (not S_ISREG(file->stat.st_mode)) {
+            concurrent_servers::open_file_cache::release(file);
+            return output.append("ERROR not a regular file\n", 25);
+        }
+
+        CS_LOG_INFO(prefix_log, "  send ", path, ", ", file->stat.st_size, " bytes");
+        const std::string header = "OK " + std::to_string(file->stat.st_size) + "\n";
+        if (not output.append(header.data(), header.size())
+            or not output.push_file(file->fd, 0, file->stat.st_size, concurrent_servers::open_file_cache::release, file)) {
+            concurrent_servers::open_file_cache::release(file);
+            CS_LOG_ERROR(prefix_log, "  out of output buffers, could not send ", path);
+            return false;
+        }
+        return true;
+    }
+
+    /**
+     * Only relative paths staying under the root directory are served.
+     */
+    static bool valid_path(const std::string &path) {
+        if (path.empty() or path.find('\0') != std::string::npos) {
+            return false;
+        }
+
+        size_t begin{0};
+        while (begin <= path.size()) {
+            size_t end = path.find('/', begin);
+            if (end == std::string::npos) {
+                end = path.size();
+            }
+            if (path.compare(begin, end - begin, "..") == 0) {
+                return false;
+            }
+            begin = end + 1;
+        }
+        return true;
+    }
+};
+
+int main(int argc, char *argv[]) {
+    const concurrent_servers::listener_options listener = concurrent_servers::listener_options::from_args(argc, argv);
+    const std::string port_num = (argc >= 2) ? argv[1] : concurrent_servers::DEFAULT_PORT;
+    const int backlog = (argc >= 3) ? atoi(argv[2]) : DEFAULT_BACKLOG;
+    const int worker_process_num = (argc >= 4) ? atoi(argv[3]) : concurrent_servers::DEFAULT_WORKER_PROCESS_NUMBER;
+    const std::string root_dir = (argc >= 5) ? argv[4] : ".";
+    concurrent_servers::linux_concurrent_server<file_request_handler> server{worker_process_num, port_num, backlog, root_dir};
+    server.set_listener_options(listener);
+
+    server.start();
+}
@@ -51,12 +51,13 @@ int main(int argc, char *argv[]) {
     strncpy(argv[0], "fork process per connection server", strlen(argv[0])); /* Change process name */
     concurrent_servers::log(argv[0]);           /* Print server process name */
 
+    const concurrent_servers::listener_options listener = concurrent_servers::listener_options::from_args(argc, argv);
     const std::string port_num = (argc >= 2) ? argv[1] : concurrent_servers::DEFAULT_PORT;
     const int backlog = (argc < 3) ? DEFAULT_BACKLOG : atoi(argv[2]);
     concurrent_servers::file_descriptor server_sfd{};
 
     try {
-        server_sfd = concurrent_servers::setup_server_tcp_socket(port_num, backlog);
+        server_sfd = concurrent_servers::setup_server_tcp_socket(port_num, backlog, false, false, listener);
         struct sockaddr_storage cli_addr{};
         char buffer[BUFF_SIZE];
 
@@ -68,7 +69,10 @@ int main(int argc, char *argv[]) {
                 throw std::runtime_error("Could not accept a new connection");
             }
 
-            concurrent_servers::log_client_info(cli_addr);
+            if constexpr (concurrent_servers::log_enabled(concurrent_servers::log_level::INFO)) {
+                concurrent_servers::log_client_info(cli_addr);
+            }
+            concurrent_servers::set_accepted_options(client_sfd.get_fd(), listener);
 
             // Fork a new child process to handle the accepted connection
             int child_pid;
@@ -89,12 +93,12 @@ int main(int argc, char *argv[]) {
                     }
 
                     if (rlen == 0) {
-                        std::cout << "  Connection closed" << std::endl;
+                        CS_LOG_INFO("  Connection closed");
                         client_sfd.close_fd();
                         exit(EXIT_SUCCESS);
                     }
 
-                    std::cout << "  received: " << buffer;
+                    CS_LOG_INFO("  received: ", std::string{buffer, static_cast<size_t>(rlen)});
 
                     // Echo the data back to the client
                     const ssize_t wlen = write(client_sfd.get_fd(), buffer, (size_t)rlen);
@@ -0,0 +1,184 @@
+/*
+ * BSD 2-Clause License
+ *
+ * Copyright (c) 2019, Pham Phi Long <phamphilong2010@gmail.com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *   * Redistributions of source code must retain the above copyright notice,
+ *     this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *   * Neither the name of Redis nor the names of its contributors may be used
+ *     to endorse or promote products derived from this software without
+ *     specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * HTTP/1.1 health check and small JSON API on the prefork/reuseport engine:
+ *   GET /health    200 OK
+ *   GET /info      JSON with the worker pid and the number of requests it served
+ *   POST /echo     the request body, with its Content-Type
+ *   GET /work?rounds=N   a hash chained N times, CPU heavy, runs on the offload pool when there is one
+ * Connections are kept alive and requests may be pipelined.
+ */
+
+#include <unistd.h>
+#include <algorithm>
+#include <atomic>
+#include <cstdlib>
+#include <string>
+
+#include "multi_worker_reuseport_nonblocking_io_multiplexing_server.h"
+#include "http_handler.h"
+#include "http_parser.h"
+#include "print_utility.h"
+#include "command_line.h"
+
+namespace {
+    constexpr const char *SYNOPSIS{"[port] [backlog] [worker processes] [--idle-timeout=S] [--upgrade=PATH] [--offload=N]\n"
+                                   "    [--zerocopy=BYTES] [--stats=PORT] [--stats-address=ADDR]"};
+}
+
+class api_handler {
+public:
+    void operator()(const std::string &prefix_log, const concurrent_servers::http_request &request, concurrent_servers::http_response &response) const {
+        _requests.fetch_add(1, std::memory_order_relaxed);
+        CS_LOG_INFO(prefix_log, "  ", request.method, " ", request.target);
+
+        if (request.target == "/health") {
+            if (not allow(request, response, "GET")) {
+                return;
+            }
+            response.body = "OK\n";
+        } else if (request.target == "/info") {
+            if (not allow(request, response, "GET")) {
+                return;
+            }
+            response.content_type = "application/json";
+            response.body = "{\"pid\": " + std::to_string(getpid()) + ", \"requests\": " + std::to_string(_requests.load(std::memory_order_relaxed)) + "}\n";
+        } else if (request.target == "/echo") {
+            if (not allow(request, response, "POST")) {
+                return;
+            }
+            const std::string_view content_type = request.header("Content-Type");
+            response.content_type = content_type.empty() ? "application/octet-stream" : content_type;
+            response.body.assign(request.body.data(), request.body.size());
+        } else if (is_work(request.target)) {
+            if (not allow(request, response, "GET")) {
+                return;
+            }
+            response.body = std::to_string(work(rounds(request.target))) + "\n";
+        } else {
+            response.status = 404;
+            response.body = "Not Found\n";
+        }
+    }
+
+    /**
+     * Requests served on the offload pool, from any of its threads.
+     */
+    bool offload(const concurrent_servers::http_request &request) const {
+        return is_work(request.target);
+    }
+
+private:
+    static constexpr uint64_t MAX_ROUNDS{1000000000};
+
+    mutable std::atomic<uint64_t> _requests{0};
+
+    static bool is_work(std::string_view target) {
+        return target == "/work" or target.rfind("/work?", 0) == 0;
+    }
+
+    static uint64_t rounds(std::string_view target) {
+        const size_t position = target.find("rounds=");
+        if (position == std::string_view::npos) {
+            return 1;
+        }
+        const std::string value{target.substr(position + 7)};
+        return std::min<uint64_t>(strtoull(value.c_str(), nullptr, 10), MAX_ROUNDS);
+    }
+
+    /**
+     * FNV-1a over its own result, every round depends on the previous one.
+     */
+    static uint64_t work(uint64_t rounds) {
+        uint64_t hash{14695981039346656037ULL};
+        for (uint64_t round{0}; round < rounds; ++round) {
+            for (int byte{0}; byte < 8; ++byte) {
+                hash ^= (hash >> (byte * 8)) & 0xff;
+                hash *= 1099511628211ULL;
+            }
+        }
+        return hash;
+    }
+
+    /**
+     * HEAD is allowed wherever GET is.
+     */
+    static bool allow(const concurrent_servers::http_request &request, concurrent_servers::http_response &response, std::string_view method) {
+        if (request.method == method or (method == "GET" and request.method == "HEAD")) {
+            return true;
+        }
+        response.status = 405;
+        response.body = "Method Not Allowed\n";
+        return false;
+    }
+};
+
+int main(int argc, char *argv[]) {
+    const concurrent_servers::listener_options listener = concurrent_servers::listener_options::from_args(argc, argv);
+    concurrent_servers::command_line args{argc, argv};
+    try {
+        const std::string port_num = args.positional(0, concurrent_servers::DEFAULT_PORT);
+        const int backlog = args.positional_number(1, DEFAULT_BACKLOG);
+        const int worker_process_num = args.positional_number(2, concurrent_servers::DEFAULT_WORKER_PROCESS_NUMBER);
+        const long idle_s = args.number("idle-timeout", -1);
+        const std::string upgrade_path = args.text("upgrade", "");
+        const auto offload_threads = static_cast<size_t>(args.number("offload", 0));
+        const auto zerocopy_threshold = static_cast<size_t>(args.number("zerocopy", 0));
+        const std::string stats_port = args.text("stats", "");
+        const std::string stats_address = args.text("stats-address", concurrent_servers::metrics_endpoint::DEFAULT_ADDRESS);
+        args.finish(3);
+
+        const concurrent_servers::http_parser parser{};
+        const char *levels[] = {"scalar", "SSE4.2", "AVX2"};
+        concurrent_servers::log_info("HTTP parser uses ", levels[static_cast<int>(parser.level())]);
+        concurrent_servers::linux_concurrent_server<concurrent_servers::http_read_handler<api_handler>> server{
+                worker_process_num, port_num, backlog, parser};
+        server.set_listener_options(listener);
+        if (idle_s >= 0) {
+            concurrent_servers::connection_timeouts timeouts{};
+            timeouts.idle = std::chrono::seconds{idle_s};
+            server.set_timeouts(timeouts);
+        }
+        if (not upgrade_path.empty()) {
+            server.set_upgrade_socket(upgrade_path);
+        }
+        server.set_offload_threads(offload_threads);
+        server.set_zerocopy_threshold(zerocopy_threshold);
+        if (not stats_port.empty()) {
+            server.set_stats_port(stats_port, stats_address);
+        }
+
+        server.start();
+    } catch (const concurrent_servers::usage_error &e) {
+        concurrent_servers::exit_with_usage(argv[0], SYNOPSIS, e);
+    }
+}
@@ -0,0 +1,71 @@
+/*
+ * BSD 2-Clause License
+ *
+ * Copyright (c) 2019, Pham Phi Long <phamphilong2010@gmail.com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *   * Redistributions of source code must retain the above copyright notice,
+ *     this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *   * Neither the name of Redis nor the names of its contributors may be used
+ *     to endorse or promote products derived from this software without
+ *     specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "multi_worker_reuseport_nonblocking_io_multiplexing_server.h"
+#include "frame_codec.h"
+#include "server_config.h"
+#include "command_line.h"
+
+/**
+ * Echoes every frame back as a frame, like test_server, built with lean_server_config: no timeouts, busy
+ * polling, steering or hot upgrade compiled in, and a single epoll registration per connection.
+ */
+struct frame_handler {
+    void operator()(const std::string &, const char *payload, size_t payload_len, concurrent_servers::frame_writer &reply) const {
+        if (not reply.write(payload, payload_len)) {
+            CS_LOG_WARNING_FROM(concurrent_servers::lean_server_config::LOG_LEVEL, "out of output buffers, closing the connection");
+        }
+    }
+};
+
+int main(int argc, char *argv[]) {
+    const concurrent_servers::listener_options listener = concurrent_servers::listener_options::from_args(argc, argv);
+    concurrent_servers::command_line args{argc, argv};
+    try {
+        const std::string port_num = args.positional(0, concurrent_servers::DEFAULT_PORT);
+        const int backlog = args.positional_number(1, DEFAULT_BACKLOG);
+        const int worker_process_num = args.positional_number(2, concurrent_servers::DEFAULT_WORKER_PROCESS_NUMBER);
+        const concurrent_servers::frame_prefix prefix = args.choice<concurrent_servers::frame_prefix>("prefix", {
+                    {"fixed32", concurrent_servers::frame_prefix::FIXED32},
+                    {"varint", concurrent_servers::frame_prefix::VARINT}},
+                    concurrent_servers::frame_prefix::FIXED32);
+        args.finish(3);
+
+        concurrent_servers::linux_concurrent_server<concurrent_servers::framed_read_handler<frame_handler>,
+                                                          concurrent_servers::lean_server_config> server{
+                worker_process_num, port_num, backlog, concurrent_servers::frame_codec{prefix}};
+        server.set_listener_options(listener);
+
+        server.start();
+    } catch (const concurrent_servers::usage_error &e) {
+        concurrent_servers::exit_with_usage(argv[0], "[port] [backlog] [worker processes] [--prefix=fixed32|varint]", e);
+    }
+}
@@ -33,44 +33,132 @@
 #include <cstring>
 #include <sys/socket.h>
 #include <sys/epoll.h>
+#include <sys/eventfd.h>
 #include <sys/prctl.h>
 #include <netinet/in.h>
 #include <netdb.h>
 #include <arpa/inet.h>
 #include <array>
 #include <vector>
-#include <unordered_map>
 #include <memory>
-#include <shared_mutex>
-#include <mutex>
 #include <thread>
+#include <atomic>
+#include <algorithm>
 
 #include "constants.h"
 #include "print_utility.h"
 #include "file_descriptor.h"
+#include "io_uring_utility.h"
+#include "connection_table.h"
+#include "buffer_pool.h"
+#include "output_queue.h"
+#include "timing_wheel.h"
+#include "cpu_topology.h"
+#include "reuseport_steering.h"
+#include "busy_poll.h"
+#include "mpsc_queue.h"
+#include "zerocopy_linger.h"
+#include "listener_options.h"
+#include "metrics.h"
 
 #define PREFIX_LOG prefix_log_, "line ", __LINE__, ":\t"
 
 class MultiWorkerIoMultiplexingTCPServer {
 public:
-    MultiWorkerIoMultiplexingTCPServer(std::string port_num, int backlog, int worker_num, bool reuse_port) :
+    enum class WorkerEngine {
+        EPOLL,   // shared epoll set, one shot edge triggered events; with reuse_port, shared-nothing workers that own
+                 // a listener and a private epoll set each
+        IO_URING, // one io_uring per worker, multishot accept/recv with provided buffers
+        ACCEPTOR  // acceptor threads hand new connections to workers that own a private epoll set each
+    };
+
+    /**
+     * How the acceptor threads of the ACCEPTOR engine pick the worker of a new connection.
+     */
+    enum class Dispatch {
+        ROUND_ROBIN,
+        LEAST_LOADED // fewest open connections, ties are broken round robin
+    };
+
+    /**
+     * The connection timeouts apply to the epoll engine. A worker_num of 0 starts one worker per CPU that the
+     * affinity allows. cpu_steering hands every new connection to the listener of the worker pinned to the CPU
+     * that received it, it requires reuse_port. busy_poll lets the workers of every engine poll before blocking.
+     * acceptor_num and dispatch apply to the ACCEPTOR engine, with reuse_port every acceptor has its own listener.
+     * The epoll and ACCEPTOR workers send with MSG_ZEROCOPY when at least zerocopy_threshold bytes go out in one
+     * call, 0 disables it.
+     */
+    MultiWorkerIoMultiplexingTCPServer(std::string port_num, int backlog, int worker_num, bool reuse_port,
+                                       WorkerEngine engine = WorkerEngine::EPOLL,
+                                       concurrent_servers::connection_timeouts timeouts = {},
+                                       concurrent_servers::worker_affinity affinity = concurrent_servers::worker_affinity::CPU,
+                                       bool cpu_steering = false,
+                                       concurrent_servers::busy_poll_options busy_poll = {},
+                                       int acceptor_num = 1,
+                                       Dispatch dispatch = Dispatch::LEAST_LOADED,
+                                       size_t zerocopy_threshold = 0) :
         server_sfd_{-1},
         port_num_{std::move(port_num)},
         backlog_{backlog},
-        worker_num_{worker_num},
+        topology_{concurrent_servers::cpu_topology::detect()},
+        worker_num_{worker_num > 0 ? worker_num : topology_.worker_count(affinity)},
         reuse_port_{reuse_port},
-        data_manager_{} {
+        engine_{engine},
+        timeouts_{timeouts},
+        affinity_{affinity},
+        cpu_steering_{cpu_steering},
+        busy_poll_{busy_poll},
+        acceptor_num_{std::max(acceptor_num, 1)},
+        dispatch_{dispatch},
+        zerocopy_threshold_{zerocopy_threshold},
+        listener_{},
+        metrics_port_{},
+        metrics_address_{},
+        metrics_{},
+        metrics_endpoint_{},
+        data_manager_{},
+        inboxes_{},
+        next_worker_{0},
+        workers_threads{} {
 
     }
 
+    /**
+     * Tunes the listening sockets and the accepted connections of every engine, see listener_options.
+     * Call it before start().
+     */
+    void setListenerOptions(const concurrent_servers::listener_options &options) {
+        listener_ = options;
+    }
+
+    /**
+     * Serves the metrics of the workers in the Prometheus text format on this port of address, loopback by
+     * default, see metrics_endpoint. Call it before start().
+     */
+    void setMetricsPort(std::string port_num, std::string address = concurrent_servers::metrics_endpoint::DEFAULT_ADDRESS) {
+        metrics_port_ = std::move(port_num);
+        metrics_address_ = std::move(address);
+    }
+
     void start() {
         try {
-            if (reuse_port_) {
+            if (not metrics_port_.empty()) {
+                metrics_endpoint_ = std::make_unique<concurrent_servers::metrics_endpoint>(metrics_, metrics_port_, metrics_address_);
+                CS_LOG_INFO("metrics served on port ", metrics_port_);
+            }
+            if (engine_ == WorkerEngine::IO_URING) {
+                startUringWorkers();
+            } else if (engine_ == WorkerEngine::ACCEPTOR) {
+                startAcceptors();
+            } else if (reuse_port_) {
                 // create worker threads to distribute accept() and read()
                 // for accept(), the server listening socket fd
+                std::vector<int> listeners{};
                 for (int i{0}; i < worker_num_; ++i) {
-                    server_sfd_ = setupServerTcpSocket(port_num_, backlog_, true, false);
-                    concurrent_servers::log_info("\033[32m", "server socket fd=", server_sfd_, "\033[0m");
+                    // every worker accepts on a listener of its own, the kernel spreads connections over them
+                    const int server_sfd = setupServerTcpSocket(port_num_, backlog_, true, true);
+                    listeners.push_back(server_sfd);
+                    CS_LOG_INFO("\033[32m", "server socket fd=", server_sfd, "\033[0m");
 
                     // create the epoll socket
                     int epoll_fd = epoll_create1(0);
@@ -78,28 +166,30 @@ public:
                         throw std::runtime_error("epoll_create1() failed");
                     }
 
-                    // mark the server socket for reading, and become edge-triggered
+                    // mark the server socket for reading
                     struct epoll_event event{};
                     memset(&event, 0, sizeof(event));
-                    event.data.ptr = data_manager_.insert(server_sfd_);
-                    event.events = EPOLLIN | EPOLLEXCLUSIVE; // use level-triggered and EPOLLEXCLUSIVE to distribute accept() to
-                    // multiple threads or processes
-                    // Reference:
-                    //     https://idea.popcount.org/2017-02-20-epoll-is-fundamentally-broken-12/
-                    //     https://sudonull.com/post/14030-The-whole-truth-about-linux-epoll
-                    if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, server_sfd_, &event) == -1) {
+                    event.data.u64 = data_manager_.insert(server_sfd);
+                    event.events = EPOLLIN; // level-triggered, no other epoll set polls this listener
+                    if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, server_sfd, &event) == -1) {
                         throw std::runtime_error("epoll_ctl() failed");
                     }
 
-                    workers_threads.emplace_back([this, epoll_fd, i]() {
-                        Worker worker{server_sfd_, epoll_fd, i, data_manager_};
-                        worker.start();
+                    workers_threads.emplace_back([this, server_sfd, epoll_fd, i]() {
+                        try {
+                            placeWorker(i);
+                            Worker worker{server_sfd, epoll_fd, true, i, data_manager_, metrics_.add_worker(std::to_string(i)), timeouts_, busy_poll_, listener_, zerocopy_threshold_};
+                            worker.start();
+                        } catch (const std::runtime_error& e) {
+                            CS_LOG_ERROR(e.what(), "\t", strerror(errno));
+                            exit(EXIT_FAILURE);
+                        }
                     });
                 }
-                server_sfd_ = setupServerTcpSocket(port_num_, backlog_, true, true);
+                attachCpuSteering(listeners);
             } else {
                 server_sfd_ = setupServerTcpSocket(port_num_, backlog_, true, false);
-                concurrent_servers::log_info("\033[32m", "server socket fd=", server_sfd_, "\033[0m");
+                CS_LOG_INFO("\033[32m", "server socket fd=", server_sfd_, "\033[0m");
 
                 // create the epoll socket
                 int epoll_fd = epoll_create1(0);
@@ -110,7 +200,7 @@ public:
                 // mark the server socket for reading, and become edge-triggered
                 struct epoll_event event{};
                 memset(&event, 0, sizeof(event));
-                event.data.ptr = data_manager_.insert(server_sfd_);
+                event.data.u64 = data_manager_.insert(server_sfd_);
                 event.events = EPOLLIN | EPOLLEXCLUSIVE; // use level-triggered and EPOLLEXCLUSIVE to distribute accept() to
                 // multiple threads or processes
                 // Reference:
@@ -124,8 +214,14 @@ public:
                 // for accept(), the server listening socket fd
                 for (int i{0}; i < worker_num_; ++i) {
                     workers_threads.emplace_back([this, epoll_fd, i]() {
-                        Worker worker{server_sfd_, epoll_fd, i, data_manager_};
-                        worker.start();
+                        try {
+                            placeWorker(i);
+                            Worker worker{server_sfd_, epoll_fd, false, i, data_manager_, metrics_.add_worker(std::to_string(i)), timeouts_, busy_poll_, listener_, zerocopy_threshold_};
+                            worker.start();
+                        } catch (const std::runtime_error& e) {
+                            CS_LOG_ERROR(e.what(), "\t", strerror(errno));
+                            exit(EXIT_FAILURE);
+                        }
                     });
                 }
             }
@@ -135,7 +231,7 @@ public:
             }
 
         } catch (const std::runtime_error& e) {
-            concurrent_servers::log_error(e.what(), "\t", strerror(errno));
+            CS_LOG_ERROR(e.what(), "\t", strerror(errno));
             close(server_sfd_);
             exit(EXIT_FAILURE);
         }
@@ -143,96 +239,167 @@ public:
 
 private:
     /**
-     * This class is not thread-safe
+     * This class is not thread-safe, a worker owns the connection while it holds busy_. Workers with a private
+     * epoll set own their connections for good, the slot is then only ever touched by that worker.
      */
     struct ConnectionData {
-        explicit ConnectionData(int conn_fd) :
-                conn_fd_{conn_fd},
-                buffer_(1024, '\0'),
-                read_index_{0},
-                write_index_{0},
-                ready_for_write_{false} {
-            
+        ConnectionData() :
+                conn_fd_{-1},
+                handle_{0},
+                output_{},
+                reading_paused_{false},
+                busy_{false},
+                deadline_ms_{0} {
+
         }
 
-        void reset() {
-            read_index_ = 0;
-            write_index_ = 0;
-            ready_for_write_ = false;
+        /**
+         * Called by the connection table when the slot is handed to a new connection.
+         */
+        void reset(int conn_fd) {
+            conn_fd_ = conn_fd;
+            output_.clear();
+            reading_paused_ = false;
+            busy_.store(false, std::memory_order_relaxed);
+            deadline_ms_.store(0, std::memory_order_relaxed);
         }
 
         int conn_fd_;
-        std::vector<char> buffer_;
-        ssize_t read_index_;
-        ssize_t write_index_;
-        bool ready_for_write_;
+        uint64_t handle_; // connection table handle, stored in epoll_event.data.u64
+        concurrent_servers::output_queue output_; // data waiting to be echoed, only holds buffers while not empty
+        bool reading_paused_; // output_ went above its high watermark, wait for it to drain before reading more
+        std::atomic<bool> busy_; // a worker is serving an event or expiring the connection
+        std::atomic<uint64_t> deadline_ms_; // idle or write deadline, checked by the timer of the accepting worker
     };
 
-    class ConnectionDataManager {
-    public:
-        ConnectionData *get(int conn_fd) {
-            std::shared_lock s_lock(mutex_);
-            auto it = data_.find(conn_fd);
-            return (it != data_.end()) ? it->second.get() : nullptr;
-        }
+    using ConnectionDataManager = concurrent_servers::connection_table<ConnectionData>;
 
-        ConnectionData *insert(int conn_fd) {
-            std::unique_lock u_lock(mutex_);
-            auto result = data_.insert({conn_fd, std::make_shared<ConnectionData>(conn_fd)});
-            return result.second ? result.first->second.get() : nullptr;
-        }
+    /**
+     * New connections handed to one worker of the ACCEPTOR engine. Acceptor threads push the fd and write to
+     * event_fd_, which sits in the private epoll set of the worker, once per accepted batch.
+     */
+    struct WorkerInbox {
+        explicit WorkerInbox(int event_fd) :
+                event_fd_{event_fd},
+                queue_{QUEUE_CAPACITY},
+                load_{0} {
 
-        void remove(int conn_fd) {
-            std::unique_lock u_lock(mutex_);
-            data_.erase(conn_fd);
         }
 
-    private:
-        std::shared_mutex mutex_{};
-        std::unordered_map<int, std::shared_ptr<ConnectionData>> data_{};
+        static const size_t QUEUE_CAPACITY{4096};
+        const int event_fd_;
+        concurrent_servers::mpsc_queue<int> queue_;
+        std::atomic<size_t> load_; // connections handed to the worker and not closed yet
     };
 
+    /**
+     * Serves the connections of an epoll set. When the set is shared, an event may wake any worker: connections
+     * are registered one shot, claimed through busy_ and rearmed after every event. When the set is private,
+     * private_epoll, the worker is the only one to ever serve its connections: they are registered once, edge
+     * triggered for reading and writing, and served without a claim or an epoll_ctl() per event.
+     */
     class Worker {
     public:
-        Worker(int server_sfd, int epoll_fd, int worker_id, ConnectionDataManager &data_manager) :
+        Worker(int server_sfd, int epoll_fd, bool private_epoll, int worker_id, ConnectionDataManager &data_manager,
+               concurrent_servers::worker_metrics &metrics, const concurrent_servers::connection_timeouts &timeouts, const concurrent_servers::busy_poll_options &busy_poll,
+               const concurrent_servers::listener_options &listener, size_t zerocopy_threshold, WorkerInbox *inbox = nullptr) :
                 server_sfd_{server_sfd},
                 epoll_fd_{epoll_fd},
+                private_epoll_{private_epoll},
                 worker_id_{worker_id},
                 data_manager_{data_manager},
+                metrics_{metrics},
                 prefix_log_{"Multi Worker Server: Worker " + std::to_string(worker_id_) + ": "},
-                event_{} {
+                event_{},
+                buffer_pool_{CONNECTION_BUFFER_SIZE},
+                timeouts_{timeouts},
+                check_interval_ms_{checkInterval(timeouts)},
+                timers_{},
+                timer_nodes_{},
+                free_timers_{},
+                now_ms_{concurrent_servers::timing_wheel::now_ms()},
+                busy_poll_{busy_poll},
+                poller_{busy_poll, prefix_log_},
+                listener_{listener},
+                zerocopy_threshold_{zerocopy_threshold},
+                lingering_{},
+                inbox_{inbox} {
 
         }
 
+        Worker(const Worker &) = delete;
+        Worker &operator=(const Worker &) = delete;
+
         void start() {
             prctl(PR_SET_NAME, prefix_log_.c_str(), NULL, NULL, NULL);
 
             for (;;) {
-                int nfds = epoll_wait(epoll_fd_, events_.data(), MAX_EVENTS, -1);
+                int wait_ms = timers_.next_timeout_ms(now_ms_);
+                if (not lingering_.empty()) {
+                    const int linger_ms{concurrent_servers::zerocopy_linger::POLL_INTERVAL_MS};
+                    wait_ms = wait_ms < 0 ? linger_ms : std::min(wait_ms, linger_ms);
+                }
+                int nfds = poller_.wait(wait_ms, [this](int timeout_ms) {
+                    return epoll_wait(epoll_fd_, events_.data(), MAX_EVENTS, timeout_ms);
+                });
                 if (nfds == -1) {
+                    if (errno == EINTR) {
+                        continue;
+                    }
                     throw std::runtime_error(prefix_log_ + "epoll_wait() failed");
                 }
+                metrics_.record_wakeup(nfds);
+
+                now_ms_ = concurrent_servers::timing_wheel::now_ms();
+                if (not lingering_.empty()) {
+                    lingering_.poll(now_ms_);
+                }
+                timers_.advance(now_ms_, [this](concurrent_servers::timing_wheel::timer &timer) {
+                    expireTimer(timer);
+                });
 
-                concurrent_servers::log_info(PREFIX_LOG, "epoll_wait() returns, nfds=", nfds, " event ");
+                CS_LOG_INFO(PREFIX_LOG, "epoll_wait() returns, nfds=", nfds, " event ");
                 for (int i{0}; i < nfds; ++i) {
-                    auto *conn_data = (ConnectionData *)(events_[i].data.ptr);
+                    auto *conn_data = data_manager_.get(events_[i].data.u64);
+                    if (conn_data == nullptr) {
+                        // the connection was closed and its fd possibly reused since this event was queued
+                        CS_LOG_INFO(PREFIX_LOG, "\tstale event for fd=", ConnectionDataManager::fd_of(events_[i].data.u64));
+                        continue;
+                    }
 
                     if (conn_data->conn_fd_ == server_sfd_) {
                         acceptConnections(events_[i].events, conn_data);
+                    } else if (inbox_ != nullptr and conn_data->conn_fd_ == inbox_->event_fd_) {
+                        takeConnections();
                     } else {
-                        concurrent_servers::log_info(PREFIX_LOG, "\tevents_[i].data.ptr = " , events_[i].data.ptr);
-                        concurrent_servers::log_info(PREFIX_LOG, "\tfd=", conn_data->conn_fd_, " event ", events_[i].events, " this is a connection fd");
+                        CS_LOG_INFO(PREFIX_LOG, "\tevents_[i].data.u64 = " , events_[i].data.u64);
+                        CS_LOG_INFO(PREFIX_LOG, "\tfd=", conn_data->conn_fd_, " event ", events_[i].events, " this is a connection fd");
+
+                        if (not private_epoll_ and not claimConnection(events_[i].data.u64, conn_data)) {
+                            CS_LOG_INFO(PREFIX_LOG, "\tconnection closed meanwhile, fd=", ConnectionDataManager::fd_of(events_[i].data.u64));
+                            continue;
+                        }
 
-                        if (events_[i].events & EPOLLERR) {
-                            concurrent_servers::log_warning(PREFIX_LOG, "\tepoll_wait() error on fd ", conn_data->conn_fd_, " event ", events_[i].events);
-                            closeConnection(epoll_fd_, conn_data->conn_fd_);
+                        // zerocopy completions wait in the socket error queue, which raises EPOLLERR
+                        bool failed = events_[i].events & EPOLLERR;
+                        if (conn_data->output_.zerocopy_pending()) {
+                            conn_data->output_.complete_zerocopy(conn_data->conn_fd_);
+                        }
+                        if (failed and zerocopy_threshold_ > 0) {
+                            failed = concurrent_servers::take_socket_error(conn_data->conn_fd_) != 0;
+                        }
+
+                        if (failed) {
+                            CS_LOG_WARNING(PREFIX_LOG, "\tepoll_wait() error on fd ", conn_data->conn_fd_, " event ", events_[i].events);
+                            closeConnection(conn_data);
                             continue;
                         } else if (events_[i].events & EPOLLRDHUP) {
-                            concurrent_servers::log_warning(PREFIX_LOG, "\tConnection closed, fd=", conn_data->conn_fd_);
-                            closeConnection(epoll_fd_, conn_data->conn_fd_);
+                            CS_LOG_WARNING(PREFIX_LOG, "\tConnection closed, fd=", conn_data->conn_fd_);
+                            closeConnection(conn_data);
                             continue;
                         } else if (events_[i].events & EPOLLHUP) {
-                            concurrent_servers::log_info(PREFIX_LOG, "\tConnection hangup");
+                            CS_LOG_INFO(PREFIX_LOG, "\tConnection hangup");
+                            closeConnection(conn_data);
                             continue;
                         }
 
@@ -245,21 +412,130 @@ private:
     private:
         int server_sfd_;
         int epoll_fd_;
+        const bool private_epoll_; // no other worker polls epoll_fd_
         const int worker_id_; // could be either process id or thread id
         static const int MAX_EVENTS{100000};
         std::array<epoll_event, MAX_EVENTS> events_{};
         ConnectionDataManager &data_manager_;
+        concurrent_servers::worker_metrics &metrics_; // written by this worker only
         const std::string prefix_log_;
         struct epoll_event event_;
+        static const size_t CONNECTION_BUFFER_SIZE{4096};
+        concurrent_servers::buffer_pool buffer_pool_; // constructed by the worker thread, which owns it
+        const concurrent_servers::connection_timeouts timeouts_;
+        const uint64_t check_interval_ms_; // 0 when every timeout is disabled
+        concurrent_servers::timing_wheel timers_; // one timer per connection accepted by this worker
+        std::vector<std::unique_ptr<concurrent_servers::timing_wheel::timer>> timer_nodes_;
+        std::vector<concurrent_servers::timing_wheel::timer *> free_timers_;
+        uint64_t now_ms_; // refreshed after every epoll_wait()
+        const concurrent_servers::busy_poll_options busy_poll_;
+        concurrent_servers::busy_poller poller_;
+        const concurrent_servers::listener_options listener_; // applied to every connection this worker adds
+        const size_t zerocopy_threshold_; // 0 when zerocopy sends are disabled
+        concurrent_servers::zerocopy_linger lingering_; // connections closed by this worker with zerocopy sends in flight
+        WorkerInbox *const inbox_; // fed by the acceptor threads, only with the ACCEPTOR engine
+
+        /**
+         * A connection may move to any worker and change its deadline there, so the accepting worker does not
+         * reschedule its timer on every event but checks the deadline at least this often. A deadline set after
+         * a check is at least this far away, hence the next check still comes before it.
+         */
+        static uint64_t checkInterval(const concurrent_servers::connection_timeouts &timeouts) {
+            uint64_t interval{0};
+            for (const auto timeout : {timeouts.idle, timeouts.write}) {
+                if (timeout.count() > 0 and (interval == 0 or static_cast<uint64_t>(timeout.count()) < interval)) {
+                    interval = static_cast<uint64_t>(timeout.count());
+                }
+            }
+            return interval;
+        }
+
+        uint64_t deadlineOf(const ConnectionData *conn_data) const {
+            return concurrent_servers::connection_timeouts::deadline(now_ms_, conn_data->output_.empty() ? timeouts_.idle : timeouts_.write);
+        }
+
+        /**
+         * Waits for the worker holding the connection, if any, then takes it. Returns false if the connection
+         * was closed meanwhile.
+         */
+        bool claimConnection(uint64_t handle, ConnectionData *conn_data) {
+            while (conn_data->busy_.exchange(true, std::memory_order_acquire)) {
+                if (data_manager_.get(handle) != conn_data) {
+                    return false;
+                }
+                std::this_thread::yield(); // the holder is about to rearm the fd or to run a short expiry check
+            }
+            if (data_manager_.get(handle) != conn_data) {
+                // closed and handed to a new connection before the claim, let it go
+                conn_data->busy_.store(false, std::memory_order_release);
+                return false;
+            }
+            return true;
+        }
+
+        void scheduleTimer(concurrent_servers::timing_wheel::timer &timer, uint64_t deadline) {
+            timers_.schedule(timer, std::min(deadline, now_ms_ + check_interval_ms_));
+        }
+
+        /**
+         * Timers are cancelled lazily: the node of a closed connection is recycled when it fires.
+         */
+        void expireTimer(concurrent_servers::timing_wheel::timer &timer) {
+            const uint64_t handle = timer.data;
+            ConnectionData *conn_data = data_manager_.get(handle);
+            if (conn_data == nullptr) {
+                free_timers_.push_back(&timer);
+                return;
+            }
+            if (conn_data->deadline_ms_.load(std::memory_order_relaxed) > now_ms_) {
+                scheduleTimer(timer, conn_data->deadline_ms_.load(std::memory_order_relaxed));
+                return;
+            }
+            if (conn_data->busy_.exchange(true, std::memory_order_acquire)) {
+                // another worker is serving it right now and sets a new deadline
+                scheduleTimer(timer, now_ms_ + timers_.resolution_ms());
+                return;
+            }
+            if (data_manager_.get(handle) != conn_data) {
+                conn_data->busy_.store(false, std::memory_order_release);
+                free_timers_.push_back(&timer);
+                return;
+            }
+            if (conn_data->deadline_ms_.load(std::memory_order_relaxed) > now_ms_) {
+                conn_data->busy_.store(false, std::memory_order_release);
+                scheduleTimer(timer, conn_data->deadline_ms_.load(std::memory_order_relaxed));
+                return;
+            }
+
+            free_timers_.push_back(&timer);
+            CS_LOG_WARNING(PREFIX_LOG, "\tconnection timed out, fd=", conn_data->conn_fd_);
+            closeConnection(conn_data);
+        }
+
+        void startTimer(ConnectionData *conn_data) {
+            conn_data->deadline_ms_.store(deadlineOf(conn_data), std::memory_order_relaxed);
+            if (check_interval_ms_ == 0) {
+                return;
+            }
+
+            if (free_timers_.empty()) {
+                timer_nodes_.push_back(std::make_unique<concurrent_servers::timing_wheel::timer>());
+                free_timers_.push_back(timer_nodes_.back().get());
+            }
+            concurrent_servers::timing_wheel::timer *timer = free_timers_.back();
+            free_timers_.pop_back();
+            timer->data = conn_data->handle_;
+            scheduleTimer(*timer, conn_data->deadline_ms_.load(std::memory_order_relaxed));
+        }
 
         void acceptConnections(uint32_t server_events, ConnectionData *conn_data) {
             if (server_events & EPOLLIN) {
-                concurrent_servers::log_info(PREFIX_LOG, "\tEPOLLIN event, fd=", conn_data->conn_fd_);
+                CS_LOG_INFO(PREFIX_LOG, "\tEPOLLIN event, fd=", conn_data->conn_fd_);
             } else {
-                concurrent_servers::log_info(PREFIX_LOG, "\tnot a EPOLLIN event, fd=", conn_data->conn_fd_, " events=", server_events);
+                CS_LOG_INFO(PREFIX_LOG, "\tnot a EPOLLIN event, fd=", conn_data->conn_fd_, " events=", server_events);
             }
 
-            concurrent_servers::log_info(PREFIX_LOG, "\tstart accepting connections");
+            CS_LOG_INFO(PREFIX_LOG, "\tstart accepting connections");
 
             // server socket, accept as many new connections as possible
             struct sockaddr_storage cli_addr{};
@@ -270,114 +546,230 @@ private:
 
                 if (conn_fd < 0) {
                     if (errno != EWOULDBLOCK and errno != EAGAIN) {
-                        concurrent_servers::log_error(PREFIX_LOG, "\t\tcould not accept a new connection. ", strerror(errno));
+                        CS_LOG_ERROR(PREFIX_LOG, "\t\tcould not accept a new connection. ", strerror(errno));
                         break;
                     } else {
                         // no more connection to accept
-                        concurrent_servers::log_info(PREFIX_LOG, "\t\tno more connection to accept");
+                        CS_LOG_INFO(PREFIX_LOG, "\t\tno more connection to accept");
                         break;
                     }
                 }
 
-                log_client_info(cli_addr, prefix_log_ + "\t\t");
-                concurrent_servers::log_info(PREFIX_LOG, "\t\tadd new client socket fd=", conn_fd);
-
-                // add the new client fd to epoll event list
-                event_.events = EPOLLIN | EPOLLET | EPOLLONESHOT;  // one shot edge triggered
-                event_.data.ptr = data_manager_.insert(conn_fd);
+                if constexpr (concurrent_servers::log_enabled(concurrent_servers::log_level::INFO)) {
+                    log_client_info(cli_addr, prefix_log_ + "\t\t");
+                }
+                CS_LOG_INFO(PREFIX_LOG, "\t\tadd new client socket fd=", conn_fd, " incoming cpu=", concurrent_servers::incoming_cpu(conn_fd),
+                            " worker cpu=", sched_getcpu());
 
-                if (epoll_ctl(epoll_fd_, EPOLL_CTL_ADD, conn_fd, &event_) == -1) {
-                    concurrent_servers::log_error(PREFIX_LOG, "\t\tepoll_ctl() failed. Could not register event for new client_fd ", conn_fd);
+                if (not addConnection(conn_fd)) {
                     break;
                 }
             }
         }
 
-        void handleConnectionEvent(uint32_t conn_events, ConnectionData *conn_data) {
-            if (not conn_data->ready_for_write_) {
-                concurrent_servers::log_info(PREFIX_LOG, "\thandleConnectionEvent() ready for read, connection events: ", conn_events);
-
-                for (;;) {
-                    concurrent_servers::log_info(PREFIX_LOG, "\t\thandleConnectionEvent() Read data sent from client");
-                    // Read data sent from client
-                    const ssize_t rlen = read(conn_data->conn_fd_, conn_data->buffer_.data() + conn_data->read_index_, conn_data->buffer_.size() - conn_data->read_index_ + 1);
-                    concurrent_servers::log_info(PREFIX_LOG, "\t\trlen = ", rlen);
-                    if (rlen > 0) {
-                        conn_data->read_index_ += rlen;
-                        concurrent_servers::log_info(PREFIX_LOG, "\t\treceived: ", conn_data->buffer_.data());
-                        continue;
-                    } else if (rlen == 0) {
-                        break;
-                    } else { // rlen < 0
-                        if (errno == EWOULDBLOCK or errno == EAGAIN) {
-                            concurrent_servers::log_info(PREFIX_LOG, "\t\tnothing else to read on socket fd=", conn_data->conn_fd_);
-                            conn_data->ready_for_write_ = true;
-                            break;
-                        } else {
-                            concurrent_servers::log_error(PREFIX_LOG, "\t\terror on reading, fd=",
-                                                          conn_data->conn_fd_, ", errno=",
-                                                          errno, "\t", strerror(errno));
-                            rearmEpoll(conn_data, true);
-                            conn_data->reset();
-                            return;
-                        }
-                    }
+        /**
+         * Drains the inbox filled by the acceptor threads. The eventfd is reset first, so a connection pushed
+         * after the drain wakes this worker again.
+         */
+        void takeConnections() {
+            uint64_t wakeups{0};
+            if (read(inbox_->event_fd_, &wakeups, sizeof(wakeups)) < 0 and errno != EAGAIN) {
+                CS_LOG_ERROR(PREFIX_LOG, "\t\tcould not read the inbox eventfd. ", strerror(errno));
+            }
+
+            int conn_fd{-1};
+            while (inbox_->queue_.pop(conn_fd)) {
+                CS_LOG_INFO(PREFIX_LOG, "\t\ttake new client socket fd=", conn_fd, " worker cpu=", sched_getcpu());
+                addConnection(conn_fd);
+            }
+        }
+
+        /**
+         * Registers a new connection in the epoll set of this worker. Returns false if epoll_ctl() failed.
+         */
+        bool addConnection(int conn_fd) {
+            const auto handle = data_manager_.insert(conn_fd);
+            if (handle == ConnectionDataManager::INVALID_HANDLE) {
+                CS_LOG_ERROR(PREFIX_LOG, "\t\tconnection table is full, drop client_fd ", conn_fd);
+                close(conn_fd);
+                releaseLoad();
+                return true;
+            }
+            ConnectionData *new_conn_data = data_manager_.get(handle);
+            new_conn_data->handle_ = handle;
+            concurrent_servers::set_accepted_options(conn_fd, listener_);
+            if (busy_poll_.enabled() and not concurrent_servers::set_socket_busy_poll(conn_fd, busy_poll_)) {
+                CS_LOG_INFO(PREFIX_LOG, "\t\tbusy poll socket options not supported, fd=", conn_fd);
+            }
+            if (zerocopy_threshold_ > 0) {
+                const bool zerocopy = concurrent_servers::enable_socket_zerocopy(conn_fd);
+                if (not zerocopy) {
+                    CS_LOG_INFO(PREFIX_LOG, "\t\tzerocopy not supported, fd=", conn_fd);
                 }
+                new_conn_data->output_.set_zerocopy_threshold(zerocopy ? zerocopy_threshold_ : 0);
+            }
+            startTimer(new_conn_data);
+
+            // add the new client fd to epoll event list, one shot edge triggered unless the set is private
+            event_.events = private_epoll_ ? EPOLLIN | EPOLLOUT | EPOLLET : EPOLLIN | EPOLLET | EPOLLONESHOT;
+            event_.data.u64 = handle;
 
-                // Echo the data back to the client
+            if (epoll_ctl(epoll_fd_, EPOLL_CTL_ADD, conn_fd, &event_) == -1) {
+                CS_LOG_ERROR(PREFIX_LOG, "\t\tepoll_ctl() failed. Could not register event for new client_fd ", conn_fd);
+                data_manager_.remove(handle);
+                close(conn_fd);
+                releaseLoad();
+                return false;
             }
+            metrics_.add(concurrent_servers::worker_counter::ACCEPTS);
+            return true;
+        }
 
-            if (conn_data->ready_for_write_) {
-                // Echo the data back to the client
-                concurrent_servers::log_info(PREFIX_LOG, "\t\techo the data back to the client");
-                for (;;) {
-                    const ssize_t wlen = write(conn_data->conn_fd_, conn_data->buffer_.data() + conn_data->write_index_, conn_data->read_index_ - conn_data->write_index_);
-                    concurrent_servers::log_info(PREFIX_LOG, "\t\twlen = ", wlen);
-                    if (wlen > 0) {
-                        conn_data->write_index_ += wlen;
-                        concurrent_servers::log_info(PREFIX_LOG, "\t\tread index = ", conn_data->read_index_, " write index = ", conn_data->write_index_);
-                        if (conn_data->write_index_ >= conn_data->read_index_) {
-                            concurrent_servers::log_info(PREFIX_LOG, "\t\techo is complete");
-                            conn_data->ready_for_write_ = false;
-                            rearmEpoll(conn_data, true);
-                            break;
-                        }
-                    } else { // wlen <= 0
-                        conn_data->ready_for_write_ = false;
-                        if (errno == EWOULDBLOCK or errno == EAGAIN) {
-                            concurrent_servers::log_info(PREFIX_LOG, "\t\tcannot write anymore socket fd=", conn_data->conn_fd_);
-                            rearmEpoll(conn_data, false);
-                            break;
-                        } else {
-                            concurrent_servers::log_error(PREFIX_LOG, "\t\tERROR on writing, fd=", conn_data->conn_fd_, ", errno=", errno, "\t", strerror(errno));
-                            rearmEpoll(conn_data, true);
-                            return;
-                        }
-                    }
+        void releaseLoad() {
+            if (inbox_ != nullptr) {
+                inbox_->load_.fetch_sub(1, std::memory_order_relaxed);
+            }
+        }
+
+        void handleConnectionEvent(uint32_t conn_events, ConnectionData *conn_data) {
+            CS_LOG_INFO(PREFIX_LOG, "\thandleConnectionEvent() connection events: ", conn_events);
+            concurrent_servers::output_queue &output = conn_data->output_;
+            output.set_buffer_pool(&buffer_pool_);
+
+            if (not output.empty() and not flushOutput(conn_data)) {
+                return;
+            }
+            if (conn_data->reading_paused_ and output.below_low_watermark()) {
+                CS_LOG_INFO(PREFIX_LOG, "\t\toutput drained, resume reading fd=", conn_data->conn_fd_);
+                conn_data->reading_paused_ = false;
+            }
+
+            // Read data sent from client straight into output segments, which are echoed back as they are
+            while (not conn_data->reading_paused_) {
+                // nothing is rearmed on a private epoll set, flush before pausing: only a full socket send buffer
+                // guarantees the EPOLLOUT edge that resumes the reads
+                if (private_epoll_ and output.above_high_watermark() and not flushOutput(conn_data)) {
+                    return; // the write failed and the connection is closed
                 }
+                if (output.above_high_watermark()) {
+                    // the client does not read its echo fast enough, stop reading until it does
+                    CS_LOG_INFO(PREFIX_LOG, "\t\toutput above high watermark, pause reading fd=", conn_data->conn_fd_);
+                    conn_data->reading_paused_ = true;
+                    break;
+                }
+
+                concurrent_servers::output_queue::segment *segment = output.acquire_segment();
+                if (segment == nullptr) {
+                    CS_LOG_ERROR(PREFIX_LOG, "\t\tout of connection buffers, fd=", conn_data->conn_fd_);
+                    closeConnection(conn_data);
+                    return;
+                }
+
+                const ssize_t rlen = read(conn_data->conn_fd_, segment->data(), segment->capacity);
+                CS_LOG_INFO(PREFIX_LOG, "\t\trlen = ", rlen);
+                if (rlen > 0) {
+                    CS_LOG_INFO(PREFIX_LOG, "\t\treceived: ", std::string{segment->data(), static_cast<size_t>(rlen)});
+                    metrics_.add(concurrent_servers::worker_counter::BYTES_IN, static_cast<uint64_t>(rlen));
+                    segment->end = static_cast<uint32_t>(rlen);
+                    output.push(segment);
+                    continue;
+                }
+
+                concurrent_servers::output_queue::release_segment(segment);
+                if (rlen == 0) {
+                    CS_LOG_INFO(PREFIX_LOG, "\t\tend of file, fd=", conn_data->conn_fd_);
+                    output.flush(conn_data->conn_fd_); // last attempt to echo what is left
+                    closeConnection(conn_data);
+                    return;
+                } else if (errno == EWOULDBLOCK or errno == EAGAIN) {
+                    CS_LOG_INFO(PREFIX_LOG, "\t\tnothing else to read on socket fd=", conn_data->conn_fd_);
+                    metrics_.add(concurrent_servers::worker_counter::READ_EAGAIN);
+                    break;
+                } else {
+                    CS_LOG_ERROR(PREFIX_LOG, "\t\terror on reading, fd=", conn_data->conn_fd_, ", errno=", errno, "\t", strerror(errno));
+                    closeConnection(conn_data);
+                    return;
+                }
+            }
+
+            // Echo the data back to the client
+            if (not output.empty() and not flushOutput(conn_data)) {
+                return;
             }
+            rearmEpoll(conn_data);
         }
 
-        void rearmEpoll(ConnectionData *conn_data, bool isRead) {
-            // due to EPOLLONESHOT, after finishing writing all data in buffer,
-            // we need to rearm the client fd to catch its reading event again
-            concurrent_servers::log_info(PREFIX_LOG, "\t\trearm epoll event to read, fd=", conn_data->conn_fd_);
-            event_.events = (isRead ? EPOLLIN : EPOLLOUT) | EPOLLET | EPOLLONESHOT;  // one shot edge triggered
-            event_.data.ptr = conn_data;
-            if (epoll_ctl(epoll_fd_, EPOLL_CTL_MOD, conn_data->conn_fd_, &event_) == -1) {
-                concurrent_servers::log_error(PREFIX_LOG, "\t\tepoll_ctl() failed to rearm");
+        /**
+         * Returns false if the connection was closed.
+         */
+        bool flushOutput(ConnectionData *conn_data) {
+            CS_LOG_INFO(PREFIX_LOG, "\t\techo ", conn_data->output_.size(), " bytes back to the client");
+            const size_t pending = conn_data->output_.size();
+            const auto result = conn_data->output_.flush(conn_data->conn_fd_);
+            if (result == concurrent_servers::output_queue::flush_result::ERROR) {
+                CS_LOG_ERROR(PREFIX_LOG, "\t\tERROR on writing, fd=", conn_data->conn_fd_, ", errno=", errno, "\t", strerror(errno));
+                closeConnection(conn_data);
+                return false;
+            }
+            metrics_.add(concurrent_servers::worker_counter::BYTES_OUT, pending - conn_data->output_.size());
+            if (result == concurrent_servers::output_queue::flush_result::WOULD_BLOCK) {
+                metrics_.add(concurrent_servers::worker_counter::WRITE_EAGAIN);
             }
+            return true;
         }
 
-        void closeConnection(int epoll_fd, int &conn_fd) {
-            if (conn_fd < 0) {
+        /**
+         * Due to EPOLLONESHOT the fd has to be rearmed after every event. EPOLLOUT is only requested while
+         * output is pending, EPOLLIN only while reading is not paused. Reading resumes here as well when the
+         * last flush drained the queue, EPOLL_CTL_MOD reports the data waiting in the socket right away.
+         * The connection is released once rearmed, with the write deadline while output is pending.
+         * A private epoll set keeps the connection registered for both edges, only the deadline is updated.
+         */
+        void rearmEpoll(ConnectionData *conn_data) {
+            if (conn_data->reading_paused_ and conn_data->output_.below_low_watermark()) {
+                conn_data->reading_paused_ = false;
+            }
+            if (private_epoll_) {
+                conn_data->deadline_ms_.store(deadlineOf(conn_data), std::memory_order_relaxed);
                 return;
             }
+            event_.events = EPOLLET | EPOLLONESHOT;  // one shot edge triggered
+            if (not conn_data->reading_paused_) {
+                event_.events |= EPOLLIN;
+            }
+            if (not conn_data->output_.empty()) {
+                event_.events |= EPOLLOUT;
+            }
+            CS_LOG_INFO(PREFIX_LOG, "\t\trearm epoll events ", event_.events, ", fd=", conn_data->conn_fd_);
+            event_.data.u64 = conn_data->handle_;
+            conn_data->deadline_ms_.store(deadlineOf(conn_data), std::memory_order_relaxed);
+            if (epoll_ctl(epoll_fd_, EPOLL_CTL_MOD, conn_data->conn_fd_, &event_) == -1) {
+                CS_LOG_ERROR(PREFIX_LOG, "\t\tepoll_ctl() failed to rearm");
+                metrics_.add(concurrent_servers::worker_counter::REARM_FAILURES);
+            }
+            conn_data->busy_.store(false, std::memory_order_release);
+        }
 
-            data_manager_.remove(conn_fd);
-            epoll_ctl(epoll_fd, EPOLL_CTL_DEL, conn_fd, nullptr);
-            close(conn_fd);
-            conn_fd = -1;
+        /**
+         * The caller holds the connection, its slot stays busy until handed to a new connection.
+         */
+        void closeConnection(ConnectionData *conn_data) {
+            const int conn_fd = conn_data->conn_fd_;
+
+            // segments that zerocopy sends still read from linger with the fd, the slot is reused meanwhile
+            conn_data->output_.clear();
+            const bool lingering = conn_data->output_.zerocopy_pending() and lingering_.hold(conn_fd, conn_data->output_, now_ms_);
+
+            // bump the slot generation first, events still queued for this fd become stale
+            if (not data_manager_.remove(conn_data->handle_)) {
+                return;
+            }
+            epoll_ctl(epoll_fd_, EPOLL_CTL_DEL, conn_fd, nullptr);
+            if (not lingering) {
+                close(conn_fd);
+            }
+            releaseLoad();
+            metrics_.add(concurrent_servers::worker_counter::CLOSES);
         }
 
         void log_client_info(const struct sockaddr_storage& cli_addr, const std::string &prefix_log) const {
@@ -399,14 +791,572 @@ private:
         }
     };
 
+    /**
+     * io_uring based worker, an alternative to the epoll Worker above.
+     * A single multishot accept and one multishot recv per connection stay armed in the kernel, received
+     * data lands in a ring of provided buffers and is echoed back from that very buffer. All sends and
+     * closes queued while processing a batch of completions are submitted with the next io_uring_enter(),
+     * which also waits for the next completions, so the steady state costs one syscall per batch.
+     */
+    class UringWorker {
+    public:
+        UringWorker(int server_sfd, int worker_id, const concurrent_servers::busy_poll_options &busy_poll,
+                    const concurrent_servers::listener_options &listener, concurrent_servers::worker_metrics &metrics) :
+                server_sfd_{server_sfd},
+                worker_id_{worker_id},
+                prefix_log_{"Multi Worker Server: io_uring Worker " + std::to_string(worker_id_) + ": "},
+                ring_{RING_ENTRIES},
+                buffer_ring_{ring_, BUFFER_GROUP_ID, BUFFER_NUM, BUFFER_SIZE, userData(PROVIDE, 0)},
+                next_bid_(BUFFER_NUM, NO_BUFFER),
+                buffer_len_(BUFFER_NUM, 0),
+                connections_{},
+                starved_fds_{},
+                busy_poll_{busy_poll},
+                poller_{busy_poll, prefix_log_},
+                listener_{listener},
+                metrics_{metrics} {
+
+        }
+
+        void start() {
+            prctl(PR_SET_NAME, prefix_log_.c_str(), NULL, NULL, NULL);
+
+            postAccept();
+
+            for (;;) {
+                // spinning only peeks at the completion queue, io_uring_enter() is not called again once submitted
+                poller_.wait(-1, [this](int timeout_ms) {
+                    if (ring_.submit(timeout_ms == 0 ? 0 : 1) < 0 and errno != EBUSY) {
+                        throw std::runtime_error(prefix_log_ + "io_uring_enter() failed");
+                    }
+                    return ring_.has_cqe() ? 1 : 0;
+                });
+
+                buffers_recycled_ = false;
+                const unsigned ncqes = ring_.for_each_cqe([this](const struct io_uring_cqe &cqe) {
+                    handleCompletion(cqe);
+                });
+                CS_LOG_INFO(PREFIX_LOG, "io_uring_enter() returns, ncqes=", ncqes);
+                metrics_.record_wakeup(static_cast<int>(ncqes));
+
+                if (buffers_recycled_) {
+                    buffer_ring_.publish();
+
+                    // connections whose multishot recv stopped with ENOBUFS can be served again
+                    for (int conn_fd : starved_fds_) {
+                        UringConnection &conn = connections_[conn_fd];
+                        if (conn.open_ and not conn.closing_ and not conn.recv_active_) {
+                            postRecv(conn_fd, conn);
+                        }
+                    }
+                    starved_fds_.clear();
+                }
+            }
+        }
+
+    private:
+        enum Operation : uint64_t {
+            ACCEPT = 1,
+            RECV = 2,
+            SEND = 3,
+            CLOSE = 4,
+            PROVIDE = 5
+        };
+
+        /**
+         * Buffers waiting to be echoed are chained through next_bid_, so queueing costs no allocation.
+         */
+        struct UringConnection {
+            uint16_t head_bid_{NO_BUFFER};
+            uint16_t tail_bid_{NO_BUFFER};
+            uint32_t head_offset_{0};
+            bool open_{false};
+            bool recv_active_{false};
+            bool send_in_flight_{false};
+            bool closing_{false};
+        };
+
+        static constexpr unsigned RING_ENTRIES{4096};
+        static constexpr uint16_t BUFFER_GROUP_ID{0};
+        static constexpr unsigned BUFFER_NUM{1024};
+        static constexpr unsigned BUFFER_SIZE{2048};
+        static constexpr uint16_t NO_BUFFER{0xffff};
+
+        int server_sfd_;
+        const int worker_id_;
+        const std::string prefix_log_;
+        concurrent_servers::io_uring_ring ring_;
+        concurrent_servers::io_uring_buffer_ring buffer_ring_;
+        std::vector<uint16_t> next_bid_;
+        std::vector<uint32_t> buffer_len_;
+        std::vector<UringConnection> connections_;
+        std::vector<int> starved_fds_;
+        const concurrent_servers::busy_poll_options busy_poll_;
+        concurrent_servers::busy_poller poller_;
+        const concurrent_servers::listener_options listener_;
+        concurrent_servers::worker_metrics &metrics_; // written by this worker only
+        bool buffers_recycled_{false};
+        unsigned buffers_in_use_{0};
+
+        static uint64_t userData(Operation op, int fd) {
+            return (static_cast<uint64_t>(op) << 32) | static_cast<uint32_t>(fd);
+        }
+
+        struct io_uring_sqe *getSqe() {
+            struct io_uring_sqe *sqe = ring_.get_sqe();
+            if (sqe == nullptr) {
+                throw std::runtime_error(prefix_log_ + "io_uring submission queue is full");
+            }
+            return sqe;
+        }
+
+        UringConnection &connection(int conn_fd) {
+            if (static_cast<size_t>(conn_fd) >= connections_.size()) {
+                connections_.resize(std::max(static_cast<size_t>(conn_fd) + 1, connections_.size() * 2));
+            }
+            return connections_[conn_fd];
+        }
+
+        void postAccept() {
+            concurrent_servers::io_uring_ring::prep_multishot_accept(getSqe(), server_sfd_, userData(ACCEPT, server_sfd_));
+        }
+
+        void postRecv(int conn_fd, UringConnection &conn) {
+            concurrent_servers::io_uring_ring::prep_multishot_recv(getSqe(), conn_fd, BUFFER_GROUP_ID, userData(RECV, conn_fd));
+            conn.recv_active_ = true;
+        }
+
+        void postSend(int conn_fd, UringConnection &conn) {
+            const char *data = buffer_ring_.buffer(conn.head_bid_) + conn.head_offset_;
+            const size_t len = buffer_len_[conn.head_bid_] - conn.head_offset_;
+            concurrent_servers::io_uring_ring::prep_send(getSqe(), conn_fd, data, len, userData(SEND, conn_fd));
+            conn.send_in_flight_ = true;
+        }
+
+        void recycleBuffer(uint16_t bid) {
+            buffer_ring_.recycle(bid);
+            buffers_recycled_ = true;
+            --buffers_in_use_;
+        }
+
+        void handleCompletion(const struct io_uring_cqe &cqe) {
+            const auto op = static_cast<Operation>(cqe.user_data >> 32);
+            const auto fd = static_cast<int>(cqe.user_data & 0xffffffff);
+
+            switch (op) {
+                case ACCEPT:
+                    acceptConnection(cqe);
+                    break;
+                case RECV:
+                    handleRecv(fd, cqe);
+                    break;
+                case SEND:
+                    handleSend(fd, cqe);
+                    break;
+                case CLOSE:
+                case PROVIDE:
+                    break;
+                default:
+                    CS_LOG_WARNING(PREFIX_LOG, "\tunknown completion, user_data=", cqe.user_data);
+            }
+        }
+
+        void acceptConnection(const struct io_uring_cqe &cqe) {
+            if (cqe.res >= 0) {
+                const int conn_fd = cqe.res;
+                CS_LOG_INFO(PREFIX_LOG, "\t\tadd new client socket fd=", conn_fd, " incoming cpu=", concurrent_servers::incoming_cpu(conn_fd),
+                            " worker cpu=", sched_getcpu());
+                if (busy_poll_.enabled()) {
+                    concurrent_servers::set_socket_busy_poll(conn_fd, busy_poll_);
+                }
+                concurrent_servers::set_accepted_options(conn_fd, listener_);
+
+                UringConnection &conn = connection(conn_fd);
+                conn = UringConnection{};
+                conn.open_ = true;
+                metrics_.add(concurrent_servers::worker_counter::ACCEPTS);
+                postRecv(conn_fd, conn);
+            } else {
+                CS_LOG_ERROR(PREFIX_LOG, "\t\tcould not accept a new connection. ", strerror(-cqe.res));
+            }
+
+            if (not (cqe.flags & IORING_CQE_F_MORE)) {
+                // the kernel terminated the multishot accept, arm a new one
+                postAccept();
+            }
+        }
+
+        void handleRecv(int conn_fd, const struct io_uring_cqe &cqe) {
+            UringConnection &conn = connections_[conn_fd];
+
+            if (cqe.res > 0) {
+                const auto bid = static_cast<uint16_t>(cqe.flags >> IORING_CQE_BUFFER_SHIFT);
+                ++buffers_in_use_;
+                CS_LOG_INFO(PREFIX_LOG, "\t\tfd=", conn_fd, " rlen = ", cqe.res, " buffer id = ", bid);
+                metrics_.add(concurrent_servers::worker_counter::BYTES_IN, static_cast<uint64_t>(cqe.res));
+                queueSend(conn_fd, conn, bid, static_cast<uint32_t>(cqe.res));
+
+                if (not (cqe.flags & IORING_CQE_F_MORE)) {
+                    postRecv(conn_fd, conn);
+                }
+                return;
+            }
+
+            conn.recv_active_ = false;
+
+            if (cqe.res == -ENOBUFS and buffers_in_use_ == 0 and buffer_ring_.uses_buffer_ring()) {
+                // the kernel accepted the buffer ring but never takes buffers from it
+                CS_LOG_WARNING(PREFIX_LOG, "\t\tbuffer ring is not usable, falling back to IORING_OP_PROVIDE_BUFFERS");
+                buffer_ring_.fall_back_to_provide_buffers();
+                postRecv(conn_fd, conn);
+                return;
+            }
+
+            if (cqe.res == -ENOBUFS) {
+                // every provided buffer is waiting to be echoed, receive again once some are recycled
+                CS_LOG_INFO(PREFIX_LOG, "\t\tout of provided buffers, fd=", conn_fd);
+                starved_fds_.push_back(conn_fd);
+                return;
+            }
+
+            if (cqe.res < 0) {
+                CS_LOG_ERROR(PREFIX_LOG, "\t\terror on reading, fd=", conn_fd, "\t", strerror(-cqe.res));
+            } else {
+                CS_LOG_INFO(PREFIX_LOG, "\t\tConnection closed, fd=", conn_fd);
+            }
+
+            conn.closing_ = true;
+            closeConnection(conn_fd, conn);
+        }
+
+        void queueSend(int conn_fd, UringConnection &conn, uint16_t bid, uint32_t len) {
+            buffer_len_[bid] = len;
+            next_bid_[bid] = NO_BUFFER;
+
+            if (conn.tail_bid_ == NO_BUFFER) {
+                conn.head_bid_ = bid;
+                conn.head_offset_ = 0;
+            } else {
+                next_bid_[conn.tail_bid_] = bid;
+            }
+            conn.tail_bid_ = bid;
+
+            // keep a single send in flight per connection so the echo keeps the byte order
+            if (not conn.send_in_flight_) {
+                postSend(conn_fd, conn);
+            }
+        }
+
+        void handleSend(int conn_fd, const struct io_uring_cqe &cqe) {
+            UringConnection &conn = connections_[conn_fd];
+            conn.send_in_flight_ = false;
+
+            if (cqe.res < 0) {
+                CS_LOG_ERROR(PREFIX_LOG, "\t\tERROR on writing, fd=", conn_fd, "\t", strerror(-cqe.res));
+                conn.closing_ = true;
+                if (conn.recv_active_) {
+                    // terminates the multishot recv, the connection is closed on its last completion
+                    shutdown(conn_fd, SHUT_RDWR);
+                }
+                closeConnection(conn_fd, conn);
+                return;
+            }
+
+            CS_LOG_INFO(PREFIX_LOG, "\t\tfd=", conn_fd, " wlen = ", cqe.res);
+            metrics_.add(concurrent_servers::worker_counter::BYTES_OUT, static_cast<uint64_t>(cqe.res));
+            conn.head_offset_ += static_cast<uint32_t>(cqe.res);
+            if (conn.head_offset_ >= buffer_len_[conn.head_bid_]) {
+                const uint16_t done_bid = conn.head_bid_;
+                conn.head_bid_ = next_bid_[done_bid];
+                conn.head_offset_ = 0;
+                if (conn.head_bid_ == NO_BUFFER) {
+                    conn.tail_bid_ = NO_BUFFER;
+                }
+                recycleBuffer(done_bid);
+            }
+
+            if (conn.head_bid_ != NO_BUFFER) {
+                postSend(conn_fd, conn);
+            } else if (conn.closing_) {
+                closeConnection(conn_fd, conn);
+            }
+        }
+
+        /**
+         * Closes the connection once the kernel holds no more request on it.
+         */
+        void closeConnection(int conn_fd, UringConnection &conn) {
+            if (not conn.open_ or conn.recv_active_ or conn.send_in_flight_) {
+                return;
+            }
+
+            // after a failed send nobody will read the rest of the echo
+            for (uint16_t bid = conn.head_bid_; bid != NO_BUFFER; bid = next_bid_[bid]) {
+                recycleBuffer(bid);
+            }
+
+            conn = UringConnection{};
+            concurrent_servers::io_uring_ring::prep_close(getSqe(), conn_fd, userData(CLOSE, conn_fd));
+            metrics_.add(concurrent_servers::worker_counter::CLOSES);
+        }
+    };
+
+    /**
+     * Acceptor thread of the ACCEPTOR engine. It waits for the listening socket alone, so a connection storm
+     * does not delay the reads and writes of the workers, accepts up to ACCEPT_BATCH connections per wakeup and
+     * pushes each one to the inbox of the worker picked by the dispatch policy. Every worker that received
+     * connections is woken once per batch.
+     */
+    class Acceptor {
+    public:
+        Acceptor(int server_sfd, int acceptor_id, const std::vector<std::unique_ptr<WorkerInbox>> &inboxes,
+                 Dispatch dispatch, std::atomic<unsigned> &next_worker) :
+                server_sfd_{server_sfd},
+                acceptor_id_{acceptor_id},
+                prefix_log_{"Multi Worker Server: Acceptor " + std::to_string(acceptor_id_) + ": "},
+                inboxes_{inboxes},
+                dispatch_{dispatch},
+                next_worker_{next_worker},
+                woken_(inboxes.size(), false) {
+
+        }
+
+        void start() {
+            prctl(PR_SET_NAME, prefix_log_.c_str(), NULL, NULL, NULL);
+
+            concurrent_servers::file_descriptor epoll_fd{epoll_create1(0)};
+            if (epoll_fd.get_fd() < 0) {
+                throw std::runtime_error(prefix_log_ + "epoll_create1() failed");
+            }
+            struct epoll_event event{};
+            event.data.fd = server_sfd_;
+            event.events = EPOLLIN | EPOLLEXCLUSIVE; // level-triggered, acceptors sharing a listener take turns
+            if (epoll_ctl(epoll_fd.get_fd(), EPOLL_CTL_ADD, server_sfd_, &event) == -1) {
+                throw std::runtime_error(prefix_log_ + "epoll_ctl() failed");
+            }
+
+            for (;;) {
+                if (epoll_wait(epoll_fd.get_fd(), &event, 1, -1) == -1) {
+                    if (errno == EINTR) {
+                        continue;
+                    }
+                    throw std::runtime_error(prefix_log_ + "epoll_wait() failed");
+                }
+
+                for (int accepted{0}; accepted < ACCEPT_BATCH; ++accepted) {
+                    const int conn_fd = accept4(server_sfd_, nullptr, nullptr, SOCK_NONBLOCK);
+                    if (conn_fd < 0) {
+                        if (errno != EWOULDBLOCK and errno != EAGAIN) {
+                            CS_LOG_ERROR(PREFIX_LOG, "\tcould not accept a new connection. ", strerror(errno));
+                        }
+                        break;
+                    }
+                    handOver(conn_fd);
+                }
+
+                const uint64_t one{1};
+                for (size_t worker{0}; worker < woken_.size(); ++worker) {
+                    if (woken_[worker]) {
+                        woken_[worker] = false;
+                        if (write(inboxes_[worker]->event_fd_, &one, sizeof(one)) < 0) {
+                            CS_LOG_ERROR(PREFIX_LOG, "\tcould not wake worker ", worker, ". ", strerror(errno));
+                        }
+                    }
+                }
+            }
+        }
+
+    private:
+        static const int ACCEPT_BATCH{64}; // the level-triggered listener reports the rest on the next epoll_wait()
+
+        int server_sfd_;
+        const int acceptor_id_;
+        const std::string prefix_log_;
+        const std::vector<std::unique_ptr<WorkerInbox>> &inboxes_;
+        const Dispatch dispatch_;
+        std::atomic<unsigned> &next_worker_; // shared by the acceptors, spreads the round robin over all of them
+        std::vector<bool> woken_; // workers that received connections in the current batch
+
+        size_t pickWorker() const {
+            const size_t first = next_worker_.fetch_add(1, std::memory_order_relaxed) % inboxes_.size();
+            if (dispatch_ == Dispatch::ROUND_ROBIN) {
+                return first;
+            }
+
+            size_t least_loaded = first;
+            size_t least_load = inboxes_[first]->load_.load(std::memory_order_relaxed);
+            for (size_t i{1}; i < inboxes_.size() and least_load > 0; ++i) {
+                const size_t worker = (first + i) % inboxes_.size();
+                const size_t load = inboxes_[worker]->load_.load(std::memory_order_relaxed);
+                if (load < least_load) {
+                    least_loaded = worker;
+                    least_load = load;
+                }
+            }
+            return least_loaded;
+        }
+
+        /**
+         * Pushes the connection to the picked worker, or to the next one whose inbox is not full.
+         */
+        void handOver(int conn_fd) {
+            size_t worker = pickWorker();
+            for (size_t tries{0}; tries < inboxes_.size(); ++tries) {
+                WorkerInbox &inbox = *inboxes_[worker];
+                inbox.load_.fetch_add(1, std::memory_order_relaxed); // before the worker can take and close it
+                if (inbox.queue_.push(conn_fd)) {
+                    CS_LOG_INFO(PREFIX_LOG, "\thand new client socket fd=", conn_fd, " over to worker ", worker);
+                    woken_[worker] = true;
+                    return;
+                }
+                inbox.load_.fetch_sub(1, std::memory_order_relaxed);
+                worker = (worker + 1) % inboxes_.size();
+            }
+
+            CS_LOG_ERROR(PREFIX_LOG, "\tevery worker inbox is full, drop client_fd ", conn_fd);
+            close(conn_fd);
+        }
+    };
+
     int server_sfd_;
     const std::string port_num_;
     const int backlog_;
+    const concurrent_servers::cpu_topology topology_;
     const int worker_num_;
     const bool reuse_port_;
+    const WorkerEngine engine_;
+    const concurrent_servers::connection_timeouts timeouts_;
+    const concurrent_servers::worker_affinity affinity_;
+    const bool cpu_steering_;
+    const concurrent_servers::busy_poll_options busy_poll_;
+    const int acceptor_num_;
+    const Dispatch dispatch_;
+    const size_t zerocopy_threshold_;
+    concurrent_servers::listener_options listener_;
+    std::string metrics_port_;
+    std::string metrics_address_;
+    concurrent_servers::metrics_registry metrics_; // one worker_metrics per epoll, io_uring and acceptor engine worker
+    std::unique_ptr<concurrent_servers::metrics_endpoint> metrics_endpoint_;
     ConnectionDataManager data_manager_;
+    std::vector<std::unique_ptr<WorkerInbox>> inboxes_; // one per worker of the ACCEPTOR engine
+    std::atomic<unsigned> next_worker_;
     std::vector<std::thread> workers_threads;
 
+    /**
+     * Pins the calling worker thread before it allocates its buffers, which then come from its NUMA node.
+     * The connection table is shared by all workers and stays where the main thread allocated it.
+     */
+    void placeWorker(int worker_id) const {
+        const int cpu = topology_.place_worker(worker_id, affinity_);
+        CS_LOG_INFO("worker ", worker_id, " cpu=", cpu);
+    }
+
+    /**
+     * Listeners are numbered in the order they were opened, i.e. listeners[i] belongs to worker i.
+     */
+    void attachCpuSteering(const std::vector<int> &listeners) const {
+        if (not cpu_steering_ or listeners.empty()) {
+            return;
+        }
+
+        std::vector<int> listener_cpus{};
+        for (int i{0}; i < static_cast<int>(listeners.size()); ++i) {
+            listener_cpus.push_back(topology_.worker_cpu(i, affinity_));
+        }
+        if (not concurrent_servers::attach_reuseport_cpu_steering(listeners.front(), listener_cpus)) {
+            CS_LOG_WARNING("could not attach the reuseport steering program: ", strerror(errno));
+        }
+    }
+
+    void startUringWorkers() {
+        // every io_uring worker arms its own multishot accept, either on the shared listening socket
+        // or, with SO_REUSEPORT, on a listening socket of its own
+        if (not reuse_port_) {
+            server_sfd_ = setupServerTcpSocket(port_num_, backlog_, true, false);
+            CS_LOG_INFO("\033[32m", "server socket fd=", server_sfd_, "\033[0m");
+        }
+
+        std::vector<int> listeners{};
+        for (int i{0}; i < worker_num_; ++i) {
+            const int server_sfd = reuse_port_ ? setupServerTcpSocket(port_num_, backlog_, true, true) : server_sfd_;
+            if (reuse_port_) {
+                listeners.push_back(server_sfd);
+                CS_LOG_INFO("\033[32m", "server socket fd=", server_sfd, "\033[0m");
+            }
+
+            workers_threads.emplace_back([this, server_sfd, i]() {
+                try {
+                    placeWorker(i);
+                    UringWorker worker{server_sfd, i, busy_poll_, listener_, metrics_.add_worker(std::to_string(i))};
+                    worker.start();
+                } catch (const std::runtime_error& e) {
+                    CS_LOG_ERROR(e.what(), "\t", strerror(errno));
+                    exit(EXIT_FAILURE);
+                }
+            });
+        }
+        attachCpuSteering(listeners);
+    }
+
+    void startAcceptors() {
+        // every worker polls a private epoll set holding its own connections and the eventfd of its inbox
+        for (int i{0}; i < worker_num_; ++i) {
+            const int event_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+            if (event_fd < 0) {
+                throw std::runtime_error("eventfd() failed");
+            }
+            inboxes_.push_back(std::make_unique<WorkerInbox>(event_fd));
+
+            int epoll_fd = epoll_create1(0);
+            if (epoll_fd < 0) {
+                throw std::runtime_error("epoll_create1() failed");
+            }
+            struct epoll_event event{};
+            event.data.u64 = data_manager_.insert(event_fd);
+            event.events = EPOLLIN; // level-triggered, the worker resets the eventfd before draining the inbox
+            if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, event_fd, &event) == -1) {
+                throw std::runtime_error("epoll_ctl() failed");
+            }
+
+            WorkerInbox *inbox = inboxes_.back().get();
+            workers_threads.emplace_back([this, epoll_fd, inbox, i]() {
+                try {
+                    placeWorker(i);
+                    Worker worker{-1, epoll_fd, true, i, data_manager_, metrics_.add_worker(std::to_string(i)), timeouts_, busy_poll_, listener_, zerocopy_threshold_, inbox};
+                    worker.start();
+                } catch (const std::runtime_error& e) {
+                    CS_LOG_ERROR(e.what(), "\t", strerror(errno));
+                    exit(EXIT_FAILURE);
+                }
+            });
+        }
+
+        // the acceptors are not pinned, the scheduler keeps them off the busy worker CPUs
+        if (not reuse_port_) {
+            server_sfd_ = setupServerTcpSocket(port_num_, backlog_, true, false);
+            CS_LOG_INFO("\033[32m", "server socket fd=", server_sfd_, "\033[0m");
+        }
+        for (int i{0}; i < acceptor_num_; ++i) {
+            const int server_sfd = reuse_port_ ? setupServerTcpSocket(port_num_, backlog_, true, true) : server_sfd_;
+            if (reuse_port_) {
+                CS_LOG_INFO("\033[32m", "server socket fd=", server_sfd, "\033[0m");
+            }
+
+            workers_threads.emplace_back([this, server_sfd, i]() {
+                try {
+                    Acceptor acceptor{server_sfd, i, inboxes_, dispatch_, next_worker_};
+                    acceptor.start();
+                } catch (const std::runtime_error& e) {
+                    CS_LOG_ERROR(e.what(), "\t", strerror(errno));
+                    exit(EXIT_FAILURE);
+                }
+            });
+        }
+    }
+
+    /**
+     * A backlog of 0 or less listens with net.core.somaxconn. The listener options apply to the new socket.
+     */
     int setupServerTcpSocket(const std::string& port_num, const int backlog, bool is_nonblock, bool reuse_port) {
         int server_sfd{};
 
@@ -435,14 +1385,17 @@ private:
         for (rp = result; rp != nullptr; rp = rp->ai_next) {
             const int socket_type = is_nonblock ? (rp->ai_socktype | SOCK_NONBLOCK) : rp->ai_socktype;
             server_sfd = socket(rp->ai_family, socket_type, rp->ai_protocol);
-            if (!server_sfd) {
+            if (server_sfd < 0) {
                 continue;
             }
 
             if (reuse_port) {
+                // two options, OR-ing their names sets neither
                 int one = 1;
-                setsockopt(server_sfd, SOL_SOCKET, SO_REUSEADDR | SO_REUSEPORT, &one, sizeof(one));
+                setsockopt(server_sfd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+                setsockopt(server_sfd, SOL_SOCKET, SO_REUSEPORT, &one, sizeof(one));
             }
+            concurrent_servers::set_listener_options(server_sfd, listener_);
 
             if (bind(server_sfd, rp->ai_addr, rp->ai_addrlen) == 0) {
                 break;                  // Success
@@ -457,11 +1410,12 @@ private:
 
         freeaddrinfo(result);           // No longer needed
 
-        if (listen(server_sfd, backlog) < 0) {  // Listen to the socket
+        if (listen(server_sfd, concurrent_servers::listen_backlog(backlog)) < 0) {  // Listen to the socket
             concurrent_servers::close_fd(server_sfd);
             throw std::runtime_error("Could not listen to port " + port_num);
         }
 
+        metrics_.add_listener(server_sfd);
         return server_sfd;
     }
 };
\ No newline at end of file
@@ -36,15 +36,21 @@
 #include <sys/wait.h>
 
 #include "constants.h"
+#include "cpu_topology.h"
 #include "print_utility.h"
 #include "file_descriptor.h"
 #include "server_utility.h"
+#include "stats_segment.h"
 
 
 int main(int argc, char *argv[]) {
+    const concurrent_servers::listener_options listener = concurrent_servers::listener_options::from_args(argc, argv);
     const std::string port_num = (argc >= 2) ? argv[1] : concurrent_servers::DEFAULT_PORT;
     const int backlog = (argc >= 3) ? atoi(argv[2]) : DEFAULT_BACKLOG;
-    const int worker_process_num = (argc >= 4) ? atoi(argv[3]) : concurrent_servers::DEFAULT_WORKER_PROCESS_NUMBER;
+    const int requested_worker_num = (argc >= 4) ? atoi(argv[3]) : concurrent_servers::DEFAULT_WORKER_PROCESS_NUMBER;
+    // without a worker process number, i.e. 0, one worker per CPU that the affinity allows
+    const concurrent_servers::cpu_topology topology = concurrent_servers::cpu_topology::detect();
+    const int worker_process_num = requested_worker_num > 0 ? requested_worker_num : topology.worker_count(concurrent_servers::worker_affinity::CPU);
     concurrent_servers::file_descriptor server_sfd;
 
     const size_t process_name_len{strlen(argv[0])};
@@ -52,6 +58,9 @@ int main(int argc, char *argv[]) {
     concurrent_servers::log_info(argv[0]);           // Print process name
     strncpy(argv[0], "tcp-server worker process pid=", process_name_len); /* Change process name */
 
+    // one slot per worker process, read with linux_tcp_stats <pid>
+    concurrent_servers::stats_segment stats{static_cast<size_t>(worker_process_num)};
+
     // Pre-fork worker processes to distribute accept() and read()
     // for accept(), the server listening socket fd
     for (int i{0}; i < worker_process_num; ++ i) {
@@ -63,7 +72,11 @@ int main(int argc, char *argv[]) {
             std::cout << "\033[32m" << "Forked new worker process with pid=" << child_pid << "\033[0m" << std::endl;
         } else if (child_pid == 0) { // child process
             try {
-                server_sfd = concurrent_servers::setup_server_tcp_socket(port_num, backlog, true, true);
+                // pinned before anything is allocated, the connection state then stays on the local node
+                const int cpu = topology.place_worker(i, concurrent_servers::worker_affinity::CPU);
+                concurrent_servers::log_info("worker process ", i, " pid=", getpid(), " cpu=", cpu);
+
+                server_sfd = concurrent_servers::setup_server_tcp_socket(port_num, backlog, true, true, listener);
 
                 // create the epoll socket
                 concurrent_servers::file_descriptor epoll_fd;
@@ -80,7 +93,9 @@ int main(int argc, char *argv[]) {
                     throw std::runtime_error("epoll_ctl() failed");
                 }
 
-                epoll_event_loop(server_sfd, epoll_fd);
+                concurrent_servers::worker_stats_slot &slot = stats.slot(static_cast<size_t>(i));
+                slot.pid.store(getpid(), std::memory_order_relaxed);
+                epoll_event_loop(server_sfd, epoll_fd, slot.metrics, listener);
 
                 wait(nullptr);
             } catch (const std::runtime_error& e) {
@@ -42,29 +42,190 @@
 #include <string.h>
 #include <sys/epoll.h>
 #include <array>
+#include <memory>
+#include <type_traits>
+#include <vector>
 #include <sys/wait.h>
+#include <sys/ioctl.h>
+#include <csignal>
+#include <algorithm>
+#include <chrono>
 
 #include "utilities/print_utility.h"
 #include "utilities/file_descriptor.h"
 #include "utilities/server_utility.h"
+#include "utilities/listener_options.h"
+#include "utilities/buffer_pool.h"
+#include "utilities/input_buffer.h"
+#include "utilities/output_queue.h"
+#include "utilities/timing_wheel.h"
+#include "utilities/cpu_topology.h"
+#include "utilities/reuseport_steering.h"
+#include "utilities/busy_poll.h"
+#include "utilities/socket_handover.h"
+#include "utilities/offload.h"
+#include "utilities/poller.h"
+#include "utilities/server_config.h"
+#include "utilities/zerocopy_linger.h"
+#include "utilities/metrics.h"
+#include "utilities/stats_segment.h"
 #include "include/constants.h"
 
 
 namespace concurrent_servers {
-    template <typename ReadHandler>
+    /**
+     * Prefork server, every worker process accepts from its own SO_REUSEPORT listener and serves its connections
+     * with ReadHandler. Config, see default_server_config, picks the poller, the connection table, the buffer size
+     * and the log level, and which optional features are compiled in.
+     */
+    template <typename ReadHandler, typename Config = concurrent_servers::default_server_config>
     class linux_concurrent_server {
     public:
+        /**
+         * handler_args, if any, are given to the ReadHandler constructor.
+         */
+        template <typename... HandlerArgs>
         explicit
         linux_concurrent_server(const int worker_process_num,
                 std::string port_num,
-                const int backlog
+                const int backlog,
+                HandlerArgs&&... handler_args
                 ) : _worker_process_num{worker_process_num},
                     _port_num{std::move(port_num)},
-                    _backlog{backlog}
+                    _backlog{backlog},
+                    _read_handler{std::forward<HandlerArgs>(handler_args)...},
+                    _timeouts{},
+                    _affinity{concurrent_servers::worker_affinity::CPU},
+                    _cpu_steering{false},
+                    _busy_poll{},
+                    _upgrade_socket{},
+                    _offload_threads{0},
+                    _zerocopy_threshold{0},
+                    _listener{},
+                    _stats_port{},
+                    _stats_address{}
         {}
 
+        /**
+         * Replaces the default connection timeouts, call it before start().
+         */
+        void set_timeouts(const concurrent_servers::connection_timeouts &timeouts) {
+            static_assert(Config::TIMEOUTS, "timeouts are compiled out of this server configuration");
+            _timeouts = timeouts;
+        }
+
+        /**
+         * Replaces the default placement, one worker pinned to every allowed CPU. Call it before start().
+         */
+        void set_affinity(concurrent_servers::worker_affinity affinity) {
+            _affinity = affinity;
+        }
+
+        /**
+         * Hands every new connection to the worker pinned to the CPU that received it, instead of the hash of
+         * the SO_REUSEPORT group. Call it before start().
+         */
+        void set_cpu_steering(bool cpu_steering) {
+            static_assert(Config::CPU_STEERING, "CPU steering is compiled out of this server configuration");
+            _cpu_steering = cpu_steering;
+        }
+
+        /**
+         * Lets the workers poll for the given time before blocking in epoll_wait(). Call it before start().
+         */
+        void set_busy_poll(const concurrent_servers::busy_poll_options &busy_poll) {
+            static_assert(Config::BUSY_POLL, "busy polling is compiled out of this server configuration");
+            _busy_poll = busy_poll;
+        }
+
+        /**
+         * Enables hot upgrades through the Unix socket at path. start() first asks a server running there for
+         * its listening sockets, then waits for the next binary to ask for them in turn: once they are handed
+         * over, the workers stop accepting, finish the requests in progress and exit, and so does start().
+         * Call it before start().
+         */
+        void set_upgrade_socket(std::string path) {
+            static_assert(Config::HOT_UPGRADE, "hot upgrades are compiled out of this server configuration");
+            _upgrade_socket = std::move(path);
+        }
+
+        /**
+         * Gives every worker process a work stealing pool of thread_num threads, which runs the work that a read
+         * handler taking a concurrent_servers::offloader hands to it. 0, the default, runs that work inline.
+         * Call it before start().
+         */
+        void set_offload_threads(size_t thread_num) {
+            _offload_threads = thread_num;
+        }
+
+        /**
+         * Sends the output with MSG_ZEROCOPY when at least threshold bytes go out in one call, 0, the default,
+         * disables it. Pays off for large replies only, e.g. from 16KB on. Call it before start().
+         */
+        void set_zerocopy_threshold(size_t threshold) {
+            static_assert(Config::ZEROCOPY, "zerocopy sends are compiled out of this server configuration");
+            _zerocopy_threshold = threshold;
+        }
+
+        /**
+         * Tunes the listening sockets and the accepted connections, see listener_options. Call it before start().
+         */
+        void set_listener_options(const concurrent_servers::listener_options &options) {
+            _listener = options;
+        }
+
+        /**
+         * Keeps the parent process running after the fork, serving the stats_segment of the workers in the
+         * Prometheus text format on port_num of address, loopback by default, see metrics_endpoint.
+         * Call it before start().
+         */
+        void set_stats_port(std::string port_num, std::string address = concurrent_servers::metrics_endpoint::DEFAULT_ADDRESS) {
+            static_assert(Config::STATS, "worker stats are compiled out of this server configuration");
+            _stats_port = std::move(port_num);
+            _stats_address = std::move(address);
+        }
+
+        /**
+         * Without a worker process number, i.e. 0, forks one worker per CPU that the affinity allows.
+         */
         void start() const {
             concurrent_servers::file_descriptor server_sfd;
+            const concurrent_servers::cpu_topology topology = concurrent_servers::cpu_topology::detect();
+            int worker_process_num = _worker_process_num > 0 ? _worker_process_num : topology.worker_count(_affinity);
+
+            concurrent_servers::file_descriptor upgrade_sfd{};
+            if (Config::HOT_UPGRADE and not _upgrade_socket.empty()) {
+                const std::vector<int> inherited = concurrent_servers::socket_handover::request(_upgrade_socket);
+                if (not inherited.empty()) {
+                    CS_LOG_INFO_FROM(Config::LOG_LEVEL, "took over ", inherited.size(), " listening sockets from ", _upgrade_socket);
+                    concurrent_servers::add_inherited_listeners(inherited);
+                    // every inherited accept queue needs a worker
+                    worker_process_num = std::max(worker_process_num, static_cast<int>(inherited.size()));
+                }
+                upgrade_sfd = concurrent_servers::socket_handover::listen_for_upgrade(_upgrade_socket);
+            }
+
+            // The steering program maps CPUs to listener numbers, i.e. the listen() order, and a hot upgrade hands
+            // the listeners over, so in both cases they are opened here in worker order rather than by the workers
+            std::vector<concurrent_servers::file_descriptor> listeners{};
+            if ((Config::CPU_STEERING and _cpu_steering) or upgrade_sfd.get_fd() >= 0) {
+                std::vector<int> listener_cpus{};
+                for (int i{0}; i < worker_process_num; ++i) {
+                    listeners.push_back(concurrent_servers::setup_server_tcp_socket(_port_num, _backlog, true, true, _listener));
+                    listener_cpus.push_back(topology.worker_cpu(i, _affinity));
+                }
+                if (Config::CPU_STEERING and _cpu_steering and not concurrent_servers::attach_reuseport_cpu_steering(listeners.front().get_fd(), listener_cpus)) {
+                    concurrent_servers::log_warning("could not attach the reuseport steering program: ", strerror(errno));
+                }
+            }
+            std::vector<pid_t> child_pids{};
+
+            // every worker process writes its own slot, the segment stays mapped in the workers when start() returns
+            std::unique_ptr<concurrent_servers::stats_segment> stats{};
+            if constexpr (Config::STATS) {
+                stats = std::make_unique<concurrent_servers::stats_segment>(static_cast<size_t>(worker_process_num));
+                CS_LOG_INFO_FROM(Config::LOG_LEVEL, "worker stats segment ", stats->path());
+            }
 
 //            const size_t process_name_len{strlen(argv[0])};
 //            strncpy(argv[0], "tcp-server master process", process_name_len); /* Change process name */
@@ -73,35 +234,58 @@ namespace concurrent_servers {
 
             // Pre-fork worker processes to distribute accept() and read()
             // for accept(), the server listening socket fd
-            for (int i{0}; i < _worker_process_num; ++ i) {
+            for (int i{0}; i < worker_process_num; ++ i) {
                 int child_pid;
 
                 if ((child_pid = fork()) == -1) { // failed to fork a child process
                     throw std::runtime_error("Failed to fork worker processes");
                 } else if (child_pid > 0) { // parent process
+                    child_pids.push_back(child_pid);
                     std::cout << "\033[32m" << "Forked new worker process with pid=" << child_pid << "\033[0m" << std::endl;
                 } else if (child_pid == 0) { // child process
                     try {
-                        server_sfd = concurrent_servers::setup_server_tcp_socket(_port_num, _backlog, true, true);
+                        // pinned before anything is allocated, the connection state then stays on the local node
+                        const int cpu = topology.place_worker(i, _affinity);
+                        CS_LOG_INFO_FROM(Config::LOG_LEVEL, "worker process ", i, " pid=", getpid(), " cpu=", cpu);
+
+                        if constexpr (Config::HOT_UPGRADE) {
+                            upgrade_sfd.close_fd();
+                            struct sigaction drain_action{};
+                            drain_action.sa_handler = request_drain; // no SA_RESTART, epoll_wait() returns EINTR
+                            sigaction(DRAIN_SIGNAL, &drain_action, nullptr);
+                        }
 
-                        // create the epoll socket
-                        concurrent_servers::file_descriptor epoll_fd;
-                        if (!epoll_fd.set_fd(epoll_create1(0))) {
-                            throw std::runtime_error("epoll_create1() failed");
+                        if (not listeners.empty()) {
+                            server_sfd = listeners[i];
+                            for (auto &listener : listeners) {
+                                if (listener.get_fd() != server_sfd.get_fd()) {
+                                    listener.close_fd();
+                                }
+                            }
+                        } else {
+                            server_sfd = concurrent_servers::setup_server_tcp_socket(_port_num, _backlog, true, true, _listener);
                         }
 
-                        // mark the server socket for reading, and become edge-triggered
-                        struct epoll_event event{};
-                        memset(&event, 0, sizeof(event));
-                        event.data.fd = server_sfd.get_fd();
-                        event.events = EPOLLIN | EPOLLET;
-                        if (epoll_ctl(epoll_fd.get_fd(), EPOLL_CTL_ADD, server_sfd.get_fd(), &event) == -1) {
-                            throw std::runtime_error("epoll_ctl() failed");
+                        if (Config::BUSY_POLL and _busy_poll.enabled()) {
+                            concurrent_servers::set_socket_busy_poll(server_sfd.get_fd(), _busy_poll);
                         }
 
-                        epoll_event_loop(server_sfd, epoll_fd);
+                        // mark the server socket for reading, edge-triggered with the epoll pollers
+                        typename Config::poller poller{};
+                        if (not poller.add(server_sfd.get_fd(), EPOLLIN | EPOLLET)) {
+                            throw std::runtime_error("could not poll the listening socket");
+                        }
+
+                        concurrent_servers::worker_metrics *metrics{nullptr};
+                        if constexpr (Config::STATS) {
+                            concurrent_servers::worker_stats_slot &slot = stats->slot(static_cast<size_t>(i));
+                            slot.pid.store(getpid(), std::memory_order_relaxed);
+                            slot.started_ms.store(concurrent_servers::timing_wheel::now_ms(), std::memory_order_relaxed);
+                            metrics = &slot.metrics;
+                        }
 
-                        wait(nullptr);
+                        event_loop(server_sfd, poller, metrics);
+                        exit(EXIT_SUCCESS);
                     } catch (const std::runtime_error& e) {
                         concurrent_servers::log_error(e.what(), "\n\t", strerror(errno));
                         server_sfd.close_fd();
@@ -109,136 +293,540 @@ namespace concurrent_servers {
                     }
                 }
             }
+
+            concurrent_servers::metrics_registry registry{};
+            std::unique_ptr<concurrent_servers::metrics_endpoint> stats_endpoint{};
+            if (Config::STATS and not _stats_port.empty()) {
+                for (size_t i{0}; i < stats->slot_count(); ++i) {
+                    registry.add_worker(std::to_string(i), stats->slot(i).metrics);
+                }
+                for (const auto &listener : listeners) {
+                    registry.add_listener(listener.get_fd());
+                }
+                stats_endpoint = std::make_unique<concurrent_servers::metrics_endpoint>(registry, _stats_port, _stats_address);
+            }
+
+            if (upgrade_sfd.get_fd() >= 0) {
+                // the listeners stay open here until the next binary holds them, their queues are never dropped
+                std::vector<int> listener_fds{};
+                for (const auto &listener : listeners) {
+                    listener_fds.push_back(listener.get_fd());
+                }
+                concurrent_servers::socket_handover::serve(upgrade_sfd, _upgrade_socket, listener_fds);
+                CS_LOG_INFO_FROM(Config::LOG_LEVEL, "listening sockets handed over, draining the workers");
+                for (const pid_t child_pid : child_pids) {
+                    kill(child_pid, DRAIN_SIGNAL);
+                }
+            }
+
+            // every worker holds its own listener, which leaves the group when the worker exits
+            for (auto &listener : listeners) {
+                listener.close_fd();
+            }
+
+            if ((Config::HOT_UPGRADE and not _upgrade_socket.empty()) or stats_endpoint != nullptr) {
+                while (wait(nullptr) > 0 or errno == EINTR) {}
+            }
         }
 
     private:
         const int _worker_process_num;
         const std::string _port_num;
         const int _backlog;
-        const ReadHandler _read_handler{};
+        const ReadHandler _read_handler;
+        concurrent_servers::connection_timeouts _timeouts;
+        concurrent_servers::worker_affinity _affinity;
+        bool _cpu_steering;
+        concurrent_servers::busy_poll_options _busy_poll;
+        std::string _upgrade_socket;
+        size_t _offload_threads;
+        size_t _zerocopy_threshold;
+        concurrent_servers::listener_options _listener;
+        std::string _stats_port;
+        std::string _stats_address;
+
+        static constexpr int DRAIN_SIGNAL{SIGUSR2};
+        static constexpr uint64_t DRAIN_TIMEOUT_MS{30000}; // connections still busy by then are closed
+        static inline volatile sig_atomic_t _drain_requested{0};
+
+        static void request_drain(int) {
+            _drain_requested = 1;
+        }
+
+        /**
+         * The worker stats, metrics is null when they are compiled out.
+         */
+        static void count(concurrent_servers::worker_metrics *metrics, concurrent_servers::worker_counter counter, uint64_t n = 1) {
+            if constexpr (Config::STATS) {
+                metrics->add(counter, n);
+            }
+        }
+
+        static concurrent_servers::output_queue::flush_result flush(int fd, concurrent_servers::output_queue &output,
+                                                                    concurrent_servers::worker_metrics *metrics) {
+            if constexpr (Config::STATS) {
+                const size_t pending = output.size();
+                const auto result = output.flush(fd);
+                if (result != concurrent_servers::output_queue::flush_result::ERROR) {
+                    metrics->add(concurrent_servers::worker_counter::BYTES_OUT, pending - output.size());
+                }
+                if (result == concurrent_servers::output_queue::flush_result::WOULD_BLOCK) {
+                    metrics->add(concurrent_servers::worker_counter::WRITE_EAGAIN);
+                }
+                return result;
+            } else {
+                return output.flush(fd);
+            }
+        }
+
+        static uint64_t now_ns() {
+            return static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::nanoseconds>(
+                    std::chrono::steady_clock::now().time_since_epoch()).count());
+        }
+
+        /**
+         * A read handler returning size_t reports how many bytes it consumed, or CLOSE_CONNECTION. The rest stays
+         * in the connection input_buffer, the next read lands right after it and the handler is given both.
+         */
+        static constexpr bool OFFLOADS{std::is_invocable_r_v<size_t, const ReadHandler &, const std::string &, char *, size_t, concurrent_servers::output_queue &, concurrent_servers::offloader &>};
+        static constexpr bool CONSUMES_INPUT{OFFLOADS or std::is_invocable_r_v<size_t, const ReadHandler &, const std::string &, char *, size_t, concurrent_servers::output_queue &>};
+
+        struct connection_state {
+            concurrent_servers::output_queue output{}; // written by the read handler, flushed by the event loop
+            concurrent_servers::input_buffer input{};  // bytes the read handler did not consume yet
+            bool reading_paused{false};                 // output went above its high watermark
+            bool closing{false};                        // no more reads, closed once the output is sent
+            concurrent_servers::timing_wheel::timer timer{}; // the timeout that applies, see update_timeout()
+            uint64_t read_deadline{0};                  // set while a request is incomplete
+            uint64_t id{0};                             // tells replies of offloaded work for a reused fd apart
+            bool offloaded{false};                      // waits for the reply of offloaded work, reads nothing meanwhile
+            bool resume_input{false};                   // the reply arrived, serve the input that is left
+        };
+
+        /**
+         * Nothing in progress: no pending output, no partial request and nothing waiting to be read.
+         */
+        static bool is_idle(int fd, const connection_state &conn) {
+            int unread{0};
+            return conn.output.empty() and conn.input.empty() and not conn.offloaded and ioctl(fd, FIONREAD, &unread) == 0 and unread == 0;
+        }
 
-        void epoll_event_loop(const concurrent_servers::file_descriptor& server_sfd, const concurrent_servers::file_descriptor& epoll_fd) const {
+        /**
+         * Arms the timeout that applies to the connection now: write while output is pending or offloaded work
+         * prepares it, read while a request is incomplete, which further reads do not extend, and idle otherwise.
+         */
+        void update_timeout(concurrent_servers::timing_wheel &timers, connection_state &conn, uint64_t now) const {
+            if (conn.input.empty()) {
+                conn.read_deadline = 0;
+            } else if (conn.read_deadline == 0) {
+                conn.read_deadline = concurrent_servers::connection_timeouts::deadline(now, _timeouts.read);
+            }
+
+            if (not conn.output.empty() or conn.offloaded) {
+                timers.schedule(conn.timer, concurrent_servers::connection_timeouts::deadline(now, _timeouts.write));
+            } else if (not conn.input.empty()) {
+                timers.schedule(conn.timer, conn.read_deadline);
+            } else {
+                timers.schedule(conn.timer, concurrent_servers::connection_timeouts::deadline(now, _timeouts.idle));
+            }
+        }
+
+        /**
+         * Calls the read handler, handing it the connection output queue if it takes one:
+         * void operator()(const std::string &prefix_log, char *buff, size_t buff_len, concurrent_servers::output_queue &output)
+         * Returns false if the connection has to be closed.
+         */
+        bool handle_read(const std::string &prefix_log, char *buffer, size_t len, int fd, connection_state &conn,
+                         concurrent_servers::offload_channel *offload) const {
+            if constexpr (CONSUMES_INPUT) {
+                // buffer is the end of conn.input
+                conn.input.commit(len);
+                return handle_input(prefix_log, fd, conn, offload);
+            } else if constexpr (std::is_invocable_v<const ReadHandler &, const std::string &, char *, size_t, concurrent_servers::output_queue &>) {
+                _read_handler(prefix_log, buffer, len, conn.output);
+                return true;
+            } else {
+                _read_handler(prefix_log, buffer, len);
+                return true;
+            }
+        }
+
+        /**
+         * Hands the input that is left to a read handler consuming input. Returns false if the connection has to
+         * be closed.
+         */
+        bool handle_input(const std::string &prefix_log, int fd, connection_state &conn, concurrent_servers::offload_channel *offload) const {
+            size_t consumed{0};
+            if constexpr (OFFLOADS) {
+                concurrent_servers::offloader offloader{offload, fd, conn.id, conn.output};
+                consumed = _read_handler(prefix_log, conn.input.data(), conn.input.size(), conn.output, offloader);
+                conn.offloaded = offloader.pending();
+            } else {
+                consumed = _read_handler(prefix_log, conn.input.data(), conn.input.size(), conn.output);
+            }
+            if (consumed == concurrent_servers::CLOSE_CONNECTION) {
+                return false;
+            }
+            conn.input.consume(consumed);
+            return true;
+        }
+
+        void event_loop(const concurrent_servers::file_descriptor& server_sfd, typename Config::poller &poller,
+                        concurrent_servers::worker_metrics *metrics) const {
+            using poller_type = typename Config::poller;
             const pid_t pid = getpid();
             const std::string prefix_log = "Worker process " + std::to_string(pid) + ": ";
-            const int MAX_EVENTS{10000};
-            std::array<struct epoll_event, MAX_EVENTS> events{};
+            std::array<struct epoll_event, Config::MAX_EVENTS> events{};
+            concurrent_servers::buffer_pool buffer_pool{Config::BUFFER_SIZE}; // read buffers and output segments of this worker process
+            typename Config::template connection_table<connection_state> connections{}; // indexed by client socket fd
+            concurrent_servers::timing_wheel timers{}; // one timer per connection, sets the poller timeout
+            concurrent_servers::busy_poller busy_poller{_busy_poll, prefix_log};
+
+            size_t open_connections{0};
+            uint64_t next_connection_id{0};
+            bool draining{false}; // the listening sockets were handed over, finish the connections and return
+            uint64_t drain_deadline{0};
+
+            // the pool threads are started here, after fork(), and send their replies through an eventfd
+            std::unique_ptr<concurrent_servers::offload_channel> offload{};
+            if (OFFLOADS and _offload_threads > 0) {
+                offload = std::make_unique<concurrent_servers::offload_channel>(_offload_threads);
+                // level-triggered, drain() resets the eventfd first
+                if (not poller.add(offload->event_fd(), EPOLLIN)) {
+                    throw std::runtime_error(prefix_log + "could not poll the offload eventfd");
+                }
+            }
+
+            concurrent_servers::zerocopy_linger lingering{}; // closed sockets waiting for their zerocopy completions
+
+            const auto close_connection = [&connections, &poller, &timers, &open_connections, &lingering, metrics](int fd) {
+                poller.remove(fd);
+                if (not Config::ZEROCOPY or not lingering.hold(fd, connections.get(fd)->output, concurrent_servers::timing_wheel::now_ms())) {
+                    close(fd);
+                }
+                if constexpr (Config::TIMEOUTS) {
+                    timers.cancel(connections.get(fd)->timer);
+                }
+                connections.erase(fd);
+                --open_connections;
+                count(metrics, concurrent_servers::worker_counter::CLOSES);
+            };
 
             for (;;) {
-                int nfds = epoll_wait(epoll_fd.get_fd(), events.data(), MAX_EVENTS, -1);
+                int wait_ms{-1};
+                if constexpr (Config::TIMEOUTS) {
+                    wait_ms = timers.next_timeout_ms(concurrent_servers::timing_wheel::now_ms());
+                }
+                if (Config::HOT_UPGRADE and draining) {
+                    // the last connections may close without leaving a timer behind, wake up for the drain check
+                    const uint64_t now = concurrent_servers::timing_wheel::now_ms();
+                    const int drain_left = open_connections == 0 or now >= drain_deadline ? 0 : static_cast<int>(drain_deadline - now);
+                    wait_ms = wait_ms < 0 ? drain_left : std::min(wait_ms, drain_left);
+                }
+                if (Config::ZEROCOPY and not lingering.empty()) {
+                    const int linger_ms{concurrent_servers::zerocopy_linger::POLL_INTERVAL_MS};
+                    wait_ms = wait_ms < 0 ? linger_ms : std::min(wait_ms, linger_ms);
+                }
+                int nfds{0};
+                if constexpr (Config::BUSY_POLL) {
+                    nfds = busy_poller.wait(wait_ms, [&poller, &events](int timeout_ms) {
+                        return poller.wait(events.data(), Config::MAX_EVENTS, timeout_ms);
+                    });
+                } else {
+                    nfds = poller.wait(events.data(), Config::MAX_EVENTS, wait_ms);
+                }
                 if (nfds == -1) {
-                    throw std::runtime_error(prefix_log + "epoll_wait() failed");
+                    if (errno != EINTR) {
+                        throw std::runtime_error(prefix_log + "waiting for events failed");
+                    }
+                    nfds = 0;
+                }
+                if constexpr (Config::STATS) {
+                    metrics->record_wakeup(nfds);
+                }
+
+                const uint64_t now = Config::TIMEOUTS or Config::HOT_UPGRADE or Config::ZEROCOPY ? concurrent_servers::timing_wheel::now_ms() : 0;
+                if (Config::ZEROCOPY and not lingering.empty()) {
+                    lingering.poll(now);
+                }
+                if constexpr (Config::TIMEOUTS) {
+                    timers.advance(now, [&prefix_log, &close_connection](concurrent_servers::timing_wheel::timer &timer) {
+                        const auto fd = static_cast<int>(timer.data);
+                        CS_LOG_WARNING_FROM(Config::LOG_LEVEL, prefix_log, "  connection timed out, fd=", fd);
+                        close_connection(fd);
+                    });
+                }
+
+                if (Config::HOT_UPGRADE and _drain_requested != 0 and not draining) {
+                    // the next server process accepts from the same queues now
+                    CS_LOG_INFO_FROM(Config::LOG_LEVEL, prefix_log, "draining ", open_connections, " connections");
+                    draining = true;
+                    drain_deadline = now + DRAIN_TIMEOUT_MS;
+                    poller.remove(server_sfd.get_fd());
+                    for (size_t fd{0}; fd < connections.size(); ++fd) {
+                        const connection_state *conn = connections.get(static_cast<int>(fd));
+                        if (conn != nullptr and is_idle(static_cast<int>(fd), *conn)) {
+                            close_connection(static_cast<int>(fd));
+                        }
+                    }
+                }
+                if (Config::HOT_UPGRADE and draining and (open_connections == 0 or now >= drain_deadline)) {
+                    CS_LOG_INFO_FROM(Config::LOG_LEVEL, prefix_log, "drained, ", open_connections, " connections left");
+                    if (Config::ZEROCOPY and _zerocopy_threshold > 0) {
+                        const concurrent_servers::zerocopy_counters &zerocopy = concurrent_servers::zerocopy_stats();
+                        CS_LOG_INFO_FROM(Config::LOG_LEVEL, prefix_log, "zerocopy sends=", zerocopy.sends.load(), " completed=",
+                                         zerocopy.completed.load(), " copied=", zerocopy.copied.load());
+                    }
+                    return;
                 }
 
                 for (int i{0}; i < nfds; ++i) {
-                    concurrent_servers::log_info(prefix_log, "epoll_wait() return, fd=", events[i].data.fd, " event ", events[i].events);
+                    CS_LOG_INFO_FROM(Config::LOG_LEVEL, prefix_log, "epoll_wait() return, fd=", events[i].data.fd, " event ", events[i].events);
+
+                    if (events[i].data.fd == server_sfd.get_fd()) {
+                        if (Config::HOT_UPGRADE and draining) {
+                            continue;
+                        }
+                        // server socket, accept as many new connections as possible
+                        concurrent_servers::file_descriptor client_sfd{};
+                        struct sockaddr_storage cli_addr{};
+
+                        for (;;) {
+                            int cli_len = sizeof(cli_addr); // Always reset this value before calling accept()
+                            if ((!client_sfd.set_fd(
+                                    accept4(server_sfd.get_fd(), (struct sockaddr *) &cli_addr, (socklen_t *) &cli_len,
+                                            SOCK_NONBLOCK)))) {
+                                if (errno != EWOULDBLOCK and errno != EAGAIN) {
+                                    throw std::runtime_error(prefix_log + "Could not accept a new connection");
+                                } else {
+                                    // no more connection to accept
+                                    break;
+                                }
+                            }
 
-                    if (events[i].events & EPOLLERR) {
-                        concurrent_servers::log_warning(prefix_log + "epoll_wait() error on fd ", events[i].data.fd, " event ", events[i].events);
-//                    epoll_ctl(epoll_fd.get_fd(), EPOLL_CTL_DEL, events[i].data.fd, nullptr);
-//                    close(events[i].data.fd);
-//                    if (events[i].data.fd == server_sfd.get_fd()) {
-//                        throw std::runtime_error(prefix_log + "epoll_wait() error on server fd");
-//                    }
+                            if constexpr (concurrent_servers::log_enabled(concurrent_servers::log_level::INFO)
+                                          and concurrent_servers::log_level::INFO >= Config::LOG_LEVEL) {
+                                log_client_info(cli_addr, prefix_log);
+                            }
+                            CS_LOG_INFO_FROM(Config::LOG_LEVEL, prefix_log + "Add new client socket fd=", client_sfd.get_fd(),
+                                        " incoming cpu=", concurrent_servers::incoming_cpu(client_sfd.get_fd()), " worker cpu=", sched_getcpu());
+
+                            concurrent_servers::set_accepted_options(client_sfd.get_fd(), _listener);
+                            if (Config::BUSY_POLL and _busy_poll.enabled() and not concurrent_servers::set_socket_busy_poll(client_sfd.get_fd(), _busy_poll)) {
+                                CS_LOG_INFO_FROM(Config::LOG_LEVEL, prefix_log, "busy poll socket options not supported, fd=", client_sfd.get_fd());
+                            }
+                            connection_state *new_conn = connections.emplace(client_sfd.get_fd());
+                            if (new_conn == nullptr) {
+                                CS_LOG_ERROR_FROM(Config::LOG_LEVEL, prefix_log, "no room for the connection, fd=", client_sfd.get_fd());
+                                client_sfd.close_fd();
+                                continue;
+                            }
+                            new_conn->id = ++next_connection_id;
+                            ++open_connections;
+                            count(metrics, concurrent_servers::worker_counter::ACCEPTS);
+                            new_conn->output.set_buffer_pool(&buffer_pool);
+                            new_conn->input.set_buffer_pool(&buffer_pool);
+                            if (Config::ZEROCOPY and _zerocopy_threshold > 0) {
+                                if (concurrent_servers::enable_socket_zerocopy(client_sfd.get_fd())) {
+                                    new_conn->output.set_zerocopy_threshold(_zerocopy_threshold);
+                                } else {
+                                    CS_LOG_INFO_FROM(Config::LOG_LEVEL, prefix_log, "zerocopy not supported, fd=", client_sfd.get_fd());
+                                }
+                            }
+                            if constexpr (Config::TIMEOUTS) {
+                                new_conn->timer.data = static_cast<uint64_t>(client_sfd.get_fd());
+                                update_timeout(timers, *new_conn, now);
+                            }
+
+                            // start polling the new client fd for reading
+                            if (not poller.watch(client_sfd.get_fd(), true, false)) {
+                                CS_LOG_ERROR_FROM(Config::LOG_LEVEL, prefix_log, "could not poll the new client fd ", client_sfd.get_fd());
+                                close_connection(client_sfd.get_fd());
+                            }
+                        }
+                        continue;
                     }
 
-                    if (events[i].events & EPOLLRDHUP) {
-                        concurrent_servers::log_warning(prefix_log, "  Connection closed, fd=", events[i].data.fd);
-                        epoll_ctl(epoll_fd.get_fd(), EPOLL_CTL_DEL, events[i].data.fd, nullptr); // remove client socket fd from epoll list
-                        close(events[i].data.fd);
+                    if (offload != nullptr and events[i].data.fd == offload->event_fd()) {
+                        offload->drain([&prefix_log, &connections, &poller, &close_connection](concurrent_servers::offload_completion &completion) {
+                            const int fd = completion.fd;
+                            connection_state *completed = connections.get(fd);
+                            if (completed == nullptr or completed->id != completion.connection_id) {
+                                CS_LOG_INFO_FROM(Config::LOG_LEVEL, prefix_log, "  offloaded reply for a closed connection dropped, fd=", fd);
+                                return;
+                            }
+                            connection_state &conn = *completed;
+                            if (not conn.output.append(completion.reply.data(), completion.reply.size())) {
+                                // part of the reply may be queued, the next one would follow it
+                                CS_LOG_ERROR_FROM(Config::LOG_LEVEL, prefix_log, "  could not queue the offloaded reply, fd=", fd);
+                                close_connection(fd);
+                                return;
+                            }
+                            conn.offloaded = false;
+                            conn.resume_input = true;
+
+                            // the fd is not polled for reading meanwhile, writability wakes it up right away to send
+                            // the reply and serve the rest of the input
+                            if (not poller.wake_for_write(fd)) {
+                                throw std::runtime_error(prefix_log + "could not poll fd " + std::to_string(fd));
+                            }
+                        });
                         continue;
                     }
 
-                    if (events[i].events & EPOLLHUP) {
-                        concurrent_servers::log_warning(prefix_log, "  Connection hangup");
+                    const int fd = events[i].data.fd;
+                    connection_state *const polled = connections.get(fd);
+                    if (polled == nullptr) {
+                        continue;
+                    }
+                    bool failed = events[i].events & (EPOLLERR | EPOLLHUP);
+                    if constexpr (Config::ZEROCOPY) {
+                        // zerocopy completions wait in the socket error queue, which raises EPOLLERR, or makes the
+                        // socket readable for select()
+                        if (polled->output.zerocopy_pending()) {
+                            polled->output.complete_zerocopy(fd);
+                        }
+                        if (failed and _zerocopy_threshold > 0 and not (events[i].events & EPOLLHUP)) {
+                            failed = concurrent_servers::take_socket_error(fd) != 0;
+                        }
+                    }
+                    if (failed) {
+                        CS_LOG_WARNING_FROM(Config::LOG_LEVEL, prefix_log, "  Connection closed, fd=", fd, " event ", events[i].events);
+                        close_connection(fd);
+                        continue;
                     }
 
-                    if (events[i].events & EPOLLIN) {
-                        concurrent_servers::log_info(prefix_log, "  EPOLLIN event, fd=", events[i].data.fd);
+                    connection_state &conn = *polled;
+                    if (events[i].events & EPOLLOUT) {
+                        CS_LOG_INFO_FROM(Config::LOG_LEVEL, prefix_log, "  EPOLLOUT event, fd=", fd);
+                    }
+                    if (not conn.output.empty() and flush(fd, conn.output, metrics) == concurrent_servers::output_queue::flush_result::ERROR) {
+                        CS_LOG_ERROR_FROM(Config::LOG_LEVEL, prefix_log, "error on writing, fd=", fd, "\t", strerror(errno));
+                        close_connection(fd);
+                        continue;
+                    }
+                    if (conn.reading_paused and conn.output.below_low_watermark()) {
+                        conn.reading_paused = false;
+                    }
 
-                        if (events[i].data.fd == server_sfd.get_fd()) {
-                            // server socket, accept as many new connections as possible
-                            concurrent_servers::file_descriptor client_sfd{};
-                            struct sockaddr_storage cli_addr{};
+                    // client socket; read as much data as we can, unless the client does not keep up with the output
+                    bool connection_is_closed{false};
+                    char *buffer{nullptr};
+                    size_t buffer_size{buffer_pool.chunk_size()};
+                    if constexpr (not CONSUMES_INPUT) {
+                        buffer = buffer_pool.acquire();
+                        if (buffer == nullptr) {
+                            throw std::runtime_error(prefix_log + "out of read buffers");
+                        }
+                    }
 
-                            for (;;) {
-                                int cli_len = sizeof(cli_addr); // Always reset this value before calling accept()
-                                if ((!client_sfd.set_fd(
-                                        accept4(server_sfd.get_fd(), (struct sockaddr *) &cli_addr, (socklen_t *) &cli_len,
-                                                SOCK_NONBLOCK)))) {
-                                    if (errno != EWOULDBLOCK and errno != EAGAIN) {
-                                        throw std::runtime_error(prefix_log + "Could not accept a new connection");
-                                    } else {
-                                        // no more connection to accept
-                                        break;
-                                    }
-                                }
+                    if constexpr (OFFLOADS) {
+                        if (conn.resume_input and not conn.offloaded) {
+                            // requests that arrived while the offloaded one was running
+                            conn.resume_input = false;
+                            if (not conn.closing and not conn.input.empty() and not handle_input(prefix_log, fd, conn, offload.get())) {
+                                CS_LOG_INFO_FROM(Config::LOG_LEVEL, prefix_log, "  close after the reply, fd=", fd);
+                                conn.closing = true;
+                            }
+                        }
+                    }
 
-                                log_client_info(cli_addr, prefix_log);
-                                concurrent_servers::log_info(prefix_log + "Add new client socket fd=", client_sfd.get_fd());
-
-                                // add the new client fd to epoll event list
-                                struct epoll_event event{};
-                                memset(&event, 0, sizeof(event));
-                                event.data.fd = client_sfd.get_fd();
-                                event.events = EPOLLIN | EPOLLRDHUP |EPOLLET | EPOLLONESHOT;  // one shot edge triggered
-                                if (epoll_ctl(epoll_fd.get_fd(), EPOLL_CTL_ADD, client_sfd.get_fd(), &event) == -1) {
-                                    throw std::runtime_error(prefix_log + "epoll_ctl() failed");
-                                }
+                    while (not conn.reading_paused and not conn.closing and not conn.offloaded) {
+                        if constexpr (not poller_type::REWATCH) {
+                            // nothing polls for the input left in the socket but the next writability edge, which
+                            // only comes if the socket send buffer fills up
+                            if (conn.output.above_high_watermark()
+                                and flush(fd, conn.output, metrics) == concurrent_servers::output_queue::flush_result::ERROR) {
+                                CS_LOG_ERROR_FROM(Config::LOG_LEVEL, prefix_log, "error on writing, fd=", fd, "\t", strerror(errno));
+                                connection_is_closed = true;
+                                break;
                             }
-                        } else {
-                            // client socket; read as much data as we can
-                            concurrent_servers::file_descriptor client_sfd{events[i].data.fd};
-                            char buffer[BUFF_SIZE];
-
-                            for (;;) {
-                                // Read data sent from client
-                                const ssize_t rlen = read(client_sfd.get_fd(), buffer, sizeof(buffer));
-                                if (rlen < 0) {
-                                    if (errno == EWOULDBLOCK or errno == EAGAIN) {
-                                        // due to EPOLLONESHOT, after finishing reading all data in buffer,
-                                        // we need to rearm the client fd to catch its event again
-                                        concurrent_servers::log_info(prefix_log + "rearm epoll event, fd=", client_sfd.get_fd());
-                                        struct epoll_event event{};
-                                        memset(&event, 0, sizeof(event));
-                                        event.data.fd = client_sfd.get_fd();
-                                        event.events = EPOLLIN | EPOLLRDHUP | EPOLLET | EPOLLONESHOT;  // one shot edge triggered
-                                        if (epoll_ctl(epoll_fd.get_fd(), EPOLL_CTL_MOD, client_sfd.get_fd(), &event) == -1) {
-                                            throw std::runtime_error(prefix_log + "epoll_ctl() failed");
-                                        }
-                                    } else {
-                                        concurrent_servers::log_error(prefix_log, "error on reading, fd=",
-                                                                      std::to_string(client_sfd.get_fd()), ", errno=",
-                                                                      std::to_string(errno), "\t", strerror(errno));
-//                                    throw std::runtime_error(prefix_log + "ERROR on reading, fd=" + std::to_string(client_sfd.get_fd()) + ", errno=" + std::to_string(errno));
-                                    }
-                                    break;
-                                }
+                        }
+                        if (conn.output.above_high_watermark()) {
+                            CS_LOG_INFO_FROM(Config::LOG_LEVEL, prefix_log, "  output above high watermark, pause reading fd=", fd);
+                            conn.reading_paused = true;
+                            break;
+                        }
 
-                                if (rlen == 0) {
-                                    concurrent_servers::log_info(prefix_log, "  end of file, fd=" + std::to_string(client_sfd.get_fd()));
+                        if constexpr (CONSUMES_INPUT) {
+                            buffer = conn.input.prepare(Config::MAX_PENDING_INPUT);
+                            if (buffer == nullptr) {
+                                if (conn.input.size() < Config::MAX_PENDING_INPUT) {
+                                    throw std::runtime_error(prefix_log + "out of read buffers");
                                 }
+                                CS_LOG_WARNING_FROM(Config::LOG_LEVEL, prefix_log, "  request too long, fd=", fd);
+                                connection_is_closed = true;
+                                break;
+                            }
+                            buffer_size = conn.input.writable();
+                        }
 
-                                _read_handler(prefix_log, buffer, rlen);
+                        // Read data sent from client
+                        const ssize_t rlen = read(fd, buffer, buffer_size);
+                        if (rlen < 0) {
+                            if (errno != EWOULDBLOCK and errno != EAGAIN) {
+                                CS_LOG_ERROR_FROM(Config::LOG_LEVEL, prefix_log, "error on reading, fd=", std::to_string(fd), ", errno=",
+                                             std::to_string(errno), "\t", strerror(errno));
+                                connection_is_closed = true;
+                            } else {
+                                count(metrics, concurrent_servers::worker_counter::READ_EAGAIN);
                             }
+                            break;
+                        }
+
+                        if (rlen == 0) {
+                            CS_LOG_INFO_FROM(Config::LOG_LEVEL, prefix_log, "  end of file, fd=" + std::to_string(fd));
+                            conn.closing = true;
+                            break;
+                        }
+
+                        count(metrics, concurrent_servers::worker_counter::BYTES_IN, static_cast<uint64_t>(rlen));
+                        const uint64_t handler_start = Config::STATS ? now_ns() : 0;
+                        const bool keep_open = handle_read(prefix_log, buffer, static_cast<size_t>(rlen), fd, conn, offload.get());
+                        if constexpr (Config::STATS) {
+                            metrics->record_latency(now_ns() - handler_start);
+                        }
+                        if (not keep_open) {
+                            CS_LOG_INFO_FROM(Config::LOG_LEVEL, prefix_log, "  close after the reply, fd=", fd);
+                            conn.closing = true;
+                            break;
                         }
                     }
 
-                    if (events[i].events & EPOLLOUT) {
-                        concurrent_servers::log_info(prefix_log, "  EPOLLOUT event, fd=", events[i].data.fd);
-
-//                    concurrent_servers::file_descriptor client_sfd{events[i].data.fd};
-//                    const std::string dummy_buffer{"echo back"};
-//
-//
-//                    // Echo the data back to the client
-//                    const ssize_t wlen = write(client_sfd.get_fd(), dummy_buffer.data(), dummy_buffer.length());
-//                    if (wlen < 0) {
-//                        if (errno != EWOULDBLOCK and errno != EAGAIN) {
-//                            concurrent_servers::log_error(prefix_log, "ERROR on writing, fd=", std::to_string(client_sfd.get_fd()), ", errno=", std::to_string(errno), "\t", strerror(errno));
-//                            throw std::runtime_error(prefix_log + "ERROR on writing, fd=" + std::to_string(client_sfd.get_fd()) + ", errno=" + std::to_string(errno));
-//                        }
-//                        break;
-//                    }
+                    if constexpr (not CONSUMES_INPUT) {
+                        buffer_pool.release(buffer);
+                    }
+
+                    // Send what the handler queued
+                    if (not connection_is_closed and not conn.output.empty()
+                        and flush(fd, conn.output, metrics) == concurrent_servers::output_queue::flush_result::ERROR) {
+                        CS_LOG_ERROR_FROM(Config::LOG_LEVEL, prefix_log, "error on writing, fd=", fd, "\t", strerror(errno));
+                        connection_is_closed = true;
+                    }
+
+                    if (connection_is_closed or (conn.closing and conn.output.empty() and not conn.offloaded)
+                        or (Config::HOT_UPGRADE and draining and is_idle(fd, conn))) {
+                        close_connection(fd);
+                        continue;
+                    }
+
+                    // poll the client fd for what it waits for: writability only while output is pending,
+                    // input only while reading, a pending half close would wake us up in a loop otherwise.
+                    // If the last flush drained the output, resume reading now: rearming a one shot registration
+                    // reports the data already waiting in the socket.
+                    if (conn.reading_paused and conn.output.below_low_watermark()) {
+                        conn.reading_paused = false;
+                    }
+                    if constexpr (Config::TIMEOUTS) {
+                        update_timeout(timers, conn, now);
+                    }
+                    if constexpr (poller_type::REWATCH) {
+                        CS_LOG_INFO_FROM(Config::LOG_LEVEL, prefix_log + "rearm poller, fd=", fd);
+                        if (not poller.rewatch(fd, not conn.reading_paused and not conn.closing and not conn.offloaded,
+                                               not conn.output.empty())) {
+                            count(metrics, concurrent_servers::worker_counter::REARM_FAILURES);
+                            throw std::runtime_error(prefix_log + "could not poll fd " + std::to_string(fd));
+                        }
                     }
                 }
             }
@@ -39,16 +39,37 @@
 #include "print_utility.h"
 #include "file_descriptor.h"
 #include "server_utility.h"
+#include "metrics.h"
+#include "command_line.h"
 
 int main(int argc, char *argv[]) {
     concurrent_servers::log(argv[0]);           // Print server process name
 
-    const std::string port_num = (argc >= 2) ? argv[1] : concurrent_servers::DEFAULT_PORT;
-    const int backlog = (argc < 3) ? DEFAULT_BACKLOG : atoi(argv[2]);
+    const concurrent_servers::listener_options listener = concurrent_servers::listener_options::from_args(argc, argv);
+    concurrent_servers::command_line args{argc, argv};
+    std::string port_num{};
+    int backlog{DEFAULT_BACKLOG};
+    std::string metrics_port{};
+    std::string metrics_address{};
+    try {
+        port_num = args.positional(0, concurrent_servers::DEFAULT_PORT);
+        backlog = args.positional_number(1, DEFAULT_BACKLOG);
+        metrics_port = args.text("metrics", "");
+        metrics_address = args.text("metrics-address", concurrent_servers::metrics_endpoint::DEFAULT_ADDRESS);
+        args.finish(2);
+    } catch (const concurrent_servers::usage_error &e) {
+        concurrent_servers::exit_with_usage(argv[0], "[port] [backlog] [--metrics=PORT] [--metrics-address=ADDR]", e);
+    }
     concurrent_servers::file_descriptor server_sfd;
+    concurrent_servers::metrics_registry metrics{};
+    std::unique_ptr<concurrent_servers::metrics_endpoint> metrics_endpoint{};
 
     try {
-        server_sfd = concurrent_servers::setup_server_tcp_socket(port_num, backlog, true);
+        server_sfd = concurrent_servers::setup_server_tcp_socket(port_num, backlog, true, false, listener);
+        metrics.add_listener(server_sfd.get_fd());
+        if (not metrics_port.empty()) {
+            metrics_endpoint = std::make_unique<concurrent_servers::metrics_endpoint>(metrics, metrics_port, metrics_address);
+        }
 
         // create the epoll socket
         concurrent_servers::file_descriptor epoll_fd;
@@ -65,7 +86,7 @@ int main(int argc, char *argv[]) {
             throw std::runtime_error("epoll_ctl() failed");
         }
 
-        concurrent_servers::epoll_event_loop(server_sfd, epoll_fd);
+        concurrent_servers::epoll_event_loop(server_sfd, epoll_fd, metrics.add_worker("0"), listener);
     } catch (const std::runtime_error& e) {
         concurrent_servers::log_error(e.what(), "\n\t", strerror(errno));
         server_sfd.close_fd();
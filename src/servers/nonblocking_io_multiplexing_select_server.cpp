@@ -51,12 +51,13 @@
 int main(int argc, char *argv[]) {
     concurrent_servers::log(argv[0]);           // Print server process name
 
+    const concurrent_servers::listener_options listener = concurrent_servers::listener_options::from_args(argc, argv);
     const std::string port_num = (argc >= 2) ? argv[1] : concurrent_servers::DEFAULT_PORT;
     const int backlog = (argc < 3) ? DEFAULT_BACKLOG : atoi(argv[2]);
     concurrent_servers::file_descriptor server_sfd{};
 
     try {
-        server_sfd = concurrent_servers::setup_server_tcp_socket(port_num, backlog, true);
+        server_sfd = concurrent_servers::setup_server_tcp_socket(port_num, backlog, true, false, listener);
 
         // Setup select()
         int max_sfd(server_sfd.get_fd()); /* highest-numbered file descriptor in any of the three sets */
@@ -96,8 +97,11 @@ int main(int argc, char *argv[]) {
                                 }
                             }
 
-                            concurrent_servers::log_client_info(cli_addr);
+                            if constexpr (concurrent_servers::log_enabled(concurrent_servers::log_level::INFO)) {
+                                concurrent_servers::log_client_info(cli_addr);
+                            }
                             concurrent_servers::log("Add new client socket fd ", client_sfd.get_fd());
+                            concurrent_servers::set_accepted_options(client_sfd.get_fd(), listener);
                             FD_SET(client_sfd.get_fd(), &read_fd_backup_set);
                             max_sfd = std::max(max_sfd, client_sfd.get_fd());
                         }
@@ -117,12 +121,12 @@ int main(int argc, char *argv[]) {
                             }
 
                             if (rlen == 0) {
-                                std::cout << "  Connection closed" << std::endl;
+                                CS_LOG_INFO("  Connection closed");
                                 connection_is_closed = true;
                                 break;
                             }
 
-                            std::cout << "  received: " << buffer << std::endl;
+                            CS_LOG_INFO("  received: ", std::string{buffer, static_cast<size_t>(rlen)});
 
                             // Echo the data back to the client
                             const ssize_t wlen = write(client_sfd.get_fd(), buffer, (size_t)rlen);
@@ -1,9 +1,57 @@
 #include "servers/multi_worker_nonblocking_io_multiplexing_server.h"
+#include "utilities/command_line.h"
+
+namespace {
+    constexpr const char *SYNOPSIS{"[port] [backlog] [workers] [--engine=epoll|io_uring|acceptor] [--reuse-port=yes|no]\n"
+                                   "    [--idle-timeout=S] [--placement=cpu|core|none] [--cpu-steering] [--busy-poll=US]\n"
+                                   "    [--acceptors=N] [--dispatch=least_loaded|round_robin] [--zerocopy=BYTES]\n"
+                                   "    [--metrics=PORT] [--metrics-address=ADDR]"};
+}
 
 int main(int argc, char *argv[]) {
-    const std::string port_num = (argc >= 2) ? argv[1] : concurrent_servers::DEFAULT_PORT;
-    const int backlog = (argc >= 3) ? atoi(argv[2]) : DEFAULT_BACKLOG;
-    const int worker_num = (argc >= 4) ? atoi(argv[3]) : concurrent_servers::DEFAULT_WORKER_PROCESS_NUMBER;
-    MultiWorkerIoMultiplexingTCPServer server{port_num, backlog, worker_num, true};
-    server.start();
-}
\ No newline at end of file
+    const concurrent_servers::listener_options listener = concurrent_servers::listener_options::from_args(argc, argv);
+    concurrent_servers::command_line args{argc, argv};
+    try {
+        const std::string port_num = args.positional(0, concurrent_servers::DEFAULT_PORT);
+        const int backlog = args.positional_number(1, DEFAULT_BACKLOG);
+        const int worker_num = args.positional_number(2, concurrent_servers::DEFAULT_WORKER_PROCESS_NUMBER);
+        const auto engine = args.choice<MultiWorkerIoMultiplexingTCPServer::WorkerEngine>("engine", {
+                {"epoll", MultiWorkerIoMultiplexingTCPServer::WorkerEngine::EPOLL},
+                {"io_uring", MultiWorkerIoMultiplexingTCPServer::WorkerEngine::IO_URING},
+                {"acceptor", MultiWorkerIoMultiplexingTCPServer::WorkerEngine::ACCEPTOR}},
+                MultiWorkerIoMultiplexingTCPServer::WorkerEngine::EPOLL);
+        const bool reuse_port = args.choice<bool>("reuse-port", {{"yes", true}, {"no", false}}, true);
+        concurrent_servers::connection_timeouts timeouts{};
+        const long idle_s = args.number("idle-timeout", -1);
+        if (idle_s >= 0) {
+            timeouts.idle = std::chrono::seconds{idle_s};
+        }
+        const auto affinity = args.choice<concurrent_servers::worker_affinity>("placement", {
+                {"cpu", concurrent_servers::worker_affinity::CPU},
+                {"core", concurrent_servers::worker_affinity::CORE},
+                {"none", concurrent_servers::worker_affinity::NONE}},
+                concurrent_servers::worker_affinity::CPU);
+        const bool cpu_steering = args.flag("cpu-steering");
+        concurrent_servers::busy_poll_options busy_poll{};
+        busy_poll.spin = std::chrono::microseconds{args.number("busy-poll", 0)};
+        const auto acceptor_num = static_cast<int>(args.number("acceptors", 1));
+        const auto dispatch = args.choice<MultiWorkerIoMultiplexingTCPServer::Dispatch>("dispatch", {
+                {"least_loaded", MultiWorkerIoMultiplexingTCPServer::Dispatch::LEAST_LOADED},
+                {"round_robin", MultiWorkerIoMultiplexingTCPServer::Dispatch::ROUND_ROBIN}},
+                MultiWorkerIoMultiplexingTCPServer::Dispatch::LEAST_LOADED);
+        const auto zerocopy_threshold = static_cast<size_t>(args.number("zerocopy", 0));
+        const std::string metrics_port = args.text("metrics", "");
+        const std::string metrics_address = args.text("metrics-address", concurrent_servers::metrics_endpoint::DEFAULT_ADDRESS);
+        args.finish(3);
+
+        MultiWorkerIoMultiplexingTCPServer server{port_num, backlog, worker_num, reuse_port, engine, timeouts, affinity, cpu_steering,
+                                                  busy_poll, acceptor_num, dispatch, zerocopy_threshold};
+        server.setListenerOptions(listener);
+        if (not metrics_port.empty()) {
+            server.setMetricsPort(metrics_port, metrics_address);
+        }
+        server.start();
+    } catch (const concurrent_servers::usage_error &e) {
+        concurrent_servers::exit_with_usage(argv[0], SYNOPSIS, e);
+    }
+}
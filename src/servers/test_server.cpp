@@ -30,18 +30,62 @@
  */
 
 #include "multi_worker_reuseport_nonblocking_io_multiplexing_server.h"
+#include "frame_codec.h"
 #include "print_utility.h"
+#include "command_line.h"
 
-struct read_handler {
-    void operator()(const std::string &worker_process_id, char* buff, size_t buff_len) const {
-        concurrent_servers::log_info(worker_process_id, "  received: ", std::string{buff, buff_len});
+namespace {
+    constexpr const char *SYNOPSIS{"[port] [backlog] [worker processes] [--prefix=fixed32|varint] [--cpu-steering]\n"
+                                   "    [--busy-poll=US] [--upgrade=PATH] [--zerocopy=BYTES] [--stats=PORT] [--stats-address=ADDR]"};
+}
+
+/**
+ * Echoes every frame back as a frame.
+ */
+struct frame_handler {
+    void operator()(const std::string &worker_process_id, const char *payload, size_t payload_len, concurrent_servers::frame_writer &reply) const {
+        concurrent_servers::log_info(worker_process_id, "  received frame: ", std::string{payload, payload_len});
+        if (not reply.write(payload, payload_len)) {
+            concurrent_servers::log_warning(worker_process_id, "  out of output buffers, closing the connection");
+        }
     }
 };
+
 int main(int argc, char *argv[]) {
-    const std::string port_num = (argc >= 2) ? argv[1] : concurrent_servers::DEFAULT_PORT;
-    const int backlog = (argc >= 3) ? atoi(argv[2]) : DEFAULT_BACKLOG;
-    const int worker_process_num = (argc >= 4) ? atoi(argv[3]) : concurrent_servers::DEFAULT_WORKER_PROCESS_NUMBER;
-    const concurrent_servers::linux_concurrent_server<read_handler> server{worker_process_num, port_num, backlog};
+    const concurrent_servers::listener_options listener = concurrent_servers::listener_options::from_args(argc, argv);
+    concurrent_servers::command_line args{argc, argv};
+    try {
+        const std::string port_num = args.positional(0, concurrent_servers::DEFAULT_PORT);
+        const int backlog = args.positional_number(1, DEFAULT_BACKLOG);
+        const int worker_process_num = args.positional_number(2, concurrent_servers::DEFAULT_WORKER_PROCESS_NUMBER);
+        const concurrent_servers::frame_prefix prefix = args.choice<concurrent_servers::frame_prefix>("prefix", {
+                    {"fixed32", concurrent_servers::frame_prefix::FIXED32},
+                    {"varint", concurrent_servers::frame_prefix::VARINT}},
+                    concurrent_servers::frame_prefix::FIXED32);
+        const bool cpu_steering = args.flag("cpu-steering");
+        concurrent_servers::busy_poll_options busy_poll{};
+        busy_poll.spin = std::chrono::microseconds{args.number("busy-poll", 0)};
+        const std::string upgrade_path = args.text("upgrade", "");
+        const auto zerocopy_threshold = static_cast<size_t>(args.number("zerocopy", 0));
+        const std::string stats_port = args.text("stats", "");
+        const std::string stats_address = args.text("stats-address", concurrent_servers::metrics_endpoint::DEFAULT_ADDRESS);
+        args.finish(3);
 
-    server.start();
-}
\ No newline at end of file
+        concurrent_servers::linux_concurrent_server<concurrent_servers::framed_read_handler<frame_handler>> server{
+                worker_process_num, port_num, backlog, concurrent_servers::frame_codec{prefix}};
+        server.set_listener_options(listener);
+        server.set_cpu_steering(cpu_steering);
+        server.set_busy_poll(busy_poll);
+        if (not upgrade_path.empty()) {
+            server.set_upgrade_socket(upgrade_path);
+        }
+        server.set_zerocopy_threshold(zerocopy_threshold);
+        if (not stats_port.empty()) {
+            server.set_stats_port(stats_port, stats_address);
+        }
+
+        server.start();
+    } catch (const concurrent_servers::usage_error &e) {
+        concurrent_servers::exit_with_usage(argv[0], SYNOPSIS, e);
+    }
+}
@@ -0,0 +1,241 @@
+/*
+ * BSD 2-Clause License
+ *
+ * Copyright (c) 2019, Pham Phi Long <phamphilong2010@gmail.com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *   * Redistributions of source code must retain the above copyright notice,
+ *     this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *   * Neither the name of Redis nor the names of its contributors may be used
+ *     to endorse or promote products derived from this software without
+ *     specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+#ifndef LINUX_TCP_SERVERS_BUFFER_POOL_H
+#define LINUX_TCP_SERVERS_BUFFER_POOL_H
+
+#include <sys/mman.h>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <stdexcept>
+#include <thread>
+#include <vector>
+
+namespace concurrent_servers {
+    /**
+     * Per-worker pool of fixed-size buffers carved out of large arenas.
+     *
+     * Arenas are backed by explicit huge pages (MAP_HUGETLB) when the system has some reserved, otherwise
+     * they are aligned to the huge page size and advised for transparent huge pages, so a few TLB entries
+     * cover the buffers of thousands of connections.
+     *
+     * acquire() must be called from the thread owning the pool. release() may be called from any thread:
+     * chunks released by other threads go to a lock-free stack that the owner drains on its next acquire().
+     */
+    class buffer_pool {
+    public:
+        static constexpr size_t HUGE_PAGE_SIZE{2 * 1024 * 1024};
+
+        explicit buffer_pool(size_t chunk_size, size_t arena_size = HUGE_PAGE_SIZE, size_t max_arenas = 0) :
+                _chunk_size{(chunk_size + CACHE_LINE_SIZE - 1) / CACHE_LINE_SIZE * CACHE_LINE_SIZE},
+                _arena_size{(arena_size + HUGE_PAGE_SIZE - 1) / HUGE_PAGE_SIZE * HUGE_PAGE_SIZE},
+                _max_arenas{max_arenas},
+                _owner{std::this_thread::get_id()} {
+            if (_chunk_size == 0 or _chunk_size > _arena_size) {
+                throw std::runtime_error("buffer_pool: invalid chunk size");
+            }
+        }
+
+        buffer_pool(const buffer_pool &) = delete;
+        buffer_pool &operator=(const buffer_pool &) = delete;
+
+        ~buffer_pool() {
+            for (const arena &a : _arenas) {
+                munmap(a.base, a.size);
+            }
+        }
+
+        /**
+         * Returns a chunk of chunk_size() bytes, or nullptr if the pool reached max_arenas or the system is out of memory.
+         */
+        char *acquire() {
+            if (_free_list == nullptr) {
+                drain_remote();
+            }
+            if (_free_list == nullptr and not grow()) {
+                return nullptr;
+            }
+
+            free_chunk *chunk = _free_list;
+            _free_list = chunk->next;
+            --_free_count;
+            ++_in_use;
+
+            if (_in_use > _high_watermark) {
+                _high_watermark = _in_use;
+            }
+            if (_free_count < _low_watermark) {
+                _low_watermark = _free_count;
+            }
+            return reinterpret_cast<char *>(chunk);
+        }
+
+        void release(char *buffer) {
+            if (buffer == nullptr) {
+                return;
+            }
+
+            auto *chunk = reinterpret_cast<free_chunk *>(buffer);
+            if (std::this_thread::get_id() == _owner) {
+                push_local(chunk);
+                return;
+            }
+
+            chunk->next = _remote_free.load(std::memory_order_relaxed);
+            while (not _remote_free.compare_exchange_weak(chunk->next, chunk, std::memory_order_release, std::memory_order_relaxed)) {}
+        }
+
+        size_t chunk_size() const {
+            return _chunk_size;
+        }
+
+        size_t in_use() const {
+            return _in_use;
+        }
+
+        size_t free_count() const {
+            return _free_count;
+        }
+
+        size_t arena_count() const {
+            return _arenas.size();
+        }
+
+        bool huge_pages() const {
+            return _huge_pages;
+        }
+
+        /**
+         * Highest number of chunks in use at the same time since the last reset_watermarks().
+         */
+        size_t high_watermark() const {
+            return _high_watermark;
+        }
+
+        /**
+         * Lowest number of free chunks left in the pool since the last reset_watermarks().
+         */
+        size_t low_watermark() const {
+            return _low_watermark;
+        }
+
+        void reset_watermarks() {
+            _high_watermark = _in_use;
+            _low_watermark = _free_count;
+        }
+
+    private:
+        static constexpr size_t CACHE_LINE_SIZE{64};
+
+        struct free_chunk {
+            free_chunk *next;
+        };
+
+        struct arena {
+            void *base;
+            size_t size;
+        };
+
+        const size_t _chunk_size;
+        const size_t _arena_size;
+        const size_t _max_arenas;
+        const std::thread::id _owner;
+        std::vector<arena> _arenas{};
+        free_chunk *_free_list{nullptr};
+        std::atomic<free_chunk *> _remote_free{nullptr};
+        size_t _free_count{0};
+        size_t _in_use{0};
+        size_t _high_watermark{0};
+        size_t _low_watermark{SIZE_MAX};
+        bool _huge_pages{false};
+
+        void push_local(free_chunk *chunk) {
+            chunk->next = _free_list;
+            _free_list = chunk;
+            ++_free_count;
+            --_in_use;
+        }
+
+        void drain_remote() {
+            free_chunk *chunk = _remote_free.exchange(nullptr, std::memory_order_acquire);
+            while (chunk != nullptr) {
+                free_chunk *next = chunk->next;
+                push_local(chunk);
+                chunk = next;
+            }
+        }
+
+        bool grow() {
+            if (_max_arenas != 0 and _arenas.size() >= _max_arenas) {
+                return false;
+            }
+
+            void *base = mmap(nullptr, _arena_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+            size_t mapped_size = _arena_size;
+            if (base != MAP_FAILED) {
+                _huge_pages = true;
+            } else {
+                // no reserved huge pages, map a huge page aligned region and let THP back it
+                mapped_size = _arena_size + HUGE_PAGE_SIZE;
+                base = mmap(nullptr, mapped_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+                if (base == MAP_FAILED) {
+                    return false;
+                }
+
+                const auto addr = reinterpret_cast<uintptr_t>(base);
+                const uintptr_t aligned = (addr + HUGE_PAGE_SIZE - 1) & ~(HUGE_PAGE_SIZE - 1);
+                if (aligned > addr) {
+                    munmap(base, aligned - addr);
+                }
+                munmap(reinterpret_cast<void *>(aligned + _arena_size), addr + mapped_size - aligned - _arena_size);
+                base = reinterpret_cast<void *>(aligned);
+                mapped_size = _arena_size;
+                madvise(base, mapped_size, MADV_HUGEPAGE);
+            }
+            _arenas.push_back({base, mapped_size});
+
+            // thread the new chunks onto the free list, lowest address first
+            char *begin = static_cast<char *>(base);
+            const size_t chunk_num = _arena_size / _chunk_size;
+            for (size_t i = chunk_num; i > 0; --i) {
+                auto *chunk = reinterpret_cast<free_chunk *>(begin + (i - 1) * _chunk_size);
+                chunk->next = _free_list;
+                _free_list = chunk;
+            }
+            _free_count += chunk_num;
+            return true;
+        }
+    };
+}
+
+#endif /* LINUX_TCP_SERVERS_BUFFER_POOL_H */
@@ -0,0 +1,168 @@
+/*
+ * BSD 2-Clause License
+ *
+ * Copyright (c) 2019, Pham Phi Long <phamphilong2010@gmail.com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *   * Redistributions of source code must retain the above copyright notice,
+ *     this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *   * Neither the name of Redis nor the names of its contributors may be used
+ *     to endorse or promote products derived from this software without
+ *     specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+#ifndef LINUX_TCP_SERVERS_BUSY_POLL_H
+#define LINUX_TCP_SERVERS_BUSY_POLL_H
+
+#include <time.h>
+#include <sys/socket.h>
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <string>
+
+#include "print_utility.h"
+
+namespace concurrent_servers {
+    /**
+     * Busy polling trades CPU time for latency: a worker keeps polling without blocking for a while before it
+     * goes to sleep, so a request arriving meanwhile is served without a wakeup of the scheduler.
+     */
+    struct busy_poll_options {
+        std::chrono::microseconds spin{0}; // how long a worker polls before blocking, 0 disables busy polling
+        int socket_busy_poll_us{50};       // SO_BUSY_POLL of the sockets, how long a read finding no data polls the NIC queue
+        bool prefer_busy_poll{true};       // SO_PREFER_BUSY_POLL, NIC interrupts stay masked while the application polls
+
+        bool enabled() const {
+            return spin.count() > 0;
+        }
+    };
+
+    /**
+     * Applies the socket options of busy polling. Returns false if the kernel refused one of them, e.g. raising
+     * SO_BUSY_POLL above net.core.busy_read requires CAP_NET_ADMIN and SO_PREFER_BUSY_POLL Linux 5.11.
+     */
+    inline bool set_socket_busy_poll(int sfd, const busy_poll_options &options) {
+        bool applied{true};
+        if (options.socket_busy_poll_us > 0) {
+            applied = setsockopt(sfd, SOL_SOCKET, SO_BUSY_POLL, &options.socket_busy_poll_us, sizeof(options.socket_busy_poll_us)) == 0;
+        }
+#ifdef SO_PREFER_BUSY_POLL
+        if (options.prefer_busy_poll) {
+            const int one{1};
+            applied = setsockopt(sfd, SOL_SOCKET, SO_PREFER_BUSY_POLL, &one, sizeof(one)) == 0 and applied;
+        }
+#endif
+        return applied;
+    }
+
+    /**
+     * Waits for events by polling without blocking for the spin budget first, then blocking. Counts the wakeups
+     * and how many of them were served while spinning, and logs that share every REPORT_INTERVAL.
+     */
+    class busy_poller {
+    public:
+        static constexpr std::chrono::seconds REPORT_INTERVAL{10};
+
+        busy_poller(const busy_poll_options &options, std::string prefix_log) :
+                _spin_ns{static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::nanoseconds>(options.spin).count())},
+                _prefix_log{std::move(prefix_log)},
+                _next_report_ns{now_ns() + REPORT_NS} {
+        }
+
+        /**
+         * poll(timeout_ms) waits like epoll_wait() and returns the number of events, 0 on timeout or -1 on
+         * error. The spin stops early when timeout_ms, -1 for none, expires, and the blocking call only waits
+         * for what is left of it.
+         */
+        template <typename Poll>
+        int wait(int timeout_ms, Poll &&poll) {
+            if (_spin_ns == 0 or timeout_ms == 0) {
+                return poll(timeout_ms);
+            }
+
+            const uint64_t start = now_ns();
+            const uint64_t limit = timeout_ms < 0 ? _spin_ns : std::min(_spin_ns, static_cast<uint64_t>(timeout_ms) * 1000000);
+            uint64_t now = start;
+            do {
+                const int events = poll(0);
+                if (events != 0) {
+                    if (events > 0) {
+                        ++_wakeups;
+                        ++_spin_wakeups;
+                        report(now);
+                    }
+                    return events;
+                }
+                now = now_ns();
+            } while (now - start < limit);
+
+            report(now);
+            int remaining_ms{-1};
+            if (timeout_ms >= 0) {
+                remaining_ms = std::max(0, timeout_ms - static_cast<int>((now - start) / 1000000));
+            }
+            const int events = poll(remaining_ms);
+            if (events > 0) {
+                ++_wakeups;
+            }
+            return events;
+        }
+
+        uint64_t wakeups() const {
+            return _wakeups;
+        }
+
+        uint64_t spin_wakeups() const {
+            return _spin_wakeups;
+        }
+
+    private:
+        static constexpr uint64_t REPORT_NS{std::chrono::duration_cast<std::chrono::nanoseconds>(REPORT_INTERVAL).count()};
+
+        const uint64_t _spin_ns;
+        const std::string _prefix_log;
+        uint64_t _next_report_ns;
+        uint64_t _wakeups{0};
+        uint64_t _spin_wakeups{0};
+
+        static uint64_t now_ns() {
+            struct timespec now{};
+            clock_gettime(CLOCK_MONOTONIC, &now);
+            return static_cast<uint64_t>(now.tv_sec) * 1000000000 + static_cast<uint64_t>(now.tv_nsec);
+        }
+
+        void report(uint64_t now) {
+            if (now < _next_report_ns) {
+                return;
+            }
+            _next_report_ns = now + REPORT_NS;
+            if (_wakeups > 0) {
+                log_info(_prefix_log, "busy poll: ", _spin_wakeups * 100 / _wakeups, "% of ", _wakeups, " wakeups served while spinning");
+            }
+            _wakeups = 0;
+            _spin_wakeups = 0;
+        }
+    };
+}
+
+#endif /* LINUX_TCP_SERVERS_BUSY_POLL_H */
@@ -0,0 +1,193 @@
+/*
+ * BSD 2-Clause License
+ *
+ * Copyright (c) 2019, Pham Phi Long <phamphilong2010@gmail.com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *   * Redistributions of source code must retain the above copyright notice,
+ *     this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *   * Neither the name of Redis nor the names of its contributors may be used
+ *     to endorse or promote products derived from this software without
+ *     specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+#ifndef LINUX_TCP_SERVERS_COMMAND_LINE_H
+#define LINUX_TCP_SERVERS_COMMAND_LINE_H
+
+#include <cerrno>
+#include <cstdlib>
+#include <cstring>
+#include <initializer_list>
+#include <iostream>
+#include <stdexcept>
+#include <string>
+#include <utility>
+#include <vector>
+
+namespace concurrent_servers {
+    /**
+     * A command line that cannot be honoured: an unknown option, a value that does not parse or is not one of
+     * the accepted ones.
+     */
+    struct usage_error : std::runtime_error {
+        using std::runtime_error::runtime_error;
+    };
+
+    /**
+     * Command line of a server binary: positional arguments, then --name=value options and --name switches in
+     * any order. Every getter takes its option, finish() rejects whatever no getter took, so a typo or an
+     * unknown value is reported instead of silently falling back to the default. Parse the listener_options
+     * flags first, see listener_options::from_args().
+     */
+    class command_line {
+    public:
+        command_line(int argc, char *argv[]) :
+                _positional{},
+                _options{} {
+            for (int i{1}; i < argc; ++i) {
+                const std::string arg{argv[i]};
+                if (arg.compare(0, 2, "--") != 0) {
+                    _positional.push_back(arg);
+                    continue;
+                }
+                const size_t equal = arg.find('=');
+                option o{};
+                o.name = arg.substr(2, equal == std::string::npos ? std::string::npos : equal - 2);
+                o.has_value = equal != std::string::npos;
+                o.value = o.has_value ? arg.substr(equal + 1) : std::string{};
+                _options.push_back(std::move(o));
+            }
+        }
+
+        std::string positional(size_t i, const std::string &fallback) const {
+            return i < _positional.size() ? _positional[i] : fallback;
+        }
+
+        int positional_number(size_t i, int fallback) const {
+            return i < _positional.size() ? static_cast<int>(to_number("argument " + std::to_string(i + 1), _positional[i])) : fallback;
+        }
+
+        /**
+         * --name=VALUE, the last one if given more than once.
+         */
+        std::string text(const char *name, const std::string &fallback) {
+            const option *o = take(name, true);
+            return o != nullptr ? o->value : fallback;
+        }
+
+        /**
+         * --name=N, a non-negative integer.
+         */
+        long number(const char *name, long fallback) {
+            const option *o = take(name, true);
+            return o != nullptr ? to_number(std::string{"--"} + name, o->value) : fallback;
+        }
+
+        /**
+         * --name, a switch without value.
+         */
+        bool flag(const char *name) {
+            return take(name, false) != nullptr;
+        }
+
+        /**
+         * --name=VALUE, VALUE being one of the names of values.
+         */
+        template <typename T>
+        T choice(const char *name, std::initializer_list<std::pair<const char *, T>> values, T fallback) {
+            const option *o = take(name, true);
+            if (o == nullptr) {
+                return fallback;
+            }
+            std::string accepted{};
+            for (const auto &value : values) {
+                if (o->value == value.first) {
+                    return value.second;
+                }
+                accepted += accepted.empty() ? value.first : std::string{", "} + value.first;
+            }
+            throw usage_error{"--" + std::string{name} + "=" + o->value + ": expected one of " + accepted};
+        }
+
+        /**
+         * Throws for an option no getter took and for more than max_positional positional arguments.
+         */
+        void finish(size_t max_positional) const {
+            for (const option &o : _options) {
+                if (not o.taken) {
+                    throw usage_error{"unknown option --" + o.name};
+                }
+            }
+            if (_positional.size() > max_positional) {
+                throw usage_error{"unexpected argument " + _positional[max_positional]};
+            }
+        }
+
+    private:
+        struct option {
+            std::string name{};
+            std::string value{};
+            bool has_value{false};
+            bool taken{false};
+        };
+
+        std::vector<std::string> _positional;
+        std::vector<option> _options;
+
+        const option *take(const char *name, bool with_value) {
+            const option *found{nullptr};
+            for (option &o : _options) {
+                if (o.name != name) {
+                    continue;
+                }
+                if (o.has_value != with_value) {
+                    throw usage_error{"--" + o.name + (with_value ? " takes a value" : " takes no value")};
+                }
+                o.taken = true;
+                found = &o;
+            }
+            return found;
+        }
+
+        static long to_number(const std::string &name, const std::string &value) {
+            errno = 0;
+            char *end{nullptr};
+            const long number = strtol(value.c_str(), &end, 10);
+            if (value.empty() or *end != '\0' or errno != 0 or number < 0) {
+                throw usage_error{name + ": " + value + " is not a number"};
+            }
+            return number;
+        }
+    };
+
+    /**
+     * Reports a usage_error with the synopsis of the binary and exits.
+     */
+    [[noreturn]] inline void exit_with_usage(const char *program, const char *synopsis, const usage_error &e) {
+        std::cerr << "ERROR, " << e.what() << "\n"
+                  << "Usage: " << program << " " << synopsis << "\n"
+                  << "  listener flags: --defer-accept=S --fastopen=N --rcvbuf=B --sndbuf=B --nodelay --quickack" << std::endl;
+        exit(EXIT_FAILURE);
+    }
+}
+
+#endif /* LINUX_TCP_SERVERS_COMMAND_LINE_H */
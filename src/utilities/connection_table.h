@@ -0,0 +1,190 @@
+/*
+ * BSD 2-Clause License
+ *
+ * Copyright (c) 2019, Pham Phi Long <phamphilong2010@gmail.com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *   * Redistributions of source code must retain the above copyright notice,
+ *     this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *   * Neither the name of Redis nor the names of its contributors may be used
+ *     to endorse or promote products derived from this software without
+ *     specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+#ifndef LINUX_TCP_SERVERS_CONNECTION_TABLE_H
+#define LINUX_TCP_SERVERS_CONNECTION_TABLE_H
+
+#include <sys/resource.h>
+#include <atomic>
+#include <cstdint>
+#include <memory>
+
+namespace concurrent_servers {
+    /**
+     * Table of connection data indexed directly by file descriptor.
+     *
+     * Every slot carries a generation counter: it is odd while the slot holds a live connection and even
+     * when it is free. A handle packs the generation and the fd together, so a handle that outlives its
+     * connection (e.g. a stale epoll_event.data.u64 delivered after the fd was closed and reused) no longer
+     * matches the slot and get() returns nullptr.
+     *
+     * Slots are allocated CHUNK_SIZE at a time, by the first insert of an fd in their range, and kept until the
+     * table goes away: a table sized for a million fds only costs memory for the fds actually used.
+     * Lookups, inserts and removals are lock-free and only that first insert allocates. The kernel never hands out
+     * the same fd to two live connections, so only one thread inserts into a given slot at a time.
+     * Data must be default constructible and provide reset(int conn_fd), called before the slot is published.
+     */
+    template <typename Data>
+    class connection_table {
+    public:
+        using handle = uint64_t;
+        static constexpr handle INVALID_HANDLE{0};
+        static constexpr size_t CHUNK_SIZE{256};
+
+        explicit connection_table(size_t capacity = default_capacity()) :
+                _capacity{capacity},
+                _chunks{new std::atomic<slot *>[(capacity + CHUNK_SIZE - 1) / CHUNK_SIZE]{}} {
+
+        }
+
+        ~connection_table() {
+            for (size_t i = 0; i < (_capacity + CHUNK_SIZE - 1) / CHUNK_SIZE; ++i) {
+                delete[] _chunks[i].load(std::memory_order_relaxed);
+            }
+        }
+
+        connection_table(const connection_table &) = delete;
+        connection_table &operator=(const connection_table &) = delete;
+
+        /**
+         * One slot per fd the process is allowed to open. Untouched chunks cost a pointer each.
+         */
+        static size_t default_capacity() {
+            struct rlimit limit{};
+            if (getrlimit(RLIMIT_NOFILE, &limit) != 0 or limit.rlim_cur == RLIM_INFINITY) {
+                return DEFAULT_NR_OPEN;
+            }
+            return static_cast<size_t>(limit.rlim_cur);
+        }
+
+        size_t capacity() const {
+            return _capacity;
+        }
+
+        /**
+         * Returns the handle of the new connection, or INVALID_HANDLE if fd does not fit in the table
+         * or its slot is still in use.
+         */
+        handle insert(int fd) {
+            if (fd < 0 or static_cast<size_t>(fd) >= _capacity) {
+                return INVALID_HANDLE;
+            }
+
+            slot &s = chunk_of(fd)[fd % CHUNK_SIZE];
+            const uint32_t generation = s.generation.load(std::memory_order_relaxed);
+            if (generation & 1u) {
+                return INVALID_HANDLE;
+            }
+
+            s.data.reset(fd);
+            s.generation.store(generation + 1, std::memory_order_release);
+            return make_handle(fd, generation + 1);
+        }
+
+        /**
+         * Returns nullptr for INVALID_HANDLE and stale handles. A free slot at fd 0 still carries generation 0,
+         * the generation INVALID_HANDLE packs.
+         */
+        Data *get(handle h) {
+            slot *s = find(h);
+            if (h == INVALID_HANDLE or s == nullptr) {
+                return nullptr;
+            }
+            return s->generation.load(std::memory_order_acquire) == static_cast<uint32_t>(h >> 32) ? &s->data : nullptr;
+        }
+
+        /**
+         * Frees the slot. Returns false if the handle was already stale.
+         */
+        bool remove(handle h) {
+            slot *s = find(h);
+            if (s == nullptr) {
+                return false;
+            }
+
+            auto generation = static_cast<uint32_t>(h >> 32);
+            return s->generation.compare_exchange_strong(generation, generation + 1, std::memory_order_acq_rel);
+        }
+
+        static int fd_of(handle h) {
+            return static_cast<int>(static_cast<uint32_t>(h));
+        }
+
+    private:
+        static constexpr size_t DEFAULT_NR_OPEN{1u << 20}; // fs.nr_open, the kernel's own bound on RLIMIT_NOFILE
+
+        // one slot per cache line, neighbouring fds are usually served by different workers
+        struct alignas(64) slot {
+            std::atomic<uint32_t> generation{0};
+            Data data{};
+        };
+
+        const size_t _capacity;
+        std::unique_ptr<std::atomic<slot *>[]> _chunks;
+
+        static handle make_handle(int fd, uint32_t generation) {
+            return (static_cast<uint64_t>(generation) << 32) | static_cast<uint32_t>(fd);
+        }
+
+        /**
+         * Slot of a handle, nullptr if its fd is out of range or its chunk was never allocated.
+         */
+        slot *find(handle h) {
+            const auto fd = static_cast<uint32_t>(h);
+            if (fd >= _capacity) {
+                return nullptr;
+            }
+            slot *chunk = _chunks[fd / CHUNK_SIZE].load(std::memory_order_acquire);
+            return chunk != nullptr ? &chunk[fd % CHUNK_SIZE] : nullptr;
+        }
+
+        /**
+         * Allocates the chunk of fd on first use. Two threads inserting fds of the same chunk race to publish
+         * theirs, the loser frees its own and takes the winner's.
+         */
+        slot *chunk_of(int fd) {
+            std::atomic<slot *> &entry = _chunks[static_cast<size_t>(fd) / CHUNK_SIZE];
+            slot *chunk = entry.load(std::memory_order_acquire);
+            if (chunk != nullptr) {
+                return chunk;
+            }
+
+            auto fresh = std::make_unique<slot[]>(CHUNK_SIZE);
+            if (entry.compare_exchange_strong(chunk, fresh.get(), std::memory_order_acq_rel)) {
+                return fresh.release();
+            }
+            return chunk;
+        }
+    };
+}
+
+#endif /* LINUX_TCP_SERVERS_CONNECTION_TABLE_H */
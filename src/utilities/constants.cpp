@@ -33,5 +33,5 @@
 
 namespace concurrent_servers {
     const char *DEFAULT_PORT{"1606"};
-    const int DEFAULT_WORKER_PROCESS_NUMBER{16};
+    const int DEFAULT_WORKER_PROCESS_NUMBER{0}; // one worker per CPU, see cpu_topology::worker_count()
 }
\ No newline at end of file
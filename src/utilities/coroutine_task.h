@@ -0,0 +1,270 @@
+/*
+ * BSD 2-Clause License
+ *
+ * Copyright (c) 2019, Pham Phi Long <phamphilong2010@gmail.com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *   * Redistributions of source code must retain the above copyright notice,
+ *     this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *   * Neither the name of Redis nor the names of its contributors may be used
+ *     to endorse or promote products derived from this software without
+ *     specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+#ifndef LINUX_TCP_SERVERS_COROUTINE_TASK_H
+#define LINUX_TCP_SERVERS_COROUTINE_TASK_H
+
+#if __cplusplus < 202002L
+#error "coroutine_task.h requires C++20"
+#endif
+
+#include <array>
+#include <coroutine>
+#include <cstddef>
+#include <exception>
+#include <new>
+#include <optional>
+#include <utility>
+
+namespace concurrent_servers {
+    /**
+     * Allocator of coroutine frames. Frames up to MAX_POOLED_SIZE bytes are rounded up to GRANULARITY and recycled
+     * through per-thread free lists, so the frame of a connection handler and of the tasks it awaits costs no
+     * malloc() once the worker is warm. A frame must be freed by the thread that allocated it, which holds for
+     * coroutines resumed by a single event loop.
+     */
+    class coroutine_frame_pool {
+    public:
+        static constexpr size_t GRANULARITY{64};
+        static constexpr size_t MAX_POOLED_SIZE{4096};
+
+        static void *allocate(size_t size) {
+            if (size > MAX_POOLED_SIZE) {
+                return ::operator new(size);
+            }
+            free_frame *&head = _free_lists[size_class(size)];
+            if (head != nullptr) {
+                free_frame *frame = head;
+                head = frame->next;
+                return frame;
+            }
+            return ::operator new((size_class(size) + 1) * GRANULARITY);
+        }
+
+        static void deallocate(void *ptr, size_t size) {
+            if (size > MAX_POOLED_SIZE) {
+                ::operator delete(ptr);
+                return;
+            }
+            auto *frame = static_cast<free_frame *>(ptr);
+            free_frame *&head = _free_lists[size_class(size)];
+            frame->next = head;
+            head = frame;
+        }
+
+    private:
+        struct free_frame {
+            free_frame *next;
+        };
+
+        static constexpr size_t SIZE_CLASSES{MAX_POOLED_SIZE / GRANULARITY};
+
+        static size_t size_class(size_t size) {
+            return size == 0 ? 0 : (size - 1) / GRANULARITY;
+        }
+
+        // frames stay cached until the thread exits, a worker reuses them for its next connections
+        static inline thread_local std::array<free_frame *, SIZE_CLASSES> _free_lists{};
+    };
+
+    template <typename T = void>
+    class task;
+
+    namespace detail {
+        /**
+         * A task starts when it is awaited, or when the event loop resumes it for the first time, and resumes its
+         * awaiter when it finishes, by symmetric transfer so that chains of tasks do not grow the stack.
+         */
+        struct task_promise_base {
+            std::coroutine_handle<> continuation{};
+            std::exception_ptr exception{};
+
+            struct final_awaiter {
+                bool await_ready() const noexcept {
+                    return false;
+                }
+
+                template <typename Promise>
+                std::coroutine_handle<> await_suspend(std::coroutine_handle<Promise> handle) const noexcept {
+                    const std::coroutine_handle<> continuation = handle.promise().continuation;
+                    return continuation ? continuation : std::noop_coroutine();
+                }
+
+                void await_resume() const noexcept {
+                }
+            };
+
+            std::suspend_always initial_suspend() const noexcept {
+                return {};
+            }
+
+            final_awaiter final_suspend() const noexcept {
+                return {};
+            }
+
+            void unhandled_exception() noexcept {
+                exception = std::current_exception();
+            }
+
+            static void *operator new(size_t size) {
+                return coroutine_frame_pool::allocate(size);
+            }
+
+            static void operator delete(void *ptr, size_t size) {
+                coroutine_frame_pool::deallocate(ptr, size);
+            }
+        };
+
+        template <typename T>
+        struct task_promise : task_promise_base {
+            std::optional<T> value{};
+
+            task<T> get_return_object() noexcept;
+
+            template <typename Value>
+            void return_value(Value &&result) {
+                value.emplace(std::forward<Value>(result));
+            }
+
+            T result() {
+                if (exception) {
+                    std::rethrow_exception(exception);
+                }
+                return std::move(*value);
+            }
+        };
+
+        template <>
+        struct task_promise<void> : task_promise_base {
+            task<void> get_return_object() noexcept;
+
+            void return_void() const noexcept {
+            }
+
+            void result() const {
+                if (exception) {
+                    std::rethrow_exception(exception);
+                }
+            }
+        };
+    }
+
+    /**
+     * Lazily started coroutine returning T, owned by the task object, e.g. a connection handler:
+     * concurrent_servers::task<> operator()(concurrent_servers::coroutine_connection &conn) const
+     * Awaiting a task runs it and yields its result, or rethrows the exception it ended with.
+     */
+    template <typename T>
+    class task {
+    public:
+        using promise_type = detail::task_promise<T>;
+
+        task() = default;
+
+        explicit task(std::coroutine_handle<promise_type> handle) :
+                _handle{handle} {
+        }
+
+        task(task &&other) noexcept :
+                _handle{std::exchange(other._handle, {})} {
+        }
+
+        task &operator=(task &&other) noexcept {
+            if (this != &other) {
+                destroy();
+                _handle = std::exchange(other._handle, {});
+            }
+            return *this;
+        }
+
+        task(const task &) = delete;
+        task &operator=(const task &) = delete;
+
+        ~task() {
+            destroy();
+        }
+
+        auto operator co_await() && noexcept {
+            struct awaiter {
+                std::coroutine_handle<promise_type> handle;
+
+                bool await_ready() const noexcept {
+                    return not handle or handle.done();
+                }
+
+                std::coroutine_handle<> await_suspend(std::coroutine_handle<> awaiting) const noexcept {
+                    handle.promise().continuation = awaiting;
+                    return handle;
+                }
+
+                T await_resume() const {
+                    return handle.promise().result();
+                }
+            };
+            return awaiter{_handle};
+        }
+
+        /**
+         * For the event loop driving a top level task.
+         */
+        std::coroutine_handle<promise_type> handle() const {
+            return _handle;
+        }
+
+        bool done() const {
+            return not _handle or _handle.done();
+        }
+
+    private:
+        std::coroutine_handle<promise_type> _handle{};
+
+        void destroy() {
+            if (_handle) {
+                _handle.destroy();
+                _handle = {};
+            }
+        }
+    };
+
+    namespace detail {
+        template <typename T>
+        task<T> task_promise<T>::get_return_object() noexcept {
+            return task<T>{std::coroutine_handle<task_promise<T>>::from_promise(*this)};
+        }
+
+        inline task<void> task_promise<void>::get_return_object() noexcept {
+            return task<void>{std::coroutine_handle<task_promise<void>>::from_promise(*this)};
+        }
+    }
+}
+
+#endif /* LINUX_TCP_SERVERS_COROUTINE_TASK_H */
@@ -0,0 +1,244 @@
+/*
+ * BSD 2-Clause License
+ *
+ * Copyright (c) 2019, Pham Phi Long <phamphilong2010@gmail.com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *   * Redistributions of source code must retain the above copyright notice,
+ *     this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *   * Neither the name of Redis nor the names of its contributors may be used
+ *     to endorse or promote products derived from this software without
+ *     specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+#ifndef LINUX_TCP_SERVERS_CPU_TOPOLOGY_H
+#define LINUX_TCP_SERVERS_CPU_TOPOLOGY_H
+
+#include <sched.h>
+#include <dirent.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+#include <linux/mempolicy.h>
+#include <algorithm>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <string>
+#include <tuple>
+#include <vector>
+
+namespace concurrent_servers {
+    /**
+     * How workers are pinned to CPUs.
+     */
+    enum class worker_affinity {
+        NONE, // the scheduler places and migrates workers
+        CPU,  // one worker per allowed CPU, the first hyperthread of every core before any sibling
+        CORE  // one worker per physical core, hyperthread siblings are left to the rest of the system
+    };
+
+    struct cpu_info {
+        int cpu;
+        int core;    // core id within the package
+        int package;
+        int node;    // NUMA node
+        int thread;  // rank among the hyperthreads of its core, 0 for the first one
+    };
+
+    /**
+     * The CPUs this process may run on, from sched_getaffinity(), with their core, package and NUMA node read from
+     * /sys/devices/system/cpu. Missing sysfs entries count as a core of its own on node 0.
+     *
+     * Worker i is placed on worker_cpus()[i % size], which interleaves the NUMA nodes so that a few workers already
+     * spread over every memory controller.
+     */
+    class cpu_topology {
+    public:
+        explicit cpu_topology(std::vector<cpu_info> cpus) :
+                _cpus{std::move(cpus)},
+                _node_count{0} {
+            std::vector<int> nodes{};
+            for (const cpu_info &info : _cpus) {
+                nodes.push_back(info.node);
+            }
+            std::sort(nodes.begin(), nodes.end());
+            _node_count = static_cast<size_t>(std::unique(nodes.begin(), nodes.end()) - nodes.begin());
+        }
+
+        static cpu_topology detect() {
+            cpu_set_t allowed;
+            CPU_ZERO(&allowed);
+            if (sched_getaffinity(0, sizeof(allowed), &allowed) != 0) {
+                const long online = sysconf(_SC_NPROCESSORS_ONLN);
+                for (long cpu{0}; cpu < online and cpu < CPU_SETSIZE; ++cpu) {
+                    CPU_SET(cpu, &allowed);
+                }
+            }
+
+            std::vector<cpu_info> cpus{};
+            for (int cpu{0}; cpu < CPU_SETSIZE; ++cpu) {
+                if (not CPU_ISSET(cpu, &allowed)) {
+                    continue;
+                }
+                const std::string dir{"/sys/devices/system/cpu/cpu" + std::to_string(cpu)};
+                cpus.push_back({cpu, read_int(dir + "/topology/core_id", cpu), read_int(dir + "/topology/physical_package_id", 0),
+                                node_of(dir), 0});
+            }
+
+            // rank the hyperthreads of every core
+            std::sort(cpus.begin(), cpus.end(), [](const cpu_info &a, const cpu_info &b) {
+                return std::tie(a.package, a.core, a.cpu) < std::tie(b.package, b.core, b.cpu);
+            });
+            for (size_t i{1}; i < cpus.size(); ++i) {
+                if (cpus[i].package == cpus[i - 1].package and cpus[i].core == cpus[i - 1].core) {
+                    cpus[i].thread = cpus[i - 1].thread + 1;
+                }
+            }
+            std::sort(cpus.begin(), cpus.end(), [](const cpu_info &a, const cpu_info &b) {
+                return a.cpu < b.cpu;
+            });
+            return cpu_topology{std::move(cpus)};
+        }
+
+        const std::vector<cpu_info> &cpus() const {
+            return _cpus;
+        }
+
+        size_t node_count() const {
+            return _node_count;
+        }
+
+        /**
+         * The CPUs workers are pinned to in order: first hyperthreads before siblings, round robin over the NUMA
+         * nodes. Empty with worker_affinity::NONE.
+         */
+        std::vector<cpu_info> worker_cpus(worker_affinity affinity) const {
+            std::vector<cpu_info> placement{};
+            if (affinity == worker_affinity::NONE) {
+                return placement;
+            }
+            for (const cpu_info &info : _cpus) {
+                if (affinity == worker_affinity::CPU or info.thread == 0) {
+                    placement.push_back(info);
+                }
+            }
+
+            // position of every CPU among those of the same node and hyperthread rank
+            std::sort(placement.begin(), placement.end(), [](const cpu_info &a, const cpu_info &b) {
+                return std::tie(a.thread, a.node, a.package, a.core, a.cpu) < std::tie(b.thread, b.node, b.package, b.core, b.cpu);
+            });
+            std::vector<std::pair<size_t, cpu_info>> ranked{};
+            for (size_t i{0}; i < placement.size(); ++i) {
+                const bool same_group = i > 0 and placement[i].thread == placement[i - 1].thread and placement[i].node == placement[i - 1].node;
+                ranked.emplace_back(same_group ? ranked.back().first + 1 : 0, placement[i]);
+            }
+            std::stable_sort(ranked.begin(), ranked.end(), [](const auto &a, const auto &b) {
+                return std::tie(a.second.thread, a.first, a.second.node) < std::tie(b.second.thread, b.first, b.second.node);
+            });
+
+            for (size_t i{0}; i < ranked.size(); ++i) {
+                placement[i] = ranked[i].second;
+            }
+            return placement;
+        }
+
+        /**
+         * Number of workers when none is configured: one per CPU of the placement, one per allowed CPU without
+         * pinning.
+         */
+        int worker_count(worker_affinity affinity) const {
+            const size_t count = affinity == worker_affinity::NONE ? _cpus.size() : worker_cpus(affinity).size();
+            return count > 0 ? static_cast<int>(count) : 1;
+        }
+
+        /**
+         * The CPU of worker worker_id, -1 if it is not pinned.
+         */
+        int worker_cpu(int worker_id, worker_affinity affinity) const {
+            const std::vector<cpu_info> placement = worker_cpus(affinity);
+            return placement.empty() ? -1 : placement[static_cast<size_t>(worker_id) % placement.size()].cpu;
+        }
+
+        /**
+         * Pins the calling thread, or process, to the CPU of worker worker_id and, when there are several NUMA
+         * nodes, makes it allocate its memory on the node of that CPU. Call it before the worker allocates its
+         * buffers and connection state. Returns the CPU, or -1 if the worker is not pinned.
+         */
+        int place_worker(int worker_id, worker_affinity affinity) const {
+            const std::vector<cpu_info> placement = worker_cpus(affinity);
+            if (placement.empty()) {
+                return -1;
+            }
+
+            const cpu_info &info = placement[static_cast<size_t>(worker_id) % placement.size()];
+            cpu_set_t cpu_set;
+            CPU_ZERO(&cpu_set);
+            CPU_SET(info.cpu, &cpu_set);
+            if (sched_setaffinity(0, sizeof(cpu_set), &cpu_set) != 0) {
+                return -1;
+            }
+
+            if (_node_count > 1) {
+                // preferred rather than bound, allocations fall back to other nodes once the local one is full
+                constexpr size_t BITS{8 * sizeof(unsigned long)};
+                std::vector<unsigned long> node_mask(static_cast<size_t>(info.node) / BITS + 1, 0);
+                node_mask[static_cast<size_t>(info.node) / BITS] |= 1ul << (static_cast<size_t>(info.node) % BITS);
+                syscall(SYS_set_mempolicy, MPOL_PREFERRED, node_mask.data(), node_mask.size() * BITS + 1);
+            }
+            return info.cpu;
+        }
+
+    private:
+        std::vector<cpu_info> _cpus;
+        size_t _node_count;
+
+        static int read_int(const std::string &path, int fallback) {
+            std::ifstream file{path};
+            int value{fallback};
+            if (not (file >> value)) {
+                return fallback;
+            }
+            return value;
+        }
+
+        /**
+         * A CPU directory holds a nodeN link to its NUMA node.
+         */
+        static int node_of(const std::string &cpu_dir) {
+            DIR *dir = opendir(cpu_dir.c_str());
+            if (dir == nullptr) {
+                return 0;
+            }
+            int node{0};
+            while (const struct dirent *entry = readdir(dir)) {
+                if (strncmp(entry->d_name, "node", 4) == 0 and entry->d_name[4] >= '0' and entry->d_name[4] <= '9') {
+                    node = atoi(entry->d_name + 4);
+                    break;
+                }
+            }
+            closedir(dir);
+            return node;
+        }
+    };
+}
+
+#endif /* LINUX_TCP_SERVERS_CPU_TOPOLOGY_H */
@@ -38,21 +38,52 @@
 
 namespace concurrent_servers {
 
-bool set_nonblocking(int fd) {
+/**
+ * Non-owning handle of a file descriptor: copies refer to the same descriptor, which is only closed by close_fd().
+ */
+class file_descriptor {
+public:
+    file_descriptor() = default;
+
+    explicit file_descriptor(int fd) : _fd{fd} {}
+
+    /**
+     * Stores the result of a call returning a file descriptor, returns false if it failed (fd < 0).
+     */
+    bool set_fd(int fd) {
+        _fd = fd;
+        return fd >= 0;
+    }
+
+    int get_fd() const {
+        return _fd;
+    }
+
+    void close_fd() {
+        if (_fd != -1) {
+            close(_fd);
+            _fd = -1;
+        }
+    }
+
+private:
+    int _fd{-1};
+};
+
+inline bool set_nonblocking(int fd) {
     int flags = fcntl(fd, F_GETFL, 0);
     if (flags == -1) return false;
     return fcntl(fd, F_SETFL, flags | O_NONBLOCK) == 0;
 }
 
-bool is_nonblocking(int fd) {
+inline bool is_nonblocking(int fd) {
     int flags = fcntl(fd, F_GETFL, 0);
     return (flags & O_NONBLOCK) != 0;
 }
 
-void close_fd(int fd) {
+inline void close_fd(int fd) {
     if (fd != -1) {
         close(fd);
-        fd = -1;
     }
 }
 
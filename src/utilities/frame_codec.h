@@ -0,0 +1,235 @@
+/*
+ * BSD 2-Clause License
+ *
+ * Copyright (c) 2019, Pham Phi Long <phamphilong2010@gmail.com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *   * Redistributions of source code must retain the above copyright notice,
+ *     this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *   * Neither the name of Redis nor the names of its contributors may be used
+ *     to endorse or promote products derived from this software without
+ *     specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+#ifndef LINUX_TCP_SERVERS_FRAME_CODEC_H
+#define LINUX_TCP_SERVERS_FRAME_CODEC_H
+
+#include <cstdint>
+#include <string>
+#include <utility>
+
+#include "input_buffer.h"
+#include "output_queue.h"
+
+namespace concurrent_servers {
+    enum class frame_prefix {
+        FIXED32, // 4-byte big-endian payload length
+        VARINT   // LEB128 payload length, 1 to 5 bytes
+    };
+
+    /**
+     * Length-prefixed framing: every message is its payload length followed by the payload.
+     */
+    class frame_codec {
+    public:
+        enum class decode_status {
+            COMPLETE,   // header_size and payload_size are set, the payload itself may not be complete yet
+            INCOMPLETE, // more bytes are needed to decode the header
+            INVALID     // malformed header or payload larger than max_frame_size()
+        };
+
+        static constexpr size_t MAX_HEADER_SIZE{5};
+        static constexpr uint32_t DEFAULT_MAX_FRAME_SIZE{1024 * 1024};
+
+        explicit frame_codec(frame_prefix prefix = frame_prefix::FIXED32, uint32_t max_frame_size = DEFAULT_MAX_FRAME_SIZE) :
+                _prefix{prefix},
+                _max_frame_size{max_frame_size} {
+        }
+
+        decode_status decode_header(const char *data, size_t len, size_t &header_size, uint32_t &payload_size) const {
+            const auto *bytes = reinterpret_cast<const unsigned char *>(data);
+            if (_prefix == frame_prefix::FIXED32) {
+                if (len < 4) {
+                    return decode_status::INCOMPLETE;
+                }
+                header_size = 4;
+                payload_size = static_cast<uint32_t>(bytes[0]) << 24 | static_cast<uint32_t>(bytes[1]) << 16
+                               | static_cast<uint32_t>(bytes[2]) << 8 | static_cast<uint32_t>(bytes[3]);
+                return payload_size <= _max_frame_size ? decode_status::COMPLETE : decode_status::INVALID;
+            }
+
+            uint32_t value{0};
+            for (size_t i{0}; i < MAX_HEADER_SIZE; ++i) {
+                if (i == len) {
+                    return decode_status::INCOMPLETE;
+                }
+                if (i == MAX_HEADER_SIZE - 1 and bytes[i] > 0x0f) {
+                    return decode_status::INVALID; // more than 32 bits
+                }
+                value |= static_cast<uint32_t>(bytes[i] & 0x7f) << (7 * i);
+                if ((bytes[i] & 0x80) == 0) {
+                    header_size = i + 1;
+                    payload_size = value;
+                    return payload_size <= _max_frame_size ? decode_status::COMPLETE : decode_status::INVALID;
+                }
+            }
+            return decode_status::INVALID;
+        }
+
+        /**
+         * Writes the header of a payload_size bytes frame to out, which has room for MAX_HEADER_SIZE bytes.
+         * Returns the header size.
+         */
+        size_t encode_header(char *out, uint32_t payload_size) const {
+            auto *bytes = reinterpret_cast<unsigned char *>(out);
+            if (_prefix == frame_prefix::FIXED32) {
+                bytes[0] = static_cast<unsigned char>(payload_size >> 24);
+                bytes[1] = static_cast<unsigned char>(payload_size >> 16);
+                bytes[2] = static_cast<unsigned char>(payload_size >> 8);
+                bytes[3] = static_cast<unsigned char>(payload_size);
+                return 4;
+            }
+
+            size_t header_size{0};
+            do {
+                bytes[header_size] = static_cast<unsigned char>(payload_size & 0x7f);
+                payload_size >>= 7;
+                if (payload_size != 0) {
+                    bytes[header_size] |= 0x80;
+                }
+                ++header_size;
+            } while (payload_size != 0);
+            return header_size;
+        }
+
+        /**
+         * Queues a frame made of payload. Returns false if it is too large or the output queue ran out of buffers.
+         */
+        bool append_frame(output_queue &output, const char *payload, size_t len) const {
+            if (len > _max_frame_size) {
+                return false;
+            }
+            char header[MAX_HEADER_SIZE];
+            const size_t header_size = encode_header(header, static_cast<uint32_t>(len));
+            return output.append(header, header_size) and output.append(payload, len);
+        }
+
+        frame_prefix prefix() const {
+            return _prefix;
+        }
+
+        uint32_t max_frame_size() const {
+            return _max_frame_size;
+        }
+
+    private:
+        frame_prefix _prefix;
+        uint32_t _max_frame_size;
+    };
+
+    /**
+     * Replies of a frame handler, queued as frames after the replies to the previous requests of the connection.
+     */
+    class frame_writer {
+    public:
+        frame_writer(output_queue &output, const frame_codec &codec) :
+                _output{output},
+                _codec{codec},
+                _failed{false} {
+        }
+
+        /**
+         * Returns false if the frame could not be queued whole. Its header may be queued without the payload, the
+         * connection is closed then, see failed().
+         */
+        bool write(const char *payload, size_t len) {
+            if (not _codec.append_frame(_output, payload, len)) {
+                _failed = true;
+                return false;
+            }
+            return true;
+        }
+
+        /**
+         * True once a write() failed: the frame stream of the connection is broken.
+         */
+        bool failed() const {
+            return _failed;
+        }
+
+    private:
+        output_queue &_output;
+        const frame_codec &_codec;
+        bool _failed;
+    };
+
+    /**
+     * ReadHandler of linux_concurrent_server that splits the input into frames. Every complete frame of a read
+     * is handed to FrameHandler, so pipelined requests are all served by a single read:
+     * void operator()(const std::string &prefix_log, const char *payload, size_t payload_len, concurrent_servers::frame_writer &reply)
+     * A partial frame is left unconsumed, the server completes it in place with the next read. The connection is
+     * closed once a reply could not be queued.
+     */
+    template <typename FrameHandler>
+    class framed_read_handler {
+    public:
+        /**
+         * frame_handler_args, if any, are given to the FrameHandler constructor.
+         */
+        template <typename... FrameHandlerArgs>
+        explicit framed_read_handler(frame_codec codec = frame_codec{}, FrameHandlerArgs&&... frame_handler_args) :
+                _codec{codec},
+                _frame_handler{std::forward<FrameHandlerArgs>(frame_handler_args)...} {
+        }
+
+        size_t operator()(const std::string &prefix_log, char *buff, size_t buff_len, output_queue &output) const {
+            frame_writer reply{output, _codec};
+            size_t consumed{0};
+            while (consumed < buff_len) {
+                size_t header_size{0};
+                uint32_t payload_size{0};
+                const frame_codec::decode_status status = _codec.decode_header(buff + consumed, buff_len - consumed,
+                                                                               header_size, payload_size);
+                if (status == frame_codec::decode_status::INVALID) {
+                    return CLOSE_CONNECTION;
+                }
+                if (status == frame_codec::decode_status::INCOMPLETE
+                    or buff_len - consumed - header_size < payload_size) {
+                    break;
+                }
+
+                _frame_handler(prefix_log, buff + consumed + header_size, static_cast<size_t>(payload_size), reply);
+                if (reply.failed()) {
+                    return CLOSE_CONNECTION;
+                }
+                consumed += header_size + payload_size;
+            }
+            return consumed;
+        }
+
+    private:
+        const frame_codec _codec;
+        const FrameHandler _frame_handler;
+    };
+}
+
+#endif /* LINUX_TCP_SERVERS_FRAME_CODEC_H */
@@ -0,0 +1,266 @@
+/*
+ * BSD 2-Clause License
+ *
+ * Copyright (c) 2019, Pham Phi Long <phamphilong2010@gmail.com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *   * Redistributions of source code must retain the above copyright notice,
+ *     this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *   * Neither the name of Redis nor the names of its contributors may be used
+ *     to endorse or promote products derived from this software without
+ *     specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+#ifndef LINUX_TCP_SERVERS_HTTP_HANDLER_H
+#define LINUX_TCP_SERVERS_HTTP_HANDLER_H
+
+#include <cstdio>
+#include <cstring>
+#include <ctime>
+#include <string>
+#include <string_view>
+#include <type_traits>
+#include <utility>
+
+#include "http_parser.h"
+#include "input_buffer.h"
+#include "offload.h"
+#include "output_queue.h"
+#include "print_utility.h"
+
+namespace concurrent_servers {
+    /**
+     * Response filled in by a request handler. Content-Length, Date and Connection are added when it is sent.
+     */
+    struct http_response {
+        int status{200};
+        std::string_view content_type{"text/plain"};
+        std::string body{};
+        bool close{false}; // close the connection once the response is sent
+
+        void reset() {
+            status = 200;
+            content_type = "text/plain";
+            body.clear();
+            close = false;
+        }
+    };
+
+    /**
+     * Detects a RequestHandler that moves some requests off the event loop:
+     * bool offload(const concurrent_servers::http_request &request) const
+     */
+    template <typename RequestHandler, typename = void>
+    struct offloads_requests : std::false_type {};
+
+    template <typename RequestHandler>
+    struct offloads_requests<RequestHandler, std::void_t<decltype(std::declval<const RequestHandler &>().offload(std::declval<const http_request &>()))>> :
+            std::true_type {};
+
+    /**
+     * ReadHandler of linux_concurrent_server serving HTTP/1.1 with keep-alive. Every complete request of a read is
+     * handed to RequestHandler, so pipelined requests are all served by a single read, and the responses are
+     * queued in request order:
+     * void operator()(const std::string &prefix_log, const concurrent_servers::http_request &request, concurrent_servers::http_response &response)
+     * The request fields point into the connection input buffer and are only valid during the call.
+     * If RequestHandler has an offload() member returning true for a request, that request is served on the offload
+     * pool of the server from a copy, so RequestHandler must be thread safe then; response.close is ignored for it.
+     */
+    template <typename RequestHandler>
+    class http_read_handler {
+    public:
+        /**
+         * request_handler_args, if any, are given to the RequestHandler constructor.
+         */
+        template <typename... RequestHandlerArgs>
+        explicit http_read_handler(http_parser parser = http_parser{}, RequestHandlerArgs&&... request_handler_args) :
+                _parser{parser},
+                _request_handler{std::forward<RequestHandlerArgs>(request_handler_args)...} {
+        }
+
+        size_t operator()(const std::string &prefix_log, char *buff, size_t buff_len, output_queue &output) const {
+            return serve(prefix_log, buff, buff_len, output, nullptr);
+        }
+
+        template <typename Handler = RequestHandler, std::enable_if_t<offloads_requests<Handler>::value, int> = 0>
+        size_t operator()(const std::string &prefix_log, char *buff, size_t buff_len, output_queue &output, offloader &offload) const {
+            return serve(prefix_log, buff, buff_len, output, &offload);
+        }
+
+        static const char *reason_phrase(int status) {
+            switch (status) {
+                case 200: return "OK";
+                case 201: return "Created";
+                case 204: return "No Content";
+                case 301: return "Moved Permanently";
+                case 304: return "Not Modified";
+                case 400: return "Bad Request";
+                case 403: return "Forbidden";
+                case 404: return "Not Found";
+                case 405: return "Method Not Allowed";
+                case 413: return "Payload Too Large";
+                case 500: return "Internal Server Error";
+                case 501: return "Not Implemented";
+                case 503: return "Service Unavailable";
+                default: return "Unknown";
+            }
+        }
+
+    private:
+        const http_parser _parser;
+        const RequestHandler _request_handler;
+        mutable time_t _date_time{0};
+        mutable char _date[32]{};  // Date header value, formatted once per second
+
+        size_t serve(const std::string &prefix_log, char *buff, size_t buff_len, output_queue &output, offloader *offload) const {
+            http_request request{};
+            http_response response{};
+            size_t consumed{0};
+            while (consumed < buff_len) {
+                size_t request_size{0};
+                const http_parser::parse_status status = _parser.parse(buff + consumed, buff_len - consumed, request, request_size);
+                if (status == http_parser::parse_status::INCOMPLETE) {
+                    break;
+                }
+                if (status != http_parser::parse_status::COMPLETE) {
+                    response.reset();
+                    response.status = error_status(status);
+                    response.body = reason_phrase(response.status);
+                    response.body += '\n';
+                    write_response(output, response, false, false); // closed either way
+                    return CLOSE_CONNECTION;
+                }
+
+                if constexpr (offloads_requests<RequestHandler>::value) {
+                    if (offload != nullptr and _request_handler.offload(request)) {
+                        const bool queued = offload->run([this, prefix_log, raw = std::string{buff + consumed, request_size}]() {
+                            return serve_offloaded(prefix_log, raw);
+                        });
+                        consumed += request_size;
+                        if (not queued or not request.keep_alive) {
+                            return CLOSE_CONNECTION;
+                        }
+                        if (offload->pending()) {
+                            break; // the next requests wait for this reply
+                        }
+                        continue;
+                    }
+                }
+
+                response.reset();
+                _request_handler(prefix_log, request, response);
+                const bool keep_alive = request.keep_alive and not response.close;
+                const bool queued = write_response(output, response, keep_alive, request.method == "HEAD");
+                consumed += request_size;
+                if (not queued or not keep_alive) {
+                    return CLOSE_CONNECTION;
+                }
+            }
+            return consumed;
+        }
+
+        static int error_status(http_parser::parse_status status) {
+            switch (status) {
+                case http_parser::parse_status::TOO_LARGE: return 413;
+                case http_parser::parse_status::NOT_IMPLEMENTED: return 501;
+                default: return 400;
+            }
+        }
+
+        static void format_date(time_t now, char (&date)[32]) {
+            struct tm gmt{};
+            gmtime_r(&now, &gmt);
+            strftime(date, sizeof(date), "%a, %d %b %Y %H:%M:%S GMT", &gmt);
+        }
+
+        const char *date() const {
+            const time_t now = time(nullptr);
+            if (now != _date_time) {
+                format_date(now, _date);
+                _date_time = now;
+            }
+            return _date;
+        }
+
+        /**
+         * Returns the length of the head, or 0 if it does not fit.
+         */
+        static size_t format_head(char (&head)[256], const http_response &response, bool keep_alive, const char *date) {
+            const int head_len = snprintf(head, sizeof(head),
+                                          "HTTP/1.1 %d %s\r\nDate: %s\r\nContent-Type: %.*s\r\nContent-Length: %zu\r\n%s\r\n",
+                                          response.status, reason_phrase(response.status), date,
+                                          static_cast<int>(response.content_type.size()), response.content_type.data(),
+                                          response.body.size(), keep_alive ? "" : "Connection: close\r\n");
+            return head_len > 0 and static_cast<size_t>(head_len) < sizeof(head) ? static_cast<size_t>(head_len) : 0;
+        }
+
+        /**
+         * Runs on a pool thread. The request is parsed again from its copy, its fields point into raw then, and the
+         * whole response is returned. The cached Date is not shared with the event loop, it is formatted here.
+         */
+        std::string serve_offloaded(const std::string &prefix_log, const std::string &raw) const {
+            http_request request{};
+            http_response response{};
+            size_t request_size{0};
+            if (_parser.parse(raw.data(), raw.size(), request, request_size) == http_parser::parse_status::COMPLETE) {
+                _request_handler(prefix_log, request, response);
+            } else {
+                response.status = 500; // the copy was complete when it was parsed the first time
+                response.body = "Internal Server Error\n";
+            }
+
+            char date_value[32];
+            format_date(time(nullptr), date_value);
+            char head[256];
+            const size_t head_len = format_head(head, response, request.keep_alive, date_value);
+            if (head_len == 0) {
+                CS_LOG_ERROR("http: could not format the response");
+                return {};
+            }
+            std::string reply{head, head_len};
+            if (request.method != "HEAD") {
+                reply += response.body;
+            }
+            return reply;
+        }
+
+        /**
+         * Returns false if the response could not be queued whole. Part of it may be queued then, so the connection
+         * has to be closed rather than send the next response after it.
+         */
+        bool write_response(output_queue &output, const http_response &response, bool keep_alive, bool head_only) const {
+            // the head is formatted in place, the body is appended after it
+            char head[256];
+            const size_t head_len = format_head(head, response, keep_alive, date());
+            bool queued = head_len > 0 and output.append(head, head_len);
+            if (queued and not head_only) {
+                queued = output.append(response.body.data(), response.body.size());
+            }
+            if (not queued) {
+                CS_LOG_ERROR("http: could not queue the response");
+            }
+            return queued;
+        }
+    };
+}
+
+#endif /* LINUX_TCP_SERVERS_HTTP_HANDLER_H */
@@ -0,0 +1,354 @@
+/*
+ * BSD 2-Clause License
+ *
+ * Copyright (c) 2019, Pham Phi Long <phamphilong2010@gmail.com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *   * Redistributions of source code must retain the above copyright notice,
+ *     this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *   * Neither the name of Redis nor the names of its contributors may be used
+ *     to endorse or promote products derived from this software without
+ *     specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+#ifndef LINUX_TCP_SERVERS_HTTP_PARSER_H
+#define LINUX_TCP_SERVERS_HTTP_PARSER_H
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <string_view>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define LINUX_TCP_SERVERS_HTTP_X86_SIMD 1
+#endif
+
+namespace concurrent_servers {
+    struct http_header {
+        std::string_view name;
+        std::string_view value;
+    };
+
+    /**
+     * A parsed request. Every string_view points into the buffer given to http_parser::parse(), so the request
+     * is only valid as long as that buffer is.
+     */
+    struct http_request {
+        static constexpr size_t MAX_HEADERS{64};
+
+        std::string_view method{};
+        std::string_view target{};
+        int minor_version{1};     // HTTP/1.<minor_version>
+        std::array<http_header, MAX_HEADERS> headers{};
+        size_t header_count{0};
+        std::string_view body{};
+        bool keep_alive{true};
+
+        /**
+         * Value of the first header named name, compared case-insensitively, or an empty view.
+         */
+        std::string_view header(std::string_view name) const {
+            for (size_t i{0}; i < header_count; ++i) {
+                if (equals_ignore_case(headers[i].name, name)) {
+                    return headers[i].value;
+                }
+            }
+            return {};
+        }
+
+        static bool equals_ignore_case(std::string_view lhs, std::string_view rhs) {
+            if (lhs.size() != rhs.size()) {
+                return false;
+            }
+            for (size_t i{0}; i < lhs.size(); ++i) {
+                if (to_lower(lhs[i]) != to_lower(rhs[i])) {
+                    return false;
+                }
+            }
+            return true;
+        }
+
+        // only ASCII letters fold, OR-ing 0x20 into any byte would also match e.g. '\r' with '-'
+        static char to_lower(char c) {
+            return c >= 'A' and c <= 'Z' ? static_cast<char>(c | 0x20) : c;
+        }
+    };
+
+    namespace http_simd {
+        /**
+         * Index of the first byte of data equal to a or b, or len.
+         */
+        inline size_t find_any_scalar(const char *data, size_t len, char a, char b) {
+            for (size_t i{0}; i < len; ++i) {
+                if (data[i] == a or data[i] == b) {
+                    return i;
+                }
+            }
+            return len;
+        }
+
+#ifdef LINUX_TCP_SERVERS_HTTP_X86_SIMD
+        __attribute__((target("sse4.2")))
+        inline size_t find_any_sse42(const char *data, size_t len, char a, char b) {
+            const __m128i needles = _mm_setr_epi8(a, b, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0);
+            size_t i{0};
+            for (; i + 16 <= len; i += 16) {
+                const __m128i block = _mm_loadu_si128(reinterpret_cast<const __m128i *>(data + i));
+                const int index = _mm_cmpestri(needles, 2, block, 16,
+                                               _SIDD_UBYTE_OPS | _SIDD_CMP_EQUAL_ANY | _SIDD_LEAST_SIGNIFICANT);
+                if (index != 16) {
+                    return i + static_cast<size_t>(index);
+                }
+            }
+            return i + find_any_scalar(data + i, len - i, a, b);
+        }
+
+        __attribute__((target("avx2")))
+        inline size_t find_any_avx2(const char *data, size_t len, char a, char b) {
+            const __m256i needle_a = _mm256_set1_epi8(a);
+            const __m256i needle_b = _mm256_set1_epi8(b);
+            size_t i{0};
+            for (; i + 32 <= len; i += 32) {
+                const __m256i block = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(data + i));
+                const __m256i matches = _mm256_or_si256(_mm256_cmpeq_epi8(block, needle_a), _mm256_cmpeq_epi8(block, needle_b));
+                const auto mask = static_cast<uint32_t>(_mm256_movemask_epi8(matches));
+                if (mask != 0) {
+                    return i + static_cast<size_t>(__builtin_ctz(mask));
+                }
+            }
+            return i + find_any_scalar(data + i, len - i, a, b);
+        }
+#endif
+    }
+
+    /**
+     * HTTP/1.1 request parser. Delimiters (spaces, colons, line ends) are searched 32 bytes at a time with AVX2
+     * or 16 with SSE4.2, whichever the CPU supports, and byte by byte otherwise. The functions are compiled with
+     * target attributes and chosen at run time, so no -m flag is needed. Stateless, one parser may serve any
+     * number of connections.
+     */
+    class http_parser {
+    public:
+        enum class simd_level {
+            SCALAR,
+            SSE42,
+            AVX2
+        };
+
+        enum class parse_status {
+            COMPLETE,        // request and request_size are set
+            INCOMPLETE,      // the request head or body is not complete yet
+            BAD_REQUEST,
+            TOO_LARGE,       // head larger than MAX_HEAD_SIZE or body larger than max_body_size
+            NOT_IMPLEMENTED  // e.g. chunked transfer encoding
+        };
+
+        static constexpr size_t MAX_HEAD_SIZE{8192};
+        static constexpr size_t DEFAULT_MAX_BODY_SIZE{1024 * 1024};
+
+        explicit http_parser(simd_level level = detect_simd_level(), size_t max_body_size = DEFAULT_MAX_BODY_SIZE) :
+                _level{level},
+                _find_any{find_any_function(level)},
+                _max_body_size{max_body_size} {
+        }
+
+        static simd_level detect_simd_level() {
+#ifdef LINUX_TCP_SERVERS_HTTP_X86_SIMD
+            if (__builtin_cpu_supports("avx2")) {
+                return simd_level::AVX2;
+            }
+            if (__builtin_cpu_supports("sse4.2")) {
+                return simd_level::SSE42;
+            }
+#endif
+            return simd_level::SCALAR;
+        }
+
+        simd_level level() const {
+            return _level;
+        }
+
+        /**
+         * Parses the request at the beginning of data. On COMPLETE, request_size is the length of its head and body,
+         * the next pipelined request starts right after.
+         */
+        parse_status parse(const char *data, size_t len, http_request &request, size_t &request_size) const {
+            const char *const end = data + len;
+            const char *p = data;
+
+            // request line: method SP target SP HTTP/1.x CRLF
+            const char *line_end{nullptr};
+            if (not find_line_end(p, end, line_end)) {
+                return head_incomplete(len);
+            }
+
+            const char *space = find(p, line_end, ' ', ' ');
+            if (space == p or space == line_end) {
+                return parse_status::BAD_REQUEST;
+            }
+            request.method = std::string_view{p, static_cast<size_t>(space - p)};
+            p = space + 1;
+
+            space = find(p, line_end, ' ', ' ');
+            if (space == p or space == line_end) {
+                return parse_status::BAD_REQUEST;
+            }
+            request.target = std::string_view{p, static_cast<size_t>(space - p)};
+            p = space + 1;
+
+            const std::string_view version{p, static_cast<size_t>(trim_cr(p, line_end) - p)};
+            if (version.size() != 8 or version.compare(0, 7, "HTTP/1.") != 0 or version[7] < '0' or version[7] > '9') {
+                return parse_status::BAD_REQUEST;
+            }
+            request.minor_version = version[7] - '0';
+            p = line_end + 1;
+
+            // header fields, up to the empty line
+            request.header_count = 0;
+            std::string_view connection{};
+            std::string_view content_length{};
+            bool has_content_length{false};
+            bool chunked{false};
+            for (;;) {
+                if (not find_line_end(p, end, line_end)) {
+                    return head_incomplete(len);
+                }
+                if (trim_cr(p, line_end) == p) {
+                    p = line_end + 1;
+                    break;
+                }
+                if (request.header_count == http_request::MAX_HEADERS) {
+                    return parse_status::TOO_LARGE;
+                }
+
+                const char *colon = find(p, line_end, ':', ':');
+                if (colon == p or colon == line_end or colon[-1] == ' ' or colon[-1] == '\t') {
+                    return parse_status::BAD_REQUEST;
+                }
+                const char *value = colon + 1;
+                const char *value_end = trim_cr(value, line_end);
+                while (value < value_end and (*value == ' ' or *value == '\t')) {
+                    ++value;
+                }
+                while (value_end > value and (value_end[-1] == ' ' or value_end[-1] == '\t')) {
+                    --value_end;
+                }
+
+                http_header &field = request.headers[request.header_count++];
+                field.name = std::string_view{p, static_cast<size_t>(colon - p)};
+                field.value = std::string_view{value, static_cast<size_t>(value_end - value)};
+                if (http_request::equals_ignore_case(field.name, "Connection")) {
+                    connection = field.value;
+                } else if (http_request::equals_ignore_case(field.name, "Content-Length")) {
+                    // differing lengths let a proxy and this server split the stream differently
+                    if (has_content_length and field.value != content_length) {
+                        return parse_status::BAD_REQUEST;
+                    }
+                    has_content_length = true;
+                    content_length = field.value;
+                } else if (http_request::equals_ignore_case(field.name, "Transfer-Encoding")) {
+                    chunked = true;
+                }
+                p = line_end + 1;
+            }
+
+            if (static_cast<size_t>(p - data) > MAX_HEAD_SIZE) {
+                return parse_status::TOO_LARGE;
+            }
+            if (chunked) {
+                return parse_status::NOT_IMPLEMENTED;
+            }
+
+            request.keep_alive = (request.minor_version >= 1) ?
+                    not http_request::equals_ignore_case(connection, "close") :
+                    http_request::equals_ignore_case(connection, "keep-alive");
+
+            size_t body_size{0};
+            if (not content_length.empty()) {
+                if (content_length.size() > 19) {
+                    return parse_status::TOO_LARGE;
+                }
+                for (const char digit : content_length) {
+                    if (digit < '0' or digit > '9') {
+                        return parse_status::BAD_REQUEST;
+                    }
+                    body_size = body_size * 10 + static_cast<size_t>(digit - '0');
+                }
+                if (body_size > _max_body_size) {
+                    return parse_status::TOO_LARGE;
+                }
+            }
+            if (static_cast<size_t>(end - p) < body_size) {
+                return parse_status::INCOMPLETE;
+            }
+
+            request.body = std::string_view{p, body_size};
+            request_size = static_cast<size_t>(p - data) + body_size;
+            return parse_status::COMPLETE;
+        }
+
+    private:
+        using find_any_type = size_t (*)(const char *, size_t, char, char);
+
+        const simd_level _level;
+        const find_any_type _find_any;
+        const size_t _max_body_size;
+
+        static find_any_type find_any_function(simd_level level) {
+#ifdef LINUX_TCP_SERVERS_HTTP_X86_SIMD
+            if (level == simd_level::AVX2) {
+                return http_simd::find_any_avx2;
+            }
+            if (level == simd_level::SSE42) {
+                return http_simd::find_any_sse42;
+            }
+#endif
+            return http_simd::find_any_scalar;
+        }
+
+        /**
+         * First a or b in [begin, end), or end.
+         */
+        const char *find(const char *begin, const char *end, char a, char b) const {
+            return begin + _find_any(begin, static_cast<size_t>(end - begin), a, b);
+        }
+
+        /**
+         * Sets line_end to the LF ending the line that starts at begin. Lines end with CRLF, a bare LF is tolerated.
+         */
+        bool find_line_end(const char *begin, const char *end, const char *&line_end) const {
+            line_end = find(begin, end, '\n', '\n');
+            return line_end != end;
+        }
+
+        static const char *trim_cr(const char *begin, const char *line_end) {
+            return (line_end > begin and line_end[-1] == '\r') ? line_end - 1 : line_end;
+        }
+
+        static parse_status head_incomplete(size_t len) {
+            return len > MAX_HEAD_SIZE ? parse_status::TOO_LARGE : parse_status::INCOMPLETE;
+        }
+    };
+}
+
+#endif /* LINUX_TCP_SERVERS_HTTP_PARSER_H */
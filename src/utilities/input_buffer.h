@@ -0,0 +1,166 @@
+/*
+ * BSD 2-Clause License
+ *
+ * Copyright (c) 2019, Pham Phi Long <phamphilong2010@gmail.com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *   * Redistributions of source code must retain the above copyright notice,
+ *     this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *   * Neither the name of Redis nor the names of its contributors may be used
+ *     to endorse or promote products derived from this software without
+ *     specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+#ifndef LINUX_TCP_SERVERS_INPUT_BUFFER_H
+#define LINUX_TCP_SERVERS_INPUT_BUFFER_H
+
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <vector>
+
+#include "buffer_pool.h"
+
+namespace concurrent_servers {
+    /**
+     * Returned by a read handler instead of the number of bytes it consumed to have the connection closed once
+     * the output queued so far is sent, e.g. after the error reply to a malformed request.
+     */
+    inline constexpr size_t CLOSE_CONNECTION{SIZE_MAX};
+
+    /**
+     * Per-connection input that the socket is read into directly, after the bytes not consumed yet, so a
+     * request split across reads is completed in place rather than copied into a new buffer on every read.
+     *
+     * The storage is a buffer_pool chunk, taken on the first read and given back as soon as everything was
+     * consumed, so idle connections hold no input memory. When the chunk is full its unconsumed tail is moved
+     * to the front, or, if a single request does not fit in it, to a heap buffer twice as large.
+     * Not thread safe.
+     */
+    class input_buffer {
+    public:
+        input_buffer() = default;
+
+        input_buffer(const input_buffer &) = delete;
+        input_buffer &operator=(const input_buffer &) = delete;
+
+        ~input_buffer() {
+            release_storage();
+        }
+
+        void set_buffer_pool(buffer_pool *pool) {
+            _pool = pool;
+        }
+
+        /**
+         * Returns where to read the next bytes to, writable() bytes are available there. Returns nullptr if the
+         * pool is exhausted or if size() already reached max_size.
+         */
+        char *prepare(size_t max_size) {
+            if (_data == nullptr) {
+                _chunk = _pool->acquire();
+                if (_chunk == nullptr) {
+                    return nullptr;
+                }
+                _data = _chunk;
+                _capacity = _pool->chunk_size();
+                _begin = 0;
+                _end = 0;
+            }
+            if (_end < _capacity) {
+                return _data + _end;
+            }
+
+            const size_t pending = size();
+            if (_begin > 0) {
+                memmove(_data, _data + _begin, pending);
+            } else {
+                if (pending >= max_size) {
+                    return nullptr;
+                }
+
+                std::vector<char> grown(std::min(_capacity * 2, max_size));
+                memcpy(grown.data(), _data + _begin, pending);
+                release_storage();
+                _large.swap(grown);
+                _data = _large.data();
+                _capacity = _large.size();
+            }
+            _begin = 0;
+            _end = pending;
+            return _data + _end;
+        }
+
+        size_t writable() const {
+            return _capacity - _end;
+        }
+
+        /**
+         * Adds the len bytes read at prepare().
+         */
+        void commit(size_t len) {
+            _end += len;
+        }
+
+        char *data() {
+            return _data + _begin;
+        }
+
+        size_t size() const {
+            return _end - _begin;
+        }
+
+        bool empty() const {
+            return _begin == _end;
+        }
+
+        void consume(size_t len) {
+            _begin += len;
+            if (_begin == _end) {
+                release_storage();
+            }
+        }
+
+    private:
+        buffer_pool *_pool{nullptr};
+        char *_chunk{nullptr};       // storage while the pending input fits in a pool chunk
+        std::vector<char> _large{};  // storage of a request larger than a chunk
+        char *_data{nullptr};
+        size_t _capacity{0};
+        size_t _begin{0};
+        size_t _end{0};
+
+        void release_storage() {
+            if (_chunk != nullptr) {
+                _pool->release(_chunk);
+                _chunk = nullptr;
+            }
+            std::vector<char>{}.swap(_large);
+            _data = nullptr;
+            _capacity = 0;
+            _begin = 0;
+            _end = 0;
+        }
+    };
+}
+
+#endif /* LINUX_TCP_SERVERS_INPUT_BUFFER_H */
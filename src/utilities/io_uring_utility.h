@@ -0,0 +1,387 @@
+/*
+ * BSD 2-Clause License
+ *
+ * Copyright (c) 2019, Pham Phi Long <phamphilong2010@gmail.com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *   * Redistributions of source code must retain the above copyright notice,
+ *     this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *   * Neither the name of Redis nor the names of its contributors may be used
+ *     to endorse or promote products derived from this software without
+ *     specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+#ifndef LINUX_TCP_SERVERS_IO_URING_UTILITY_H
+#define LINUX_TCP_SERVERS_IO_URING_UTILITY_H
+
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <cstdint>
+#include <stdexcept>
+#include <string>
+
+namespace concurrent_servers {
+    /**
+     * Minimal io_uring wrapper built directly on the raw syscalls, so no liburing is required.
+     * This class is not thread-safe, every worker thread owns its own ring.
+     */
+    class io_uring_ring {
+    public:
+        explicit io_uring_ring(unsigned entries, unsigned flags = IORING_SETUP_SINGLE_ISSUER | IORING_SETUP_COOP_TASKRUN) {
+            struct io_uring_params params{};
+            memset(&params, 0, sizeof(params));
+            params.flags = flags | IORING_SETUP_CQSIZE;
+            params.cq_entries = entries * 4; // multishot requests post many completions per submission
+
+            _ring_fd = static_cast<int>(syscall(__NR_io_uring_setup, entries, &params));
+            if (_ring_fd < 0 and errno == EINVAL) {
+                // older kernels do not know SINGLE_ISSUER / COOP_TASKRUN
+                memset(&params, 0, sizeof(params));
+                params.flags = IORING_SETUP_CQSIZE;
+                params.cq_entries = entries * 4;
+                _ring_fd = static_cast<int>(syscall(__NR_io_uring_setup, entries, &params));
+            }
+            if (_ring_fd < 0) {
+                throw std::runtime_error("io_uring_setup() failed");
+            }
+
+            if (not (params.features & IORING_FEAT_SINGLE_MMAP)) {
+                close(_ring_fd);
+                throw std::runtime_error("io_uring: kernel does not support IORING_FEAT_SINGLE_MMAP");
+            }
+
+            _ring_size = std::max(params.sq_off.array + params.sq_entries * sizeof(unsigned),
+                                  params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe));
+            _ring_ptr = mmap(nullptr, _ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, _ring_fd, IORING_OFF_SQ_RING);
+            if (_ring_ptr == MAP_FAILED) {
+                close(_ring_fd);
+                throw std::runtime_error("io_uring: could not map the submission/completion rings");
+            }
+
+            _sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+            _sqes = static_cast<struct io_uring_sqe *>(mmap(nullptr, _sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, _ring_fd, IORING_OFF_SQES));
+            if (_sqes == MAP_FAILED) {
+                munmap(_ring_ptr, _ring_size);
+                close(_ring_fd);
+                throw std::runtime_error("io_uring: could not map the submission queue entries");
+            }
+
+            auto *base = static_cast<char *>(_ring_ptr);
+            _sq_head = reinterpret_cast<unsigned *>(base + params.sq_off.head);
+            _sq_tail = reinterpret_cast<unsigned *>(base + params.sq_off.tail);
+            _sq_mask = *reinterpret_cast<unsigned *>(base + params.sq_off.ring_mask);
+            _sq_entries = *reinterpret_cast<unsigned *>(base + params.sq_off.ring_entries);
+            _sq_array = reinterpret_cast<unsigned *>(base + params.sq_off.array);
+            _cq_head = reinterpret_cast<unsigned *>(base + params.cq_off.head);
+            _cq_tail = reinterpret_cast<unsigned *>(base + params.cq_off.tail);
+            _cq_mask = *reinterpret_cast<unsigned *>(base + params.cq_off.ring_mask);
+            _cqes = reinterpret_cast<struct io_uring_cqe *>(base + params.cq_off.cqes);
+
+            // the sqe at index i always sits at position i of the indirection array
+            for (unsigned i{0}; i < _sq_entries; ++i) {
+                _sq_array[i] = i;
+            }
+            _sqe_tail = *_sq_tail;
+        }
+
+        io_uring_ring(const io_uring_ring &) = delete;
+        io_uring_ring &operator=(const io_uring_ring &) = delete;
+
+        ~io_uring_ring() {
+            munmap(_sqes, _sqes_size);
+            munmap(_ring_ptr, _ring_size);
+            close(_ring_fd);
+        }
+
+        int get_fd() const {
+            return _ring_fd;
+        }
+
+        /**
+         * Returns a zeroed submission entry, flushing the queued entries to the kernel if the ring is full.
+         */
+        struct io_uring_sqe *get_sqe() {
+            if (_sqe_tail - __atomic_load_n(_sq_head, __ATOMIC_ACQUIRE) >= _sq_entries) {
+                submit(0);
+                if (_sqe_tail - __atomic_load_n(_sq_head, __ATOMIC_ACQUIRE) >= _sq_entries) {
+                    return nullptr;
+                }
+            }
+
+            struct io_uring_sqe *sqe = &_sqes[_sqe_tail & _sq_mask];
+            memset(sqe, 0, sizeof(*sqe));
+            ++_sqe_tail;
+            return sqe;
+        }
+
+        /**
+         * Publishes every queued submission entry and waits for at least wait_nr completions, in one syscall.
+         */
+        int submit(unsigned wait_nr) {
+            const unsigned to_submit = _sqe_tail - *_sq_tail;
+            __atomic_store_n(_sq_tail, _sqe_tail, __ATOMIC_RELEASE);
+
+            if (to_submit == 0 and wait_nr == 0) {
+                return 0;
+            }
+
+            for (;;) {
+                const int ret = static_cast<int>(syscall(__NR_io_uring_enter, _ring_fd, to_submit, wait_nr,
+                                                         wait_nr > 0 ? IORING_ENTER_GETEVENTS : 0, nullptr, 0));
+                if (ret >= 0 or errno != EINTR) {
+                    return ret;
+                }
+            }
+        }
+
+        unsigned pending_submissions() const {
+            return _sqe_tail - *_sq_tail;
+        }
+
+        /**
+         * Calls handler(const io_uring_cqe&) for every available completion and marks them as seen.
+         * Returns the number of completions handled.
+         */
+        template <typename CompletionHandler>
+        unsigned for_each_cqe(CompletionHandler &&handler) {
+            unsigned head = *_cq_head;
+            const unsigned tail = __atomic_load_n(_cq_tail, __ATOMIC_ACQUIRE);
+            unsigned count{0};
+
+            for (; head != tail; ++head, ++count) {
+                handler(_cqes[head & _cq_mask]);
+            }
+
+            __atomic_store_n(_cq_head, head, __ATOMIC_RELEASE);
+            return count;
+        }
+
+        bool has_cqe() const {
+            return *_cq_head != __atomic_load_n(_cq_tail, __ATOMIC_ACQUIRE);
+        }
+
+        int register_buffer_ring(struct io_uring_buf_reg &reg) {
+            return static_cast<int>(syscall(__NR_io_uring_register, _ring_fd, IORING_REGISTER_PBUF_RING, &reg, 1));
+        }
+
+        static void prep_multishot_accept(struct io_uring_sqe *sqe, int server_sfd, uint64_t user_data) {
+            sqe->opcode = IORING_OP_ACCEPT;
+            sqe->fd = server_sfd;
+            sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+            sqe->accept_flags = SOCK_NONBLOCK;
+            sqe->user_data = user_data;
+        }
+
+        static void prep_multishot_recv(struct io_uring_sqe *sqe, int conn_fd, uint16_t buffer_group, uint64_t user_data) {
+            sqe->opcode = IORING_OP_RECV;
+            sqe->fd = conn_fd;
+            sqe->ioprio = IORING_RECV_MULTISHOT;
+            sqe->flags = IOSQE_BUFFER_SELECT;
+            sqe->buf_group = buffer_group;
+            sqe->user_data = user_data;
+        }
+
+        static void prep_send(struct io_uring_sqe *sqe, int conn_fd, const void *buffer, size_t len, uint64_t user_data) {
+            sqe->opcode = IORING_OP_SEND;
+            sqe->fd = conn_fd;
+            sqe->addr = reinterpret_cast<uint64_t>(buffer);
+            sqe->len = static_cast<uint32_t>(len);
+            sqe->msg_flags = MSG_NOSIGNAL;
+            sqe->user_data = user_data;
+        }
+
+        static void prep_close(struct io_uring_sqe *sqe, int fd, uint64_t user_data) {
+            sqe->opcode = IORING_OP_CLOSE;
+            sqe->fd = fd;
+            sqe->user_data = user_data;
+        }
+
+    private:
+        int _ring_fd{-1};
+        void *_ring_ptr{nullptr};
+        size_t _ring_size{0};
+        struct io_uring_sqe *_sqes{nullptr};
+        size_t _sqes_size{0};
+        unsigned *_sq_head{nullptr};
+        unsigned *_sq_tail{nullptr};
+        unsigned _sq_mask{0};
+        unsigned _sq_entries{0};
+        unsigned *_sq_array{nullptr};
+        unsigned _sqe_tail{0}; // local tail, published to the kernel by submit()
+        unsigned *_cq_head{nullptr};
+        unsigned *_cq_tail{nullptr};
+        unsigned _cq_mask{0};
+        struct io_uring_cqe *_cqes{nullptr};
+    };
+
+    /**
+     * Provided buffers for requests submitted with IOSQE_BUFFER_SELECT. The kernel picks one of these
+     * buffers for every completion and the application hands it back with recycle() once it is done with the data.
+     * Buffers are shared through a buffer ring (IORING_REGISTER_PBUF_RING, kernel 5.19+); when the ring cannot
+     * be used they are handed over with IORING_OP_PROVIDE_BUFFERS requests instead.
+     */
+    class io_uring_buffer_ring {
+    public:
+        io_uring_buffer_ring(io_uring_ring &ring, uint16_t group_id, unsigned buffer_num, unsigned buffer_size,
+                             uint64_t provide_user_data = 0) :
+                _ring{ring},
+                _group_id{group_id},
+                _buffer_num{buffer_num},
+                _buffer_size{buffer_size},
+                _mask{buffer_num - 1},
+                _provide_user_data{provide_user_data} {
+            if (buffer_num == 0 or (buffer_num & (buffer_num - 1)) != 0 or buffer_num > 32768) {
+                throw std::runtime_error("io_uring: the number of provided buffers must be a power of 2 up to 32768");
+            }
+
+            _ring_size = buffer_num * sizeof(struct io_uring_buf);
+            _buffers_size = static_cast<size_t>(buffer_num) * buffer_size;
+            void *mem = mmap(nullptr, _ring_size + _buffers_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+            if (mem == MAP_FAILED) {
+                throw std::runtime_error("io_uring: could not allocate the provided buffer ring");
+            }
+            _br = static_cast<struct io_uring_buf_ring *>(mem);
+            _buffers = static_cast<char *>(mem) + _ring_size;
+
+            struct io_uring_buf_reg reg{};
+            memset(&reg, 0, sizeof(reg));
+            reg.ring_addr = reinterpret_cast<uint64_t>(_br);
+            reg.ring_entries = buffer_num;
+            reg.bgid = group_id;
+            if (_ring.register_buffer_ring(reg) < 0) {
+                provide_all();
+                return;
+            }
+
+            for (unsigned bid{0}; bid < buffer_num; ++bid) {
+                add(static_cast<uint16_t>(bid));
+            }
+            publish();
+        }
+
+        io_uring_buffer_ring(const io_uring_buffer_ring &) = delete;
+        io_uring_buffer_ring &operator=(const io_uring_buffer_ring &) = delete;
+
+        ~io_uring_buffer_ring() {
+            munmap(_br, _ring_size + _buffers_size);
+        }
+
+        uint16_t group_id() const {
+            return _group_id;
+        }
+
+        unsigned buffer_num() const {
+            return _buffer_num;
+        }
+
+        bool uses_buffer_ring() const {
+            return not _provide_buffers;
+        }
+
+        char *buffer(uint16_t bid) const {
+            return _buffers + static_cast<size_t>(bid) * _buffer_size;
+        }
+
+        /**
+         * Gives a buffer back to the kernel. Recycled buffers become visible after the next publish(),
+         * or with the next submission when the buffers are provided through requests.
+         */
+        void recycle(uint16_t bid) {
+            if (_provide_buffers) {
+                prep_provide(bid, 1);
+            } else {
+                add(bid);
+            }
+        }
+
+        void publish() {
+            if (not _provide_buffers) {
+                __atomic_store_n(&_br->tail, _local_tail, __ATOMIC_RELEASE);
+            }
+        }
+
+        /**
+         * Drops the buffer ring and provides every buffer through IORING_OP_PROVIDE_BUFFERS.
+         * Only valid while the kernel holds all the buffers.
+         */
+        void fall_back_to_provide_buffers() {
+            if (_provide_buffers) {
+                return;
+            }
+
+            struct io_uring_buf_reg reg{};
+            memset(&reg, 0, sizeof(reg));
+            reg.bgid = _group_id;
+            syscall(__NR_io_uring_register, _ring.get_fd(), IORING_UNREGISTER_PBUF_RING, &reg, 1);
+            provide_all();
+        }
+
+    private:
+        io_uring_ring &_ring;
+        const uint16_t _group_id;
+        const unsigned _buffer_num;
+        const unsigned _buffer_size;
+        const unsigned _mask;
+        const uint64_t _provide_user_data;
+        size_t _ring_size{0};
+        size_t _buffers_size{0};
+        struct io_uring_buf_ring *_br{nullptr};
+        char *_buffers{nullptr};
+        uint16_t _local_tail{0};
+        bool _provide_buffers{false};
+
+        void add(uint16_t bid) {
+            struct io_uring_buf *buf = &_br->bufs[_local_tail & _mask];
+            buf->addr = reinterpret_cast<uint64_t>(buffer(bid));
+            buf->len = _buffer_size;
+            buf->bid = bid;
+            ++_local_tail;
+        }
+
+        void provide_all() {
+            _provide_buffers = true;
+            prep_provide(0, _buffer_num);
+        }
+
+        void prep_provide(uint16_t first_bid, unsigned count) {
+            struct io_uring_sqe *sqe = _ring.get_sqe();
+            if (sqe == nullptr) {
+                throw std::runtime_error("io_uring: submission queue is full, could not provide buffers");
+            }
+            sqe->opcode = IORING_OP_PROVIDE_BUFFERS;
+            sqe->fd = static_cast<int>(count);
+            sqe->addr = reinterpret_cast<uint64_t>(buffer(first_bid));
+            sqe->len = _buffer_size;
+            sqe->off = first_bid;
+            sqe->buf_group = _group_id;
+            sqe->user_data = _provide_user_data;
+        }
+    };
+}
+
+#endif /* LINUX_TCP_SERVERS_IO_URING_UTILITY_H */
@@ -0,0 +1,264 @@
+/*
+ * BSD 2-Clause License
+ *
+ * Copyright (c) 2019, Pham Phi Long <phamphilong2010@gmail.com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *   * Redistributions of source code must retain the above copyright notice,
+ *     this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *   * Neither the name of Redis nor the names of its contributors may be used
+ *     to endorse or promote products derived from this software without
+ *     specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+#ifndef LINUX_TCP_SERVERS_LATENCY_HISTOGRAM_H
+#define LINUX_TCP_SERVERS_LATENCY_HISTOGRAM_H
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <iomanip>
+#include <ostream>
+#include <stdexcept>
+#include <vector>
+
+namespace concurrent_servers {
+    /**
+     * HDR style histogram: values are counted in buckets whose width grows with the value, so that every
+     * recorded value is kept with a fixed number of significant decimal digits while the whole range from
+     * 1 to highest_value costs a few hundred KB. Recording is a couple of shifts and an increment.
+     *
+     * Values are unitless, the load generator records nanoseconds. Not thread safe, use one histogram
+     * per thread and merge() them.
+     */
+    class latency_histogram {
+    public:
+        explicit latency_histogram(uint64_t highest_value = 3600ULL * 1000 * 1000 * 1000, int significant_digits = 3) :
+                _highest_value{highest_value} {
+            if (significant_digits < 1 or significant_digits > 5 or highest_value < 2) {
+                throw std::runtime_error("latency_histogram: invalid range or precision");
+            }
+
+            uint64_t largest_value_with_single_unit_resolution{2};
+            for (int i{0}; i < significant_digits; ++i) {
+                largest_value_with_single_unit_resolution *= 10;
+            }
+
+            int sub_bucket_count_magnitude{0};
+            while ((1ULL << sub_bucket_count_magnitude) < largest_value_with_single_unit_resolution) {
+                ++sub_bucket_count_magnitude;
+            }
+            _sub_bucket_half_count_magnitude = std::max(sub_bucket_count_magnitude, 1) - 1;
+            _sub_bucket_count = 1ULL << (_sub_bucket_half_count_magnitude + 1);
+            _sub_bucket_half_count = _sub_bucket_count / 2;
+            _sub_bucket_mask = _sub_bucket_count - 1;
+
+            // number of power of 2 buckets needed to cover highest_value
+            uint64_t smallest_untrackable_value{_sub_bucket_count};
+            int bucket_count{1};
+            while (smallest_untrackable_value <= highest_value) {
+                if (smallest_untrackable_value > UINT64_MAX / 2) {
+                    ++bucket_count;
+                    break;
+                }
+                smallest_untrackable_value <<= 1;
+                ++bucket_count;
+            }
+            _counts.resize(static_cast<size_t>(bucket_count + 1) * _sub_bucket_half_count, 0);
+        }
+
+        void record(uint64_t value, uint64_t count = 1) {
+            _counts[counts_index(std::min(value, _highest_value))] += count;
+            _total_count += count;
+            _min = std::min(_min, value);
+            _max = std::max(_max, value);
+            _sum += static_cast<double>(value) * static_cast<double>(count);
+        }
+
+        void merge(const latency_histogram &other) {
+            if (other._counts.size() != _counts.size() or other._sub_bucket_count != _sub_bucket_count) {
+                throw std::runtime_error("latency_histogram: cannot merge histograms of different layouts");
+            }
+            for (size_t i{0}; i < _counts.size(); ++i) {
+                _counts[i] += other._counts[i];
+            }
+            _total_count += other._total_count;
+            _min = std::min(_min, other._min);
+            _max = std::max(_max, other._max);
+            _sum += other._sum;
+        }
+
+        void reset() {
+            std::fill(_counts.begin(), _counts.end(), 0);
+            _total_count = 0;
+            _min = UINT64_MAX;
+            _max = 0;
+            _sum = 0;
+        }
+
+        uint64_t count() const {
+            return _total_count;
+        }
+
+        uint64_t min() const {
+            return _total_count == 0 ? 0 : _min;
+        }
+
+        uint64_t max() const {
+            return _max;
+        }
+
+        double mean() const {
+            return _total_count == 0 ? 0 : _sum / static_cast<double>(_total_count);
+        }
+
+        /**
+         * Highest value that at least percentile % of the recorded values do not exceed, within the histogram precision.
+         */
+        uint64_t value_at_percentile(double percentile) const {
+            if (_total_count == 0) {
+                return 0;
+            }
+
+            const double fraction = std::min(std::max(percentile, 0.0), 100.0) / 100.0;
+            const auto count_at_percentile = std::max<uint64_t>(1, static_cast<uint64_t>(std::ceil(fraction * static_cast<double>(_total_count))));
+            uint64_t total{0};
+            for (size_t i{0}; i < _counts.size(); ++i) {
+                total += _counts[i];
+                if (total >= count_at_percentile) {
+                    return std::min(highest_equivalent_value(i), _max);
+                }
+            }
+            return _max;
+        }
+
+        /**
+         * Prints the percentile distribution in the HdrHistogram text format, values divided by unit_divisor.
+         * The percentile step halves every time the remaining distance to 100% halves.
+         */
+        void print_percentiles(std::ostream &out, double unit_divisor = 1.0, int ticks_per_half_distance = 5) const {
+            out << std::setw(12) << "Value" << std::setw(15) << "Percentile" << std::setw(12) << "TotalCount"
+                << std::setw(18) << "1/(1-Percentile)" << "\n\n";
+
+            for_each_percentile(ticks_per_half_distance, [&out, unit_divisor](uint64_t value, double percentile, uint64_t total) {
+                out << std::fixed << std::setw(12) << std::setprecision(3) << static_cast<double>(value) / unit_divisor
+                    << std::setw(15) << std::setprecision(12) << percentile / 100.0
+                    << std::setw(12) << total;
+                if (percentile < 100.0) {
+                    out << std::setw(18) << std::setprecision(2) << 1.0 / (1.0 - percentile / 100.0);
+                }
+                out << "\n";
+            });
+
+            out << std::fixed << std::setprecision(3)
+                << "#[Mean    = " << std::setw(12) << mean() / unit_divisor << ", Max        = " << std::setw(12) << static_cast<double>(_max) / unit_divisor << "]\n"
+                << "#[Total count    = " << std::setw(12) << _total_count << "]\n";
+        }
+
+        /**
+         * Prints the summary and the percentile distribution as a JSON object, values divided by unit_divisor.
+         */
+        void print_json(std::ostream &out, double unit_divisor = 1.0, int ticks_per_half_distance = 5) const {
+            out << std::fixed << std::setprecision(3)
+                << "{\"count\": " << _total_count
+                << ", \"min\": " << static_cast<double>(min()) / unit_divisor
+                << ", \"mean\": " << mean() / unit_divisor
+                << ", \"p50\": " << static_cast<double>(value_at_percentile(50.0)) / unit_divisor
+                << ", \"p90\": " << static_cast<double>(value_at_percentile(90.0)) / unit_divisor
+                << ", \"p99\": " << static_cast<double>(value_at_percentile(99.0)) / unit_divisor
+                << ", \"p99.9\": " << static_cast<double>(value_at_percentile(99.9)) / unit_divisor
+                << ", \"p99.99\": " << static_cast<double>(value_at_percentile(99.99)) / unit_divisor
+                << ", \"max\": " << static_cast<double>(_max) / unit_divisor
+                << ", \"distribution\": [";
+
+            const char *separator = "";
+            for_each_percentile(ticks_per_half_distance, [&out, &separator, unit_divisor](uint64_t value, double percentile, uint64_t total) {
+                out << separator << std::setprecision(3) << "{\"value\": " << static_cast<double>(value) / unit_divisor
+                    << ", \"percentile\": " << std::setprecision(6) << percentile << ", \"count\": " << total << "}";
+                separator = ", ";
+            });
+            out << "]}";
+        }
+
+    private:
+        const uint64_t _highest_value;
+        int _sub_bucket_half_count_magnitude{0};
+        uint64_t _sub_bucket_count{0};
+        uint64_t _sub_bucket_half_count{0};
+        uint64_t _sub_bucket_mask{0};
+        std::vector<uint64_t> _counts{};
+        uint64_t _total_count{0};
+        uint64_t _min{UINT64_MAX};
+        uint64_t _max{0};
+        double _sum{0};
+
+        size_t counts_index(uint64_t value) const {
+            const int pow2_ceiling = 64 - __builtin_clzll(value | _sub_bucket_mask);
+            const int bucket_index = pow2_ceiling - (_sub_bucket_half_count_magnitude + 1);
+            const uint64_t sub_bucket_index = value >> bucket_index;
+            return (static_cast<size_t>(bucket_index + 1) << _sub_bucket_half_count_magnitude) + (sub_bucket_index - _sub_bucket_half_count);
+        }
+
+        uint64_t highest_equivalent_value(size_t index) const {
+            int bucket_index = static_cast<int>(index >> _sub_bucket_half_count_magnitude) - 1;
+            uint64_t sub_bucket_index = (index & (_sub_bucket_half_count - 1)) + _sub_bucket_half_count;
+            if (bucket_index < 0) {
+                sub_bucket_index -= _sub_bucket_half_count;
+                bucket_index = 0;
+            }
+            const uint64_t lowest = sub_bucket_index << bucket_index;
+            return lowest + (1ULL << bucket_index) - 1;
+        }
+
+        uint64_t count_up_to(uint64_t value) const {
+            const size_t last = counts_index(std::min(value, _highest_value));
+            uint64_t total{0};
+            for (size_t i{0}; i <= last; ++i) {
+                total += _counts[i];
+            }
+            return total;
+        }
+
+        template<typename Reporter>
+        void for_each_percentile(int ticks_per_half_distance, Reporter reporter) const {
+            if (_total_count == 0) {
+                return;
+            }
+
+            double percentile{0};
+            for (;;) {
+                const uint64_t value = value_at_percentile(percentile);
+                const uint64_t total = count_up_to(value);
+                if (total >= _total_count) {
+                    reporter(value, 100.0, total);
+                    return;
+                }
+                reporter(value, percentile, total);
+
+                const double half_distances = std::floor(std::log2(100.0 / (100.0 - percentile))) + 1;
+                percentile += 100.0 / (ticks_per_half_distance * std::pow(2.0, half_distances));
+            }
+        }
+    };
+}
+
+#endif /* LINUX_TCP_SERVERS_LATENCY_HISTOGRAM_H */
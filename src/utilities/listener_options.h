@@ -0,0 +1,224 @@
+/*
+ * BSD 2-Clause License
+ *
+ * Copyright (c) 2019, Pham Phi Long <phamphilong2010@gmail.com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *   * Redistributions of source code must retain the above copyright notice,
+ *     this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *   * Neither the name of Redis nor the names of its contributors may be used
+ *     to endorse or promote products derived from this software without
+ *     specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+#ifndef LINUX_TCP_SERVERS_LISTENER_OPTIONS_H
+#define LINUX_TCP_SERVERS_LISTENER_OPTIONS_H
+
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <sstream>
+#include <string>
+
+#include "print_utility.h"
+
+namespace concurrent_servers {
+    /**
+     * Tuning of a listening socket and of the connections accepted from it. Nothing is set by default but the
+     * backlog, see listen_backlog().
+     */
+    struct listener_options {
+        int defer_accept_s{0}; // TCP_DEFER_ACCEPT: accept() only returns once the first data arrived, or after that many seconds
+        int fastopen_queue{0}; // TCP_FASTOPEN: Fast Open requests waiting for accept(), needs net.ipv4.tcp_fastopen & 2
+        int rcvbuf{0};         // SO_RCVBUF inherited by the accepted sockets, 0 keeps autotuning
+        int sndbuf{0};         // SO_SNDBUF inherited by the accepted sockets, 0 keeps autotuning
+        bool nodelay{false};   // TCP_NODELAY on accepted sockets, small replies are not held back by Nagle's algorithm
+        bool quickack{false};  // TCP_QUICKACK on accepted sockets, the first ACKs are not delayed
+        std::string address{}; // the local address listened on, empty for every address
+
+        /**
+         * Takes the --defer-accept=S, --fastopen=N, --rcvbuf=B, --sndbuf=B, --nodelay and --quickack flags out of
+         * the command line, wherever they are, so the positional arguments of a server keep their position.
+         */
+        static listener_options from_args(int &argc, char *argv[]) {
+            listener_options options{};
+            int kept{1};
+            for (int i{1}; i < argc; ++i) {
+                const char *arg = argv[i];
+                if (not options.parse(arg)) {
+                    argv[kept++] = argv[i];
+                }
+            }
+            argv[kept] = nullptr;
+            argc = kept;
+            return options;
+        }
+
+    private:
+        bool parse(const char *arg) {
+            const auto value = [arg](const char *name, int &field) {
+                const size_t len = strlen(name);
+                if (strncmp(arg, name, len) != 0 or arg[len] != '=') {
+                    return false;
+                }
+                field = atoi(arg + len + 1);
+                return true;
+            };
+            if (strcmp(arg, "--nodelay") == 0) {
+                nodelay = true;
+                return true;
+            }
+            if (strcmp(arg, "--quickack") == 0) {
+                quickack = true;
+                return true;
+            }
+            return value("--defer-accept", defer_accept_s) or value("--fastopen", fastopen_queue)
+                   or value("--rcvbuf", rcvbuf) or value("--sndbuf", sndbuf);
+        }
+    };
+
+    /**
+     * net.core.somaxconn, the limit listen() silently truncates the backlog to.
+     */
+    inline int somaxconn() {
+        std::ifstream file{"/proc/sys/net/core/somaxconn"};
+        int value{0};
+        if (not (file >> value) or value <= 0) {
+            return SOMAXCONN;
+        }
+        return value;
+    }
+
+    /**
+     * The backlog to listen() with: somaxconn() when backlog is 0 or less, a burst of connections overflows a
+     * small accept queue right away. A larger backlog is truncated by the kernel, which is logged.
+     */
+    inline int listen_backlog(int backlog) {
+        const int limit = somaxconn();
+        if (backlog <= 0) {
+            return limit;
+        }
+        if (backlog > limit) {
+            log_warning("backlog ", backlog, " is truncated to net.core.somaxconn ", limit);
+        }
+        return backlog;
+    }
+
+    /**
+     * Applies the options of the listening socket, call it before listen(): the buffer sizes set the window
+     * scale offered in the SYN-ACK. An option the kernel refuses is logged and skipped.
+     */
+    inline void set_listener_options(int sfd, const listener_options &options) {
+        const auto set = [sfd](int level, int name, int value, const char *label) {
+            if (setsockopt(sfd, level, name, &value, sizeof(value)) != 0) {
+                log_warning("could not set ", label, " to ", value, " on the listening socket: ", strerror(errno));
+            }
+        };
+        if (options.defer_accept_s > 0) {
+            set(IPPROTO_TCP, TCP_DEFER_ACCEPT, options.defer_accept_s, "TCP_DEFER_ACCEPT");
+        }
+        if (options.fastopen_queue > 0) {
+            set(IPPROTO_TCP, TCP_FASTOPEN, options.fastopen_queue, "TCP_FASTOPEN");
+        }
+        if (options.rcvbuf > 0) {
+            set(SOL_SOCKET, SO_RCVBUF, options.rcvbuf, "SO_RCVBUF");
+        }
+        if (options.sndbuf > 0) {
+            set(SOL_SOCKET, SO_SNDBUF, options.sndbuf, "SO_SNDBUF");
+        }
+    }
+
+    /**
+     * Applies the options of an accepted socket, no system call unless nodelay or quickack is set.
+     */
+    inline void set_accepted_options(int sfd, const listener_options &options) {
+        const int one{1};
+        if (options.nodelay) {
+            setsockopt(sfd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+        }
+        if (options.quickack) {
+            setsockopt(sfd, IPPROTO_TCP, TCP_QUICKACK, &one, sizeof(one));
+        }
+    }
+
+    /**
+     * Accept queue of a listening socket, from TCP_INFO: connections waiting for accept() and the backlog.
+     */
+    struct accept_queue {
+        uint32_t queued{0};
+        uint32_t backlog{0};
+    };
+
+    inline bool read_accept_queue(int sfd, accept_queue &queue) {
+        struct tcp_info info{};
+        socklen_t len = sizeof(info);
+        if (getsockopt(sfd, IPPROTO_TCP, TCP_INFO, &info, &len) != 0 or info.tcpi_state != TCP_LISTEN) {
+            return false;
+        }
+        // a listening socket reports its queue in these fields
+        queue.queued = info.tcpi_unacked;
+        queue.backlog = info.tcpi_sacked;
+        return true;
+    }
+
+    /**
+     * TcpExt ListenOverflows and ListenDrops of /proc/net/netstat: connections refused because an accept queue
+     * was full, and all those dropped while listening, overflows included. Counted for the whole network
+     * namespace since boot, the increase over time is what matters.
+     */
+    struct listen_overflow_counters {
+        uint64_t overflows{0};
+        uint64_t drops{0};
+    };
+
+    inline listen_overflow_counters read_listen_overflows() {
+        listen_overflow_counters counters{};
+        std::ifstream file{"/proc/net/netstat"};
+        std::string names{};
+        std::string values{};
+        // a line of names followed by a line of values, per protocol
+        while (std::getline(file, names) and std::getline(file, values)) {
+            if (names.compare(0, 7, "TcpExt:") != 0) {
+                continue;
+            }
+            std::istringstream name_stream{names};
+            std::istringstream value_stream{values};
+            std::string name{};
+            std::string value{};
+            while (name_stream >> name and value_stream >> value) {
+                if (name == "ListenOverflows") {
+                    counters.overflows = std::stoull(value);
+                } else if (name == "ListenDrops") {
+                    counters.drops = std::stoull(value);
+                }
+            }
+            break;
+        }
+        return counters;
+    }
+}
+
+#endif /* LINUX_TCP_SERVERS_LISTENER_OPTIONS_H */
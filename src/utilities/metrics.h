@@ -0,0 +1,342 @@
+/*
+ * BSD 2-Clause License
+ *
+ * Copyright (c) 2019, Pham Phi Long <phamphilong2010@gmail.com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *   * Redistributions of source code must retain the above copyright notice,
+ *     this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *   * Neither the name of Redis nor the names of its contributors may be used
+ *     to endorse or promote products derived from this software without
+ *     specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+#ifndef LINUX_TCP_SERVERS_METRICS_H
+#define LINUX_TCP_SERVERS_METRICS_H
+
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <unistd.h>
+#include <array>
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#include "print_utility.h"
+#include "file_descriptor.h"
+#include "server_utility.h"
+#include "listener_options.h"
+#include "output_queue.h"
+
+namespace concurrent_servers {
+    enum class worker_counter : size_t {
+        ACCEPTS,        // connections added to the worker
+        CLOSES,         // connections closed by the worker
+        BYTES_IN,
+        BYTES_OUT,
+        WAKEUPS,        // returns of the poller wait
+        EVENTS,         // events those returns reported
+        READ_EAGAIN,    // reads that found the socket empty
+        WRITE_EAGAIN,   // flushes stopped by a full socket send buffer
+        REARM_FAILURES, // epoll_ctl() calls that could not rearm a connection
+        COUNT
+    };
+
+    /**
+     * Counters of one worker, written by that worker only. An update is a relaxed load and store, a plain add
+     * without a locked instruction, and the block fills whole cache lines, so workers share nothing on the hot
+     * path. The aggregator reads the counters concurrently, at worst one update late.
+     */
+    struct alignas(64) worker_metrics {
+        static constexpr size_t COUNTERS{static_cast<size_t>(worker_counter::COUNT)};
+        static constexpr size_t EVENT_BUCKETS{18}; // events per wakeup up to 1, 2, 4, ... 65536, and more
+        static constexpr size_t LATENCY_BUCKETS{24}; // nanoseconds up to 256, 512, ... about 1s, and more
+        static constexpr unsigned LATENCY_FIRST_BUCKET_SHIFT{8};
+
+        std::array<std::atomic<uint64_t>, COUNTERS> counters{};
+        std::array<std::atomic<uint64_t>, EVENT_BUCKETS> events_per_wakeup{};
+        std::array<std::atomic<uint64_t>, LATENCY_BUCKETS> handler_latency{};
+        std::atomic<uint64_t> handler_latency_sum_ns{0};
+
+        void add(worker_counter counter, uint64_t n = 1) {
+            increment(counters[static_cast<size_t>(counter)], n);
+        }
+
+        uint64_t get(worker_counter counter) const {
+            return counters[static_cast<size_t>(counter)].load(std::memory_order_relaxed);
+        }
+
+        /**
+         * A return of the poller wait that reported events.
+         */
+        void record_wakeup(int events) {
+            const auto n = static_cast<uint64_t>(events > 0 ? events : 0);
+            add(worker_counter::WAKEUPS);
+            add(worker_counter::EVENTS, n);
+            size_t bucket{0};
+            while (bucket + 1 < EVENT_BUCKETS and (uint64_t{1} << bucket) < n) {
+                ++bucket;
+            }
+            increment(events_per_wakeup[bucket]);
+        }
+
+        /**
+         * The time one read handler call took.
+         */
+        void record_latency(uint64_t ns) {
+            increment(handler_latency_sum_ns, ns);
+            size_t bucket{0};
+            while (bucket + 1 < LATENCY_BUCKETS and (uint64_t{1} << (bucket + LATENCY_FIRST_BUCKET_SHIFT)) < ns) {
+                ++bucket;
+            }
+            increment(handler_latency[bucket]);
+        }
+
+        /**
+         * Upper bound of a latency bucket in nanoseconds, the last one has none.
+         */
+        static uint64_t latency_bucket_bound(size_t bucket) {
+            return bucket + 1 < LATENCY_BUCKETS ? uint64_t{1} << (bucket + LATENCY_FIRST_BUCKET_SHIFT) : UINT64_MAX;
+        }
+
+    private:
+        static void increment(std::atomic<uint64_t> &value, uint64_t n = 1) {
+            value.store(value.load(std::memory_order_relaxed) + n, std::memory_order_relaxed);
+        }
+    };
+
+    /**
+     * The worker_metrics of a server and what it reports in the Prometheus text format: every counter per
+     * worker, the open connections, the accept queues of the registered listeners, the listen overflows of the
+     * network namespace and the zerocopy counters of the process.
+     */
+    class metrics_registry {
+    public:
+        metrics_registry() = default;
+
+        metrics_registry(const metrics_registry &) = delete;
+        metrics_registry &operator=(const metrics_registry &) = delete;
+
+        /**
+         * The counters of a new worker, labelled worker="name". Takes a lock, call it when the worker starts.
+         */
+        worker_metrics &add_worker(std::string name) {
+            std::lock_guard<std::mutex> lock{_mutex};
+            _owned.push_back(std::make_unique<worker_metrics>());
+            _workers.emplace_back(std::move(name), _owned.back().get());
+            return *_owned.back();
+        }
+
+        /**
+         * Reports counters kept elsewhere, e.g. in a stats_segment, which must outlive the registry.
+         */
+        void add_worker(std::string name, const worker_metrics &metrics) {
+            std::lock_guard<std::mutex> lock{_mutex};
+            _workers.emplace_back(std::move(name), &metrics);
+        }
+
+        void add_listener(int sfd) {
+            std::lock_guard<std::mutex> lock{_mutex};
+            _listeners.push_back(sfd);
+        }
+
+        std::string prometheus_text() const {
+            std::lock_guard<std::mutex> lock{_mutex};
+            std::string out{};
+            static const std::array<std::pair<const char *, const char *>, worker_metrics::COUNTERS> names{{
+                {"cs_connections_accepted_total", "Connections added to the worker."},
+                {"cs_connections_closed_total", "Connections closed by the worker."},
+                {"cs_received_bytes_total", "Bytes read from connections."},
+                {"cs_sent_bytes_total", "Bytes written to connections."},
+                {"cs_wakeups_total", "Returns of the poller wait."},
+                {"cs_events_total", "Events reported by the poller."},
+                {"cs_read_eagain_total", "Reads that found the socket empty."},
+                {"cs_write_eagain_total", "Flushes stopped by a full socket send buffer."},
+                {"cs_rearm_failures_total", "epoll_ctl() calls that could not rearm a connection."},
+            }};
+
+            for (size_t counter{0}; counter < worker_metrics::COUNTERS; ++counter) {
+                header(out, names[counter].first, names[counter].second, "counter");
+                for (const auto &worker : _workers) {
+                    sample(out, names[counter].first, "worker=\"" + worker.first + "\"",
+                           worker.second->counters[counter].load(std::memory_order_relaxed));
+                }
+            }
+
+            header(out, "cs_open_connections", "Connections accepted and not closed yet.", "gauge");
+            uint64_t accepted{0};
+            uint64_t closed{0};
+            for (const auto &worker : _workers) {
+                accepted += worker.second->get(worker_counter::ACCEPTS);
+                closed += worker.second->get(worker_counter::CLOSES);
+            }
+            sample(out, "cs_open_connections", "", accepted >= closed ? accepted - closed : 0);
+
+            header(out, "cs_events_per_wakeup", "Events reported by one return of the poller wait.", "histogram");
+            for (const auto &worker : _workers) {
+                const std::string label = "worker=\"" + worker.first + "\"";
+                uint64_t cumulative{0};
+                for (size_t bucket{0}; bucket < worker_metrics::EVENT_BUCKETS; ++bucket) {
+                    cumulative += worker.second->events_per_wakeup[bucket].load(std::memory_order_relaxed);
+                    const std::string le = bucket + 1 < worker_metrics::EVENT_BUCKETS ? std::to_string(uint64_t{1} << bucket) : "+Inf";
+                    sample(out, "cs_events_per_wakeup_bucket", label + ",le=\"" + le + "\"", cumulative);
+                }
+                sample(out, "cs_events_per_wakeup_sum", label, worker.second->get(worker_counter::EVENTS));
+                sample(out, "cs_events_per_wakeup_count", label, cumulative);
+            }
+
+            header(out, "cs_handler_duration_nanoseconds", "Time taken by one read handler call.", "histogram");
+            for (const auto &worker : _workers) {
+                const std::string label = "worker=\"" + worker.first + "\"";
+                uint64_t cumulative{0};
+                for (size_t bucket{0}; bucket < worker_metrics::LATENCY_BUCKETS; ++bucket) {
+                    cumulative += worker.second->handler_latency[bucket].load(std::memory_order_relaxed);
+                    const std::string le = bucket + 1 < worker_metrics::LATENCY_BUCKETS ? std::to_string(worker_metrics::latency_bucket_bound(bucket)) : "+Inf";
+                    sample(out, "cs_handler_duration_nanoseconds_bucket", label + ",le=\"" + le + "\"", cumulative);
+                }
+                sample(out, "cs_handler_duration_nanoseconds_sum", label, worker.second->handler_latency_sum_ns.load(std::memory_order_relaxed));
+                sample(out, "cs_handler_duration_nanoseconds_count", label, cumulative);
+            }
+
+            header(out, "cs_accept_queue_length", "Connections waiting for accept() on a listener.", "gauge");
+            for (const int sfd : _listeners) {
+                accept_queue queue{};
+                if (read_accept_queue(sfd, queue)) {
+                    sample(out, "cs_accept_queue_length", "listener=\"" + std::to_string(sfd) + "\"", queue.queued);
+                }
+            }
+            const listen_overflow_counters overflows = read_listen_overflows();
+            header(out, "cs_listen_overflows_total", "Connections refused by a full accept queue, whole network namespace.", "counter");
+            sample(out, "cs_listen_overflows_total", "", overflows.overflows);
+            header(out, "cs_listen_drops_total", "Connections dropped while listening, whole network namespace.", "counter");
+            sample(out, "cs_listen_drops_total", "", overflows.drops);
+
+            const zerocopy_counters &zerocopy = zerocopy_stats();
+            header(out, "cs_zerocopy_sends_total", "MSG_ZEROCOPY sends.", "counter");
+            sample(out, "cs_zerocopy_sends_total", "", zerocopy.sends.load(std::memory_order_relaxed));
+            header(out, "cs_zerocopy_completed_total", "MSG_ZEROCOPY sends the kernel reported complete.", "counter");
+            sample(out, "cs_zerocopy_completed_total", "", zerocopy.completed.load(std::memory_order_relaxed));
+            header(out, "cs_zerocopy_copied_total", "MSG_ZEROCOPY sends for which the kernel copied the data.", "counter");
+            sample(out, "cs_zerocopy_copied_total", "", zerocopy.copied.load(std::memory_order_relaxed));
+            return out;
+        }
+
+    private:
+        mutable std::mutex _mutex{}; // guards the lists, not the counters
+        std::vector<std::unique_ptr<worker_metrics>> _owned{};
+        std::vector<std::pair<std::string, const worker_metrics *>> _workers{};
+        std::vector<int> _listeners{};
+
+        static void header(std::string &out, const char *name, const char *help, const char *type) {
+            out.append("# HELP ").append(name).append(" ").append(help).append("\n");
+            out.append("# TYPE ").append(name).append(" ").append(type).append("\n");
+        }
+
+        static void sample(std::string &out, const char *name, const std::string &labels, uint64_t value) {
+            out.append(name);
+            if (not labels.empty()) {
+                out.append("{").append(labels).append("}");
+            }
+            out.append(" ").append(std::to_string(value)).append("\n");
+        }
+    };
+
+    /**
+     * Serves the registry on an admin port of its own, away from the workers: a thread answers every request,
+     * whatever its path, with the Prometheus text of the registry and closes the connection.
+     * It listens on the loopback address unless given another one, the admin port is not meant to be public.
+     */
+    class metrics_endpoint {
+    public:
+        static constexpr const char *DEFAULT_ADDRESS{"127.0.0.1"};
+
+        metrics_endpoint(const metrics_registry &registry, const std::string &port_num, const std::string &address = DEFAULT_ADDRESS) :
+                _registry{registry},
+                _server_sfd{setup_server_tcp_socket(port_num, 16, false, false, listen_address(address))},
+                _thread{} {
+            _thread = std::thread{[this]() {
+                serve();
+            }};
+        }
+
+        metrics_endpoint(const metrics_endpoint &) = delete;
+        metrics_endpoint &operator=(const metrics_endpoint &) = delete;
+
+        ~metrics_endpoint() {
+            shutdown(_server_sfd.get_fd(), SHUT_RDWR); // accept() returns EINVAL
+            _thread.join();
+            _server_sfd.close_fd();
+        }
+
+    private:
+        const metrics_registry &_registry;
+        file_descriptor _server_sfd;
+        std::thread _thread;
+
+        static listener_options listen_address(const std::string &address) {
+            listener_options options{};
+            options.address = address;
+            return options;
+        }
+
+        void serve() const {
+            for (;;) {
+                file_descriptor conn{accept(_server_sfd.get_fd(), nullptr, nullptr)};
+                if (conn.get_fd() < 0) {
+                    if (errno == EINTR or errno == ECONNABORTED) {
+                        continue;
+                    }
+                    return;
+                }
+
+                // the request is not parsed, only read so that closing does not reset the connection
+                const struct timeval timeout{1, 0}; // a client sending nothing does not hold the thread
+                setsockopt(conn.get_fd(), SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+                char request[1024];
+                if (read(conn.get_fd(), request, sizeof(request)) < 0) {
+                    conn.close_fd();
+                    continue;
+                }
+                const std::string body = _registry.prometheus_text();
+                const std::string response = "HTTP/1.0 200 OK\r\nContent-Type: text/plain; version=0.0.4\r\nContent-Length: "
+                                             + std::to_string(body.size()) + "\r\nConnection: close\r\n\r\n" + body;
+                size_t sent{0};
+                while (sent < response.size()) {
+                    // a scraper leaving early must not raise SIGPIPE, it would kill the server
+                    const ssize_t wlen = send(conn.get_fd(), response.data() + sent, response.size() - sent, MSG_NOSIGNAL);
+                    if (wlen <= 0) {
+                        break;
+                    }
+                    sent += static_cast<size_t>(wlen);
+                }
+                conn.close_fd();
+            }
+        }
+    };
+}
+
+#endif /* LINUX_TCP_SERVERS_METRICS_H */
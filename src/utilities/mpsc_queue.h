@@ -0,0 +1,132 @@
+/*
+ * BSD 2-Clause License
+ *
+ * Copyright (c) 2019, Pham Phi Long <phamphilong2010@gmail.com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *   * Redistributions of source code must retain the above copyright notice,
+ *     this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *   * Neither the name of Redis nor the names of its contributors may be used
+ *     to endorse or promote products derived from this software without
+ *     specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+#ifndef LINUX_TCP_SERVERS_MPSC_QUEUE_H
+#define LINUX_TCP_SERVERS_MPSC_QUEUE_H
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+
+namespace concurrent_servers {
+    /**
+     * Bounded lock-free queue with many producers and a single consumer.
+     *
+     * Every cell carries a sequence number telling whose turn it is: a producer claims the tail position with a
+     * compare and swap, writes the value and publishes it by advancing the sequence, the consumer frees the cell
+     * for the next lap the same way. Producers never wait for each other longer than one CAS, the consumer never
+     * blocks, and a full queue is reported to the producer instead of growing.
+     */
+    template<typename T>
+    class mpsc_queue {
+    public:
+        explicit mpsc_queue(size_t capacity) :
+                _mask{round_up_power_of_two(capacity) - 1},
+                _cells{std::make_unique<cell[]>(_mask + 1)},
+                _tail{0},
+                _head{0} {
+            for (size_t i{0}; i <= _mask; ++i) {
+                _cells[i].sequence.store(i, std::memory_order_relaxed);
+            }
+        }
+
+        mpsc_queue(const mpsc_queue &) = delete;
+        mpsc_queue &operator=(const mpsc_queue &) = delete;
+
+        /**
+         * May be called from any thread. Returns false if the queue is full.
+         */
+        bool push(const T &value) {
+            size_t position = _tail.load(std::memory_order_relaxed);
+            cell *target{nullptr};
+            for (;;) {
+                target = &_cells[position & _mask];
+                const size_t sequence = target->sequence.load(std::memory_order_acquire);
+                const auto lag = static_cast<intptr_t>(sequence) - static_cast<intptr_t>(position);
+                if (lag == 0) {
+                    if (_tail.compare_exchange_weak(position, position + 1, std::memory_order_relaxed)) {
+                        break;
+                    }
+                } else if (lag < 0) {
+                    return false; // the consumer has not freed this cell yet
+                } else {
+                    position = _tail.load(std::memory_order_relaxed); // another producer took it
+                }
+            }
+            target->value = value;
+            target->sequence.store(position + 1, std::memory_order_release);
+            return true;
+        }
+
+        /**
+         * Must only be called from the consumer thread. Returns false if the queue is empty.
+         */
+        bool pop(T &value) {
+            cell &source = _cells[_head & _mask];
+            if (source.sequence.load(std::memory_order_acquire) != _head + 1) {
+                return false;
+            }
+            value = source.value;
+            source.sequence.store(_head + _mask + 1, std::memory_order_release);
+            ++_head;
+            return true;
+        }
+
+        size_t capacity() const {
+            return _mask + 1;
+        }
+
+    private:
+        static constexpr size_t CACHE_LINE_SIZE{64};
+
+        struct cell {
+            std::atomic<size_t> sequence{0};
+            T value{};
+        };
+
+        static size_t round_up_power_of_two(size_t n) {
+            size_t power{2};
+            while (power < n) {
+                power <<= 1;
+            }
+            return power;
+        }
+
+        const size_t _mask;
+        const std::unique_ptr<cell[]> _cells;
+        alignas(CACHE_LINE_SIZE) std::atomic<size_t> _tail; // shared by the producers
+        alignas(CACHE_LINE_SIZE) size_t _head;              // owned by the consumer
+    };
+}
+
+#endif /* LINUX_TCP_SERVERS_MPSC_QUEUE_H */
@@ -0,0 +1,191 @@
+/*
+ * BSD 2-Clause License
+ *
+ * Copyright (c) 2019, Pham Phi Long <phamphilong2010@gmail.com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *   * Redistributions of source code must retain the above copyright notice,
+ *     this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *   * Neither the name of Redis nor the names of its contributors may be used
+ *     to endorse or promote products derived from this software without
+ *     specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+#ifndef LINUX_TCP_SERVERS_OFFLOAD_H
+#define LINUX_TCP_SERVERS_OFFLOAD_H
+
+#include <sys/eventfd.h>
+#include <unistd.h>
+#include <cerrno>
+#include <cstdint>
+#include <cstring>
+#include <functional>
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <thread>
+
+#include "file_descriptor.h"
+#include "mpsc_queue.h"
+#include "output_queue.h"
+#include "print_utility.h"
+#include "work_stealing_pool.h"
+
+namespace concurrent_servers {
+    /**
+     * Reply of offloaded work, for the connection fd as long as it is still the connection numbered connection_id.
+     */
+    struct offload_completion {
+        int fd{-1};
+        uint64_t connection_id{0};
+        std::string reply{};
+    };
+
+    /**
+     * Runs work of an I/O worker on a work_stealing_pool and carries the replies back to it: the pool threads push
+     * them to a lock-free queue and write to an eventfd that sits in the epoll set of the worker, which then
+     * drains the queue and queues every reply on its connection.
+     */
+    class offload_channel {
+    public:
+        explicit offload_channel(size_t thread_num) :
+                _completions{COMPLETION_CAPACITY},
+                _event_fd{eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)},
+                _pool{thread_num} {
+            if (_event_fd.get_fd() < 0) {
+                throw std::runtime_error("eventfd() failed");
+            }
+        }
+
+        offload_channel(const offload_channel &) = delete;
+        offload_channel &operator=(const offload_channel &) = delete;
+
+        ~offload_channel() {
+            // a task finishing now would push to the queue and write to the eventfd
+            _pool.stop();
+            offload_completion *completion{nullptr};
+            while (_completions.pop(completion)) {
+                delete completion;
+            }
+            _event_fd.close_fd();
+        }
+
+        int event_fd() const {
+            return _event_fd.get_fd();
+        }
+
+        void submit(int fd, uint64_t connection_id, std::function<std::string()> work) {
+            _pool.submit([this, fd, connection_id, work = std::move(work)]() {
+                auto *completion = new offload_completion{fd, connection_id, work()};
+                while (not _completions.push(completion)) {
+                    std::this_thread::yield(); // the I/O worker is behind, it frees room on its next wakeup
+                }
+                const uint64_t one{1};
+                if (write(_event_fd.get_fd(), &one, sizeof(one)) < 0) {
+                    CS_LOG_ERROR("offload: could not wake the I/O worker. ", strerror(errno));
+                }
+            });
+        }
+
+        /**
+         * Called by the I/O worker when the eventfd is readable, on_completion is given every reply.
+         */
+        template<typename OnCompletion>
+        void drain(OnCompletion &&on_completion) {
+            uint64_t wakeups{0};
+            if (read(_event_fd.get_fd(), &wakeups, sizeof(wakeups)) < 0 and errno != EAGAIN) {
+                CS_LOG_ERROR("offload: could not read the eventfd. ", strerror(errno));
+            }
+            offload_completion *completion{nullptr};
+            while (_completions.pop(completion)) {
+                std::unique_ptr<offload_completion> owned{completion};
+                on_completion(*owned);
+            }
+        }
+
+    private:
+        static constexpr size_t COMPLETION_CAPACITY{4096};
+
+        mpsc_queue<offload_completion *> _completions;
+        file_descriptor _event_fd;
+        work_stealing_pool _pool;
+    };
+
+    /**
+     * Given to a read handler taking one, to move expensive requests off the event loop:
+     * size_t operator()(const std::string &prefix_log, char *buff, size_t buff_len, concurrent_servers::output_queue &output, concurrent_servers::offloader &offload)
+     * The handler consumes the request, calls run() and stops: the connection reads nothing more and the
+     * handler is not called again before the reply is queued, so replies keep the request order. Without an
+     * offload pool the work runs right away, and the handler closes the connection if run() could not queue
+     * its reply.
+     */
+    class offloader {
+    public:
+        offloader(offload_channel *channel, int fd, uint64_t connection_id, output_queue &output) :
+                _channel{channel},
+                _fd{fd},
+                _connection_id{connection_id},
+                _output{output},
+                _pending{false} {
+        }
+
+        offloader(const offloader &) = delete;
+        offloader &operator=(const offloader &) = delete;
+
+        /**
+         * work runs on a pool thread and must not touch the connection, it returns the bytes to send. Returns false
+         * if the work ran inline and its reply could not be queued, the handler has to close the connection then.
+         */
+        bool run(std::function<std::string()> work) {
+            if (_pending) {
+                throw std::runtime_error("offload: a connection waits for one reply at a time");
+            }
+            if (_channel == nullptr) {
+                const std::string reply = work();
+                if (not _output.append(reply.data(), reply.size())) {
+                    CS_LOG_ERROR("offload: could not queue the reply");
+                    return false;
+                }
+                return true;
+            }
+            _channel->submit(_fd, _connection_id, std::move(work));
+            _pending = true;
+            return true;
+        }
+
+        /**
+         * True once run() handed work to the pool, the handler has to return then.
+         */
+        bool pending() const {
+            return _pending;
+        }
+
+    private:
+        offload_channel *const _channel;
+        const int _fd;
+        const uint64_t _connection_id;
+        output_queue &_output;
+        bool _pending;
+    };
+}
+
+#endif /* LINUX_TCP_SERVERS_OFFLOAD_H */
@@ -0,0 +1,177 @@
+/*
+ * BSD 2-Clause License
+ *
+ * Copyright (c) 2019, Pham Phi Long <phamphilong2010@gmail.com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *   * Redistributions of source code must retain the above copyright notice,
+ *     this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *   * Neither the name of Redis nor the names of its contributors may be used
+ *     to endorse or promote products derived from this software without
+ *     specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+#ifndef LINUX_TCP_SERVERS_OPEN_FILE_CACHE_H
+#define LINUX_TCP_SERVERS_OPEN_FILE_CACHE_H
+
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <cerrno>
+#include <chrono>
+#include <cstdint>
+#include <list>
+#include <string>
+#include <unordered_map>
+
+namespace concurrent_servers {
+    /**
+     * LRU cache of read-only file descriptors and their fstat() results, so that serving the same file again
+     * costs neither an open() nor a stat(). Paths are resolved with openat() under the root directory fd.
+     *
+     * Entries handed out by acquire() are pinned until release(): an entry evicted while pinned keeps its fd
+     * open and is freed by its last release(), so a file being sent is never closed under the sender.
+     * Entries older than the validity period are reopened, which picks up files replaced on disk.
+     * Not thread safe, meant to be owned by one worker.
+     */
+    class open_file_cache {
+    public:
+        struct entry {
+            int fd;
+            struct stat stat;
+            std::string path;
+            std::chrono::steady_clock::time_point opened;
+            uint32_t pins;
+            bool evicted;
+            std::list<entry *>::iterator lru_position;
+        };
+
+        static constexpr size_t DEFAULT_CAPACITY{1024};
+        static constexpr std::chrono::seconds DEFAULT_VALIDITY{1};
+
+        explicit open_file_cache(int root_fd, size_t capacity = DEFAULT_CAPACITY,
+                                 std::chrono::steady_clock::duration validity = DEFAULT_VALIDITY) :
+                _root_fd{root_fd},
+                _capacity{capacity},
+                _validity{validity} {
+        }
+
+        open_file_cache(const open_file_cache &) = delete;
+        open_file_cache &operator=(const open_file_cache &) = delete;
+
+        ~open_file_cache() {
+            while (not _lru.empty()) {
+                evict(_lru.back());
+            }
+        }
+
+        /**
+         * Returns the pinned entry of path, relative to the root directory, or nullptr with errno set if it
+         * cannot be opened.
+         */
+        entry *acquire(const std::string &path) {
+            const auto now = std::chrono::steady_clock::now();
+            const auto found = _entries.find(path);
+            if (found != _entries.end()) {
+                entry *cached = found->second;
+                if (now - cached->opened <= _validity) {
+                    _lru.splice(_lru.begin(), _lru, cached->lru_position);
+                    ++cached->pins;
+                    ++_hits;
+                    return cached;
+                }
+                evict(cached);
+            }
+
+            ++_misses;
+            const int fd = openat(_root_fd, path.c_str(), O_RDONLY | O_CLOEXEC | O_NONBLOCK);
+            if (fd == -1) {
+                return nullptr;
+            }
+
+            auto *opened = new entry{fd, {}, path, now, 1, false, {}};
+            if (fstat(fd, &opened->stat) == -1) {
+                const int error = errno;
+                close(fd);
+                delete opened;
+                errno = error;
+                return nullptr;
+            }
+
+            if (_entries.size() >= _capacity and not _lru.empty()) {
+                evict(_lru.back());
+            }
+            _lru.push_front(opened);
+            opened->lru_position = _lru.begin();
+            _entries.emplace(path, opened);
+            return opened;
+        }
+
+        /**
+         * Unpins an entry returned by acquire(). Takes a void * so that it can be given to
+         * output_queue::push_file() as the done callback.
+         */
+        static void release(void *context) {
+            auto *pinned = static_cast<entry *>(context);
+            if (--pinned->pins == 0 and pinned->evicted) {
+                destroy(pinned);
+            }
+        }
+
+        size_t size() const {
+            return _entries.size();
+        }
+
+        uint64_t hits() const {
+            return _hits;
+        }
+
+        uint64_t misses() const {
+            return _misses;
+        }
+
+    private:
+        const int _root_fd;
+        const size_t _capacity;
+        const std::chrono::steady_clock::duration _validity;
+        std::unordered_map<std::string, entry *> _entries{};
+        std::list<entry *> _lru{}; // most recently used first
+        uint64_t _hits{0};
+        uint64_t _misses{0};
+
+        void evict(entry *cached) {
+            _entries.erase(cached->path);
+            _lru.erase(cached->lru_position);
+            cached->evicted = true;
+            if (cached->pins == 0) {
+                destroy(cached);
+            }
+        }
+
+        static void destroy(entry *cached) {
+            close(cached->fd);
+            delete cached;
+        }
+    };
+}
+
+#endif /* LINUX_TCP_SERVERS_OPEN_FILE_CACHE_H */
@@ -0,0 +1,539 @@
+/*
+ * BSD 2-Clause License
+ *
+ * Copyright (c) 2019, Pham Phi Long <phamphilong2010@gmail.com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *   * Redistributions of source code must retain the above copyright notice,
+ *     this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *   * Neither the name of Redis nor the names of its contributors may be used
+ *     to endorse or promote products derived from this software without
+ *     specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+#ifndef LINUX_TCP_SERVERS_OUTPUT_QUEUE_H
+#define LINUX_TCP_SERVERS_OUTPUT_QUEUE_H
+
+#include <sys/sendfile.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+#include <linux/errqueue.h>
+#include <netinet/in.h>
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <cstdint>
+#include <cstring>
+#include <utility>
+
+#include "buffer_pool.h"
+
+namespace concurrent_servers {
+    /**
+     * MSG_ZEROCOPY sends of the process and how they completed: sends is the number of zerocopy sendmsg() calls,
+     * completed those the kernel reported done, copied those for which it fell back to copying, e.g. on loopback
+     * or with a NIC that cannot gather from user pages.
+     */
+    struct zerocopy_counters {
+        std::atomic<uint64_t> sends{0};
+        std::atomic<uint64_t> completed{0};
+        std::atomic<uint64_t> copied{0};
+    };
+
+    inline zerocopy_counters &zerocopy_stats() {
+        static zerocopy_counters counters{};
+        return counters;
+    }
+
+    /**
+     * Sets SO_ZEROCOPY on a socket, which MSG_ZEROCOPY sends need. Returns false if the kernel does not support it.
+     */
+    inline bool enable_socket_zerocopy(int fd) {
+        const int one{1};
+        return setsockopt(fd, SOL_SOCKET, SO_ZEROCOPY, &one, sizeof(one)) == 0;
+    }
+
+    /**
+     * The pending error of a socket, 0 if none, which it clears. An EPOLLERR event of a socket sending with
+     * MSG_ZEROCOPY may only mean that completions are waiting in its error queue.
+     */
+    inline int take_socket_error(int fd) {
+        int error{0};
+        socklen_t len = sizeof(error);
+        if (getsockopt(fd, SOL_SOCKET, SO_ERROR, &error, &len) != 0) {
+            return errno;
+        }
+        return error;
+    }
+
+    /**
+     * Per-connection queue of outgoing data, made of buffer_pool chunks chained through a small header at the
+     * start of each chunk, so queueing never allocates and an empty queue costs three pointers.
+     *
+     * Data is either copied in with append() or read straight into a segment taken with acquire_segment() and
+     * queued with push(), which lets an echo send the very buffer it received into. flush() gathers up to
+     * MAX_IOV segments per sendmsg() call. push_file() queues a range of a file instead, which flush() hands to
+     * sendfile() so the payload goes from the page cache to the socket without passing through user space.
+     *
+     * With set_zerocopy_threshold(), sendmsg() calls of at least that many bytes use MSG_ZEROCOPY: the kernel
+     * sends from the segments themselves instead of copying them into the socket buffer. Such segments are kept
+     * after they were sent until complete_zerocopy() reads from the socket error queue that the kernel is done
+     * with them.
+     *
+     * Segments go back to the pool they came from, possibly from another thread (see buffer_pool::release()),
+     * so a connection may be served by different workers over its lifetime. Not thread safe.
+     */
+    class output_queue {
+    public:
+        struct segment {
+            segment *next;
+            buffer_pool *pool;
+            uint32_t begin;    // first byte not sent yet
+            uint32_t end;      // end of the data
+            uint32_t capacity; // bytes available after the header
+            int file_fd;       // -1, or the file whose [file_offset, file_end) is sent instead of data()
+            off_t file_offset;
+            off_t file_end;
+            void (*file_done)(void *context); // called when the segment is released, e.g. to unpin a cached fd
+            void *file_context;
+            uint32_t zerocopy_end; // 0, or one past the id of the last zerocopy send that read from the segment
+
+            char *data() {
+                return reinterpret_cast<char *>(this + 1);
+            }
+        };
+
+        enum class flush_result {
+            FLUSHED,     // the queue is empty
+            WOULD_BLOCK, // the socket send buffer is full, wait for EPOLLOUT
+            ERROR        // the connection is broken, errno is set
+        };
+
+        static constexpr size_t DEFAULT_HIGH_WATERMARK{64 * 1024};
+        static constexpr size_t DEFAULT_LOW_WATERMARK{16 * 1024};
+        static constexpr int MAX_IOV{64};
+        static constexpr size_t MAX_SENDFILE{0x7ffff000}; // the most a single sendfile() call transfers
+
+        explicit output_queue(size_t high_watermark = DEFAULT_HIGH_WATERMARK, size_t low_watermark = DEFAULT_LOW_WATERMARK) :
+                _high_watermark{high_watermark},
+                _low_watermark{low_watermark} {
+        }
+
+        output_queue(const output_queue &) = delete;
+        output_queue &operator=(const output_queue &) = delete;
+
+        ~output_queue() {
+            clear();
+            // the socket is gone, nobody reports the completions any more
+            while (_zerocopy_head != nullptr) {
+                segment *next = _zerocopy_head->next;
+                release_segment(_zerocopy_head);
+                _zerocopy_head = next;
+            }
+        }
+
+        /**
+         * Pool of the thread currently serving the connection, new segments are taken from it.
+         */
+        void set_buffer_pool(buffer_pool *pool) {
+            _pool = pool;
+        }
+
+        /**
+         * Returns an empty segment to read into, or nullptr if the pool is exhausted.
+         * Give it to push() or back to release_segment().
+         */
+        segment *acquire_segment() {
+            char *chunk = _pool->acquire();
+            if (chunk == nullptr) {
+                return nullptr;
+            }
+
+            auto *seg = reinterpret_cast<segment *>(chunk);
+            seg->next = nullptr;
+            seg->pool = _pool;
+            seg->begin = 0;
+            seg->end = 0;
+            seg->capacity = static_cast<uint32_t>(_pool->chunk_size() - sizeof(segment));
+            seg->file_fd = -1;
+            seg->file_offset = 0;
+            seg->file_end = 0;
+            seg->file_done = nullptr;
+            seg->file_context = nullptr;
+            seg->zerocopy_end = 0;
+            return seg;
+        }
+
+        static void release_segment(segment *seg) {
+            if (seg->file_done != nullptr) {
+                seg->file_done(seg->file_context);
+            }
+            seg->pool->release(reinterpret_cast<char *>(seg));
+        }
+
+        /**
+         * Queues seg, whose data is [begin, end). Empty segments are released.
+         */
+        void push(segment *seg) {
+            if (seg->begin >= seg->end) {
+                release_segment(seg);
+                return;
+            }
+
+            link(seg);
+            _size += seg->end - seg->begin;
+        }
+
+        /**
+         * Queues length bytes of file_fd from offset on. file_fd must stay open until done(context) is called,
+         * which happens once the range is sent or the queue is cleared. Returns false, without calling done,
+         * if the pool ran out of chunks.
+         */
+        bool push_file(int file_fd, off_t offset, off_t length, void (*done)(void *context), void *context) {
+            segment *seg = acquire_segment();
+            if (seg == nullptr) {
+                return false;
+            }
+
+            seg->file_fd = file_fd;
+            seg->file_offset = offset;
+            seg->file_end = offset + length;
+            seg->file_done = done;
+            seg->file_context = context;
+            if (length <= 0) {
+                release_segment(seg);
+                return true;
+            }
+
+            link(seg);
+            _size += static_cast<size_t>(length);
+            return true;
+        }
+
+        /**
+         * Copies data at the end of the queue. Returns false if the pool ran out of chunks, in which case
+         * only a part of the data was queued.
+         */
+        bool append(const char *data, size_t len) {
+            while (len > 0) {
+                if (_tail == nullptr or _tail->file_fd >= 0 or _tail->end == _tail->capacity) {
+                    segment *seg = acquire_segment();
+                    if (seg == nullptr) {
+                        return false;
+                    }
+                    link(seg);
+                }
+
+                const size_t chunk = std::min<size_t>(len, _tail->capacity - _tail->end);
+                memcpy(_tail->data() + _tail->end, data, chunk);
+                _tail->end += static_cast<uint32_t>(chunk);
+                _size += chunk;
+                data += chunk;
+                len -= chunk;
+            }
+            return true;
+        }
+
+        /**
+         * Sends as much as the socket takes. A short write means the send buffer is full, so it returns
+         * WOULD_BLOCK right away rather than spending a syscall to get EAGAIN.
+         */
+        flush_result flush(int fd) {
+            while (_head != nullptr) {
+                if (_head->file_fd >= 0) {
+                    const flush_result result = flush_file(fd);
+                    if (result != flush_result::FLUSHED) {
+                        return result;
+                    }
+                    continue;
+                }
+
+                struct iovec iov[MAX_IOV];
+                int iov_count{0};
+                size_t requested{0};
+                segment *seg = _head;
+                for (; seg != nullptr and seg->file_fd < 0 and iov_count < MAX_IOV; seg = seg->next) {
+                    iov[iov_count].iov_base = seg->data() + seg->begin;
+                    iov[iov_count].iov_len = seg->end - seg->begin;
+                    requested += iov[iov_count].iov_len;
+                    ++iov_count;
+                }
+
+                struct msghdr msg{};
+                msg.msg_iov = iov;
+                msg.msg_iovlen = static_cast<size_t>(iov_count);
+                // a header followed by a file goes out in the same packets as the beginning of the file
+                int flags = (seg != nullptr and seg->file_fd >= 0) ? MSG_NOSIGNAL | MSG_MORE : MSG_NOSIGNAL;
+                const bool zerocopy = _zerocopy_threshold > 0 and requested >= _zerocopy_threshold;
+                if (zerocopy) {
+                    flags |= MSG_ZEROCOPY;
+                }
+                ssize_t wlen = sendmsg(fd, &msg, flags);
+                if (wlen < 0 and zerocopy and errno == ENOBUFS) {
+                    // out of option memory for the notifications, copy this time
+                    wlen = sendmsg(fd, &msg, flags & ~MSG_ZEROCOPY);
+                } else if (wlen >= 0 and zerocopy) {
+                    mark_zerocopy(static_cast<size_t>(wlen));
+                }
+                if (wlen < 0) {
+                    if (errno == EINTR) {
+                        continue;
+                    }
+                    return (errno == EAGAIN or errno == EWOULDBLOCK) ? flush_result::WOULD_BLOCK : flush_result::ERROR;
+                }
+
+                consume(static_cast<size_t>(wlen));
+                if (static_cast<size_t>(wlen) < requested) {
+                    return flush_result::WOULD_BLOCK;
+                }
+            }
+            return flush_result::FLUSHED;
+        }
+
+        /**
+         * Drops the data not sent yet. Segments that zerocopy sends still read from are kept until they complete.
+         */
+        void clear() {
+            while (_head != nullptr) {
+                pop_head();
+            }
+            _size = 0;
+        }
+
+        /**
+         * Sends of at least threshold bytes use MSG_ZEROCOPY, 0 disables it. The socket needs SO_ZEROCOPY, see
+         * enable_socket_zerocopy(). Below some 10KB copying is cheaper than the page pinning and the notification.
+         */
+        void set_zerocopy_threshold(size_t threshold) {
+            _zerocopy_threshold = threshold;
+        }
+
+        /**
+         * True while sent segments wait for the completion of zerocopy sends.
+         */
+        bool zerocopy_pending() const {
+            return _zerocopy_head != nullptr;
+        }
+
+        /**
+         * Takes over the segments of other that wait for zerocopy completions, and the ids of its sends, so that
+         * other can be reused while the socket lingers, see zerocopy_linger.
+         */
+        void take_zerocopy(output_queue &other) {
+            std::swap(_zerocopy_next, other._zerocopy_next);
+            std::swap(_zerocopy_done, other._zerocopy_done);
+            std::swap(_zerocopy_ahead, other._zerocopy_ahead);
+            std::swap(_zerocopy_head, other._zerocopy_head);
+            std::swap(_zerocopy_tail, other._zerocopy_tail);
+        }
+
+        /**
+         * Reads the zerocopy completions queued on the error queue of fd and releases the segments the kernel is
+         * done with. Call it on EPOLLERR, which the completions raise.
+         */
+        void complete_zerocopy(int fd) {
+            for (;;) {
+                char control[CMSG_SPACE(sizeof(struct sock_extended_err)) + CMSG_SPACE(sizeof(struct sockaddr_in6))];
+                struct msghdr msg{};
+                msg.msg_control = control;
+                msg.msg_controllen = sizeof(control);
+                if (recvmsg(fd, &msg, MSG_ERRQUEUE | MSG_DONTWAIT) < 0) {
+                    if (errno == EINTR) {
+                        continue;
+                    }
+                    break; // EAGAIN, nothing left
+                }
+
+                for (struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg); cmsg != nullptr; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+                    if (not ((cmsg->cmsg_level == SOL_IP and cmsg->cmsg_type == IP_RECVERR)
+                             or (cmsg->cmsg_level == SOL_IPV6 and cmsg->cmsg_type == IPV6_RECVERR))) {
+                        continue;
+                    }
+                    struct sock_extended_err err{};
+                    memcpy(&err, CMSG_DATA(cmsg), sizeof(err));
+                    if (err.ee_origin != SO_EE_ORIGIN_ZEROCOPY or err.ee_errno != 0) {
+                        continue;
+                    }
+                    // the sends from ee_info to ee_data included completed
+                    const uint64_t count = static_cast<uint64_t>(err.ee_data - err.ee_info) + 1;
+                    zerocopy_stats().completed.fetch_add(count, std::memory_order_relaxed);
+                    if (err.ee_code & SO_EE_CODE_ZEROCOPY_COPIED) {
+                        zerocopy_stats().copied.fetch_add(count, std::memory_order_relaxed);
+                    }
+                    complete_zerocopy_range(err.ee_info, err.ee_data);
+                }
+            }
+
+            while (_zerocopy_head != nullptr and _zerocopy_head->zerocopy_end <= _zerocopy_done) {
+                segment *next = _zerocopy_head->next;
+                release_segment(_zerocopy_head);
+                _zerocopy_head = next;
+            }
+            if (_zerocopy_head == nullptr) {
+                _zerocopy_tail = nullptr;
+            }
+        }
+
+        size_t size() const {
+            return _size;
+        }
+
+        bool empty() const {
+            return _head == nullptr;
+        }
+
+        /**
+         * Readers should stop reading from the connection above the high watermark...
+         */
+        bool above_high_watermark() const {
+            return _size >= _high_watermark;
+        }
+
+        /**
+         * ... and resume once the queue drained below the low watermark.
+         */
+        bool below_low_watermark() const {
+            return _size <= _low_watermark;
+        }
+
+    private:
+        segment *_head{nullptr};
+        segment *_tail{nullptr};
+        size_t _size{0};
+        buffer_pool *_pool{nullptr};
+        const size_t _high_watermark;
+        const size_t _low_watermark;
+        size_t _zerocopy_threshold{0};
+        uint32_t _zerocopy_next{0};     // id of the next zerocopy send, the kernel counts them per socket from 0
+        uint32_t _zerocopy_done{0};     // every send below this id completed
+        uint64_t _zerocopy_ahead{0};    // bit n: send _zerocopy_done + n completed, out of order
+        segment *_zerocopy_head{nullptr}; // sent segments waiting for their zerocopy sends, in send order
+        segment *_zerocopy_tail{nullptr};
+
+        /**
+         * The segments holding the next len bytes were read by the zerocopy send that just returned.
+         */
+        void mark_zerocopy(size_t len) {
+            const uint32_t end = ++_zerocopy_next;
+            zerocopy_stats().sends.fetch_add(1, std::memory_order_relaxed);
+            for (segment *seg = _head; seg != nullptr and len > 0 and seg->file_fd < 0; seg = seg->next) {
+                seg->zerocopy_end = end;
+                len -= std::min<size_t>(len, seg->end - seg->begin);
+            }
+        }
+
+        void complete_zerocopy_range(uint32_t first, uint32_t last) {
+            if (first <= _zerocopy_done) {
+                if (last >= _zerocopy_done) {
+                    const uint32_t shift = last + 1 - _zerocopy_done;
+                    _zerocopy_ahead = shift >= 64 ? 0 : _zerocopy_ahead >> shift;
+                    _zerocopy_done = last + 1;
+                }
+            } else {
+                for (uint32_t id = first; id <= last and id - _zerocopy_done < 64; ++id) {
+                    _zerocopy_ahead |= uint64_t{1} << (id - _zerocopy_done);
+                }
+            }
+            while (_zerocopy_ahead & 1) {
+                _zerocopy_ahead >>= 1;
+                ++_zerocopy_done;
+            }
+        }
+
+        void link(segment *seg) {
+            seg->next = nullptr;
+            if (_tail == nullptr) {
+                _head = seg;
+            } else {
+                _tail->next = seg;
+            }
+            _tail = seg;
+        }
+
+        void pop_head() {
+            segment *next = _head->next;
+            if (_head->zerocopy_end > _zerocopy_done) {
+                // the kernel may still read from it
+                _head->next = nullptr;
+                if (_zerocopy_tail == nullptr) {
+                    _zerocopy_head = _head;
+                } else {
+                    _zerocopy_tail->next = _head;
+                }
+                _zerocopy_tail = _head;
+            } else {
+                release_segment(_head);
+            }
+            _head = next;
+            if (_head == nullptr) {
+                _tail = nullptr;
+            }
+        }
+
+        /**
+         * Sends the file segment at the head of the queue. FLUSHED means the whole segment was sent.
+         */
+        flush_result flush_file(int fd) {
+            for (;;) {
+                const size_t len = std::min<size_t>(static_cast<size_t>(_head->file_end - _head->file_offset), MAX_SENDFILE);
+                const ssize_t wlen = sendfile(fd, _head->file_fd, &_head->file_offset, len);
+                if (wlen < 0) {
+                    if (errno == EINTR) {
+                        continue;
+                    }
+                    return (errno == EAGAIN or errno == EWOULDBLOCK) ? flush_result::WOULD_BLOCK : flush_result::ERROR;
+                }
+                if (wlen == 0) {
+                    // the file was truncated, the length announced to the peer can no longer be honored
+                    errno = EIO;
+                    return flush_result::ERROR;
+                }
+
+                _size -= static_cast<size_t>(wlen);
+                if (_head->file_offset == _head->file_end) {
+                    pop_head();
+                    return flush_result::FLUSHED;
+                }
+                if (static_cast<size_t>(wlen) < len) {
+                    return flush_result::WOULD_BLOCK;
+                }
+            }
+        }
+
+        void consume(size_t len) {
+            _size -= len;
+            while (len > 0) {
+                const size_t available = _head->end - _head->begin;
+                if (len < available) {
+                    _head->begin += static_cast<uint32_t>(len);
+                    return;
+                }
+
+                len -= available;
+                pop_head();
+            }
+        }
+    };
+}
+
+#endif /* LINUX_TCP_SERVERS_OUTPUT_QUEUE_H */
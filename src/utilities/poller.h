@@ -0,0 +1,284 @@
+/*
+ * BSD 2-Clause License
+ *
+ * Copyright (c) 2019, Pham Phi Long <phamphilong2010@gmail.com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *   * Redistributions of source code must retain the above copyright notice,
+ *     this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *   * Neither the name of Redis nor the names of its contributors may be used
+ *     to endorse or promote products derived from this software without
+ *     specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+#ifndef LINUX_TCP_SERVERS_POLLER_H
+#define LINUX_TCP_SERVERS_POLLER_H
+
+#include <sys/epoll.h>
+#include <sys/select.h>
+#include <unistd.h>
+#include <algorithm>
+#include <cstdint>
+#include <stdexcept>
+#include <vector>
+
+namespace concurrent_servers {
+    /*
+     * Pollers of linux_concurrent_server, chosen at compile time by its configuration. They all report events in
+     * struct epoll_event, with the fd in data.fd, and differ in how a connection is registered:
+     *  - add(fd, events) and remove(fd) for the listening socket and the other fds the worker polls,
+     *  - watch(fd, reading, writing) registers a connection, rewatch() changes what it waits for. Pollers whose
+     *    REWATCH is false ignore rewatch(), except that wake_for_write() always reports the connection writable.
+     * Not thread safe, every worker owns its poller.
+     */
+
+    /**
+     * The events a connection is registered for in epoll.
+     */
+    inline uint32_t epoll_interest(bool reading, bool writing, uint32_t flags) {
+        uint32_t events{flags};
+        if (reading) {
+            events |= EPOLLIN | EPOLLRDHUP;
+        }
+        if (writing) {
+            events |= EPOLLOUT;
+        }
+        return events;
+    }
+
+    class epoll_poller_base {
+    public:
+        epoll_poller_base() :
+                _epoll_fd{epoll_create1(EPOLL_CLOEXEC)} {
+            if (_epoll_fd == -1) {
+                throw std::runtime_error("epoll_create1() failed");
+            }
+        }
+
+        epoll_poller_base(const epoll_poller_base &) = delete;
+        epoll_poller_base &operator=(const epoll_poller_base &) = delete;
+
+        ~epoll_poller_base() {
+            close(_epoll_fd);
+        }
+
+        bool add(int fd, uint32_t events) {
+            return control(EPOLL_CTL_ADD, fd, events);
+        }
+
+        void remove(int fd) {
+            epoll_ctl(_epoll_fd, EPOLL_CTL_DEL, fd, nullptr);
+        }
+
+        int wait(struct epoll_event *events, int max_events, int timeout_ms) {
+            return epoll_wait(_epoll_fd, events, max_events, timeout_ms);
+        }
+
+    protected:
+        bool control(int op, int fd, uint32_t events) {
+            struct epoll_event event{};
+            event.data.fd = fd;
+            event.events = events;
+            return epoll_ctl(_epoll_fd, op, fd, &event) == 0;
+        }
+
+    private:
+        const int _epoll_fd;
+    };
+
+    /**
+     * Edge-triggered and one shot: every event disarms the connection, which is armed again after it was served
+     * with exactly the events it waits for. One epoll_ctl() per event, but a connection is never reported twice
+     * while it is being served.
+     */
+    class epoll_oneshot_poller : public epoll_poller_base {
+    public:
+        static constexpr bool REWATCH{true};
+
+        bool watch(int fd, bool reading, bool writing) {
+            return add(fd, epoll_interest(reading, writing, EPOLLET | EPOLLONESHOT));
+        }
+
+        bool rewatch(int fd, bool reading, bool writing) {
+            return control(EPOLL_CTL_MOD, fd, epoll_interest(reading, writing, EPOLLET | EPOLLONESHOT));
+        }
+
+        bool wake_for_write(int fd) {
+            return rewatch(fd, false, true);
+        }
+    };
+
+    /**
+     * Edge-triggered, a connection is registered once for reading and writing and never changed: no epoll_ctl()
+     * after the accept. The worker has to read and write until EAGAIN, or it misses the next edge.
+     */
+    class epoll_edge_poller : public epoll_poller_base {
+    public:
+        static constexpr bool REWATCH{false};
+
+        bool watch(int fd, bool, bool) {
+            return add(fd, epoll_interest(true, true, EPOLLET));
+        }
+
+        bool rewatch(int, bool, bool) {
+            return true;
+        }
+
+        bool wake_for_write(int fd) {
+            // modifying the registration reports the readiness again
+            return control(EPOLL_CTL_MOD, fd, epoll_interest(true, true, EPOLLET));
+        }
+    };
+
+    /**
+     * Level-triggered, a connection is reported as long as it is ready for what it waits for, so epoll_ctl() is
+     * only called when that changes, e.g. output becomes pending.
+     */
+    class epoll_level_poller : public epoll_poller_base {
+    public:
+        static constexpr bool REWATCH{true};
+
+        epoll_level_poller() :
+                epoll_poller_base{},
+                _interest{} {
+        }
+
+        bool watch(int fd, bool reading, bool writing) {
+            interest(fd) = epoll_interest(reading, writing, 0);
+            return add(fd, interest(fd));
+        }
+
+        bool rewatch(int fd, bool reading, bool writing) {
+            const uint32_t events = epoll_interest(reading, writing, 0);
+            if (interest(fd) == events) {
+                return true;
+            }
+            interest(fd) = events;
+            return control(EPOLL_CTL_MOD, fd, events);
+        }
+
+        bool wake_for_write(int fd) {
+            return rewatch(fd, false, true);
+        }
+
+    private:
+        std::vector<uint32_t> _interest; // indexed by fd
+
+        uint32_t &interest(int fd) {
+            if (static_cast<size_t>(fd) >= _interest.size()) {
+                _interest.resize(fd + 1, 0);
+            }
+            return _interest[fd];
+        }
+    };
+
+    /**
+     * Level-triggered select(), for comparison: every wait copies the fd sets and scans them, and fds from
+     * FD_SETSIZE on cannot be watched.
+     */
+    class select_poller {
+    public:
+        static constexpr bool REWATCH{true};
+
+        select_poller() :
+                _read_fds{},
+                _write_fds{},
+                _max_fd{-1} {
+            FD_ZERO(&_read_fds);
+            FD_ZERO(&_write_fds);
+        }
+
+        bool add(int fd, uint32_t events) {
+            return set(fd, events & EPOLLIN, events & EPOLLOUT);
+        }
+
+        void remove(int fd) {
+            set(fd, false, false);
+        }
+
+        bool watch(int fd, bool reading, bool writing) {
+            return set(fd, reading, writing);
+        }
+
+        bool rewatch(int fd, bool reading, bool writing) {
+            return set(fd, reading, writing);
+        }
+
+        bool wake_for_write(int fd) {
+            return set(fd, false, true);
+        }
+
+        int wait(struct epoll_event *events, int max_events, int timeout_ms) {
+            fd_set read_fds = _read_fds;
+            fd_set write_fds = _write_fds;
+            struct timeval timeout{timeout_ms / 1000, (timeout_ms % 1000) * 1000};
+            const int ready = select(_max_fd + 1, &read_fds, &write_fds, nullptr, timeout_ms < 0 ? nullptr : &timeout);
+            if (ready <= 0) {
+                return ready;
+            }
+
+            int nevents{0};
+            for (int fd{0}; fd <= _max_fd and nevents < max_events; ++fd) {
+                uint32_t ready_events{0};
+                if (FD_ISSET(fd, &read_fds)) {
+                    ready_events |= EPOLLIN;
+                }
+                if (FD_ISSET(fd, &write_fds)) {
+                    ready_events |= EPOLLOUT;
+                }
+                if (ready_events != 0) {
+                    events[nevents].data.fd = fd;
+                    events[nevents].events = ready_events;
+                    ++nevents;
+                }
+            }
+            return nevents;
+        }
+
+    private:
+        fd_set _read_fds;
+        fd_set _write_fds;
+        int _max_fd;
+
+        bool set(int fd, bool reading, bool writing) {
+            if (fd < 0 or fd >= FD_SETSIZE) {
+                return false;
+            }
+            if (reading) {
+                FD_SET(fd, &_read_fds);
+            } else {
+                FD_CLR(fd, &_read_fds);
+            }
+            if (writing) {
+                FD_SET(fd, &_write_fds);
+            } else {
+                FD_CLR(fd, &_write_fds);
+            }
+            if (reading or writing) {
+                _max_fd = std::max(_max_fd, fd);
+            }
+            return true;
+        }
+    };
+}
+
+#endif /* LINUX_TCP_SERVERS_POLLER_H */
@@ -33,40 +33,467 @@
 #ifndef LINUX_TCP_SERVERS_PRINT_UTILITY_H
 #define LINUX_TCP_SERVERS_PRINT_UTILITY_H
 
-#include <string>
+#include <pthread.h>
+#include <sys/uio.h>
+#include <unistd.h>
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <charconv>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
 #include <iostream>
+#include <memory>
+#include <mutex>
+#include <sstream>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <type_traits>
+#include <vector>
+
+/*
+ * Lowest severity compiled into the binary, one of DEBUG, INFO, WARNING, ERROR or NONE.
+ * Set it with -DLINUX_TCP_SERVERS_LOG_LEVEL=WARNING (CMake option LOG_LEVEL, Makefile variable LOG_LEVEL).
+ */
+#ifndef LINUX_TCP_SERVERS_LOG_LEVEL
+#define LINUX_TCP_SERVERS_LOG_LEVEL DEBUG
+#endif
+
+/*
+ * The CS_LOG_* macros drop calls below the compiled log level entirely, including the evaluation of their
+ * arguments (string concatenations, std::to_string()...). Use them rather than the log_* templates on hot paths.
+ */
+#define CS_LOG_DEBUG(...) CS_LOG_AT(DEBUG, log_debug, __VA_ARGS__)
+#define CS_LOG_INFO(...) CS_LOG_AT(INFO, log_info, __VA_ARGS__)
+#define CS_LOG_WARNING(...) CS_LOG_AT(WARNING, log_warning, __VA_ARGS__)
+#define CS_LOG_ERROR(...) CS_LOG_AT(ERROR, log_error, __VA_ARGS__)
+#define CS_LOG_AT(level, function, ...) \
+    do { \
+        if constexpr (concurrent_servers::log_enabled(concurrent_servers::log_level::level)) { \
+            concurrent_servers::function(__VA_ARGS__); \
+        } \
+    } while (0)
+
+/*
+ * Same as CS_LOG_*, also dropping the calls below min_level, a constant expression such as the log level of a
+ * server configuration.
+ */
+#define CS_LOG_DEBUG_FROM(min_level, ...) CS_LOG_AT_FROM(min_level, DEBUG, log_debug, __VA_ARGS__)
+#define CS_LOG_INFO_FROM(min_level, ...) CS_LOG_AT_FROM(min_level, INFO, log_info, __VA_ARGS__)
+#define CS_LOG_WARNING_FROM(min_level, ...) CS_LOG_AT_FROM(min_level, WARNING, log_warning, __VA_ARGS__)
+#define CS_LOG_ERROR_FROM(min_level, ...) CS_LOG_AT_FROM(min_level, ERROR, log_error, __VA_ARGS__)
+#define CS_LOG_AT_FROM(min_level, level, function, ...) \
+    do { \
+        if constexpr (concurrent_servers::log_enabled(concurrent_servers::log_level::level) \
+                      and concurrent_servers::log_level::level >= (min_level)) { \
+            concurrent_servers::function(__VA_ARGS__); \
+        } \
+    } while (0)
 
 namespace concurrent_servers {
-    template<typename Content>
-    void log(const Content &content) {
-        std::cout << content << std::endl;
+    enum class log_level {
+        DEBUG,
+        INFO,
+        WARNING,
+        ERROR,
+        NONE
+    };
+
+    constexpr log_level COMPILED_LOG_LEVEL{log_level::LINUX_TCP_SERVERS_LOG_LEVEL};
+
+    constexpr bool log_enabled(log_level level) {
+        return level >= COMPILED_LOG_LEVEL and level != log_level::NONE;
     }
 
-    template<typename Content, typename... LogContents>
-    void log(const Content &content, const LogContents &... log_contents) {
-        std::cout << content;
-        return log(log_contents...);
+    /**
+     * What a thread does when its log ring is full.
+     */
+    enum class log_overflow_policy {
+        DROP,  // discard the line and count it, the background thread reports the count
+        BLOCK  // wait until the background thread made room
+    };
+
+    namespace detail {
+        /**
+         * Single producer single consumer byte ring. The owning thread appends whole lines,
+         * the background log thread drains them.
+         */
+        class log_ring {
+        public:
+            static constexpr size_t CAPACITY{64 * 1024}; // power of 2
+
+            /**
+             * Appends the line only if it fits entirely, so lines are never interleaved or cut.
+             */
+            bool try_push(const char *data, size_t len) {
+                const size_t head = _head.load(std::memory_order_relaxed);
+                const size_t tail = _tail.load(std::memory_order_acquire);
+                if (CAPACITY - (head - tail) < len) {
+                    return false;
+                }
+
+                const size_t offset = head & (CAPACITY - 1);
+                const size_t first = std::min(len, CAPACITY - offset);
+                std::char_traits<char>::copy(_data + offset, data, first);
+                std::char_traits<char>::copy(_data, data + first, len - first);
+                _head.store(head + len, std::memory_order_release);
+                return true;
+            }
+
+            /**
+             * Adds the readable part of the ring to iov (at most 2 entries because of the wrap around).
+             * Returns the number of readable bytes, to be passed to consume() once they are written.
+             */
+            size_t peek(std::vector<struct iovec> &iov) {
+                const size_t tail = _tail.load(std::memory_order_relaxed);
+                const size_t len = _head.load(std::memory_order_acquire) - tail;
+                if (len == 0) {
+                    return 0;
+                }
+
+                const size_t offset = tail & (CAPACITY - 1);
+                const size_t first = std::min(len, CAPACITY - offset);
+                iov.push_back({_data + offset, first});
+                if (len > first) {
+                    iov.push_back({_data, len - first});
+                }
+                return len;
+            }
+
+            void consume(size_t len) {
+                _tail.store(_tail.load(std::memory_order_relaxed) + len, std::memory_order_release);
+            }
+
+            void discard() {
+                _tail.store(_head.load(std::memory_order_acquire), std::memory_order_release);
+            }
+
+            bool empty() const {
+                return _head.load(std::memory_order_acquire) == _tail.load(std::memory_order_acquire);
+            }
+
+            std::atomic<bool> retired{false}; // the owning thread exited
+
+        private:
+            alignas(64) std::atomic<size_t> _head{0};
+            alignas(64) std::atomic<size_t> _tail{0};
+            alignas(64) char _data[CAPACITY]{};
+        };
+
+        /**
+         * Owns the per-thread rings and the background thread that writes them to the log fd in batches.
+         * Producers only take the registry mutex once, when their thread logs for the first time.
+         */
+        class async_logger {
+        public:
+            static async_logger &instance() {
+                // never destroyed: worker threads may still log while the process exits
+                static async_logger *logger = new async_logger{};
+                return *logger;
+            }
+
+            void push(const std::string &line) {
+                log_ring *ring = thread_ring();
+                const char *data = line.data();
+                size_t len = line.size();
+                std::string truncated{};
+                if (len > log_ring::CAPACITY) {
+                    // keep the newline, or the next entry would run onto this one
+                    truncated.assign(line, 0, log_ring::CAPACITY - 1);
+                    truncated += '\n';
+                    data = truncated.data();
+                    len = truncated.size();
+                }
+
+                ensure_started();
+                while (not ring->try_push(data, len)) {
+                    if (_policy.load(std::memory_order_relaxed) == log_overflow_policy::DROP) {
+                        _dropped.fetch_add(1, std::memory_order_relaxed);
+                        return;
+                    }
+                    std::this_thread::yield();
+                }
+            }
+
+            void set_fd(int fd) {
+                _fd.store(fd, std::memory_order_relaxed);
+            }
+
+            void set_overflow_policy(log_overflow_policy policy) {
+                _policy.store(policy, std::memory_order_relaxed);
+            }
+
+            uint64_t dropped() const {
+                return _dropped_total.load(std::memory_order_relaxed) + _dropped.load(std::memory_order_relaxed);
+            }
+
+            /**
+             * Writes everything logged so far. Also called at exit.
+             */
+            void flush() {
+                std::lock_guard<std::mutex> lock{_mutex};
+                drain();
+            }
+
+        private:
+            static constexpr size_t MAX_IOV{1024};
+
+            std::mutex _mutex{};
+            std::vector<std::unique_ptr<log_ring>> _rings{};
+            std::vector<struct iovec> _iov{};
+            std::vector<std::pair<log_ring *, size_t>> _batch{};
+            std::atomic<bool> _started{false};
+            std::atomic<int> _fd{STDOUT_FILENO};
+            std::atomic<log_overflow_policy> _policy{log_overflow_policy::DROP};
+            std::atomic<uint64_t> _dropped{0};
+            std::atomic<uint64_t> _dropped_total{0};
+
+            async_logger() {
+                pthread_atfork(&async_logger::before_fork, &async_logger::after_fork_parent, &async_logger::after_fork_child);
+                std::atexit(&async_logger::at_exit);
+            }
+
+            /**
+             * Unregisters the ring once its thread exits; the background thread frees it when it is drained.
+             */
+            struct ring_holder {
+                log_ring *ring{nullptr};
+
+                ~ring_holder() {
+                    if (ring != nullptr) {
+                        ring->retired.store(true, std::memory_order_release);
+                    }
+                }
+            };
+
+            log_ring *thread_ring() {
+                thread_local ring_holder holder{};
+                if (holder.ring == nullptr) {
+                    auto ring = std::make_unique<log_ring>();
+                    holder.ring = ring.get();
+                    std::lock_guard<std::mutex> lock{_mutex};
+                    _rings.push_back(std::move(ring));
+                }
+                return holder.ring;
+            }
+
+            void ensure_started() {
+                if (_started.load(std::memory_order_acquire)) {
+                    return;
+                }
+
+                std::lock_guard<std::mutex> lock{_mutex};
+                if (not _started.load(std::memory_order_relaxed)) {
+                    std::thread{[this]() { run(); }}.detach();
+                    _started.store(true, std::memory_order_release);
+                }
+            }
+
+            void run() {
+                for (;;) {
+                    size_t written;
+                    {
+                        std::lock_guard<std::mutex> lock{_mutex};
+                        written = drain();
+                    }
+
+                    if (written == 0) {
+                        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+                    }
+                }
+            }
+
+            /**
+             * Gathers the content of every ring into as few writev() calls as possible. Requires _mutex.
+             */
+            size_t drain() {
+                const uint64_t dropped = _dropped.exchange(0, std::memory_order_relaxed);
+                if (dropped > 0) {
+                    _dropped_total.fetch_add(dropped, std::memory_order_relaxed);
+                    const std::string warning = "WARNING: log buffer overflow, " + std::to_string(dropped) + " lines dropped\n";
+                    write_all(warning.data(), warning.size());
+                }
+
+                size_t total{0};
+                size_t i{0};
+                while (i < _rings.size()) {
+                    _iov.clear();
+                    _batch.clear();
+                    for (; i < _rings.size() and _iov.size() + 2 <= MAX_IOV; ++i) {
+                        const size_t len = _rings[i]->peek(_iov);
+                        if (len > 0) {
+                            _batch.emplace_back(_rings[i].get(), len);
+                        }
+                    }
+
+                    if (_iov.empty()) {
+                        break;
+                    }
+
+                    writev_all();
+                    for (auto &[ring, len] : _batch) {
+                        ring->consume(len);
+                        total += len;
+                    }
+                }
+
+                // free the rings of threads that are gone
+                for (auto it = _rings.begin(); it != _rings.end();) {
+                    if ((*it)->retired.load(std::memory_order_acquire) and (*it)->empty()) {
+                        it = _rings.erase(it);
+                    } else {
+                        ++it;
+                    }
+                }
+                return total;
+            }
+
+            void writev_all() {
+                struct iovec *iov = _iov.data();
+                int iov_count = static_cast<int>(_iov.size());
+                while (iov_count > 0) {
+                    ssize_t n = writev(_fd.load(std::memory_order_relaxed), iov, iov_count);
+                    if (n < 0) {
+                        if (errno == EINTR) {
+                            continue;
+                        }
+                        return; // nowhere to log to, drop the batch
+                    }
+
+                    while (iov_count > 0 and static_cast<size_t>(n) >= iov->iov_len) {
+                        n -= static_cast<ssize_t>(iov->iov_len);
+                        ++iov;
+                        --iov_count;
+                    }
+                    if (iov_count > 0) {
+                        iov->iov_base = static_cast<char *>(iov->iov_base) + n;
+                        iov->iov_len -= static_cast<size_t>(n);
+                    }
+                }
+            }
+
+            void write_all(const char *data, size_t len) {
+                _iov.clear();
+                _iov.push_back({const_cast<char *>(data), len});
+                writev_all();
+            }
+
+            static void before_fork() {
+                instance()._mutex.lock();
+            }
+
+            static void after_fork_parent() {
+                instance()._mutex.unlock();
+            }
+
+            static void after_fork_child() {
+                // the background thread does not survive fork(), and the parent still writes what is pending
+                async_logger &logger = instance();
+                for (auto &ring : logger._rings) {
+                    ring->discard();
+                }
+                logger._dropped.store(0, std::memory_order_relaxed);
+                logger._started.store(false, std::memory_order_relaxed);
+                logger._mutex.unlock();
+            }
+
+            static void at_exit() {
+                instance().flush();
+            }
+        };
+
+        inline void format_value(std::string &out, bool value) {
+            out.push_back(value ? '1' : '0');
+        }
+
+        inline void format_value(std::string &out, char value) {
+            out.push_back(value);
+        }
+
+        template<typename Value>
+        void format_value(std::string &out, const Value &value) {
+            if constexpr (std::is_same_v<std::decay_t<Value>, char *> or std::is_same_v<std::decay_t<Value>, const char *>) {
+                out += (value != nullptr) ? value : "(null)";
+            } else if constexpr (std::is_convertible_v<const Value &, std::string_view>) {
+                out += std::string_view{value};
+            } else if constexpr (std::is_integral_v<Value> or std::is_floating_point_v<Value>) {
+                char buffer[64];
+                const auto result = std::to_chars(buffer, buffer + sizeof(buffer), value);
+                out.append(buffer, result.ptr);
+            } else {
+                std::ostringstream stream;
+                stream << value;
+                out += stream.str();
+            }
+        }
+
+        inline std::string &thread_line() {
+            thread_local std::string line{};
+            return line;
+        }
+    }
+
+    /**
+     * Log lines are formatted by the calling thread into its own ring buffer and written to the log fd
+     * (stdout by default) by a background thread, so logging never blocks on a lock or on I/O.
+     */
+    template<typename... LogContents>
+    void log(const LogContents &... log_contents) {
+        std::string &line = detail::thread_line();
+        line.clear();
+        (detail::format_value(line, log_contents), ...);
+        line.push_back('\n');
+        detail::async_logger::instance().push(line);
     }
 
     template<typename... LogContents>
     void log_debug(const LogContents &... log_contents) {
-        return log("DEBUG: ", log_contents...);
+        if constexpr (log_enabled(log_level::DEBUG)) {
+            log("DEBUG: ", log_contents...);
+        }
     }
 
     template<typename... LogContents>
     void log_info(const LogContents &... log_contents) {
-        return log("INFO: ", log_contents...);
+        if constexpr (log_enabled(log_level::INFO)) {
+            log("INFO: ", log_contents...);
+        }
     }
 
     template<typename... LogContents>
     void log_warning(const LogContents &... log_contents) {
-        return log("WARNING: ", log_contents...);
+        if constexpr (log_enabled(log_level::WARNING)) {
+            log("WARNING: ", log_contents...);
+        }
     }
 
     template<typename... LogContents>
     void log_error(const LogContents &... log_contents) {
-        return log("ERROR: ", log_contents...);
+        if constexpr (log_enabled(log_level::ERROR)) {
+            log("ERROR: ", log_contents...);
+        }
+    }
+
+    inline void set_log_fd(int fd) {
+        detail::async_logger::instance().set_fd(fd);
+    }
+
+    inline void set_log_overflow_policy(log_overflow_policy policy) {
+        detail::async_logger::instance().set_overflow_policy(policy);
+    }
+
+    /**
+     * Number of log lines dropped because a thread's ring was full.
+     */
+    inline uint64_t dropped_log_lines() {
+        return detail::async_logger::instance().dropped();
+    }
+
+    inline void flush_log() {
+        detail::async_logger::instance().flush();
     }
 }
 
-#endif /* LINUX_TCP_SERVERS_PRINT_UTILITY_H */
\ No newline at end of file
+#endif /* LINUX_TCP_SERVERS_PRINT_UTILITY_H */
@@ -0,0 +1,104 @@
+/*
+ * BSD 2-Clause License
+ *
+ * Copyright (c) 2019, Pham Phi Long <phamphilong2010@gmail.com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *   * Redistributions of source code must retain the above copyright notice,
+ *     this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *   * Neither the name of Redis nor the names of its contributors may be used
+ *     to endorse or promote products derived from this software without
+ *     specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+#ifndef LINUX_TCP_SERVERS_REUSEPORT_STEERING_H
+#define LINUX_TCP_SERVERS_REUSEPORT_STEERING_H
+
+#include <sys/socket.h>
+#include <linux/filter.h>
+#include <cstdint>
+#include <vector>
+
+namespace concurrent_servers {
+    /**
+     * Attaches to the SO_REUSEPORT group of listener_fd a classic BPF program that hands every new connection to
+     * the listener whose worker is pinned to the CPU processing the SYN, i.e. the CPU the RX queue of the NIC
+     * interrupts, so the connection is served where its packets already are.
+     *
+     * listener_cpus[i] is the CPU of the worker owning the i-th listener of the group, -1 if it is not pinned.
+     * Listeners are numbered in the order they called listen(), so they must be opened in worker order. A CPU
+     * without a worker of its own falls back to listener cpu % listener count, and the kernel falls back to its
+     * hash when a listener closed meanwhile. Returns false if the kernel refused the program.
+     */
+    inline bool attach_reuseport_cpu_steering(int listener_fd, const std::vector<int> &listener_cpus) {
+        // BPF_STMT() and BPF_JUMP() are compound literals, which C++ lacks
+        const auto statement = [](uint16_t op, uint32_t k) {
+            return sock_filter{op, 0, 0, k};
+        };
+        std::vector<struct sock_filter> code{};
+        code.push_back(statement(BPF_LD | BPF_W | BPF_ABS, static_cast<uint32_t>(SKF_AD_OFF + SKF_AD_CPU))); // A = current cpu
+
+        // one "if (A == cpu) return listener" pair per CPU, the first listener of a CPU wins
+        std::vector<bool> seen{};
+        for (size_t listener{0}; listener < listener_cpus.size(); ++listener) {
+            const int cpu = listener_cpus[listener];
+            if (cpu < 0) {
+                continue;
+            }
+            if (static_cast<size_t>(cpu) >= seen.size()) {
+                seen.resize(static_cast<size_t>(cpu) + 1, false);
+            }
+            if (seen[static_cast<size_t>(cpu)]) {
+                continue;
+            }
+            seen[static_cast<size_t>(cpu)] = true;
+            code.push_back(sock_filter{BPF_JMP | BPF_JEQ | BPF_K, 0, 1, static_cast<uint32_t>(cpu)});
+            code.push_back(statement(BPF_RET | BPF_K, static_cast<uint32_t>(listener)));
+        }
+
+        code.push_back(statement(BPF_ALU | BPF_MOD | BPF_K, static_cast<uint32_t>(listener_cpus.empty() ? 1 : listener_cpus.size())));
+        code.push_back(statement(BPF_RET | BPF_A, 0));
+        if (code.size() > BPF_MAXINSNS) {
+            return false;
+        }
+
+        struct sock_fprog program{};
+        program.len = static_cast<unsigned short>(code.size());
+        program.filter = code.data();
+        return setsockopt(listener_fd, SOL_SOCKET, SO_ATTACH_REUSEPORT_CBPF, &program, sizeof(program)) == 0;
+    }
+
+    /**
+     * CPU that last processed the packets of socket sfd (SO_INCOMING_CPU), -1 if unknown. Comparing it with the
+     * CPU of the accepting worker tells whether connections are steered to the right worker.
+     */
+    inline int incoming_cpu(int sfd) {
+        int cpu{-1};
+        socklen_t len = sizeof(cpu);
+        if (getsockopt(sfd, SOL_SOCKET, SO_INCOMING_CPU, &cpu, &len) != 0) {
+            return -1;
+        }
+        return cpu;
+    }
+}
+
+#endif /* LINUX_TCP_SERVERS_REUSEPORT_STEERING_H */
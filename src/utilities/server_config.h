@@ -0,0 +1,192 @@
+/*
+ * BSD 2-Clause License
+ *
+ * Copyright (c) 2019, Pham Phi Long <phamphilong2010@gmail.com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *   * Redistributions of source code must retain the above copyright notice,
+ *     this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *   * Neither the name of Redis nor the names of its contributors may be used
+ *     to endorse or promote products derived from this software without
+ *     specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+#ifndef LINUX_TCP_SERVERS_SERVER_CONFIG_H
+#define LINUX_TCP_SERVERS_SERVER_CONFIG_H
+
+#include <sys/resource.h>
+#include <cstddef>
+#include <memory>
+#include <optional>
+#include <vector>
+
+#include "poller.h"
+#include "print_utility.h"
+#include "include/constants.h"
+
+namespace concurrent_servers {
+    /**
+     * Connection state indexed by fd, grown on demand, every connection is allocated on the heap when accepted.
+     */
+    template <typename State>
+    class growing_connection_table {
+    public:
+        State *get(int fd) {
+            return static_cast<size_t>(fd) < _states.size() ? _states[fd].get() : nullptr;
+        }
+
+        State *emplace(int fd) {
+            if (static_cast<size_t>(fd) >= _states.size()) {
+                _states.resize(fd + 1);
+            }
+            _states[fd] = std::make_unique<State>();
+            return _states[fd].get();
+        }
+
+        void erase(int fd) {
+            _states[fd].reset();
+        }
+
+        /**
+         * Every fd in use is below it.
+         */
+        size_t size() const {
+            return _states.size();
+        }
+
+    private:
+        std::vector<std::unique_ptr<State>> _states{};
+    };
+
+    /**
+     * Connection state indexed by fd, one slot per fd the process is allowed to open. Slots are allocated
+     * CHUNK_SIZE at a time, when the first fd of their range is accepted, and kept: accepting a connection
+     * allocates nothing once its chunk exists and the state of neighbouring fds is contiguous, while the fds
+     * never used cost a pointer per chunk.
+     */
+    template <typename State>
+    class preallocated_connection_table {
+    public:
+        static constexpr size_t CHUNK_SIZE{256};
+
+        preallocated_connection_table() :
+                _capacity{capacity()},
+                _chunks((_capacity + CHUNK_SIZE - 1) / CHUNK_SIZE) {
+        }
+
+        State *get(int fd) {
+            std::optional<State> *slot = find(fd);
+            return slot != nullptr and slot->has_value() ? &**slot : nullptr;
+        }
+
+        /**
+         * Returns nullptr if fd does not fit in the table.
+         */
+        State *emplace(int fd) {
+            if (static_cast<size_t>(fd) >= _capacity) {
+                return nullptr;
+            }
+            auto &chunk = _chunks[fd / CHUNK_SIZE];
+            if (not chunk) {
+                chunk = std::make_unique<std::optional<State>[]>(CHUNK_SIZE);
+            }
+            return &chunk[fd % CHUNK_SIZE].emplace();
+        }
+
+        void erase(int fd) {
+            if (std::optional<State> *slot = find(fd)) {
+                slot->reset();
+            }
+        }
+
+        size_t size() const {
+            return _capacity;
+        }
+
+    private:
+        static constexpr size_t DEFAULT_NR_OPEN{1u << 20}; // fs.nr_open, the kernel's own bound on RLIMIT_NOFILE
+
+        const size_t _capacity;
+        std::vector<std::unique_ptr<std::optional<State>[]>> _chunks;
+
+        std::optional<State> *find(int fd) {
+            if (static_cast<size_t>(fd) >= _capacity or not _chunks[fd / CHUNK_SIZE]) {
+                return nullptr;
+            }
+            return &_chunks[fd / CHUNK_SIZE][fd % CHUNK_SIZE];
+        }
+
+        static size_t capacity() {
+            struct rlimit limit{};
+            if (getrlimit(RLIMIT_NOFILE, &limit) != 0 or limit.rlim_cur == RLIM_INFINITY) {
+                return DEFAULT_NR_OPEN;
+            }
+            return static_cast<size_t>(limit.rlim_cur);
+        }
+    };
+
+    /**
+     * Compile-time configuration of linux_concurrent_server. A configuration is a struct with the members below,
+     * usually derived from this one to override a few of them. A feature turned off compiles out of the event loop
+     * and its setter no longer compiles, so a service that does not use it pays no branch for it.
+     */
+    struct default_server_config {
+        using poller = epoll_oneshot_poller;  // epoll_oneshot_poller, epoll_edge_poller, epoll_level_poller or select_poller
+        template <typename State>
+        using connection_table = growing_connection_table<State>; // or preallocated_connection_table
+
+        static constexpr int MAX_EVENTS{10000};                   // events returned by one wait
+        static constexpr size_t BUFFER_SIZE{BUFF_SIZE};           // read buffers and output segments
+        static constexpr size_t MAX_PENDING_INPUT{2 * 1024 * 1024}; // longest partial request of a consuming read handler
+        static constexpr log_level LOG_LEVEL{log_level::DEBUG};   // lowest level logged, on top of the compiled level
+
+        static constexpr bool TIMEOUTS{true};     // set_timeouts(), connections are closed when they expire
+        static constexpr bool BUSY_POLL{true};    // set_busy_poll()
+        static constexpr bool CPU_STEERING{true}; // set_cpu_steering()
+        static constexpr bool HOT_UPGRADE{true};  // set_upgrade_socket()
+        static constexpr bool ZEROCOPY{true};     // set_zerocopy_threshold()
+        static constexpr bool STATS{true};        // the workers count into a stats_segment, set_stats_port()
+    };
+
+    /**
+     * A plain request/reply service: no rearm after each event, no allocation per connection, warnings and
+     * errors only, and none of the optional features.
+     */
+    struct lean_server_config : default_server_config {
+        using poller = epoll_edge_poller;
+        template <typename State>
+        using connection_table = preallocated_connection_table<State>;
+
+        static constexpr int MAX_EVENTS{1024};
+        static constexpr size_t BUFFER_SIZE{4096};
+        static constexpr log_level LOG_LEVEL{log_level::WARNING};
+
+        static constexpr bool TIMEOUTS{false};
+        static constexpr bool BUSY_POLL{false};
+        static constexpr bool CPU_STEERING{false};
+        static constexpr bool HOT_UPGRADE{false};
+        static constexpr bool ZEROCOPY{false};
+        static constexpr bool STATS{false};
+    };
+}
+
+#endif /* LINUX_TCP_SERVERS_SERVER_CONFIG_H */
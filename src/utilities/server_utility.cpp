@@ -37,10 +37,53 @@
 #include <string.h>
 #include <sys/epoll.h>
 #include <array>
+#include <memory>
+#include <vector>
 
 #include "print_utility.h"
 #include "file_descriptor.h"
 #include "constants.h"
+#include "buffer_pool.h"
+#include "output_queue.h"
+#include "server_utility.h"
+#include "metrics.h"
+
+namespace {
+    struct connection_state {
+        concurrent_servers::output_queue output{}; // echo waiting to be sent
+        bool reading_paused{false};                 // output went above its high watermark
+    };
+
+    std::vector<int> inherited_listeners{};
+
+    /**
+     * Port in network byte order, at the same offset in sockaddr_in and sockaddr_in6.
+     */
+    in_port_t port_of(const struct sockaddr *addr) {
+        return addr->sa_family == AF_INET6 ? reinterpret_cast<const struct sockaddr_in6 *>(addr)->sin6_port
+                                           : reinterpret_cast<const struct sockaddr_in *>(addr)->sin_port;
+    }
+
+    /**
+     * Removes and returns the inherited listener bound to the port of addr, -1 if there is none.
+     */
+    int take_inherited_listener(const struct sockaddr *addr) {
+        for (auto it = inherited_listeners.begin(); it != inherited_listeners.end(); ++it) {
+            struct sockaddr_storage local{};
+            socklen_t local_len = sizeof(local);
+            int listening{0};
+            socklen_t listening_len = sizeof(listening);
+            if (getsockname(*it, reinterpret_cast<struct sockaddr *>(&local), &local_len) == 0 and
+                    getsockopt(*it, SOL_SOCKET, SO_ACCEPTCONN, &listening, &listening_len) == 0 and listening != 0 and
+                    local.ss_family == addr->sa_family and port_of(reinterpret_cast<struct sockaddr *>(&local)) == port_of(addr)) {
+                const int fd = *it;
+                inherited_listeners.erase(it);
+                return fd;
+            }
+        }
+        return -1;
+    }
+}
 
 namespace concurrent_servers {
     void log_client_info(const struct sockaddr_storage& cli_addr, const std::string &prefix_log) {
@@ -61,7 +104,12 @@ namespace concurrent_servers {
         }
     }
 
-    concurrent_servers::file_descriptor setup_server_tcp_socket(const std::string& port_num, const int backlog, bool is_nonblock, bool reuse_port) {
+    void add_inherited_listeners(const std::vector<int> &fds) {
+        inherited_listeners.insert(inherited_listeners.end(), fds.begin(), fds.end());
+    }
+
+    concurrent_servers::file_descriptor setup_server_tcp_socket(const std::string& port_num, const int backlog, bool is_nonblock, bool reuse_port,
+                                                                const concurrent_servers::listener_options &options) {
         concurrent_servers::file_descriptor server_sfd{};
 
         // Setup server address
@@ -76,11 +124,26 @@ namespace concurrent_servers {
         hints.ai_next = nullptr;
 
         struct addrinfo *result{nullptr}, *rp{nullptr};
-        const int s = getaddrinfo(nullptr, port_num.data(), &hints, &result);
+        const char *node = options.address.empty() ? nullptr : options.address.c_str();
+        const int s = getaddrinfo(node, port_num.data(), &hints, &result);
         if (s != 0) {
             throw std::runtime_error("getaddrinfo: " + std::string{gai_strerror(s)});
         }
 
+        for (rp = result; rp != nullptr; rp = rp->ai_next) {
+            const int inherited_fd = take_inherited_listener(rp->ai_addr);
+            if (inherited_fd >= 0) {
+                freeaddrinfo(result);
+                server_sfd.set_fd(inherited_fd);
+                if (is_nonblock) {
+                    set_nonblocking(inherited_fd);
+                }
+                set_listener_options(inherited_fd, options);
+                listen(inherited_fd, listen_backlog(backlog)); // only updates the backlog of a listening socket
+                return server_sfd;
+            }
+        }
+
         /* getaddrinfo() returns a list of address structures.
          * Try each address until we successfully bind(2).
          * If socket(2) (or bind(2)) fails, we (close the socket
@@ -94,9 +157,12 @@ namespace concurrent_servers {
             }
 
             if (reuse_port) {
+                // two options, OR-ing their names sets neither
                 int one = 1;
-                setsockopt(server_sfd.get_fd(), SOL_SOCKET, SO_REUSEADDR | SO_REUSEPORT, &one, sizeof(one));
+                setsockopt(server_sfd.get_fd(), SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+                setsockopt(server_sfd.get_fd(), SOL_SOCKET, SO_REUSEPORT, &one, sizeof(one));
             }
+            set_listener_options(server_sfd.get_fd(), options);
 
             if (bind(server_sfd.get_fd(), rp->ai_addr, rp->ai_addrlen) == 0) {
                 break;                  // Success
@@ -111,7 +177,7 @@ namespace concurrent_servers {
 
         freeaddrinfo(result);           // No longer needed
 
-        if (listen(server_sfd.get_fd(), backlog) < 0) {  // Listen to the socket
+        if (listen(server_sfd.get_fd(), listen_backlog(backlog)) < 0) {  // Listen to the socket
             server_sfd.close_fd();
             throw std::runtime_error("Could not listen to port " + port_num);
         }
@@ -119,134 +185,185 @@ namespace concurrent_servers {
         return server_sfd;
     }
 
-    void epoll_event_loop(const concurrent_servers::file_descriptor& server_sfd, const concurrent_servers::file_descriptor& epoll_fd) {
+    void epoll_event_loop(const concurrent_servers::file_descriptor& server_sfd, const concurrent_servers::file_descriptor& epoll_fd,
+                          concurrent_servers::worker_metrics &metrics, const concurrent_servers::listener_options &options) {
         const pid_t pid = getpid();
         const std::string prefix_log = "Worker process " + std::to_string(pid) + ": ";
         const int MAX_EVENTS{10000};
         std::array<struct epoll_event, MAX_EVENTS> events{};
+        concurrent_servers::buffer_pool buffer_pool{BUFF_SIZE}; // output segments of this worker process
+        std::vector<std::unique_ptr<connection_state>> connections{}; // indexed by client socket fd
+
+        const auto close_connection = [&connections, &epoll_fd, &metrics](int fd) {
+            epoll_ctl(epoll_fd.get_fd(), EPOLL_CTL_DEL, fd, nullptr); // remove client socket fd from epoll list
+            close(fd);
+            connections[fd].reset();
+            metrics.add(worker_counter::CLOSES);
+        };
+
+        // counts what a flush sent, returns its result
+        const auto flush = [&metrics](int fd, concurrent_servers::output_queue &output) {
+            const size_t pending = output.size();
+            const auto result = output.flush(fd);
+            if (result != concurrent_servers::output_queue::flush_result::ERROR) {
+                metrics.add(worker_counter::BYTES_OUT, pending - output.size());
+            }
+            if (result == concurrent_servers::output_queue::flush_result::WOULD_BLOCK) {
+                metrics.add(worker_counter::WRITE_EAGAIN);
+            }
+            return result;
+        };
 
         for (;;) {
             int nfds = epoll_wait(epoll_fd.get_fd(), events.data(), MAX_EVENTS, -1);
             if (nfds == -1) {
                 throw std::runtime_error(prefix_log + "epoll_wait() failed");
             }
+            metrics.record_wakeup(nfds);
 
             for (int i{0}; i < nfds; ++i) {
-                concurrent_servers::log_info(prefix_log, "epoll_wait() return, fd=", events[i].data.fd, " event ", events[i].events);
+                CS_LOG_INFO(prefix_log, "epoll_wait() return, fd=", events[i].data.fd, " event ", events[i].events);
 
                 if (events[i].data.fd == server_sfd.get_fd()) {
+                    // server socket, accept as many new connections as possible
+                    concurrent_servers::file_descriptor client_sfd{};
+                    struct sockaddr_storage cli_addr{};
+
+                    for (;;) {
+                        int cli_len = sizeof(cli_addr); // Always reset this value before calling accept()
+                        if ((!client_sfd.set_fd(
+                                accept4(server_sfd.get_fd(), (struct sockaddr *) &cli_addr, (socklen_t *) &cli_len,
+                                        SOCK_NONBLOCK)))) {
+                            if (errno != EWOULDBLOCK and errno != EAGAIN) {
+                                throw std::runtime_error(prefix_log + "Could not accept a new connection");
+                            } else {
+                                // no more connection to accept
+                                break;
+                            }
+                        }
 
-                } else {
+                        if constexpr (concurrent_servers::log_enabled(concurrent_servers::log_level::INFO)) {
+                            log_client_info(cli_addr, prefix_log);
+                        }
+                        CS_LOG_INFO(prefix_log + "Add new client socket fd=", client_sfd.get_fd());
+                        set_accepted_options(client_sfd.get_fd(), options);
 
-                }
-                if (events[i].events & EPOLLERR) {
-                    concurrent_servers::log_warning(prefix_log + "epoll_wait() error on fd ", events[i].data.fd, " event ", events[i].events);
-//                    epoll_ctl(epoll_fd.get_fd(), EPOLL_CTL_DEL, events[i].data.fd, nullptr);
-//                    close(events[i].data.fd);
-//                    if (events[i].data.fd == server_sfd.get_fd()) {
-//                        throw std::runtime_error(prefix_log + "epoll_wait() error on server fd");
-//                    }
+                        if (static_cast<size_t>(client_sfd.get_fd()) >= connections.size()) {
+                            connections.resize(client_sfd.get_fd() + 1);
+                        }
+                        connections[client_sfd.get_fd()] = std::make_unique<connection_state>();
+                        connections[client_sfd.get_fd()]->output.set_buffer_pool(&buffer_pool);
+
+                        metrics.add(worker_counter::ACCEPTS);
+
+                        // add the new client fd to epoll event list
+                        struct epoll_event event{};
+                        memset(&event, 0, sizeof(event));
+                        event.data.fd = client_sfd.get_fd();
+                        event.events = EPOLLIN | EPOLLRDHUP |EPOLLET | EPOLLONESHOT;  // one shot edge triggered
+                        if (epoll_ctl(epoll_fd.get_fd(), EPOLL_CTL_ADD, client_sfd.get_fd(), &event) == -1) {
+                            throw std::runtime_error(prefix_log + "epoll_ctl() failed");
+                        }
+                    }
+                    continue;
                 }
 
-                if (events[i].events & EPOLLRDHUP) {
-                    concurrent_servers::log_warning(prefix_log, "  Connection closed, fd=", events[i].data.fd);
-                    epoll_ctl(epoll_fd.get_fd(), EPOLL_CTL_DEL, events[i].data.fd, nullptr); // remove client socket fd from epoll list
-                    close(events[i].data.fd);
+                const int fd = events[i].data.fd;
+                if (static_cast<size_t>(fd) >= connections.size() or connections[fd] == nullptr) {
+                    continue;
+                }
+                if (events[i].events & (EPOLLERR | EPOLLHUP)) {
+                    CS_LOG_WARNING(prefix_log, "  Connection closed, fd=", fd, " event ", events[i].events);
+                    close_connection(fd);
                     continue;
                 }
 
-                if (events[i].events & EPOLLHUP) {
-                    concurrent_servers::log_warning(prefix_log, "  Connection hangup");
+                connection_state &conn = *connections[fd];
+                if (events[i].events & EPOLLOUT) {
+                    CS_LOG_INFO(prefix_log, "  EPOLLOUT event, fd=", fd);
+                }
+                if (not conn.output.empty() and flush(fd, conn.output) == concurrent_servers::output_queue::flush_result::ERROR) {
+                    CS_LOG_ERROR(prefix_log, "error on writing, fd=", fd, "\t", strerror(errno));
+                    close_connection(fd);
+                    continue;
+                }
+                if (conn.reading_paused and conn.output.below_low_watermark()) {
+                    conn.reading_paused = false;
                 }
 
-                if (events[i].events & EPOLLIN) {
-                    concurrent_servers::log_info(prefix_log, "  EPOLLIN event, fd=", events[i].data.fd);
-
-                    if (events[i].data.fd == server_sfd.get_fd()) {
-                        // server socket, accept as many new connections as possible
-                        concurrent_servers::file_descriptor client_sfd{};
-                        struct sockaddr_storage cli_addr{};
-
-                        for (;;) {
-                            int cli_len = sizeof(cli_addr); // Always reset this value before calling accept()
-                            if ((!client_sfd.set_fd(
-                                    accept4(server_sfd.get_fd(), (struct sockaddr *) &cli_addr, (socklen_t *) &cli_len,
-                                            SOCK_NONBLOCK)))) {
-                                if (errno != EWOULDBLOCK and errno != EAGAIN) {
-                                    throw std::runtime_error(prefix_log + "Could not accept a new connection");
-                                } else {
-                                    // no more connection to accept
-                                    break;
-                                }
-                            }
+                // client socket; read as much data as we can, or until the client falls too far behind reading its echo
+                bool connection_is_closed{false};
+                bool end_of_file{false};
+                while (not conn.reading_paused) {
+                    if (conn.output.above_high_watermark()) {
+                        CS_LOG_INFO(prefix_log, "  output above high watermark, pause reading fd=", fd);
+                        conn.reading_paused = true;
+                        break;
+                    }
 
-                            log_client_info(cli_addr, prefix_log);
-                            concurrent_servers::log_info(prefix_log + "Add new client socket fd=", client_sfd.get_fd());
-
-                            // add the new client fd to epoll event list
-                            struct epoll_event event{};
-                            memset(&event, 0, sizeof(event));
-                            event.data.fd = client_sfd.get_fd();
-                            event.events = EPOLLIN | EPOLLRDHUP |EPOLLET | EPOLLONESHOT;  // one shot edge triggered
-                            if (epoll_ctl(epoll_fd.get_fd(), EPOLL_CTL_ADD, client_sfd.get_fd(), &event) == -1) {
-                                throw std::runtime_error(prefix_log + "epoll_ctl() failed");
-                            }
-                        }
-                    } else {
-                        // client socket; read as much data as we can
-                        concurrent_servers::file_descriptor client_sfd{events[i].data.fd};
-                        char buffer[BUFF_SIZE];
-
-                        for (;;) {
-                            // Read data sent from client
-                            const ssize_t rlen = read(client_sfd.get_fd(), buffer, sizeof(buffer));
-                            if (rlen < 0) {
-                                if (errno == EWOULDBLOCK or errno == EAGAIN) {
-                                    // due to EPOLLONESHOT, after finishing reading all data in buffer,
-                                    // we need to rearm the client fd to catch its event again
-                                    concurrent_servers::log_info(prefix_log + "rearm epoll event, fd=", client_sfd.get_fd());
-                                    struct epoll_event event{};
-                                    memset(&event, 0, sizeof(event));
-                                    event.data.fd = client_sfd.get_fd();
-                                    event.events = EPOLLIN | EPOLLRDHUP | EPOLLET | EPOLLONESHOT;  // one shot edge triggered
-                                    if (epoll_ctl(epoll_fd.get_fd(), EPOLL_CTL_MOD, client_sfd.get_fd(), &event) == -1) {
-                                        throw std::runtime_error(prefix_log + "epoll_ctl() failed");
-                                    }
-                                } else {
-                                    concurrent_servers::log_error(prefix_log, "error on reading, fd=",
-                                                         std::to_string(client_sfd.get_fd()), ", errno=",
-                                                         std::to_string(errno), "\t", strerror(errno));
-//                                    throw std::runtime_error(prefix_log + "ERROR on reading, fd=" + std::to_string(client_sfd.get_fd()) + ", errno=" + std::to_string(errno));
-                                }
-                                break;
-                            }
+                    concurrent_servers::output_queue::segment *segment = conn.output.acquire_segment();
+                    if (segment == nullptr) {
+                        throw std::runtime_error(prefix_log + "out of read buffers");
+                    }
 
-                            if (rlen == 0) {
-                                concurrent_servers::log_info(prefix_log, "  end of file, fd=" + std::to_string(client_sfd.get_fd()));
-                                break;
-                            }
+                    // Read data sent from client
+                    const ssize_t rlen = read(fd, segment->data(), segment->capacity);
+                    if (rlen > 0) {
+                        CS_LOG_INFO(prefix_log, "  received: ", std::string{segment->data(), static_cast<size_t>(rlen)});
+                        metrics.add(worker_counter::BYTES_IN, static_cast<uint64_t>(rlen));
+                        // the segment is echoed back as is
+                        segment->end = static_cast<uint32_t>(rlen);
+                        conn.output.push(segment);
+                        continue;
+                    }
 
-                            concurrent_servers::log_info(prefix_log, "  received: ", buffer);
-                        }
+                    concurrent_servers::output_queue::release_segment(segment);
+                    if (rlen == 0) {
+                        CS_LOG_INFO(prefix_log, "  end of file, fd=" + std::to_string(fd));
+                        end_of_file = true;
+                    } else if (errno == EWOULDBLOCK or errno == EAGAIN) {
+                        metrics.add(worker_counter::READ_EAGAIN);
+                    } else {
+                        CS_LOG_ERROR(prefix_log, "error on reading, fd=", std::to_string(fd), ", errno=",
+                                     std::to_string(errno), "\t", strerror(errno));
+                        connection_is_closed = true;
                     }
+                    break;
                 }
 
-                if (events[i].events & EPOLLOUT) {
-                    concurrent_servers::log_info(prefix_log, "  EPOLLOUT event, fd=", events[i].data.fd);
-
-//                    concurrent_servers::file_descriptor client_sfd{events[i].data.fd};
-//                    const std::string dummy_buffer{"echo back"};
-//
-//
-//                    // Echo the data back to the client
-//                    const ssize_t wlen = write(client_sfd.get_fd(), dummy_buffer.data(), dummy_buffer.length());
-//                    if (wlen < 0) {
-//                        if (errno != EWOULDBLOCK and errno != EAGAIN) {
-//                            concurrent_servers::log_error(prefix_log, "ERROR on writing, fd=", std::to_string(client_sfd.get_fd()), ", errno=", std::to_string(errno), "\t", strerror(errno));
-//                            throw std::runtime_error(prefix_log + "ERROR on writing, fd=" + std::to_string(client_sfd.get_fd()) + ", errno=" + std::to_string(errno));
-//                        }
-//                        break;
-//                    }
+                // Echo the data back to the client, the last time after end of file
+                if (not connection_is_closed and not conn.output.empty()
+                    and flush(fd, conn.output) == concurrent_servers::output_queue::flush_result::ERROR) {
+                    CS_LOG_ERROR(prefix_log, "error on writing, fd=", fd, "\t", strerror(errno));
+                    connection_is_closed = true;
+                }
+
+                if (connection_is_closed or end_of_file) {
+                    close_connection(fd);
+                    continue;
+                }
+
+                // due to EPOLLONESHOT, rearm the client fd: EPOLLOUT only while output is pending,
+                // EPOLLIN and EPOLLRDHUP only while reading, a pending half close would wake us up in a loop otherwise.
+                // If the last flush drained the output, resume reading now: EPOLL_CTL_MOD reports the data already
+                // waiting in the socket.
+                if (conn.reading_paused and conn.output.below_low_watermark()) {
+                    conn.reading_paused = false;
+                }
+                CS_LOG_INFO(prefix_log + "rearm epoll event, fd=", fd);
+                struct epoll_event event{};
+                memset(&event, 0, sizeof(event));
+                event.data.fd = fd;
+                event.events = EPOLLET | EPOLLONESHOT;  // one shot edge triggered
+                if (not conn.reading_paused) {
+                    event.events |= EPOLLIN | EPOLLRDHUP;
+                }
+                if (not conn.output.empty()) {
+                    event.events |= EPOLLOUT;
+                }
+                if (epoll_ctl(epoll_fd.get_fd(), EPOLL_CTL_MOD, fd, &event) == -1) {
+                    metrics.add(worker_counter::REARM_FAILURES);
+                    throw std::runtime_error(prefix_log + "epoll_ctl() failed");
                 }
             }
         }
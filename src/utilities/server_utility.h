@@ -35,11 +35,26 @@
 
 #include <string>
 #include <iostream>
+#include <vector>
+
+#include "listener_options.h"
 
 namespace concurrent_servers {
+    struct worker_metrics;
+
     void log_client_info(const struct sockaddr_storage& cli_addr, const std::string &prefix_log="");
-    concurrent_servers::file_descriptor setup_server_tcp_socket(const std::string& port_num, const int backlog, bool is_nonblock = false, bool reuse_port = false);
-    void epoll_event_loop(const concurrent_servers::file_descriptor& server_sfd, const concurrent_servers::file_descriptor& epoll_fd);
+    /**
+     * Listening sockets handed over by the previous server process, setup_server_tcp_socket() takes one bound to
+     * its port, if any, rather than binding a new socket, so the connections waiting in its queue are kept.
+     */
+    void add_inherited_listeners(const std::vector<int> &fds);
+    /**
+     * A backlog of 0 or less listens with net.core.somaxconn, see listen_backlog().
+     */
+    concurrent_servers::file_descriptor setup_server_tcp_socket(const std::string& port_num, const int backlog, bool is_nonblock = false, bool reuse_port = false,
+                                                                const concurrent_servers::listener_options &options = {});
+    void epoll_event_loop(const concurrent_servers::file_descriptor& server_sfd, const concurrent_servers::file_descriptor& epoll_fd,
+                          concurrent_servers::worker_metrics &metrics, const concurrent_servers::listener_options &options = {});
 }
 
 #endif /* LINUX_TCP_SERVERS_SERVER_UTILITY_H */
\ No newline at end of file
@@ -0,0 +1,209 @@
+/*
+ * BSD 2-Clause License
+ *
+ * Copyright (c) 2019, Pham Phi Long <phamphilong2010@gmail.com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *   * Redistributions of source code must retain the above copyright notice,
+ *     this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *   * Neither the name of Redis nor the names of its contributors may be used
+ *     to endorse or promote products derived from this software without
+ *     specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+#ifndef LINUX_TCP_SERVERS_SOCKET_HANDOVER_H
+#define LINUX_TCP_SERVERS_SOCKET_HANDOVER_H
+
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+#include <algorithm>
+#include <cerrno>
+#include <cstdint>
+#include <cstring>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include "file_descriptor.h"
+
+namespace concurrent_servers {
+    /**
+     * Hot upgrade: the running server listens on a Unix socket; a new binary started with the same path connects
+     * to it and receives the listening sockets with SCM_RIGHTS, so their accept queues survive the restart. The
+     * old server then stops accepting, drains its connections and exits.
+     *
+     * The sockets travel in SOCK_SEQPACKET messages of at most MAX_FDS_PER_MESSAGE descriptors, each carrying
+     * its descriptor count as payload. The old server unlinks the path before it closes the connection, so the
+     * end of file tells the new one that it may bind the path for the next upgrade.
+     */
+    namespace socket_handover {
+        constexpr size_t MAX_FDS_PER_MESSAGE{250}; // below SCM_MAX_FD
+
+        inline bool send_fds(int sfd, const std::vector<int> &fds) {
+            for (size_t sent{0}; sent < fds.size(); ) {
+                const size_t batch = std::min(fds.size() - sent, MAX_FDS_PER_MESSAGE);
+                auto count = static_cast<uint32_t>(batch);
+                struct iovec iov{&count, sizeof(count)};
+                std::vector<char> control(CMSG_SPACE(batch * sizeof(int)), 0);
+
+                struct msghdr msg{};
+                msg.msg_iov = &iov;
+                msg.msg_iovlen = 1;
+                msg.msg_control = control.data();
+                msg.msg_controllen = control.size();
+                struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+                cmsg->cmsg_level = SOL_SOCKET;
+                cmsg->cmsg_type = SCM_RIGHTS;
+                cmsg->cmsg_len = CMSG_LEN(batch * sizeof(int));
+                memcpy(CMSG_DATA(cmsg), fds.data() + sent, batch * sizeof(int));
+
+                if (sendmsg(sfd, &msg, MSG_NOSIGNAL) != static_cast<ssize_t>(sizeof(count))) {
+                    return false;
+                }
+                sent += batch;
+            }
+            return true;
+        }
+
+        /**
+         * Appends the received descriptors to fds until the peer closes the connection.
+         */
+        inline bool receive_fds(int sfd, std::vector<int> &fds) {
+            for (;;) {
+                uint32_t count{0};
+                struct iovec iov{&count, sizeof(count)};
+                std::vector<char> control(CMSG_SPACE(MAX_FDS_PER_MESSAGE * sizeof(int)), 0);
+
+                struct msghdr msg{};
+                msg.msg_iov = &iov;
+                msg.msg_iovlen = 1;
+                msg.msg_control = control.data();
+                msg.msg_controllen = control.size();
+
+                const ssize_t len = recvmsg(sfd, &msg, MSG_CMSG_CLOEXEC);
+                if (len == 0) {
+                    return true;
+                } else if (len < 0) {
+                    if (errno == EINTR) {
+                        continue;
+                    }
+                    return false;
+                }
+
+                for (struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg); cmsg != nullptr; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+                    if (cmsg->cmsg_level == SOL_SOCKET and cmsg->cmsg_type == SCM_RIGHTS) {
+                        const size_t received = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+                        const size_t offset = fds.size();
+                        fds.resize(offset + received);
+                        memcpy(fds.data() + offset, CMSG_DATA(cmsg), received * sizeof(int));
+                    }
+                }
+                if ((msg.msg_flags & MSG_CTRUNC) or count > MAX_FDS_PER_MESSAGE) {
+                    return false;
+                }
+            }
+        }
+
+        inline struct sockaddr_un address_of(const std::string &path) {
+            struct sockaddr_un addr{};
+            addr.sun_family = AF_UNIX;
+            if (path.size() >= sizeof(addr.sun_path)) {
+                throw std::runtime_error("upgrade socket path too long: " + path);
+            }
+            memcpy(addr.sun_path, path.c_str(), path.size() + 1);
+            return addr;
+        }
+
+        /**
+         * Asks the server listening on path for its sockets. Returns none when no server is running there,
+         * which is a cold start.
+         */
+        inline std::vector<int> request(const std::string &path) {
+            std::vector<int> fds{};
+            const struct sockaddr_un addr = address_of(path);
+            file_descriptor sfd{socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0)};
+            if (sfd.get_fd() < 0) {
+                throw std::runtime_error("socket(AF_UNIX) failed");
+            }
+            if (connect(sfd.get_fd(), reinterpret_cast<const struct sockaddr *>(&addr), sizeof(addr)) != 0) {
+                sfd.close_fd();
+                return fds;
+            }
+
+            const bool complete = receive_fds(sfd.get_fd(), fds);
+            sfd.close_fd();
+            if (not complete) {
+                for (int fd : fds) {
+                    close(fd);
+                }
+                throw std::runtime_error("socket hand over from " + path + " failed");
+            }
+            return fds;
+        }
+
+        /**
+         * Listens for the next binary on path, replacing the socket file of a server that is gone.
+         */
+        inline file_descriptor listen_for_upgrade(const std::string &path) {
+            const struct sockaddr_un addr = address_of(path);
+            file_descriptor sfd{socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0)};
+            if (sfd.get_fd() < 0) {
+                throw std::runtime_error("socket(AF_UNIX) failed");
+            }
+            unlink(path.c_str());
+            if (bind(sfd.get_fd(), reinterpret_cast<const struct sockaddr *>(&addr), sizeof(addr)) != 0 or listen(sfd.get_fd(), 1) != 0) {
+                sfd.close_fd();
+                throw std::runtime_error("could not listen for upgrades on " + path);
+            }
+            return sfd;
+        }
+
+        /**
+         * Blocks until a new binary connects to upgrade_sfd, then hands fds over to it. Returns once it owns them.
+         */
+        inline void serve(file_descriptor &upgrade_sfd, const std::string &path, const std::vector<int> &fds) {
+            for (;;) {
+                file_descriptor conn{accept4(upgrade_sfd.get_fd(), nullptr, nullptr, SOCK_CLOEXEC)};
+                if (conn.get_fd() < 0) {
+                    if (errno == EINTR or errno == ECONNABORTED) {
+                        continue;
+                    }
+                    throw std::runtime_error("accept() of an upgrade failed");
+                }
+
+                const bool sent = send_fds(conn.get_fd(), fds);
+                if (sent) {
+                    // free the path before the end of file, the new binary listens on it next
+                    unlink(path.c_str());
+                    upgrade_sfd.close_fd();
+                }
+                conn.close_fd();
+                if (sent) {
+                    return;
+                }
+            }
+        }
+    }
+}
+
+#endif /* LINUX_TCP_SERVERS_SOCKET_HANDOVER_H */
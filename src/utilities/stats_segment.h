@@ -0,0 +1,200 @@
+/*
+ * BSD 2-Clause License
+ *
+ * Copyright (c) 2019, Pham Phi Long <phamphilong2010@gmail.com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *   * Redistributions of source code must retain the above copyright notice,
+ *     this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *   * Neither the name of Redis nor the names of its contributors may be used
+ *     to endorse or promote products derived from this software without
+ *     specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+#ifndef LINUX_TCP_SERVERS_STATS_SEGMENT_H
+#define LINUX_TCP_SERVERS_STATS_SEGMENT_H
+
+#include <dirent.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <atomic>
+#include <cstdint>
+#include <new>
+#include <stdexcept>
+#include <string>
+
+#include "metrics.h"
+
+namespace concurrent_servers {
+    /**
+     * The slot of one worker process in a stats_segment, on cache lines of its own.
+     */
+    struct alignas(64) worker_stats_slot {
+        std::atomic<int64_t> pid{0};         // 0 until a worker process takes the slot
+        std::atomic<uint64_t> started_ms{0}; // CLOCK_MONOTONIC
+        worker_metrics metrics{};
+    };
+
+    /**
+     * Shared memory, a memfd mapped MAP_SHARED, with one worker_stats_slot per worker process of a prefork server.
+     * It is made before fork(), every child writes the worker_metrics of its own slot and any process mapping the
+     * segment reads all of them without a lock, the parent as well as a tool attached from outside, e.g.
+     * linux_tcp_stats, through /proc/<pid>/fd/<fd> of any process of the server.
+     * std::atomic<uint64_t> is lock-free, so its state lies in the shared memory itself.
+     */
+    class stats_segment {
+    public:
+        static constexpr const char *MEMFD_NAME{"linux-tcp-servers-stats"};
+
+        /**
+         * Makes a segment of slot_count zeroed slots.
+         */
+        explicit stats_segment(size_t slot_count) :
+                _fd{memfd_create(MEMFD_NAME, MFD_CLOEXEC)},
+                _size{mapping_size(slot_count)},
+                _header{nullptr} {
+            if (_fd < 0) {
+                throw std::runtime_error("memfd_create() failed");
+            }
+            if (ftruncate(_fd, static_cast<off_t>(_size)) != 0) {
+                close(_fd);
+                throw std::runtime_error("could not size the stats segment");
+            }
+            map(PROT_READ | PROT_WRITE);
+
+            new (_header) segment_header{};
+            for (size_t i{0}; i < slot_count; ++i) {
+                new (&slots()[i]) worker_stats_slot{};
+            }
+            _header->slot_count = slot_count;
+            _header->magic.store(MAGIC, std::memory_order_release);
+        }
+
+        /**
+         * Maps the segment of a running server read only, path being /proc/<pid>/fd/<fd>, see find().
+         */
+        explicit stats_segment(const std::string &path) :
+                _fd{open(path.c_str(), O_RDONLY | O_CLOEXEC)},
+                _size{0},
+                _header{nullptr} {
+            if (_fd < 0) {
+                throw std::runtime_error("could not open the stats segment " + path);
+            }
+            struct stat st{};
+            if (fstat(_fd, &st) != 0 or static_cast<size_t>(st.st_size) < sizeof(segment_header)) {
+                close(_fd);
+                throw std::runtime_error(path + " is not a stats segment");
+            }
+            _size = static_cast<size_t>(st.st_size);
+            map(PROT_READ);
+            if (_header->magic.load(std::memory_order_acquire) != MAGIC or mapping_size(_header->slot_count) > _size) {
+                munmap(_header, _size);
+                close(_fd);
+                throw std::runtime_error(path + " is not a stats segment");
+            }
+        }
+
+        stats_segment(const stats_segment &) = delete;
+        stats_segment &operator=(const stats_segment &) = delete;
+
+        ~stats_segment() {
+            munmap(_header, _size);
+            close(_fd);
+        }
+
+        size_t slot_count() const {
+            return _header->slot_count;
+        }
+
+        worker_stats_slot &slot(size_t i) {
+            return slots()[i];
+        }
+
+        const worker_stats_slot &slot(size_t i) const {
+            return slots()[i];
+        }
+
+        /**
+         * Where another process opens the segment while this one keeps it open.
+         */
+        std::string path() const {
+            return "/proc/" + std::to_string(getpid()) + "/fd/" + std::to_string(_fd);
+        }
+
+        /**
+         * The path of the segment that process pid holds, empty if it holds none.
+         */
+        static std::string find(pid_t pid) {
+            const std::string fd_dir = "/proc/" + std::to_string(pid) + "/fd";
+            const std::string target = std::string{"/memfd:"} + MEMFD_NAME;
+            DIR *dir = opendir(fd_dir.c_str());
+            if (dir == nullptr) {
+                return {};
+            }
+            std::string found{};
+            while (const struct dirent *entry = readdir(dir)) {
+                const std::string path = fd_dir + "/" + entry->d_name;
+                char link[256];
+                const ssize_t len = readlink(path.c_str(), link, sizeof(link) - 1);
+                if (len > 0 and std::string{link, static_cast<size_t>(len)}.compare(0, target.size(), target) == 0) {
+                    found = path;
+                    break;
+                }
+            }
+            closedir(dir);
+            return found;
+        }
+
+    private:
+        static constexpr uint64_t MAGIC{0x6373737461747331}; // "csstats1"
+
+        struct alignas(64) segment_header {
+            std::atomic<uint64_t> magic{0}; // set once the slots are made
+            uint64_t slot_count{0};
+        };
+
+        int _fd;
+        size_t _size;
+        segment_header *_header;
+
+        static size_t mapping_size(size_t slot_count) {
+            return sizeof(segment_header) + slot_count * sizeof(worker_stats_slot);
+        }
+
+        void map(int protection) {
+            void *mem = mmap(nullptr, _size, protection, MAP_SHARED, _fd, 0);
+            if (mem == MAP_FAILED) {
+                close(_fd);
+                throw std::runtime_error("could not map the stats segment");
+            }
+            _header = static_cast<segment_header *>(mem);
+        }
+
+        worker_stats_slot *slots() const {
+            return reinterpret_cast<worker_stats_slot *>(reinterpret_cast<char *>(_header) + sizeof(segment_header));
+        }
+    };
+}
+
+#endif /* LINUX_TCP_SERVERS_STATS_SEGMENT_H */
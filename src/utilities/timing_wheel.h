@@ -0,0 +1,262 @@
+/*
+ * BSD 2-Clause License
+ *
+ * Copyright (c) 2019, Pham Phi Long <phamphilong2010@gmail.com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *   * Redistributions of source code must retain the above copyright notice,
+ *     this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *   * Neither the name of Redis nor the names of its contributors may be used
+ *     to endorse or promote products derived from this software without
+ *     specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+#ifndef LINUX_TCP_SERVERS_TIMING_WHEEL_H
+#define LINUX_TCP_SERVERS_TIMING_WHEEL_H
+
+#include <time.h>
+#include <algorithm>
+#include <chrono>
+#include <climits>
+#include <cstdint>
+
+namespace concurrent_servers {
+    /**
+     * Connection timeouts, 0 disables one.
+     */
+    struct connection_timeouts {
+        std::chrono::milliseconds idle{std::chrono::seconds{60}};  // nothing to read or send, e.g. an idle keep-alive connection
+        std::chrono::milliseconds read{std::chrono::seconds{10}};  // a request was started but is still incomplete
+        std::chrono::milliseconds write{std::chrono::seconds{30}}; // output is pending and the peer does not read it
+
+        /**
+         * Deadline of a timeout starting at now_ms, UINT64_MAX if it is disabled.
+         */
+        static uint64_t deadline(uint64_t now_ms, std::chrono::milliseconds timeout) {
+            return timeout.count() > 0 ? now_ms + static_cast<uint64_t>(timeout.count()) : UINT64_MAX;
+        }
+    };
+
+    /**
+     * Hierarchical timing wheel: LEVELS wheels of SLOTS slots, a slot of level n spans SLOTS^n ticks. A timer goes
+     * to the lowest level whose span covers its deadline and moves down one level each time the level below wraps
+     * around, so scheduling and cancelling are O(1) and expiring costs O(1) per timer plus a few cascades.
+     *
+     * Timers are intrusive, the owner embeds or allocates them and must cancel() a timer before destroying it.
+     * advance() runs the expired timers and next_timeout_ms() tells how long the event loop may sleep, e.g. the
+     * epoll_wait() timeout. Not thread safe, meant to be owned by one worker.
+     */
+    class timing_wheel {
+    public:
+        static constexpr int LEVELS{4};
+        static constexpr int SLOT_BITS{6};
+        static constexpr int SLOTS{1 << SLOT_BITS};
+        static constexpr std::chrono::milliseconds DEFAULT_RESOLUTION{10};
+
+        struct timer {
+            timer *prev{nullptr};
+            timer *next{nullptr};
+            uint64_t expiry{0};          // in ticks
+            uint64_t data{0};            // user data, e.g. the connection fd or handle
+            int bucket{NO_BUCKET};       // level * SLOTS + slot while scheduled
+
+            bool scheduled() const {
+                return bucket != NO_BUCKET;
+            }
+        };
+
+        explicit timing_wheel(std::chrono::milliseconds resolution = DEFAULT_RESOLUTION, uint64_t now = now_ms()) :
+                _resolution_ms{static_cast<uint64_t>(resolution.count() > 0 ? resolution.count() : 1)},
+                _current_tick{now / _resolution_ms} {
+        }
+
+        timing_wheel(const timing_wheel &) = delete;
+        timing_wheel &operator=(const timing_wheel &) = delete;
+
+        /**
+         * Milliseconds of CLOCK_MONOTONIC_COARSE, precise enough for timeouts and cheaper than the fine clock.
+         */
+        static uint64_t now_ms() {
+            struct timespec now{};
+            clock_gettime(CLOCK_MONOTONIC_COARSE, &now);
+            return static_cast<uint64_t>(now.tv_sec) * 1000 + static_cast<uint64_t>(now.tv_nsec) / 1000000;
+        }
+
+        uint64_t resolution_ms() const {
+            return _resolution_ms;
+        }
+
+        /**
+         * (Re)schedules t to expire at deadline_ms or up to one resolution later, never earlier.
+         */
+        void schedule(timer &t, uint64_t deadline_ms) {
+            if (t.scheduled()) {
+                unlink(t);
+            }
+            t.expiry = deadline_ms / _resolution_ms + (deadline_ms % _resolution_ms != 0 ? 1 : 0);
+            insert(t);
+        }
+
+        void cancel(timer &t) {
+            if (t.scheduled()) {
+                unlink(t);
+            }
+        }
+
+        /**
+         * Calls on_expired(timer &) for every timer whose deadline is not after now. The timer is no longer
+         * scheduled when on_expired runs, which may schedule it again.
+         */
+        template <typename OnExpired>
+        void advance(uint64_t now, OnExpired &&on_expired) {
+            const uint64_t target = now / _resolution_ms;
+            while (_current_tick < target) {
+                if (_size == 0) {
+                    _current_tick = target;
+                    break;
+                }
+                if (_occupied[0] == 0) {
+                    // nothing expires before the lowest level wraps around
+                    const uint64_t wrap = ((_current_tick >> SLOT_BITS) + 1) << SLOT_BITS;
+                    if (wrap > target) {
+                        _current_tick = target;
+                        break;
+                    }
+                    _current_tick = wrap - 1;
+                }
+
+                ++_current_tick;
+                for (int level{LEVELS - 1}; level > 0; --level) {
+                    if ((_current_tick & ((uint64_t{1} << (SLOT_BITS * level)) - 1)) == 0) {
+                        cascade(level, static_cast<int>((_current_tick >> (SLOT_BITS * level)) & (SLOTS - 1)));
+                    }
+                }
+
+                const auto slot = static_cast<int>(_current_tick & (SLOTS - 1));
+                while (_slots[0][slot] != nullptr) {
+                    timer &expired = *_slots[0][slot];
+                    unlink(expired);
+                    on_expired(expired);
+                }
+            }
+        }
+
+        /**
+         * Milliseconds until the next timer may expire, 0 if one is already due, -1 if none is scheduled.
+         */
+        int next_timeout_ms(uint64_t now) const {
+            if (_size == 0) {
+                return -1;
+            }
+
+            // the next lowest level slot in use, or the next wrap around, which cascades the upper levels
+            uint64_t next_tick = ((_current_tick >> SLOT_BITS) + 1) << SLOT_BITS;
+            if (_occupied[0] != 0) {
+                const int from = static_cast<int>((_current_tick + 1) & (SLOTS - 1));
+                const uint64_t rotated = from == 0 ? _occupied[0] : (_occupied[0] >> from) | (_occupied[0] << (SLOTS - from));
+                next_tick = std::min(next_tick, _current_tick + 1 + static_cast<uint64_t>(__builtin_ctzll(rotated)));
+            }
+
+            const uint64_t deadline = next_tick * _resolution_ms;
+            if (deadline <= now) {
+                return 0;
+            }
+            return static_cast<int>(std::min<uint64_t>(deadline - now, INT_MAX));
+        }
+
+        size_t size() const {
+            return _size;
+        }
+
+    private:
+        static constexpr int NO_BUCKET{-1};
+
+        const uint64_t _resolution_ms;
+        uint64_t _current_tick; // every timer up to this tick has expired
+        timer *_slots[LEVELS][SLOTS]{};
+        uint64_t _occupied[LEVELS]{}; // one bit per non empty slot
+        size_t _size{0};
+
+        void insert(timer &t) {
+            constexpr uint64_t MAX_DELTA{(uint64_t{1} << (SLOT_BITS * LEVELS)) - 1};
+
+            // overdue timers expire on the next tick, the ones beyond the top level wait in its farthest slot
+            uint64_t expiry = std::max(t.expiry, _current_tick + 1);
+            if (expiry - _current_tick > MAX_DELTA) {
+                expiry = _current_tick + MAX_DELTA;
+            }
+
+            int level{0};
+            while (level < LEVELS - 1 and expiry - _current_tick >= (uint64_t{1} << (SLOT_BITS * (level + 1)))) {
+                ++level;
+            }
+            const auto slot = static_cast<int>((expiry >> (SLOT_BITS * level)) & (SLOTS - 1));
+
+            t.bucket = level * SLOTS + slot;
+            t.prev = nullptr;
+            t.next = _slots[level][slot];
+            if (t.next != nullptr) {
+                t.next->prev = &t;
+            }
+            _slots[level][slot] = &t;
+            _occupied[level] |= uint64_t{1} << slot;
+            ++_size;
+        }
+
+        void unlink(timer &t) {
+            const int level = t.bucket / SLOTS;
+            const int slot = t.bucket % SLOTS;
+            if (t.prev != nullptr) {
+                t.prev->next = t.next;
+            } else {
+                _slots[level][slot] = t.next;
+            }
+            if (t.next != nullptr) {
+                t.next->prev = t.prev;
+            }
+            if (_slots[level][slot] == nullptr) {
+                _occupied[level] &= ~(uint64_t{1} << slot);
+            }
+            t.prev = nullptr;
+            t.next = nullptr;
+            t.bucket = NO_BUCKET;
+            --_size;
+        }
+
+        /**
+         * Moves the timers of a slot to the lower levels, now that they are closer.
+         */
+        void cascade(int level, int slot) {
+            timer *t = _slots[level][slot];
+            _slots[level][slot] = nullptr;
+            _occupied[level] &= ~(uint64_t{1} << slot);
+            while (t != nullptr) {
+                timer *next = t->next;
+                --_size;
+                insert(*t);
+                t = next;
+            }
+        }
+    };
+}
+
+#endif /* LINUX_TCP_SERVERS_TIMING_WHEEL_H */
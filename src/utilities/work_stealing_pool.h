@@ -0,0 +1,330 @@
+/*
+ * BSD 2-Clause License
+ *
+ * Copyright (c) 2019, Pham Phi Long <phamphilong2010@gmail.com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *   * Redistributions of source code must retain the above copyright notice,
+ *     this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *   * Neither the name of Redis nor the names of its contributors may be used
+ *     to endorse or promote products derived from this software without
+ *     specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+#ifndef LINUX_TCP_SERVERS_WORK_STEALING_POOL_H
+#define LINUX_TCP_SERVERS_WORK_STEALING_POOL_H
+
+#include <sys/prctl.h>
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace concurrent_servers {
+    /**
+     * Chase-Lev work stealing deque of bounded capacity. The owner thread pushes and pops at the bottom, LIFO so
+     * the work it just spawned is still in cache, other threads steal the oldest element from the top. Only a
+     * pop racing a steal for the last element costs a compare and swap.
+     */
+    template<typename T>
+    class chase_lev_deque {
+    public:
+        explicit chase_lev_deque(size_t capacity) :
+                _mask{round_up_power_of_two(capacity) - 1},
+                _elements{std::make_unique<std::atomic<T *>[]>(_mask + 1)},
+                _top{0},
+                _bottom{0} {
+        }
+
+        chase_lev_deque(const chase_lev_deque &) = delete;
+        chase_lev_deque &operator=(const chase_lev_deque &) = delete;
+
+        /**
+         * Owner only. Returns false if the deque is full.
+         */
+        bool push(T *element) {
+            const int64_t bottom = _bottom.load(std::memory_order_relaxed);
+            const int64_t top = _top.load(std::memory_order_acquire);
+            if (bottom - top > static_cast<int64_t>(_mask)) {
+                return false;
+            }
+            _elements[bottom & _mask].store(element, std::memory_order_relaxed);
+            std::atomic_thread_fence(std::memory_order_release);
+            _bottom.store(bottom + 1, std::memory_order_relaxed);
+            return true;
+        }
+
+        /**
+         * Owner only. Returns nullptr if the deque is empty or a thief took the last element.
+         */
+        T *pop() {
+            const int64_t bottom = _bottom.load(std::memory_order_relaxed) - 1;
+            _bottom.store(bottom, std::memory_order_relaxed);
+            std::atomic_thread_fence(std::memory_order_seq_cst);
+            int64_t top = _top.load(std::memory_order_relaxed);
+            if (top > bottom) {
+                _bottom.store(bottom + 1, std::memory_order_relaxed);
+                return nullptr;
+            }
+
+            T *element = _elements[bottom & _mask].load(std::memory_order_relaxed);
+            if (top == bottom) {
+                // last element, race the thieves for it
+                if (not _top.compare_exchange_strong(top, top + 1, std::memory_order_seq_cst, std::memory_order_relaxed)) {
+                    element = nullptr;
+                }
+                _bottom.store(bottom + 1, std::memory_order_relaxed);
+            }
+            return element;
+        }
+
+        /**
+         * Any thread. Returns nullptr if the deque is empty or another thread won the race for the element.
+         */
+        T *steal() {
+            int64_t top = _top.load(std::memory_order_acquire);
+            std::atomic_thread_fence(std::memory_order_seq_cst);
+            const int64_t bottom = _bottom.load(std::memory_order_acquire);
+            if (top >= bottom) {
+                return nullptr;
+            }
+
+            T *element = _elements[top & _mask].load(std::memory_order_relaxed);
+            if (not _top.compare_exchange_strong(top, top + 1, std::memory_order_seq_cst, std::memory_order_relaxed)) {
+                return nullptr;
+            }
+            return element;
+        }
+
+    private:
+        static constexpr size_t CACHE_LINE_SIZE{64};
+
+        static size_t round_up_power_of_two(size_t n) {
+            size_t power{2};
+            while (power < n) {
+                power <<= 1;
+            }
+            return power;
+        }
+
+        const size_t _mask;
+        const std::unique_ptr<std::atomic<T *>[]> _elements;
+        alignas(CACHE_LINE_SIZE) std::atomic<int64_t> _top;    // advanced by the thieves and the owner's last pop
+        alignas(CACHE_LINE_SIZE) std::atomic<int64_t> _bottom; // written by the owner only
+    };
+
+    /**
+     * Thread pool for CPU heavy work, so that it does not stall the event loop that would otherwise run it.
+     *
+     * Every pool thread owns a chase_lev_deque. Work submitted from outside the pool goes to a shared injection
+     * queue, from which an idle thread takes a batch into its deque; work submitted by a pool thread goes to its
+     * own deque. A thread runs its own work first, then injected work, then steals from the others, and sleeps
+     * once there is nothing left anywhere. The destructor stops the threads, dropping the work not started.
+     */
+    class work_stealing_pool {
+    public:
+        explicit work_stealing_pool(size_t thread_num, std::string name = "offload") :
+                _name{std::move(name)},
+                _queues{},
+                _threads{},
+                _mutex{},
+                _wakeup{},
+                _injected{},
+                _queued{0},
+                _sleeping{0},
+                _stopping{false} {
+            for (size_t i{0}; i < std::max<size_t>(thread_num, 1); ++i) {
+                _queues.push_back(std::make_unique<chase_lev_deque<task>>(DEQUE_CAPACITY));
+            }
+            for (size_t i{0}; i < _queues.size(); ++i) {
+                _threads.emplace_back([this, i]() {
+                    run(i);
+                });
+            }
+        }
+
+        work_stealing_pool(const work_stealing_pool &) = delete;
+        work_stealing_pool &operator=(const work_stealing_pool &) = delete;
+
+        ~work_stealing_pool() {
+            stop();
+
+            for (auto &queue : _queues) {
+                while (task *dropped = queue->pop()) {
+                    delete dropped;
+                }
+            }
+            for (task *dropped : _injected) {
+                delete dropped;
+            }
+        }
+
+        /**
+         * May be called from any thread, including the pool threads.
+         */
+        void submit(std::function<void()> work) {
+            auto *submitted = new task{std::move(work)};
+            if (_current_pool == this) {
+                _queued.fetch_add(1); // before a thief can take it
+                if (not _queues[_current_index]->push(submitted)) {
+                    // the own deque is full, running the work right away still makes progress
+                    _queued.fetch_sub(1);
+                    execute(submitted);
+                    return;
+                }
+                if (_sleeping.load() > 0) {
+                    std::lock_guard<std::mutex> lock{_mutex}; // a thread about to sleep sees _queued, or is waiting already
+                }
+                _wakeup.notify_one();
+                return;
+            }
+
+            {
+                std::lock_guard<std::mutex> lock{_mutex};
+                _injected.push_back(submitted);
+                _queued.fetch_add(1);
+            }
+            _wakeup.notify_one();
+        }
+
+        /**
+         * Waits for the work in progress and stops the threads, the work not started is dropped by the destructor.
+         * Call it before tearing down what the work uses. Not from a pool thread.
+         */
+        void stop() {
+            {
+                std::lock_guard<std::mutex> lock{_mutex};
+                _stopping = true;
+            }
+            _wakeup.notify_all();
+            for (auto &thread : _threads) {
+                if (thread.joinable()) {
+                    thread.join();
+                }
+            }
+        }
+
+        size_t thread_num() const {
+            return _threads.size();
+        }
+
+    private:
+        struct task {
+            std::function<void()> work;
+        };
+
+        static constexpr size_t DEQUE_CAPACITY{4096};
+        static constexpr size_t INJECTED_BATCH{32}; // taken at once into the deque of a thread, the others steal them
+
+        static inline thread_local const work_stealing_pool *_current_pool{nullptr};
+        static inline thread_local size_t _current_index{0};
+
+        const std::string _name;
+        std::vector<std::unique_ptr<chase_lev_deque<task>>> _queues; // one per thread
+        std::vector<std::thread> _threads;
+        std::mutex _mutex; // guards _injected and the sleeping threads
+        std::condition_variable _wakeup;
+        std::deque<task *> _injected;
+        std::atomic<size_t> _queued;   // submitted and not taken by a thread yet
+        std::atomic<size_t> _sleeping;
+        bool _stopping;
+
+        static void execute(task *taken) {
+            std::unique_ptr<task> owned{taken};
+            owned->work();
+        }
+
+        void run(size_t index) {
+            _current_pool = this;
+            _current_index = index;
+            const std::string thread_name = _name + " " + std::to_string(index);
+            prctl(PR_SET_NAME, thread_name.c_str(), NULL, NULL, NULL);
+
+            for (;;) {
+                task *taken = _queues[index]->pop();
+                if (taken == nullptr) {
+                    taken = take_injected(index);
+                }
+                if (taken == nullptr) {
+                    taken = steal(index);
+                }
+                if (taken != nullptr) {
+                    _queued.fetch_sub(1);
+                    execute(taken);
+                    continue;
+                }
+
+                std::unique_lock<std::mutex> lock{_mutex};
+                _sleeping.fetch_add(1);
+                _wakeup.wait(lock, [this]() {
+                    return _stopping or _queued.load() > 0;
+                });
+                _sleeping.fetch_sub(1);
+                if (_stopping) {
+                    return;
+                }
+            }
+        }
+
+        /**
+         * Returns one injected task and moves up to INJECTED_BATCH more into the deque of the thread.
+         */
+        task *take_injected(size_t index) {
+            std::lock_guard<std::mutex> lock{_mutex};
+            if (_injected.empty()) {
+                return nullptr;
+            }
+            task *taken = _injected.front();
+            _injected.pop_front();
+            for (size_t moved{0}; moved < INJECTED_BATCH and not _injected.empty(); ++moved) {
+                if (not _queues[index]->push(_injected.front())) {
+                    break;
+                }
+                _injected.pop_front();
+            }
+            if (not _injected.empty() or _queued.load() > 1) {
+                _wakeup.notify_one(); // work left for another thread
+            }
+            return taken;
+        }
+
+        task *steal(size_t index) {
+            for (size_t i{1}; i < _queues.size(); ++i) {
+                task *stolen = _queues[(index + i) % _queues.size()]->steal();
+                if (stolen != nullptr) {
+                    return stolen;
+                }
+            }
+            return nullptr;
+        }
+    };
+}
+
+#endif /* LINUX_TCP_SERVERS_WORK_STEALING_POOL_H */
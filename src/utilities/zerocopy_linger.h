@@ -0,0 +1,134 @@
+/*
+ * BSD 2-Clause License
+ *
+ * Copyright (c) 2019, Pham Phi Long <phamphilong2010@gmail.com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *   * Redistributions of source code must retain the above copyright notice,
+ *     this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *   * Neither the name of Redis nor the names of its contributors may be used
+ *     to endorse or promote products derived from this software without
+ *     specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+#ifndef LINUX_TCP_SERVERS_ZEROCOPY_LINGER_H
+#define LINUX_TCP_SERVERS_ZEROCOPY_LINGER_H
+
+#include <sys/socket.h>
+#include <unistd.h>
+#include <cstdint>
+#include <memory>
+#include <vector>
+
+#include "output_queue.h"
+
+namespace concurrent_servers {
+    /**
+     * Sockets closed by their connection while MSG_ZEROCOPY sends were still in flight. Closing them right away
+     * would lose the completions, and their segments could go back to the pool and be overwritten with another
+     * client's data while the kernel still sends from them. They stay open, out of the poller, until the kernel
+     * reports the sends complete, or until LINGER_TIMEOUT_MS when the connection is aborted. One per worker.
+     */
+    class zerocopy_linger {
+    public:
+        static constexpr uint64_t LINGER_TIMEOUT_MS{30000};
+        static constexpr int POLL_INTERVAL_MS{10}; // the poller wait while sockets linger, completions raise no event
+
+        zerocopy_linger() = default;
+
+        zerocopy_linger(const zerocopy_linger &) = delete;
+        zerocopy_linger &operator=(const zerocopy_linger &) = delete;
+
+        /**
+         * Drops the data output has not sent yet and takes fd over if zerocopy sends from output are still in
+         * flight, output can be reused right away. Returns false if none are, the caller closes fd then.
+         */
+        bool hold(int fd, output_queue &output, uint64_t now_ms) {
+            output.clear();
+            if (output.zerocopy_pending()) {
+                output.complete_zerocopy(fd);
+            }
+            if (not output.zerocopy_pending()) {
+                return false;
+            }
+
+            auto pending = std::make_unique<output_queue>();
+            pending->take_zerocopy(output);
+            _sockets.push_back(lingering{fd, now_ms + LINGER_TIMEOUT_MS, std::move(pending)});
+            return true;
+        }
+
+        /**
+         * Reads the completions of the lingering sockets and closes those that are done. Call it from the event
+         * loop, at least every POLL_INTERVAL_MS while not empty().
+         */
+        void poll(uint64_t now_ms) {
+            for (size_t i = 0; i < _sockets.size();) {
+                lingering &socket = _sockets[i];
+                socket.output->complete_zerocopy(socket.fd);
+                if (socket.output->zerocopy_pending() and now_ms >= socket.deadline) {
+                    abort(socket);
+                }
+                if (socket.output->zerocopy_pending() and now_ms < socket.deadline) {
+                    ++i;
+                    continue;
+                }
+
+                ::close(socket.fd);
+                if (socket.output->zerocopy_pending()) {
+                    // never confirmed: the segments are leaked rather than risk reusing them
+                    socket.output.release();
+                }
+                _sockets[i] = std::move(_sockets.back());
+                _sockets.pop_back();
+            }
+        }
+
+        bool empty() const {
+            return _sockets.empty();
+        }
+
+    private:
+        struct lingering {
+            int fd;
+            uint64_t deadline;
+            std::unique_ptr<output_queue> output;
+        };
+
+        std::vector<lingering> _sockets{};
+
+        /**
+         * The peer does not acknowledge the data: resets the connection, which frees the write queue and with it
+         * the references to the segments, the kernel then queues the last completions.
+         */
+        static void abort(lingering &socket) {
+            const struct linger reset{1, 0};
+            setsockopt(socket.fd, SOL_SOCKET, SO_LINGER, &reset, sizeof(reset));
+            struct sockaddr unspec{};
+            unspec.sa_family = AF_UNSPEC;
+            connect(socket.fd, &unspec, sizeof(unspec)); // disconnects without closing the fd
+            socket.output->complete_zerocopy(socket.fd);
+        }
+    };
+}
+
+#endif /* LINUX_TCP_SERVERS_ZEROCOPY_LINGER_H */